@@ -0,0 +1,11 @@
+find_path(LIBURING_INCLUDE_DIR liburing.h)
+find_library(LIBURING_LIBRARIES uring)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(liburing DEFAULT_MSG
+  LIBURING_LIBRARIES
+  LIBURING_INCLUDE_DIR)
+
+mark_as_advanced(
+  LIBURING_INCLUDE_DIR
+  LIBURING_LIBRARIES)
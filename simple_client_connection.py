@@ -35,6 +35,27 @@ def client_hello_bad_magic_number():
         assert error_code == 1, "Expected error_code = %s, got %s instead" % (1, error_code)
 
 
+def client_test():
+    client_hello_struct = struct.Struct('> I I I')
+    client_hello = client_hello_struct.pack(0x40000000, 0xE6955EBF, 1)
+    payload = b'kiwi' * 16
+    client_test_struct = struct.Struct('> I I')
+    client_test = client_test_struct.pack(0x40000002, len(payload)) + payload
+
+    with closing(socket.socket(socket.AF_INET, socket.SOCK_STREAM)) as sock:
+        sock.connect(KIWI_SERVER)
+        sock.sendall(client_hello + client_test * 2)
+
+        expected = struct.pack('> I', 0x40000001) + (client_test_struct.pack(0x40000003, len(payload)) + payload) * 2
+        response_data = b''
+        while len(response_data) < len(expected):
+            data = sock.recv(64*1024)
+            assert data, "Connection closed after %s bytes" % len(response_data)
+            response_data += data
+        assert response_data == expected, "Unexpected ClientTestReply: %r" % response_data
+
+
 if __name__ == '__main__':
     client_hello()
     client_hello_bad_magic_number()
+    client_test()
@@ -1,44 +1,124 @@
-#include "common/config.h"
-#if defined(HAVE_EPOLL)
-    #include <sys/epoll.h>
-#elif defined(HAVE_KQUEUE)
-    #include <sys/event.h>
-#endif
-
 #include <errno.h>
 #include <exception>
 #include <iostream>
+#include <string.h>
 #include <unistd.h>
 
-#include "common/buffered_socket.h"
+#include "common/constants.h"
 #include "common/exceptions.h"
+#include "common/frame_reader.h"
+#include "common/frame_writer.h"
 #include "common/io_utils.h"
 #include "common/protocol.h"
+#include "common/timing_utils.h"
 #include "client.h"
 
 
 using namespace std;
 
-enum KqueueUserEventID {
+enum UserEventID {
     kSHUTDOWN = 1,
 };
 
-Client::Client(SocketAddress const& server_address) : server_address(server_address) {
-    kq = kqueue();
-    if (kq == -1) {
-        throw runtime_error("Error creating kqueue: " + string(strerror(errno)));
+static const uint64_t kReconnectDelayNanos = 100 * 1000 * 1000;
+static const int kMaxTimeoutMillis = 100;
+
+static uint64_t NowNanos(void) {
+    struct timespec now;
+    TimingUtils::Nanotime(&now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+Client::Connection::Connection(void) :
+        socket(nullptr),
+        connected(false),
+        hello_acknowledged(false),
+        interested_in_writes(false),
+        reconnect_at(0),
+        send_times(),
+        first_outstanding(0),
+        num_outstanding(0),
+        schedule_start(0),
+        next_request(0) {}
+
+
+Client::Client(SocketAddress const& server_address, ClientOptions const& options, size_t id) :
+        server_address(server_address),
+        options(options),
+        id(id),
+        poller(),
+        started(false),
+        payload(options.payload_size, '\0'),
+        interval(0),
+        connections(options.connections_per_thread),
+        latencies(),
+        completed(0),
+        errors(0) {
+
+    for (size_t i = 0; i < options.payload_size; i++) {
+        payload[i] = static_cast<char>(i % 251);
     }
 
-    try {
-        int err = pthread_create(&thread, nullptr, ThreadWrapper, this);
-        if (err != 0) {
-            throw runtime_error("Error creating IO thread: " + string(strerror(err)));
+    if (options.rate > 0) {
+        // Every connection gets an equal share of the offered load.
+        uint64_t total_connections = options.threads * options.connections_per_thread;
+        interval = 1000000000ull * total_connections / options.rate;
+        if (interval == 0) {
+            interval = 1;
         }
+    }
 
-    } catch (...) {
-        IOUtils::Close(kq);
-        throw;
+    for (Connection& connection : connections) {
+        connection.send_times.resize(options.pipeline_depth);
+    }
+}
+
+
+Client::~Client(void) noexcept {
+    if (started) {
+        Stop();
+    }
+
+    for (Connection& connection : connections) {
+        delete connection.socket;
+    }
+}
+
+
+void Client::Start(void) {
+    int err = pthread_create(&thread, nullptr, ThreadWrapper, this);
+    if (err != 0) {
+        throw runtime_error("Error creating IO thread: " + string(strerror(err)));
+    }
+    started = true;
+}
+
+
+void Client::Stop(void) {
+    poller.Trigger(kSHUTDOWN);
+
+    int err = pthread_join(thread, nullptr);
+    if (err != 0) {
+        cerr << "Fatal: problem joining IO thread: " << strerror(err) << endl;
+        abort();
     }
+    started = false;
+}
+
+
+uint64_t Client::Completed(void) const noexcept {
+    return completed.load(memory_order_relaxed);
+}
+
+
+uint64_t Client::Errors(void) const noexcept {
+    return errors.load(memory_order_relaxed);
+}
+
+
+Histogram const& Client::Latencies(void) const noexcept {
+    return latencies;
 }
 
 
@@ -57,178 +137,288 @@ void* Client::ThreadWrapper(void* ptr) {
 }
 
 
-void Client::AddEventInterest(int ident, short filter, void* data) {
-    struct kevent event;
-    EV_SET(&event, ident, filter, EV_ADD, 0, 0, data);
-
-    int err = kevent(kq, &event, 1, nullptr, 0, nullptr);
-    if (err == -1) {
-        throw IOException("Error adding (ident,filter) pair to kqueue: " + string(strerror(errno)));
+void Client::ThreadMain(void) {
+    uint64_t now = NowNanos();
+    for (size_t i = 0; i < connections.size(); i++) {
+        // Stagger the open loop schedules so that connections don't all fire
+        // at the same instant.
+        size_t global_index = id * options.connections_per_thread + i;
+        size_t total_connections = options.threads * options.connections_per_thread;
+        connections[i].schedule_start = now + interval * global_index / total_connections;
+        Connect(connections[i], now);
     }
 
-    if (event.flags & EV_ERROR) {
-        throw IOException("Error adding (ident,filter) pair to kqueue: " + string(strerror(event.data)));
+    bool shutdown = false;
+    while (!shutdown) {
+        Poller::Event events[64];
+        int num_events = poller.Wait(events, sizeof(events) / sizeof(events[0]), NextTimeout(NowNanos()));
+
+        for (int i = 0; i < num_events; i++) {
+            Poller::Event* event = &events[i];
+            if (event->user) {
+                UserEventID event_id = static_cast<UserEventID>(event->user_event);
+                switch (event_id) {
+                    case kSHUTDOWN:
+                        shutdown = true;
+                        break;
+
+                    default:
+                        cerr << "Unknown event id: " << event_id << endl;
+                        abort();
+                }
+                continue;
+            }
+
+            Connection& connection = *static_cast<Connection*>(event->data);
+            if (connection.socket == nullptr) {
+                continue;
+            }
+
+            if (!connection.connected) {
+                if (!event->writable) {
+                    continue;
+                }
+                if (connection.socket->GetErrorCode() != 0) {
+                    Disconnect(connection, NowNanos());
+                    continue;
+                }
+                connection.connected = true;
+            }
+
+            if (event->readable && !RecvReplies(connection)) {
+                Disconnect(connection, NowNanos());
+            }
+        }
+
+        now = NowNanos();
+        for (Connection& connection : connections) {
+            if (connection.socket == nullptr) {
+                if (now >= connection.reconnect_at) {
+                    Connect(connection, now);
+                }
+                continue;
+            }
+
+            if (connection.connected) {
+                IssueRequests(connection, now);
+                if (!FlushRequests(connection)) {
+                    Disconnect(connection, now);
+                }
+            }
+        }
     }
 }
 
 
-void Client::ThreadMain(void) {
+void Client::Connect(Connection& connection, uint64_t now) {
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    char port_str[16];
-    sprintf(port_str, "%d", server_address.Port());
+    IOUtils::AutoCloseableAddrInfo addrs(server_address, hints);
+    while (addrs.HasNext()) {
+        struct addrinfo* addr = addrs.Next();
+        BufferedSocket* socket = new BufferedSocket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        socket->SetNonBlocking(true);
+
+        bool connected;
+        if (socket->Connect(addr->ai_addr, addr->ai_addrlen) == 0) {
+            connected = true;
+        } else if (errno == EINPROGRESS) {
+            connected = false;
+        } else if (errno == ECONNREFUSED || errno == ECONNRESET || errno == ENETUNREACH || errno == ETIMEDOUT) {
+            delete socket;
+            continue;
+        } else {
+            int err = errno;
+            delete socket;
+            throw IOException("Problem calling connect(2): " + string(strerror(err)));
+        }
 
-    bool shutdown = false;
-    while (!shutdown) {
-        IOUtils::AutoCloseableAddrInfo addrs(server_address, hints);
-        while (!shutdown && addrs.HasNext()) {
-            struct addrinfo* addr = addrs.Next();
+        connection.socket = socket;
+        connection.connected = connected;
+        connection.hello_acknowledged = false;
+        connection.interested_in_writes = true;
+        connection.first_outstanding = 0;
+        connection.num_outstanding = 0;
+        poller.Add(socket->GetFD(), Poller::Interest::READ | Poller::Interest::WRITE, &connection);
+
+        // Requests missed while we were disconnected are skipped rather than
+        // fired all at once.
+        if (interval > 0 && connection.schedule_start + connection.next_request * interval < now) {
+            connection.next_request = (now - connection.schedule_start) / interval;
+        }
+
+        // Requests may be pipelined right behind the hello.
+        FrameWriter writer(socket->ReserveWrite(4 + 4 + 4));
+        writer.PutInt(Protocol::MessageType::CLIENT_HELLO);
+        writer.PutInt(Protocol::MAGIC_NUMBER);
+        writer.PutInt(Protocol::PROTOCOL_VERSION);
+        return;
+    }
+
+    errors.fetch_add(1, memory_order_relaxed);
+    connection.reconnect_at = now + kReconnectDelayNanos;
+}
 
-            BufferedSocket socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-            socket.SetNonBlocking(true);
 
-            Buffer sink(64 * 1024);
-            Buffer client_hello(12);
-            Buffer client_test(4);
+void Client::Disconnect(Connection& connection, uint64_t now) {
+    // Requests that were in flight are lost; they never complete.
+    errors.fetch_add(1, memory_order_relaxed);
+    delete connection.socket;
+    connection.socket = nullptr;
+    connection.connected = false;
+    connection.num_outstanding = 0;
+    connection.reconnect_at = now + kReconnectDelayNanos;
+}
 
-            client_hello.UnsafePutInt(Protocol::MessageType::CLIENT_HELLO);
-            client_hello.UnsafePutInt(Protocol::MAGIC_NUMBER);
-            client_hello.UnsafePutInt(Protocol::PROTOCOL_VERSION);
-            client_hello.Flip();
 
-            client_test.UnsafePutInt(Protocol::MessageType::CLIENT_TEST);
-            client_test.Flip();
+void Client::IssueRequests(Connection& connection, uint64_t now) {
+    size_t depth = options.pipeline_depth;
+    while (connection.num_outstanding < depth) {
+        uint64_t send_time = now;
+        if (interval > 0) {
+            send_time = connection.schedule_start + connection.next_request * interval;
+            if (send_time > now) {
+                break;
+            }
+            connection.next_request++;
+        }
+
+        FrameWriter writer(connection.socket->ReserveWrite(4 + 4 + payload.length()));
+        writer.PutInt(Protocol::MessageType::CLIENT_TEST);
+        writer.PutInt(payload.length());
+        writer.PutBytes(payload.data(), payload.length());
+
+        size_t slot = (connection.first_outstanding + connection.num_outstanding) % depth;
+        connection.send_times[slot] = send_time;
+        connection.num_outstanding++;
+    }
+}
+
+
+bool Client::RecvReplies(Connection& connection) {
+    BufferedSocket& socket = *connection.socket;
+    for (;;) {
+        BufferedSocket::RecvStatus status = socket.Recv();
+        uint64_t now = NowNanos();
+
+        char const* data = socket.ReadData();
+        size_t length = socket.ReadableBytes();
+        size_t consumed = 0;
+        size_t needed = 0;
+        uint64_t num_replies = 0;
+        for (;;) {
+            FrameReader reader(data + consumed, length - consumed);
+            uint32_t message_type;
+            if (!reader.GetInt(&message_type)) {
+                needed = reader.Needed();
+                break;
+            }
 
-            bool connected;
-            if (socket.Connect(addr->ai_addr, addr->ai_addrlen) == 0) {
-                connected = true;
-                AddEventInterest(socket.GetFD(), EVFILT_READ, nullptr);
+            if (!connection.hello_acknowledged) {
+                if (message_type != Protocol::MessageType::CLIENT_HELLO_REPLY) {
+                    cerr << "Expected a ClientHelloReply, got message type " << message_type << endl;
+                    return false;
+                }
+                connection.hello_acknowledged = true;
             } else {
-                if (errno == EINPROGRESS) {
-                    connected = false;
-                } else if (errno == ECONNREFUSED || errno == ECONNRESET || errno == ENETUNREACH || errno == ETIMEDOUT) {
+                uint32_t payload_length;
+                char const* reply_payload;
+                if (message_type != Protocol::MessageType::CLIENT_TEST_REPLY) {
+                    cerr << "Expected a ClientTestReply, got message type " << message_type << endl;
+                    return false;
+                }
+                if (!reader.GetInt(&payload_length) || !reader.GetBytes(payload_length, &reply_payload)) {
+                    needed = reader.Needed();
                     break;
-                } else {
-                    throw IOException("Problem calling connect(2): " + string(strerror(errno)));
                 }
-            }
-
-            bool closed = false;
-            AddEventInterest(socket.GetFD(), EVFILT_WRITE, nullptr);
-            while (!shutdown && !closed) {
-                struct kevent events[64];
-                int num_events = kevent(kq, nullptr, 0, events, sizeof(events) / sizeof(events[0]), nullptr);
-                if (num_events == -1) {
-                    cerr << "Problem querying ready events from kqueue: " << strerror(errno) << endl;
-                    abort();
+                if (connection.num_outstanding == 0 || payload.compare(0, string::npos, reply_payload, payload_length) != 0) {
+                    cerr << "ClientTestReply does not match any request" << endl;
+                    return false;
                 }
 
-                for (int i = 0; i < num_events; i++) {
-                    struct kevent* event = &events[i];
-                    if (event->filter == EVFILT_USER) {
-                        KqueueUserEventID event_id = static_cast<KqueueUserEventID>(event->ident);
-                        switch (event_id) {
-                            case kSHUTDOWN:
-                                shutdown = true;
-                                break;
-
-                            default:
-                                cerr << "Unknown event id: " << event_id << endl;
-                                abort();
-                        }
-                    } else {
-                        switch (event->filter) {
-                            case EVFILT_READ:
-                                switch (socket.Fill(sink)) {
-                                    case BufferedSocket::RecvStatus::complete:
-                                        sink.Clear();
-                                        break;
-
-                                    case BufferedSocket::RecvStatus::incomplete:
-                                        break;
-
-                                    case BufferedSocket::RecvStatus::closed:
-                                        closed = true;
-                                        break;
-                                }
-                                break;
-
-                            case EVFILT_WRITE:
-                                if (connected) {
-                                    switch (socket.Write(client_hello)) {
-                                        case BufferedSocket::SendStatus::complete:
-                                            break;
-
-                                        case BufferedSocket::SendStatus::incomplete:
-                                            break;
-
-                                        case BufferedSocket::SendStatus::closed:
-                                            closed = true;
-                                            break;
-                                    }
-
-                                    switch (socket.Write(client_test)) {
-                                        case BufferedSocket::SendStatus::complete:
-                                            client_test.Flip();
-                                            break;
-
-                                        case BufferedSocket::SendStatus::incomplete:
-                                            break;
-
-                                        case BufferedSocket::SendStatus::closed:
-                                            closed = true;
-                                            break;
-                                    }
-
-                                    // TODO: flush?
-
-                                } else {
-                                    if (socket.GetErrorCode() == 0) {
-                                        connected = true;
-                                        AddEventInterest(socket.GetFD(), EVFILT_READ, nullptr);
-                                    } else {
-                                        closed = true;
-                                    }
-                                }
-                                break;
-
-                            default:
-                                cerr << "Unexpected event filter: " << event->filter << endl;
-                                abort();
-                        }
-                    }
-                }
+                // Replies arrive in request order.
+                uint64_t send_time = connection.send_times[connection.first_outstanding];
+                connection.first_outstanding = (connection.first_outstanding + 1) % options.pipeline_depth;
+                connection.num_outstanding--;
+                latencies.Record(now - send_time);
+                num_replies++;
             }
+            consumed += reader.Position();
         }
+        socket.Consume(consumed);
+        completed.fetch_add(num_replies, memory_order_relaxed);
+
+        switch (status) {
+            case BufferedSocket::RecvStatus::complete:
+                if (needed > Constants::MAX_MESSAGE_SIZE) {
+                    cerr << "Reply of " << needed << " bytes exceeds the maximum message size" << endl;
+                    return false;
+                }
+                socket.ReserveRead(needed);
+                break;
+
+            case BufferedSocket::RecvStatus::incomplete:
+                return true;
 
-        // Sleep and try again later.
+            case BufferedSocket::RecvStatus::closed:
+                return false;
+        }
     }
 }
 
 
-Client::~Client(void) noexcept {
-    struct kevent event;
-    EV_SET(&event, kSHUTDOWN/*ident*/, EVFILT_USER/*filter*/, EV_ADD/*flags*/, NOTE_TRIGGER/*fflags*/, 0/*data*/, nullptr/*user data*/);
-
-    int err = kevent(kq, &event, 1, nullptr, 0, nullptr);
-    if (err == -1) {
-        cerr << "Fatal: problem notifying event loop about shutdown: " << strerror(err) << endl;
-        abort();
+bool Client::FlushRequests(Connection& connection) {
+    BufferedSocket& socket = *connection.socket;
+    if (!socket.HasPendingWrites() && !connection.interested_in_writes) {
+        return true;
     }
 
-    if (event.flags & EV_ERROR) {
-        cerr << "Fatal: problem notifying event loop about shutdown: " << strerror(event.data) << endl;
-        abort();
+    switch (socket.Flush()) {
+        case BufferedSocket::SendStatus::complete:
+            if (connection.interested_in_writes) {
+                connection.interested_in_writes = false;
+                poller.Modify(socket.GetFD(), Poller::Interest::READ, &connection);
+            }
+            return true;
+
+        case BufferedSocket::SendStatus::incomplete:
+            if (!connection.interested_in_writes) {
+                connection.interested_in_writes = true;
+                poller.Modify(socket.GetFD(), Poller::Interest::READ | Poller::Interest::WRITE, &connection);
+            }
+            return true;
+
+        case BufferedSocket::SendStatus::closed:
+            return false;
     }
+    return false;
+}
 
-    err = pthread_join(thread, nullptr);
-    if (err != 0) {
-        cerr << "Fatal: problem joining IO thread: " << strerror(err) << endl;
-        abort();
+
+int Client::NextTimeout(uint64_t now) {
+    uint64_t timeout = static_cast<uint64_t>(kMaxTimeoutMillis) * 1000000;
+    for (Connection& connection : connections) {
+        uint64_t due;
+        if (connection.socket == nullptr) {
+            due = connection.reconnect_at;
+        } else if (interval > 0 && connection.connected && connection.num_outstanding < options.pipeline_depth) {
+            due = connection.schedule_start + connection.next_request * interval;
+        } else {
+            continue;
+        }
+
+        if (due <= now) {
+            return 0;
+        }
+        if (due - now < timeout) {
+            timeout = due - now;
+        }
     }
 
-    IOUtils::Close(kq);
+    // Round down: sending late would show up as latency, so for the final
+    // millisecond before a request is due we poll without blocking instead.
+    return static_cast<int>(timeout / 1000000);
 }
@@ -1,23 +1,101 @@
 #ifndef KIWI_CLIENT_H_
 #define KIWI_CLIENT_H_
 
+#include <atomic>
 #include <pthread.h>
+#include <string>
+#include <vector>
+#include "common/buffered_socket.h"
+#include "common/poller.h"
 #include "common/socket_address.h"
+#include "histogram.h"
 
 
+struct ClientOptions {
+    size_t threads;
+    size_t connections_per_thread;
+    size_t pipeline_depth;
+    uint64_t rate;           // total requests/s across all threads; 0 = closed loop
+    uint64_t duration;       // seconds; 0 = until interrupted
+    size_t payload_size;
+    std::string json_path;
+};
+
+
+/*
+ * One load-generating thread driving `connections_per_thread` connections
+ * with ClientTest requests.
+ *
+ * Closed loop (rate 0): every connection keeps `pipeline_depth` requests
+ * outstanding, and latency is measured from when a request was sent.
+ *
+ * Open loop (rate > 0): every connection issues requests on a fixed schedule,
+ * whether or not the server keeps up. Latency is measured from when a
+ * request was *supposed* to be sent, so a stalled server (or a full pipeline)
+ * shows up as latency instead of silently lowering the offered load, i.e. we
+ * correct for coordinated omission.
+ */
 class Client {
 public:
-    Client(SocketAddress const& server_address);
+    Client(SocketAddress const& server_address, ClientOptions const& options, size_t id);
     ~Client(void) noexcept;
 
+    void Start(void);
+    void Stop(void);
+
+    // Safe to call from any thread while running. Errors counts failed
+    // connection attempts and connections lost mid-run.
+    uint64_t Completed(void) const noexcept;
+    uint64_t Errors(void) const noexcept;
+
+    // Only meaningful once Stop() has returned.
+    Histogram const& Latencies(void) const noexcept;
+
+    // Delete copy constructor and copy assignment operator
+    Client(Client const& other) = delete;
+    Client& operator=(Client const& other) = delete;
+
 private:
+    struct Connection {
+        Connection(void);
+
+        BufferedSocket* socket;
+        bool connected;
+        bool hello_acknowledged;
+        bool interested_in_writes;
+        uint64_t reconnect_at;
+
+        // Send (or, open loop, intended send) times of outstanding requests.
+        std::vector<uint64_t> send_times;
+        size_t first_outstanding;
+        size_t num_outstanding;
+
+        // Open loop schedule: request n is due at schedule_start + n * interval.
+        uint64_t schedule_start;
+        uint64_t next_request;
+    };
+
     SocketAddress const& server_address;
-    int kq;
+    ClientOptions const& options;
+    size_t id;
+    Poller poller;
     pthread_t thread;
+    bool started;
+    std::string payload;
+    uint64_t interval;
+    std::vector<Connection> connections;
+    Histogram latencies;
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> errors;
 
     static void* ThreadWrapper(void* ptr);
     void ThreadMain(void);
-    void AddEventInterest(int ident, short filter, void* data);
+    void Connect(Connection& connection, uint64_t now);
+    void Disconnect(Connection& connection, uint64_t now);
+    void IssueRequests(Connection& connection, uint64_t now);
+    bool RecvReplies(Connection& connection);
+    bool FlushRequests(Connection& connection);
+    int NextTimeout(uint64_t now);
 };
 
 #endif  // KIWI_CLIENT_H_
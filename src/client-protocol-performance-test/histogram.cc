@@ -0,0 +1,109 @@
+#include "histogram.h"
+
+
+static const int kSubBucketBits = 7;
+static const uint64_t kSubBucketCount = 1 << kSubBucketBits;          // 128
+static const uint64_t kSubBucketHalfCount = kSubBucketCount / 2;       // 64
+static const size_t kNumBuckets = (64 - kSubBucketBits + 1) * kSubBucketHalfCount + kSubBucketHalfCount;
+
+static size_t BucketIndex(uint64_t value) {
+    if (value < kSubBucketCount) {
+        return value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (kSubBucketBits - 1);
+    return shift * kSubBucketHalfCount + (value >> shift);
+}
+
+
+static uint64_t HighestEquivalentValue(size_t index) {
+    if (index < kSubBucketCount) {
+        return index;
+    }
+
+    int shift = index / kSubBucketHalfCount - 1;
+    uint64_t sub_bucket = index % kSubBucketHalfCount + kSubBucketHalfCount;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+
+Histogram::Histogram(void) :
+        counts(kNumBuckets, 0),
+        total_count(0),
+        min(UINT64_MAX),
+        max(0),
+        sum(0) {}
+
+
+void Histogram::Record(uint64_t value) noexcept {
+    counts[BucketIndex(value)]++;
+    total_count++;
+    sum += value;
+    if (value < min) {
+        min = value;
+    }
+    if (value > max) {
+        max = value;
+    }
+}
+
+
+void Histogram::Merge(Histogram const& other) noexcept {
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        counts[i] += other.counts[i];
+    }
+    total_count += other.total_count;
+    sum += other.sum;
+    if (other.min < min) {
+        min = other.min;
+    }
+    if (other.max > max) {
+        max = other.max;
+    }
+}
+
+
+uint64_t Histogram::Count(void) const noexcept {
+    return total_count;
+}
+
+
+uint64_t Histogram::Min(void) const noexcept {
+    return (total_count > 0) ? (min) : (0);
+}
+
+
+uint64_t Histogram::Max(void) const noexcept {
+    return max;
+}
+
+
+double Histogram::Mean(void) const noexcept {
+    return (total_count > 0) ? (sum / total_count) : (0);
+}
+
+
+uint64_t Histogram::Percentile(double percentile) const noexcept {
+    if (total_count == 0) {
+        return 0;
+    }
+
+    if (percentile > 100) {
+        percentile = 100;
+    }
+    uint64_t target = static_cast<uint64_t>(percentile / 100 * total_count + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += counts[i];
+        if (seen >= target) {
+            uint64_t value = HighestEquivalentValue(i);
+            return (value < max) ? (value) : (max);
+        }
+    }
+    return max;
+}
@@ -0,0 +1,47 @@
+#ifndef KIWI_HISTOGRAM_H_
+#define KIWI_HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+/*
+ * HDR-style log-linear histogram of non-negative integer values (we record
+ * latencies in nanoseconds).
+ *
+ * Values below 128 get a bucket each; above that, every power of two is split
+ * into 64 linear sub-buckets, so any recorded value is reported to within
+ * 1/64 (~1.6%) of its true value across the whole 64-bit range, using a fixed
+ * ~30 KiB of counters. Recording is a couple of shifts and an increment.
+ *
+ * Not thread-safe: each load thread records into its own histogram and they
+ * are merged once the threads have stopped.
+ */
+class Histogram {
+public:
+    Histogram(void);
+
+    void Record(uint64_t value) noexcept;
+    void Merge(Histogram const& other) noexcept;
+
+    uint64_t Count(void) const noexcept;
+    uint64_t Min(void) const noexcept;
+    uint64_t Max(void) const noexcept;
+    double Mean(void) const noexcept;
+
+    /*
+     * Returns the highest value equivalent (i.e. the upper end of the bucket)
+     * to the given percentile, which is in the range [0, 100].
+     */
+    uint64_t Percentile(double percentile) const noexcept;
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total_count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+};
+
+#endif  // KIWI_HISTOGRAM_H_
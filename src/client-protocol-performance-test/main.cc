@@ -1,33 +1,216 @@
+#include <atomic>
+#include <errno.h>
+#include <fstream>
+#include <getopt.h>
+#include <iomanip>
 #include <iostream>
 #include <pthread.h>
 #include <signal.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
 #include "client.h"
 #include "common/constants.h"
+#include "common/timing_utils.h"
 
 
 using namespace std;
 
+static const long kPollIntervalNanos = 100 * 1000 * 1000;
+
 static void PrintUsage(int argc, char * const argv[]) {
     const char * program_name = (argc > 0) ? (argv[0]) : ("(unknown)");
-    cerr << "usage: " << program_name << " server-address" << endl;
+    cerr << "usage: " << program_name << " [options] server-address" << endl;
+    cerr << endl;
+    cerr << "  -t, --threads N        load-generating threads (default: 1)" << endl;
+    cerr << "  -c, --connections N    connections per thread (default: 1)" << endl;
+    cerr << "  -p, --pipeline N       max outstanding requests per connection (default: 16)" << endl;
+    cerr << "  -r, --rate N           total requests/s, open loop; 0 = closed loop (default: 0)" << endl;
+    cerr << "  -d, --duration N       seconds to run; 0 = until interrupted (default: 10)" << endl;
+    cerr << "  -s, --payload N        ClientTest payload bytes (default: 0)" << endl;
+    cerr << "  -j, --json PATH        write a JSON summary to PATH (- for stdout)" << endl;
+    cerr << "  -h, --help             show this message" << endl;
 }
 
 
-static int Run(const char * address, const sigset_t termination_signals) {
+static bool ParseNumber(char const* value, uint64_t min, uint64_t max, uint64_t* result) {
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (errno != 0 || *end != '\0' || end == value || parsed < min || parsed > max) {
+        return false;
+    }
+    *result = parsed;
+    return true;
+}
 
-    // Parse the server address
-    SocketAddress server_address = SocketAddress::FromString(address, Constants::DEFAULT_PORT);
 
-    // Initialize the client
-    Client client(server_address);
+static double Seconds(struct timespec const& timespec) {
+    return timespec.tv_sec + timespec.tv_nsec / 1e9;
+}
+
 
-    // Wait for termination signal
+static double Micros(double nanos) {
+    return nanos / 1e3;
+}
+
+
+struct SignalWaiter {
+    sigset_t termination_signals;
+    std::atomic<bool> terminated;
+};
+
+
+static void* WaitForSignal(void* ptr) {
+    SignalWaiter* waiter = static_cast<SignalWaiter*>(ptr);
     int termination_signal;
-    int err = sigwait(&termination_signals, &termination_signal);
+    int err = sigwait(&waiter->termination_signals, &termination_signal);
     if (err != 0) {
         cerr << "Problem waiting for signal: " << strerror(err) << endl;
+    }
+    waiter->terminated.store(true);
+    return nullptr;
+}
+
+
+static string Summarize(ClientOptions const& options, double elapsed, uint64_t completed, uint64_t errors, Histogram const& latencies, vector<uint64_t> const& per_second) {
+    stringstream ss;
+    ss << fixed << setprecision(3);
+    ss << "{" << endl;
+    ss << "  \"threads\": " << options.threads << "," << endl;
+    ss << "  \"connections_per_thread\": " << options.connections_per_thread << "," << endl;
+    ss << "  \"pipeline_depth\": " << options.pipeline_depth << "," << endl;
+    ss << "  \"mode\": \"" << ((options.rate > 0) ? ("open_loop") : ("closed_loop")) << "\"," << endl;
+    ss << "  \"target_rate\": " << options.rate << "," << endl;
+    ss << "  \"payload_bytes\": " << options.payload_size << "," << endl;
+    ss << "  \"elapsed_seconds\": " << elapsed << "," << endl;
+    ss << "  \"requests\": " << completed << "," << endl;
+    ss << "  \"errors\": " << errors << "," << endl;
+    ss << "  \"throughput\": " << ((elapsed > 0) ? (completed / elapsed) : (0)) << "," << endl;
+    ss << "  \"latency_us\": {" << endl;
+    ss << "    \"min\": " << Micros(latencies.Min()) << "," << endl;
+    ss << "    \"mean\": " << Micros(latencies.Mean()) << "," << endl;
+    ss << "    \"p50\": " << Micros(latencies.Percentile(50)) << "," << endl;
+    ss << "    \"p90\": " << Micros(latencies.Percentile(90)) << "," << endl;
+    ss << "    \"p99\": " << Micros(latencies.Percentile(99)) << "," << endl;
+    ss << "    \"p999\": " << Micros(latencies.Percentile(99.9)) << "," << endl;
+    ss << "    \"max\": " << Micros(latencies.Max()) << endl;
+    ss << "  }," << endl;
+    ss << "  \"per_second\": [";
+    for (size_t i = 0; i < per_second.size(); i++) {
+        ss << ((i > 0) ? (", ") : ("")) << per_second[i];
+    }
+    ss << "]" << endl;
+    ss << "}" << endl;
+    return ss.str();
+}
+
+
+static int Run(const char * address, ClientOptions const& options, sigset_t const& termination_signals) {
+
+    // Parse the server address
+    SocketAddress server_address = SocketAddress::FromString(address, Constants::DEFAULT_PORT);
+
+    // Termination signals are picked up by a dedicated thread so that the
+    // main thread is free to report progress.
+    static SignalWaiter waiter;
+    waiter.termination_signals = termination_signals;
+    waiter.terminated.store(false);
+    pthread_t signal_thread;
+    int err = pthread_create(&signal_thread, nullptr, WaitForSignal, &waiter);
+    if (err != 0) {
+        cerr << "Problem creating signal thread: " << strerror(err) << endl;
         return 1;
     }
+    pthread_detach(signal_thread);
+
+    // Initialize the load threads
+    vector<Client*> clients;
+    for (size_t i = 0; i < options.threads; i++) {
+        clients.push_back(new Client(server_address, options, i));
+    }
+
+    struct timespec start;
+    TimingUtils::Nanotime(&start);
+    for (Client* client : clients) {
+        client->Start();
+    }
+
+    // Report throughput once a second until we're done
+    vector<uint64_t> per_second;
+    uint64_t last_completed = 0;
+    struct timespec last_report = start;
+    struct timespec now;
+    struct timespec elapsed;
+    for (;;) {
+        struct timespec poll_interval = {0, kPollIntervalNanos};
+        nanosleep(&poll_interval, nullptr);
+
+        TimingUtils::Nanotime(&now);
+        TimingUtils::Subtract(&elapsed, &now, &start);
+        bool done = waiter.terminated.load() || (options.duration > 0 && Seconds(elapsed) >= options.duration);
+
+        struct timespec since_report;
+        TimingUtils::Subtract(&since_report, &now, &last_report);
+        if (Seconds(since_report) >= 1 || done) {
+            uint64_t completed = 0;
+            uint64_t errors = 0;
+            for (Client* client : clients) {
+                completed += client->Completed();
+                errors += client->Errors();
+            }
+
+            if (Seconds(since_report) >= 1) {
+                per_second.push_back(completed - last_completed);
+                cerr << setw(4) << per_second.size() << "s  "
+                     << setw(10) << static_cast<uint64_t>((completed - last_completed) / Seconds(since_report)) << " req/s  "
+                     << errors << " errors" << endl;
+                last_completed = completed;
+                last_report = now;
+            }
+        }
+
+        if (done) {
+            break;
+        }
+    }
+
+    // Stop the load and merge the per-thread results
+    Histogram latencies;
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    for (Client* client : clients) {
+        client->Stop();
+        latencies.Merge(client->Latencies());
+        completed += client->Completed();
+        errors += client->Errors();
+        delete client;
+    }
+    TimingUtils::Nanotime(&now);
+    TimingUtils::Subtract(&elapsed, &now, &start);
+
+    cerr << fixed << setprecision(1);
+    cerr << completed << " requests in " << Seconds(elapsed) << "s (" << completed / Seconds(elapsed) << " req/s), " << errors << " errors" << endl;
+    cerr << "latency (us): p50 " << Micros(latencies.Percentile(50))
+         << "  p99 " << Micros(latencies.Percentile(99))
+         << "  p999 " << Micros(latencies.Percentile(99.9))
+         << "  max " << Micros(latencies.Max()) << endl;
+
+    if (!options.json_path.empty()) {
+        string summary = Summarize(options, Seconds(elapsed), completed, errors, latencies, per_second);
+        if (options.json_path == "-") {
+            cout << summary;
+        } else {
+            ofstream json(options.json_path);
+            json << summary;
+            if (!json) {
+                cerr << "Problem writing " << options.json_path << endl;
+                return 1;
+            }
+        }
+    }
 
     // Bye
     return 0;
@@ -42,12 +225,12 @@ int main(int argc, char * const argv[]) {
 
     /*
      * Block termination signals
-     * 
+     *
      * Note: all threads inherit this sigmask. It's imperative that threads do not
      * modify their sigmask from this inherited version; this ensures that the
      * termination signals are properly blocked and not delivered to random threads.
      * We rely upon this expectation so that we can then deliver the signals in a
-     * controlled manner within the main thread.
+     * controlled manner within the signal thread.
      */
     int err = pthread_sigmask(SIG_BLOCK, &termination_signals, nullptr);
     if (err != 0) {
@@ -55,18 +238,92 @@ int main(int argc, char * const argv[]) {
         return 1;
     }
 
-    if (argc != 2) {
+    ClientOptions options;
+    options.threads = 1;
+    options.connections_per_thread = 1;
+    options.pipeline_depth = 16;
+    options.rate = 0;
+    options.duration = 10;
+    options.payload_size = 0;
+
+    static struct option long_options[] = {
+        {"threads",     required_argument, nullptr, 't'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"pipeline",    required_argument, nullptr, 'p'},
+        {"rate",        required_argument, nullptr, 'r'},
+        {"duration",    required_argument, nullptr, 'd'},
+        {"payload",     required_argument, nullptr, 's'},
+        {"json",        required_argument, nullptr, 'j'},
+        {"help",        no_argument,       nullptr, 'h'},
+        {nullptr,       0,                 nullptr, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "t:c:p:r:d:s:j:h", long_options, nullptr)) != -1) {
+        uint64_t value = 0;
+        bool valid = true;
+        switch (option) {
+            case 't':
+                valid = ParseNumber(optarg, 1, 1024, &value);
+                options.threads = value;
+                break;
+
+            case 'c':
+                valid = ParseNumber(optarg, 1, 65536, &value);
+                options.connections_per_thread = value;
+                break;
+
+            case 'p':
+                valid = ParseNumber(optarg, 1, 65536, &value);
+                options.pipeline_depth = value;
+                break;
+
+            case 'r':
+                valid = ParseNumber(optarg, 0, UINT64_MAX, &value);
+                options.rate = value;
+                break;
+
+            case 'd':
+                valid = ParseNumber(optarg, 0, UINT64_MAX, &value);
+                options.duration = value;
+                break;
+
+            case 's':
+                valid = ParseNumber(optarg, 0, Constants::MAX_MESSAGE_SIZE - 8, &value);
+                options.payload_size = value;
+                break;
+
+            case 'j':
+                options.json_path = optarg;
+                break;
+
+            case 'h':
+                PrintUsage(argc, argv);
+                return 0;
+
+            default:
+                valid = false;
+                break;
+        }
+
+        if (!valid) {
+            PrintUsage(argc, argv);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
         PrintUsage(argc, argv);
         return 1;
     }
 
     try {
-        return Run(argv[1], termination_signals);
+        return Run(argv[optind], options, termination_signals);
     } catch (exception const& e) {
-        cerr << "Problem running server: " << e.what() << endl;
+        cerr << "Problem running client: " << e.what() << endl;
         return 1;
     } catch (...) {
-        cerr << "Problem running server" << endl;
+        cerr << "Problem running client" << endl;
         return 1;
     }
 }
@@ -1,6 +1,5 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <iostream>
 #include <netdb.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -10,6 +9,7 @@
 #include "abstract_socket.h"
 #include "exceptions.h"
 #include "io_utils.h"
+#include "logger.h"
 
 
 using namespace std;
@@ -57,7 +57,7 @@ void AbstractSocket::SetNonBlocking(bool nonblocking) noexcept {
             if (errno == EINTR) {
                 continue;
             } else {
-                cerr << "Problem fetching fd flags: " << strerror(errno) << endl;
+                KIWI_LOG_FATAL("Problem fetching fd flags: " << strerror(errno));
                 abort();
             }
         }
@@ -74,7 +74,7 @@ void AbstractSocket::SetNonBlocking(bool nonblocking) noexcept {
             if (errno == EINTR) {
                 continue;
             } else {
-                cerr << "Problem setting fd flags: " << strerror(errno) << endl;
+                KIWI_LOG_FATAL("Problem setting fd flags: " << strerror(errno));
                 abort();
             }
         }
@@ -86,7 +86,16 @@ void AbstractSocket::SetNonBlocking(bool nonblocking) noexcept {
 void AbstractSocket::SetReuseAddr(bool reuse_addr) noexcept {
     int optval = (reuse_addr) ? (1) : (0);
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) != 0) {
-        cerr << "WARNING: problem setting SO_REUSEADDR: " << strerror(errno) << endl;
+        KIWI_LOG_FATAL("Problem setting SO_REUSEADDR: " << strerror(errno));
+        abort();
+    }
+}
+
+
+void AbstractSocket::SetReusePort(bool reuse_port) noexcept {
+    int optval = (reuse_port) ? (1) : (0);
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0) {
+        KIWI_LOG_FATAL("Problem setting SO_REUSEPORT: " << strerror(errno));
         abort();
     }
 }
@@ -109,10 +118,10 @@ int AbstractSocket::Listen(int backlog) noexcept {
 
 int AbstractSocket::GetErrorCode(void) noexcept {
     int optval;
-    socklen_t optsize;
+    socklen_t optsize = sizeof(optval);
     int err = getsockopt(fd, SOL_SOCKET, SO_ERROR, &optval, &optsize);
     if (err == -1) {
-        cerr << "WARNING: problem getting socket error status: " << strerror(errno) << endl;
+        KIWI_LOG_FATAL("Problem getting socket error status: " << strerror(errno));
         abort();
     }
 
@@ -10,6 +10,7 @@ public:
     int GetFD(void) noexcept;
     void SetNonBlocking(bool nonblocking) noexcept;
     void SetReuseAddr(bool reuse_addr) noexcept;
+    void SetReusePort(bool reuse_port) noexcept;
     int Bind(struct sockaddr const* addr, socklen_t addrlen) noexcept;
     int Connect(struct sockaddr const* addr, socklen_t addrlen) noexcept;
     int Listen(int backlog) noexcept;
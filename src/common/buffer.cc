@@ -1,18 +1,27 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include "buffer.h"
+#include "buffer_pool.h"
+
+
+Buffer::Buffer(void) noexcept :
+        position(0),
+        limit(0),
+        capacity(0),
+        data(nullptr) {
+}
 
 
 Buffer::Buffer(size_t capacity) :
         position(0),
         limit(capacity),
         capacity(capacity),
-        data(new char[capacity]) {
+        data(BufferPool::Allocate(capacity)) {
 }
 
 
 Buffer::~Buffer(void) noexcept {
-    delete[] data;
+    BufferPool::Release(data, capacity);
 }
 
 
@@ -20,7 +29,7 @@ Buffer::Buffer(Buffer const& other) :
         position(other.position),
         limit(other.limit),
         capacity(other.capacity),
-        data(new char[capacity]) {
+        data(BufferPool::Allocate(capacity)) {
     std::memcpy(data, other.data, capacity);
 }
 
@@ -30,14 +39,12 @@ Buffer& Buffer::operator=(Buffer const& other) {
         return *this;
     }
 
-    if (data != nullptr) {
-        delete[] data;
-    }
+    BufferPool::Release(data, capacity);
 
     position = other.position;
     limit = other.limit;
     capacity = other.capacity;
-    data = new char[capacity];
+    data = BufferPool::Allocate(capacity);
     std::memcpy(data, other.data, capacity);
     return *this;
 }
@@ -48,6 +55,9 @@ Buffer::Buffer(Buffer&& other) noexcept :
         limit(other.limit),
         capacity(other.capacity),
         data(other.data) {
+    other.position = 0;
+    other.limit = 0;
+    other.capacity = 0;
     other.data = nullptr;
 }
 
@@ -57,15 +67,16 @@ Buffer& Buffer::operator=(Buffer&& other) noexcept {
         return *this;
     }
 
-    if (data != nullptr) {
-        delete[] data;
-    }
+    BufferPool::Release(data, capacity);
 
     position = other.position;
     limit = other.limit;
     capacity = other.capacity;
     data = other.data;
 
+    other.position = 0;
+    other.limit = 0;
+    other.capacity = 0;
     other.data = nullptr;
     return *this;
 }
@@ -96,10 +107,10 @@ size_t Buffer::Capacity(void) {
 
 
 void Buffer::ResetAndGrow(size_t new_capacity) {
-    delete[] data;
+    BufferPool::Release(data, capacity);
     data = nullptr;
 
-    data = new char[new_capacity];
+    data = BufferPool::Allocate(new_capacity);
     capacity = new_capacity;
     position = 0;
     limit = new_capacity;
@@ -7,6 +7,7 @@
 
 class Buffer {
 public:
+    Buffer(void) noexcept;  // empty; nothing is allocated
     Buffer(size_t capacity);
     ~Buffer(void) noexcept;
 
@@ -0,0 +1,157 @@
+#include "buffer_pool.h"
+
+
+static const size_t kNumClasses = 17;  // 2^4 .. 2^20
+static const size_t kHighWaterBytes = 32 * 1024 * 1024;
+static const size_t kLowWaterBytes = 16 * 1024 * 1024;
+
+namespace {
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+
+struct ThreadCache {
+    FreeBlock* free_lists[kNumClasses];
+    BufferPool::Statistics statistics;
+
+    ThreadCache(void) :
+            free_lists(),
+            statistics() {}
+
+    ~ThreadCache(void);
+
+    void ReleaseClass(size_t size_class, size_t target_bytes) noexcept;
+};
+
+// Trivially destructible, so still readable while (and after) the cache below
+// is torn down at thread exit; buffers freed after that bypass the pool.
+thread_local bool cache_alive = false;
+thread_local ThreadCache cache;
+
+
+ThreadCache::~ThreadCache(void) {
+    cache_alive = false;
+    for (size_t i = 0; i < kNumClasses; i++) {
+        ReleaseClass(i, 0);
+    }
+}
+
+
+void ThreadCache::ReleaseClass(size_t size_class, size_t target_bytes) noexcept {
+    size_t class_size = BufferPool::MIN_CLASS_SIZE << size_class;
+    while (free_lists[size_class] != nullptr && statistics.cached_bytes > target_bytes) {
+        FreeBlock* block = free_lists[size_class];
+        free_lists[size_class] = block->next;
+        statistics.cached_bytes -= class_size;
+        delete[] reinterpret_cast<char*>(block);
+    }
+}
+
+
+ThreadCache* GetCache(void) noexcept {
+    static thread_local bool initialized = false;
+    if (!initialized) {
+        initialized = true;
+        cache_alive = true;
+    }
+    return (cache_alive) ? (&cache) : (nullptr);
+}
+
+
+size_t SizeClass(size_t capacity) noexcept {
+    size_t size_class = 0;
+    size_t class_size = BufferPool::MIN_CLASS_SIZE;
+    while (class_size < capacity) {
+        class_size <<= 1;
+        size_class++;
+    }
+    return size_class;
+}
+
+}  // namespace
+
+
+char* BufferPool::Allocate(size_t capacity) {
+    if (capacity == 0) {
+        return nullptr;
+    }
+
+    ThreadCache* thread_cache = GetCache();
+    if (thread_cache != nullptr) {
+        thread_cache->statistics.allocations++;
+    }
+
+    if (capacity > MAX_CLASS_SIZE || thread_cache == nullptr) {
+        if (thread_cache != nullptr) {
+            thread_cache->statistics.oversized++;
+        }
+        return new char[capacity];
+    }
+
+    size_t size_class = SizeClass(capacity);
+    FreeBlock* block = thread_cache->free_lists[size_class];
+    if (block != nullptr) {
+        thread_cache->free_lists[size_class] = block->next;
+        thread_cache->statistics.cached_bytes -= MIN_CLASS_SIZE << size_class;
+        thread_cache->statistics.hits++;
+        return reinterpret_cast<char*>(block);
+    }
+
+    thread_cache->statistics.misses++;
+    return new char[MIN_CLASS_SIZE << size_class];
+}
+
+
+void BufferPool::Release(char* data, size_t capacity) noexcept {
+    if (data == nullptr) {
+        return;
+    }
+
+    ThreadCache* thread_cache = GetCache();
+    if (capacity > MAX_CLASS_SIZE || thread_cache == nullptr) {
+        delete[] data;
+        return;
+    }
+
+    size_t size_class = SizeClass(capacity);
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(data);
+    block->next = thread_cache->free_lists[size_class];
+    thread_cache->free_lists[size_class] = block;
+
+    Statistics& statistics = thread_cache->statistics;
+    statistics.releases++;
+    statistics.cached_bytes += MIN_CLASS_SIZE << size_class;
+    if (statistics.cached_bytes > statistics.peak_cached_bytes) {
+        statistics.peak_cached_bytes = statistics.cached_bytes;
+    }
+
+    if (statistics.cached_bytes > kHighWaterBytes) {
+        statistics.trims++;
+        for (size_t i = kNumClasses; i > 0 && statistics.cached_bytes > kLowWaterBytes; i--) {
+            thread_cache->ReleaseClass(i - 1, kLowWaterBytes);
+        }
+    }
+}
+
+
+BufferPool::Statistics BufferPool::GetStatistics(void) noexcept {
+    ThreadCache* thread_cache = GetCache();
+    if (thread_cache == nullptr) {
+        return Statistics();
+    }
+    return thread_cache->statistics;
+}
+
+
+void BufferPool::Trim(void) noexcept {
+    ThreadCache* thread_cache = GetCache();
+    if (thread_cache == nullptr) {
+        return;
+    }
+
+    for (size_t i = 0; i < kNumClasses; i++) {
+        thread_cache->ReleaseClass(i, 0);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef KIWI_BUFFER_POOL_H_
+#define KIWI_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Thread-local, size-classed cache of Buffer backing storage.
+ *
+ * Requests are rounded up to a power-of-two size class between 16 B and
+ * 1 MiB; each class keeps an intrusive free list of blocks released on this
+ * thread, so steady-state allocate/release never reaches malloc and never
+ * takes a lock. Larger requests bypass the pool. Blocks may be released on a
+ * different thread than the one that allocated them; they simply join the
+ * releasing thread's cache.
+ *
+ * Once a thread's cache grows past a high-water mark it is trimmed back down
+ * to a low-water mark, largest classes first, so that a burst of connections
+ * doesn't pin its peak memory forever.
+ */
+namespace BufferPool {
+    const size_t MIN_CLASS_SIZE = 16;
+    const size_t MAX_CLASS_SIZE = 1024 * 1024;
+
+    struct Statistics {
+        uint64_t allocations;    // requests served (pooled or not)
+        uint64_t hits;           // served from a free list
+        uint64_t misses;         // pooled size class, but had to allocate
+        uint64_t oversized;      // larger than MAX_CLASS_SIZE; bypassed the pool
+        uint64_t releases;
+        uint64_t trims;          // times the high-water mark was crossed
+        size_t cached_bytes;     // currently sitting in free lists
+        size_t peak_cached_bytes;
+    };
+
+    /*
+     * Returns storage for at least `capacity` bytes; nullptr for zero. The
+     * same `capacity` must be passed back to Release().
+     */
+    char* Allocate(size_t capacity);
+    void Release(char* data, size_t capacity) noexcept;
+
+    // Both apply to the calling thread's cache only.
+    Statistics GetStatistics(void) noexcept;
+    void Trim(void) noexcept;
+}
+
+#endif  // KIWI_BUFFER_POOL_H_
@@ -1,5 +1,6 @@
 #include <errno.h>
-#include <iostream>
+#include <cstring>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -10,24 +11,46 @@
 
 using namespace std;
 
+#if defined(MSG_NOSIGNAL)
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
 BufferedSocket::BufferedSocket(int domain, int type, int protocol) :
         BufferedSocket(IOUtils::OpenSocketFD(domain, type, protocol)) {}
 
 
 BufferedSocket::BufferedSocket(int fd) noexcept :
         AbstractSocket(fd),
-        read_buffer(64 * 1024),
-        write_buffer(64 * 1024),
-        flushing_in_progress(false) {
-    read_buffer.Flip();
-}
+        read_buffer(),
+        write_buffer(),
+        output_segments(),
+        first_output_segment(0),
+        send_in_flight(false),
+        max_buffer_size(DEFAULT_MAX_BUFFER_SIZE),
+        read_buffer_size(MIN_BUFFER_SIZE),
+        write_buffer_size(MIN_BUFFER_SIZE),
+        read_high_water(0),
+        write_high_water(0),
+        completion_based(false),
+        end_of_stream(false) {}
 
 
 BufferedSocket::BufferedSocket(BufferedSocket&& other) noexcept :
         AbstractSocket(other.fd),
         read_buffer(move(other.read_buffer)),
         write_buffer(move(other.write_buffer)),
-        flushing_in_progress(other.flushing_in_progress) {
+        output_segments(move(other.output_segments)),
+        first_output_segment(other.first_output_segment),
+        send_in_flight(other.send_in_flight),
+        max_buffer_size(other.max_buffer_size),
+        read_buffer_size(other.read_buffer_size),
+        write_buffer_size(other.write_buffer_size),
+        read_high_water(other.read_high_water),
+        write_high_water(other.write_high_water),
+        completion_based(other.completion_based),
+        end_of_stream(other.end_of_stream) {
     other.fd = -1;
 }
 
@@ -44,7 +67,16 @@ BufferedSocket& BufferedSocket::operator=(BufferedSocket&& other) noexcept {
     fd = other.fd;
     read_buffer = move(other.read_buffer);
     write_buffer = move(other.write_buffer);
-    flushing_in_progress = other.flushing_in_progress;
+    output_segments = move(other.output_segments);
+    first_output_segment = other.first_output_segment;
+    send_in_flight = other.send_in_flight;
+    max_buffer_size = other.max_buffer_size;
+    read_buffer_size = other.read_buffer_size;
+    write_buffer_size = other.write_buffer_size;
+    read_high_water = other.read_high_water;
+    write_high_water = other.write_high_water;
+    completion_based = other.completion_based;
+    end_of_stream = other.end_of_stream;
 
     other.fd = -1;
     return *this;
@@ -55,10 +87,66 @@ BufferedSocket::~BufferedSocket(void) noexcept {
 }
 
 
+void BufferedSocket::SetMaxBufferSize(size_t max_buffer_size) noexcept {
+    this->max_buffer_size = (max_buffer_size < MIN_BUFFER_SIZE) ? (MIN_BUFFER_SIZE) : (max_buffer_size);
+    if (read_buffer_size > this->max_buffer_size) {
+        read_buffer_size = this->max_buffer_size;
+    }
+    if (write_buffer_size > this->max_buffer_size) {
+        write_buffer_size = this->max_buffer_size;
+    }
+}
+
+
+void BufferedSocket::ReleaseIdleBuffers(void) noexcept {
+    // A busy period that never used more than a quarter of the buffer means
+    // the next one can probably make do with half of it.
+    if (read_buffer.Capacity() > 0 && read_buffer.Remaining() == 0) {
+        if (read_high_water < read_buffer_size / 4 && read_buffer_size / 2 >= MIN_BUFFER_SIZE) {
+            read_buffer_size /= 2;
+        }
+        read_high_water = 0;
+        read_buffer = Buffer();
+    }
+
+    if (write_buffer.Capacity() > 0 && !HasPendingWrites() && !send_in_flight) {
+        if (write_high_water < write_buffer_size / 4 && write_buffer_size / 2 >= MIN_BUFFER_SIZE) {
+            write_buffer_size /= 2;
+        }
+        write_high_water = 0;
+        write_buffer = Buffer();
+    }
+}
+
+
+void BufferedSocket::ResizeReadBuffer(size_t capacity) {
+    // read_buffer is kept flipped: [position, limit) holds the unread bytes.
+    size_t unread = read_buffer.Remaining();
+    Buffer resized(capacity);
+    if (unread > 0) {
+        std::memcpy(resized.Data(), read_buffer.Data() + read_buffer.Position(), unread);
+    }
+    resized.Position(0);
+    resized.Limit(unread);
+    read_buffer = move(resized);
+}
+
+
 BufferedSocket::RecvStatus BufferedSocket::Fill(Buffer& buffer) {
     while (buffer.Remaining() > 0) {
         buffer.FillFrom(read_buffer);
         if (read_buffer.Remaining() == 0) {
+            if (read_buffer.Capacity() == 0) {
+                ResizeReadBuffer(read_buffer_size);
+            }
+
+            if (completion_based) {
+                if (end_of_stream) {
+                    return RecvStatus::closed;
+                }
+                break;
+            }
+
             auto data = read_buffer.Data();
             auto capacity = read_buffer.Capacity();
             auto bytes_read = recv(fd, data, capacity, 0);
@@ -87,61 +175,315 @@ BufferedSocket::RecvStatus BufferedSocket::Fill(Buffer& buffer) {
 }
 
 
-BufferedSocket::SendStatus BufferedSocket::Write(Buffer& buffer) {
-    if (flushing_in_progress) {
-        SendStatus status = Flush();
-        if (status != SendStatus::complete) {
-            return status;
+BufferedSocket::RecvStatus BufferedSocket::Recv(void) {
+    if (read_buffer.Capacity() < read_buffer_size) {
+        if (completion_based) {
+            return (end_of_stream) ? (RecvStatus::closed) : (RecvStatus::incomplete);
+        }
+        ResizeReadBuffer(read_buffer_size);
+    }
+
+    // read_buffer is kept flipped: [position, limit) holds the unread bytes.
+    size_t unread = read_buffer.Remaining();
+    if (read_buffer.Position() > 0) {
+        if (unread > 0) {
+            std::memmove(read_buffer.Data(), read_buffer.Data() + read_buffer.Position(), unread);
         }
+        read_buffer.Position(0);
+        read_buffer.Limit(unread);
+    }
+
+    if (completion_based) {
+        return (end_of_stream) ? (RecvStatus::closed) : (RecvStatus::incomplete);
+    }
+
+    while (read_buffer.Limit() < read_buffer.Capacity()) {
+        auto data = read_buffer.Data() + read_buffer.Limit();
+        auto space_available = read_buffer.Capacity() - read_buffer.Limit();
+        auto bytes_read = recv(fd, data, space_available, 0);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return RecvStatus::incomplete;
+            } else if (errno == ECONNREFUSED || errno == ECONNRESET) {
+                return RecvStatus::closed;
+            } else {
+                throw IOException("Problem reading data from socket: " + string(strerror(errno)));
+            }
+        } else if (bytes_read == 0) {
+            return RecvStatus::closed;
+        } else {
+            read_buffer.Limit(read_buffer.Limit() + bytes_read);
+            if (read_buffer.Limit() > read_high_water) {
+                read_high_water = read_buffer.Limit();
+            }
+        }
+    }
+
+    // Filled the buffer in one go; more is probably on its way, so give the
+    // next receive more room.
+    if (read_buffer_size < max_buffer_size) {
+        read_buffer_size = (read_buffer_size * 2 < max_buffer_size) ? (read_buffer_size * 2) : (max_buffer_size);
+    }
+    return RecvStatus::complete;
+}
+
+
+char const* BufferedSocket::ReadData(void) noexcept {
+    return read_buffer.Data() + read_buffer.Position();
+}
+
+
+size_t BufferedSocket::ReadableBytes(void) noexcept {
+    return read_buffer.Remaining();
+}
+
+
+void BufferedSocket::Consume(size_t num_bytes) noexcept {
+    read_buffer.Position(read_buffer.Position() + num_bytes);
+}
+
+
+void BufferedSocket::ReserveRead(size_t num_bytes) {
+    if (read_buffer.Capacity() >= num_bytes) {
+        return;
+    }
+
+    // Oversized frames get a buffer of their own, which goes away again once
+    // the connection is idle; the adaptive size stays within the maximum.
+    ResizeReadBuffer(num_bytes);
+}
+
+
+size_t BufferedSocket::ReadCapacity(void) noexcept {
+    return read_buffer.Capacity();
+}
+
+
+BufferedSocket::SendStatus BufferedSocket::Write(Buffer& buffer) {
+    if (write_buffer.Capacity() == 0 && buffer.Remaining() > 0) {
+        write_buffer = Buffer(write_buffer_size);
+        write_buffer.Flip();
     }
 
     while (buffer.Remaining() > 0) {
-        write_buffer.FillFrom(buffer);
-        if (write_buffer.Remaining() == 0) {
+        size_t space_available = write_buffer.Capacity() - write_buffer.Remaining();
+        if (space_available == 0) {
             SendStatus status = Flush();
             if (status != SendStatus::complete) {
                 return status;
             }
+            continue;
         }
+
+        size_t bytes_to_copy = buffer.Remaining();
+        if (bytes_to_copy > space_available) {
+            bytes_to_copy = space_available;
+        }
+        std::memcpy(ReserveWrite(bytes_to_copy), buffer.Data() + buffer.Position(), bytes_to_copy);
+        buffer.Position(buffer.Position() + bytes_to_copy);
+    }
+
+    return SendStatus::complete;
+}
+
+
+char* BufferedSocket::ReserveWrite(size_t num_bytes) {
+    if (write_buffer.Capacity() - write_buffer.Limit() < num_bytes) {
+        if (send_in_flight) {
+            // The kernel holds pointers into the arena, so its bytes must not
+            // move; give this write a buffer of its own instead.
+            OutputSegment& segment = output_segments.emplace_back();
+            segment.arena_bytes = 0;
+            segment.buffer = Buffer(num_bytes);
+            return segment.buffer.Data();
+        }
+
+        size_t unsent = write_buffer.Remaining();
+        if (write_buffer.Capacity() == 0) {
+            size_t capacity = (num_bytes > write_buffer_size) ? (num_bytes) : (write_buffer_size);
+            write_buffer = Buffer(capacity);
+        } else if (write_buffer.Capacity() - unsent >= num_bytes) {
+            std::memmove(write_buffer.Data(), write_buffer.Data() + write_buffer.Position(), unsent);
+        } else {
+            size_t new_capacity = write_buffer.Capacity() * 2;
+            if (new_capacity < unsent + num_bytes) {
+                new_capacity = unsent + num_bytes;
+            }
+            Buffer grown(new_capacity);
+            std::memcpy(grown.Data(), write_buffer.Data() + write_buffer.Position(), unsent);
+            write_buffer = move(grown);
+
+            // Replies are outgrowing the arena; start bigger next time.
+            write_buffer_size = (new_capacity < max_buffer_size) ? (new_capacity) : (max_buffer_size);
+        }
+        write_buffer.Position(0);
+        write_buffer.Limit(unsent);
+    }
+
+    if (output_segments.size() == first_output_segment || output_segments.back().arena_bytes == 0) {
+        OutputSegment& segment = output_segments.emplace_back();
+        segment.arena_bytes = 0;
+    }
+    output_segments.back().arena_bytes += num_bytes;
+
+    char* reserved = write_buffer.Data() + write_buffer.Limit();
+    write_buffer.Limit(write_buffer.Limit() + num_bytes);
+    if (write_buffer.Limit() > write_high_water) {
+        write_high_water = write_buffer.Limit();
     }
+    return reserved;
+}
+
 
+void BufferedSocket::WriteBuffer(Buffer&& buffer) {
     if (buffer.Remaining() == 0) {
-        return SendStatus::complete;
-    } else {
-        return SendStatus::incomplete;
+        return;
     }
+
+    OutputSegment& segment = output_segments.emplace_back();
+    segment.arena_bytes = 0;
+    segment.buffer = move(buffer);
+}
+
+
+bool BufferedSocket::HasPendingWrites(void) noexcept {
+    return first_output_segment < output_segments.size();
 }
 
 
 BufferedSocket::SendStatus BufferedSocket::Flush(void) {
-    if (!flushing_in_progress) {
-        write_buffer.Flip();
-        flushing_in_progress = true;
+    if (completion_based) {
+        return (HasPendingWrites()) ? (SendStatus::incomplete) : (SendStatus::complete);
     }
 
-    while (write_buffer.Remaining() > 0) {
-        auto data  = write_buffer.Data();
-        auto position = write_buffer.Position();
-        auto remaining = write_buffer.Remaining();
-        auto bytes_written = send(fd, data + position, remaining, 0);
+    while (HasPendingWrites()) {
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = send_iovecs;
+        message.msg_iovlen = GatherOutput(send_iovecs, kMaxIOVecs);
+
+        auto bytes_written = sendmsg(fd, &message, kSendFlags);
         if (bytes_written == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                break;
-            } else if (errno == ECONNREFUSED || errno == ECONNRESET) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SendStatus::incomplete;
+            } else if (errno == ECONNREFUSED || errno == ECONNRESET || errno == EPIPE) {
                 return SendStatus::closed;
             } else {
-                throw IOException("Problem reading data from socket: " + string(strerror(errno)));
+                throw IOException("Problem writing data to socket: " + string(strerror(errno)));
             }
+        }
+
+        AdvanceOutput(bytes_written);
+    }
+
+    return SendStatus::complete;
+}
+
+
+int BufferedSocket::GatherOutput(struct iovec* iovecs, int max_iovecs) noexcept {
+    int num_iovecs = 0;
+    char* arena = write_buffer.Data() + write_buffer.Position();
+    for (size_t i = first_output_segment; i < output_segments.size() && num_iovecs < max_iovecs; i++) {
+        OutputSegment& segment = output_segments[i];
+        struct iovec* iovec = &iovecs[num_iovecs++];
+        if (segment.arena_bytes > 0) {
+            iovec->iov_base = arena;
+            iovec->iov_len = segment.arena_bytes;
+            arena += segment.arena_bytes;
         } else {
-            write_buffer.Position(position + bytes_written);
+            iovec->iov_base = segment.buffer.Data() + segment.buffer.Position();
+            iovec->iov_len = segment.buffer.Remaining();
         }
     }
+    return num_iovecs;
+}
 
-    if (write_buffer.Remaining() == 0) {
-        write_buffer.Clear();
-        flushing_in_progress = false;
-        return SendStatus::complete;
-    } else {
-        return SendStatus::incomplete;
+
+void BufferedSocket::AdvanceOutput(size_t num_bytes) noexcept {
+    while (num_bytes > 0) {
+        OutputSegment& segment = output_segments[first_output_segment];
+        if (segment.arena_bytes > 0) {
+            size_t advance = (num_bytes < segment.arena_bytes) ? (num_bytes) : (segment.arena_bytes);
+            write_buffer.Position(write_buffer.Position() + advance);
+            segment.arena_bytes -= advance;
+            num_bytes -= advance;
+            if (segment.arena_bytes == 0) {
+                first_output_segment++;
+            }
+        } else {
+            size_t remaining = segment.buffer.Remaining();
+            size_t advance = (num_bytes < remaining) ? (num_bytes) : (remaining);
+            segment.buffer.Position(segment.buffer.Position() + advance);
+            num_bytes -= advance;
+            if (advance == remaining) {
+                segment.buffer = Buffer();
+                first_output_segment++;
+            }
+        }
     }
+
+    // Everything went out: rewind so the arena is reused from the start and
+    // the segment list keeps its storage.
+    if (first_output_segment == output_segments.size()) {
+        output_segments.clear();
+        first_output_segment = 0;
+        write_buffer.Position(0);
+        write_buffer.Limit(0);
+    }
+}
+
+
+void BufferedSocket::SetCompletionBased(bool completion_based) noexcept {
+    this->completion_based = completion_based;
+}
+
+
+void BufferedSocket::Append(char const* data, size_t length) {
+    // read_buffer is kept flipped: [position, limit) holds the unread bytes.
+    size_t unread = read_buffer.Remaining();
+    if (read_buffer.Capacity() - read_buffer.Limit() < length) {
+        if (read_buffer.Capacity() - unread >= length) {
+            std::memmove(read_buffer.Data(), read_buffer.Data() + read_buffer.Position(), unread);
+        } else {
+            size_t capacity = (unread + length > read_buffer_size) ? (unread + length) : (read_buffer_size);
+            ResizeReadBuffer(capacity);
+        }
+        read_buffer.Position(0);
+        read_buffer.Limit(unread);
+    }
+
+    std::memcpy(read_buffer.Data() + read_buffer.Limit(), data, length);
+    read_buffer.Limit(read_buffer.Limit() + length);
+    if (read_buffer.Limit() > read_high_water) {
+        read_high_water = read_buffer.Limit();
+    }
+}
+
+
+void BufferedSocket::MarkEndOfStream(void) noexcept {
+    end_of_stream = true;
+}
+
+
+bool BufferedSocket::PendingSend(struct msghdr const** message) noexcept {
+    if (!HasPendingWrites()) {
+        return false;
+    }
+
+    std::memset(&send_message, 0, sizeof(send_message));
+    send_message.msg_iov = send_iovecs;
+    send_message.msg_iovlen = GatherOutput(send_iovecs, kMaxIOVecs);
+    send_in_flight = true;
+    *message = &send_message;
+    return true;
+}
+
+
+void BufferedSocket::SendCompleted(size_t bytes_sent) noexcept {
+    send_in_flight = false;
+    AdvanceOutput(bytes_sent);
 }
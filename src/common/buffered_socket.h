@@ -1,6 +1,9 @@
 #ifndef KIWI_BUFFERED_SOCKET_H_
 #define KIWI_BUFFERED_SOCKET_H_
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
 #include "abstract_socket.h"
 #include "buffer.h"
 
@@ -14,6 +17,22 @@ public:
     BufferedSocket(int fd) noexcept;
     ~BufferedSocket(void) noexcept;
 
+    static const size_t MIN_BUFFER_SIZE = 4 * 1024;
+    static const size_t DEFAULT_MAX_BUFFER_SIZE = 64 * 1024;
+
+    /*
+     * Buffers are allocated lazily, on first use, and handed back to the
+     * buffer pool by ReleaseIdleBuffers(), which the owner calls once the
+     * connection has nothing left to read or write. Their size adapts to the
+     * traffic between MIN_BUFFER_SIZE and the configured maximum: a receive
+     * that fills the read buffer doubles it, a growing reply backlog enlarges
+     * the output arena, and a busy period that used less than a quarter of a
+     * buffer halves it. Frames larger than the maximum still fit (see
+     * ReserveRead()); they just don't make the buffers stay large.
+     */
+    void SetMaxBufferSize(size_t max_buffer_size) noexcept;
+    void ReleaseIdleBuffers(void) noexcept;
+
     /*
      * Return `complete` if we had enough bytes already or we could read
      * enough from the socket to fill the specified buffer, `incomplete` if we
@@ -23,6 +42,27 @@ public:
      */
     RecvStatus Fill(Buffer& buffer);
 
+    /*
+     * Zero-copy receive path. Recv() reads from the socket into the internal
+     * read buffer until the socket would block (`incomplete`), the buffer is
+     * full (`complete`; consume some data and call again) or the peer closed
+     * the stream (`closed`). Unread bytes are exposed in place through
+     * ReadData()/ReadableBytes() and released with Consume(). Unconsumed bytes
+     * (i.e. a frame that straddles two receives) are moved to the front of the
+     * buffer on the next Recv(); that is the only copy on this path.
+     */
+    RecvStatus Recv(void);
+    char const* ReadData(void) noexcept;
+    size_t ReadableBytes(void) noexcept;
+    void Consume(size_t num_bytes) noexcept;
+
+    /*
+     * Ensure that the read buffer can hold at least `num_bytes` unread bytes,
+     * for frames larger than the default buffer size.
+     */
+    void ReserveRead(size_t num_bytes);
+    size_t ReadCapacity(void) noexcept;
+
     /*
      * Return `complete` if there was enough buffer space to fully consume the
      * provided buffer, `incomplete` if need to try the call again (note:
@@ -33,7 +73,24 @@ public:
     SendStatus Write(Buffer& buffer);
 
     /*
-     * Returns `complete` if the entire write buffer has been flushed to the
+     * Output path. Small frames are encoded straight into a contiguous output
+     * arena: ReserveWrite() hands out `num_bytes` of space at its tail (the
+     * arena grows as needed) which the caller fills in completely, typically
+     * with a FrameWriter. Large payloads that already live in a Buffer are
+     * queued by reference with WriteBuffer() rather than copied; the
+     * [position, limit) range of the buffer is sent.
+     *
+     * Nothing is sent until Flush(), which gathers everything queued so far
+     * (arena ranges interleaved with queued buffers, in order) into a single
+     * sendmsg(2). Pointers returned by ReserveWrite() are only valid until
+     * the next call on this socket.
+     */
+    char* ReserveWrite(size_t num_bytes);
+    void WriteBuffer(Buffer&& buffer);
+    bool HasPendingWrites(void) noexcept;
+
+    /*
+     * Returns `complete` if all queued output has been flushed to the
      * network stack, `incomplete` if we need to wait for the socket to be
      * writable again before trying to flush the remaining buffered data, and
      * `closed` if the stream was closed before all the unflushed data could
@@ -41,6 +98,24 @@ public:
      */
     SendStatus Flush(void);
 
+    /*
+     * Completion-based I/O (io_uring). When enabled, Fill() and Recv() never
+     * issue syscalls themselves: received bytes are handed to us through
+     * Append(), and Flush() merely reports whether output is queued so that
+     * the owner can submit it via PendingSend()/SendCompleted(). Fill()
+     * reports `incomplete` once the appended data runs dry and `closed` once
+     * the owner has seen the peer's EOF and called MarkEndOfStream().
+     *
+     * PendingSend() describes the queued output as a msghdr owned by this
+     * socket; it and the memory it points at stay valid until the matching
+     * SendCompleted(), and new output may be queued in the meantime.
+     */
+    void SetCompletionBased(bool completion_based) noexcept;
+    void Append(char const* data, size_t length);
+    void MarkEndOfStream(void) noexcept;
+    bool PendingSend(struct msghdr const** message) noexcept;
+    void SendCompleted(size_t bytes_sent) noexcept;
+
     // Move constructor + move assignment operator
     BufferedSocket(BufferedSocket&& other) noexcept;
     BufferedSocket& operator=(BufferedSocket&& other) noexcept;
@@ -50,9 +125,37 @@ public:
     BufferedSocket& operator=(BufferedSocket const& other) = delete;
 
 private:
+    static const int kMaxIOVecs = 64;
+
+    /*
+     * A run of queued output: either the next `arena_bytes` bytes of the
+     * output arena or, when `arena_bytes` is zero, an externally supplied
+     * buffer.
+     */
+    struct OutputSegment {
+        size_t arena_bytes;
+        Buffer buffer;
+    };
+
     Buffer read_buffer;
+    // Output arena, kept flipped: [position, limit) holds the unsent bytes.
     Buffer write_buffer;
-    bool flushing_in_progress;
+    std::vector<OutputSegment> output_segments;
+    size_t first_output_segment;
+    bool send_in_flight;
+    struct iovec send_iovecs[kMaxIOVecs];
+    struct msghdr send_message;
+    size_t max_buffer_size;
+    size_t read_buffer_size;     // adaptive target sizes
+    size_t write_buffer_size;
+    size_t read_high_water;      // peak usage since the buffer was last released
+    size_t write_high_water;
+    bool completion_based;
+    bool end_of_stream;
+
+    int GatherOutput(struct iovec* iovecs, int max_iovecs) noexcept;
+    void AdvanceOutput(size_t num_bytes) noexcept;
+    void ResizeReadBuffer(size_t capacity);
 };
 
 #endif  // KIWI_BUFFERED_SOCKET_H_
@@ -0,0 +1,5 @@
+// cmake will use this template (config.h.in) to generate config.h
+
+#define HAVE_EPOLL
+/* #undef HAVE_KQUEUE */
+/* #undef HAVE_LIBURING */
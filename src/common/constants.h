@@ -1,12 +1,20 @@
 #ifndef KIWI_CONSTANTS_H_
 #define KIWI_CONSTANTS_H_
 
+#include <cstddef>
 #include <cstdint>
 
 
 namespace Constants {
     const int DEFAULT_PORT = 12312;
     const uint16_t MAX_CLUSTER_NAME_LENGTH = 65535;
+    const uint32_t MAX_IO_THREADS = 1024;
+    const size_t MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+    const uint32_t MAX_RAFT_LOG_BATCH_WINDOW_MS = 1000;
+    const uint32_t DEFAULT_RAFT_LOG_BATCH_MAX_SIZE = 4 * 1024 * 1024;
+    const uint64_t MIN_RAFT_SNAPSHOT_MAX_BYTES_PER_SECOND = 1024 * 1024;
+    const uint64_t DEFAULT_RAFT_SNAPSHOT_MAX_BYTES_PER_SECOND = 64 * 1024 * 1024;
+    const uint64_t DEFAULT_TABLE_LOG_RETENTION = 1000000;
 }
 
 #endif  // KIWI_CONSTANTS_H_
@@ -1,5 +1,7 @@
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <sstream>
 #include <string.h>
 #include <sys/stat.h>
@@ -42,3 +44,90 @@ string FileUtils::ReadFile(string const& path) {
     IOUtils::Close(fd);
     return ss.str();
 }
+
+
+void FileUtils::MakeDirectory(string const& path) {
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+        throw IOException("Error creating directory " + path + ": " + string(strerror(errno)));
+    }
+}
+
+
+static int RemoveEntry(char const* path, struct stat const* stat, int type, struct FTW* ftw) {
+    (void) stat;
+    (void) ftw;
+    return (type == FTW_DP) ? (rmdir(path)) : (unlink(path));
+}
+
+
+void FileUtils::RemoveDirectory(string const& path) {
+    if (nftw(path.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS) == -1 && errno != ENOENT) {
+        throw IOException("Error removing directory " + path + ": " + string(strerror(errno)));
+    }
+}
+
+
+vector<string> FileUtils::ListDirectory(string const& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        throw IOException("Error opening directory " + path + ": " + string(strerror(errno)));
+    }
+
+    vector<string> names;
+    for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+        string name(entry->d_name);
+        if (name != "." && name != "..") {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+
+void FileUtils::Sync(string const& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw IOException("Error opening " + path + ": " + string(strerror(errno)));
+    }
+    int result = fsync(fd);
+    int error = errno;
+    IOUtils::Close(fd);
+    if (result == -1) {
+        throw IOException("Error syncing " + path + ": " + string(strerror(error)));
+    }
+}
+
+
+void FileUtils::ReadAt(int fd, char* buf, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t num_read = pread(fd, buf, length, offset);
+        if (num_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (num_read == -1) {
+            throw IOException("Error reading file: " + string(strerror(errno)));
+        }
+        if (num_read == 0) {
+            throw IOException("Error reading file: unexpected end of file");
+        }
+        buf += num_read;
+        length -= num_read;
+        offset += num_read;
+    }
+}
+
+
+void FileUtils::WriteAll(int fd, char const* data, size_t length) {
+    while (length > 0) {
+        ssize_t num_written = write(fd, data, length);
+        if (num_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (num_written == -1) {
+            throw IOException("Error writing file: " + string(strerror(errno)));
+        }
+        data += num_written;
+        length -= num_written;
+    }
+}
@@ -1,11 +1,30 @@
 #ifndef KIWI_FILE_UTILS_H_
 #define KIWI_FILE_UTILS_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 
 namespace FileUtils {
     std::string ReadFile(std::string const& path);
+
+    // Succeeds if the directory already exists.
+    void MakeDirectory(std::string const& path);
+
+    // Removes a directory and everything in it; succeeds if it doesn't exist.
+    void RemoveDirectory(std::string const& path);
+
+    // Names of the entries in a directory, excluding "." and "..".
+    std::vector<std::string> ListDirectory(std::string const& path);
+
+    // fsync()s a file or directory.
+    void Sync(std::string const& path);
+
+    // Read or write exactly `length` bytes, retrying short transfers.
+    void ReadAt(int fd, char* buf, size_t length, uint64_t offset);
+    void WriteAll(int fd, char const* data, size_t length);
 }
 
 #endif  // KIWI_FILE_UTILS_H_
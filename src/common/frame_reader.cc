@@ -0,0 +1,91 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include "frame_reader.h"
+
+
+FrameReader::FrameReader(char const* data, size_t length) noexcept :
+        data(data),
+        length(length),
+        position(0),
+        needed(0) {}
+
+
+bool FrameReader::Require(size_t num_bytes) noexcept {
+    if (length - position < num_bytes) {
+        needed = position + num_bytes;
+        return false;
+    }
+    return true;
+}
+
+
+bool FrameReader::GetInt(uint32_t* value) noexcept {
+    if (!Require(4)) {
+        return false;
+    }
+
+    uint32_t network_order_value;
+    std::memcpy(&network_order_value, data + position, 4);
+    position += 4;
+    *value = ntohl(network_order_value);
+    return true;
+}
+
+
+bool FrameReader::GetShort(uint16_t* value) noexcept {
+    if (!Require(2)) {
+        return false;
+    }
+
+    uint16_t network_order_value;
+    std::memcpy(&network_order_value, data + position, 2);
+    position += 2;
+    *value = ntohs(network_order_value);
+    return true;
+}
+
+
+bool FrameReader::GetByte(uint8_t* value) noexcept {
+    if (!Require(1)) {
+        return false;
+    }
+
+    *value = static_cast<uint8_t>(data[position]);
+    position += 1;
+    return true;
+}
+
+
+bool FrameReader::GetLong(uint64_t* value) noexcept {
+    uint32_t high;
+    uint32_t low;
+    if (!Require(8)) {
+        return false;
+    }
+
+    GetInt(&high);
+    GetInt(&low);
+    *value = (static_cast<uint64_t>(high) << 32) | low;
+    return true;
+}
+
+
+bool FrameReader::GetBytes(size_t num_bytes, char const** bytes) noexcept {
+    if (!Require(num_bytes)) {
+        return false;
+    }
+
+    *bytes = data + position;
+    position += num_bytes;
+    return true;
+}
+
+
+size_t FrameReader::Position(void) const noexcept {
+    return position;
+}
+
+
+size_t FrameReader::Needed(void) const noexcept {
+    return needed;
+}
@@ -0,0 +1,45 @@
+#ifndef KIWI_FRAME_READER_H_
+#define KIWI_FRAME_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Decodes protocol fields in place from a borrowed byte range (typically the
+ * unread portion of a BufferedSocket's read buffer); nothing is copied.
+ *
+ * Every getter is bounds-checked: if the range does not hold enough bytes the
+ * getter returns false, leaves the position untouched and records how many
+ * bytes (from the start of the range) would have been required. Callers use
+ * this to tell an incomplete frame apart from a complete one and to size the
+ * read buffer for frames that are larger than it.
+ */
+class FrameReader {
+public:
+    FrameReader(char const* data, size_t length) noexcept;
+
+    bool GetInt(uint32_t* value) noexcept;
+    bool GetShort(uint16_t* value) noexcept;
+    bool GetByte(uint8_t* value) noexcept;
+    bool GetLong(uint64_t* value) noexcept;
+
+    /*
+     * Points `bytes` at the next `length` bytes of the underlying range. The
+     * pointer is only valid for as long as the underlying range is.
+     */
+    bool GetBytes(size_t length, char const** bytes) noexcept;
+
+    size_t Position(void) const noexcept;
+    size_t Needed(void) const noexcept;
+
+private:
+    char const* data;
+    size_t length;
+    size_t position;
+    size_t needed;
+
+    bool Require(size_t num_bytes) noexcept;
+};
+
+#endif  // KIWI_FRAME_READER_H_
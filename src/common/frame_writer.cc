@@ -0,0 +1,45 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include "frame_writer.h"
+
+
+FrameWriter::FrameWriter(char* data) noexcept :
+        data(data),
+        position(0) {}
+
+
+void FrameWriter::PutInt(uint32_t value) noexcept {
+    uint32_t network_order_value = htonl(value);
+    std::memcpy(data + position, &network_order_value, 4);
+    position += 4;
+}
+
+
+void FrameWriter::PutShort(uint16_t value) noexcept {
+    uint16_t network_order_value = htons(value);
+    std::memcpy(data + position, &network_order_value, 2);
+    position += 2;
+}
+
+
+void FrameWriter::PutByte(uint8_t value) noexcept {
+    data[position] = static_cast<char>(value);
+    position += 1;
+}
+
+
+void FrameWriter::PutLong(uint64_t value) noexcept {
+    PutInt(static_cast<uint32_t>(value >> 32));
+    PutInt(static_cast<uint32_t>(value));
+}
+
+
+void FrameWriter::PutBytes(char const* bytes, size_t length) noexcept {
+    std::memcpy(data + position, bytes, length);
+    position += length;
+}
+
+
+size_t FrameWriter::Position(void) const noexcept {
+    return position;
+}
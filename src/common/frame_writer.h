@@ -0,0 +1,33 @@
+#ifndef KIWI_FRAME_WRITER_H_
+#define KIWI_FRAME_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Encodes protocol fields in network order directly into a borrowed byte
+ * range (typically space handed out by BufferedSocket::ReserveWrite()).
+ *
+ * Unchecked: the caller sizes the range for the whole frame up front, which
+ * it always knows before encoding. Like FrameReader, it is resilient to
+ * unaligned writes.
+ */
+class FrameWriter {
+public:
+    FrameWriter(char* data) noexcept;
+
+    void PutInt(uint32_t value) noexcept;
+    void PutShort(uint16_t value) noexcept;
+    void PutByte(uint8_t value) noexcept;
+    void PutLong(uint64_t value) noexcept;
+    void PutBytes(char const* bytes, size_t length) noexcept;
+
+    size_t Position(void) const noexcept;
+
+private:
+    char* data;
+    size_t position;
+};
+
+#endif  // KIWI_FRAME_WRITER_H_
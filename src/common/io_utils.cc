@@ -1,6 +1,5 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <iostream>
 #include <netdb.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -8,6 +7,7 @@
 #include <unistd.h>
 #include "exceptions.h"
 #include "io_utils.h"
+#include "logger.h"
 
 
 void IOUtils::Close(int fd) noexcept {
@@ -18,7 +18,7 @@ void IOUtils::Close(int fd) noexcept {
     // TL;DR: for true portability, we might need to retry the close() on some OS.
     int err = close(fd);
     if (err == -1) {
-        std::cerr << "Problem closing file descriptor: " << strerror(errno) << std::endl;
+        KIWI_LOG_ERROR("Problem closing file descriptor: " << strerror(errno));
     }
 }
 
@@ -38,12 +38,12 @@ void IOUtils::ForceWriteByte(int fd, char c) noexcept {
                 if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
                     continue;
                 } else {
-                    std::cerr << "Failed to write byte: " << strerror(errno) << std::endl;
+                    KIWI_LOG_FATAL("Failed to write byte: " << strerror(errno));
                     abort();
                 }
 
             default:
-                std::cerr << "Expected to write 1 byte, but wrote " << bytes_written << " bytes! How did this happen?" << std::endl;
+                KIWI_LOG_FATAL("Expected to write 1 byte, but wrote " << bytes_written << " bytes! How did this happen?");
                 abort();
         }
     }
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <mutex>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <streambuf>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "logger.h"
+
+
+using namespace std;
+
+static const size_t kMaxMessageLength = 232;
+static const size_t kRingCapacity = 1024;
+static const long kIdleSleepNanos = 10 * 1000 * 1000;
+
+static char const* const kLevelNames[] = {"DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+
+namespace {
+
+struct LogRecord {
+    struct timespec timestamp;
+    uint32_t level;
+    uint32_t length;
+    char text[kMaxMessageLength];
+};
+
+
+/*
+ * Single-producer (the owning thread) / single-consumer (whoever holds the
+ * drain mutex) ring of log records.
+ */
+struct LogRing {
+    LogRing(uint64_t thread_number) :
+            head(0),
+            tail(0),
+            dropped(0),
+            abandoned(false),
+            thread_number(thread_number) {}
+
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> abandoned;
+    uint64_t thread_number;
+    LogRecord records[kRingCapacity];
+};
+
+
+/*
+ * streambuf over a fixed array that silently truncates instead of growing.
+ */
+class FixedStreamBuf : public std::streambuf {
+public:
+    FixedStreamBuf(void) {
+        Reset();
+    }
+
+    void Reset(void) {
+        setp(data, data + sizeof(data));
+    }
+
+    char const* Data(void) const {
+        return data;
+    }
+
+    size_t Length(void) const {
+        return pptr() - pbase();
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(char const* s, std::streamsize n) override {
+        std::streamsize space = epptr() - pptr();
+        std::streamsize count = (n < space) ? (n) : (space);
+        memcpy(pptr(), s, count);
+        pbump(static_cast<int>(count));
+        return n;
+    }
+
+private:
+    char data[kMaxMessageLength];
+};
+
+
+class LogDrainer {
+public:
+    static LogDrainer& Instance(void) {
+        static LogDrainer instance;
+        return instance;
+    }
+
+    LogRing* Register(void) {
+        lock_guard<mutex> guard(registry_mutex);
+        LogRing* ring = new LogRing(next_thread_number++);
+        rings.push_back(ring);
+
+        if (!thread_started) {
+            int err = pthread_create(&thread, nullptr, ThreadWrapper, this);
+            if (err == 0) {
+                thread_started = true;
+            } else {
+                WriteAll("Problem starting log thread: " + string(strerror(err)) + "\n");
+            }
+        }
+        return ring;
+    }
+
+    /*
+     * Write out everything currently sitting in the rings, ordered by time.
+     * Returns whether anything was written.
+     */
+    bool DrainAll(void) noexcept {
+        lock_guard<mutex> drain_guard(drain_mutex);
+
+        vector<LogRing*> snapshot;
+        {
+            lock_guard<mutex> guard(registry_mutex);
+            snapshot = rings;
+        }
+
+        struct Pending {
+            LogRing* ring;
+            LogRecord* record;
+        };
+        vector<Pending> pending;
+        vector<uint64_t> observed_tails;
+        string output;
+        for (LogRing* ring : snapshot) {
+            uint64_t head = ring->head.load(memory_order_relaxed);
+            uint64_t tail = ring->tail.load(memory_order_acquire);
+            for (uint64_t i = head; i < tail; i++) {
+                pending.push_back({ring, &ring->records[i % kRingCapacity]});
+            }
+            observed_tails.push_back(tail);
+
+            uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+            if (dropped > 0) {
+                output += "WARN  [t" + to_string(ring->thread_number) + "] " + to_string(dropped) + " log messages dropped\n";
+            }
+        }
+
+        sort(pending.begin(), pending.end(), [](Pending const& a, Pending const& b) {
+            if (a.record->timestamp.tv_sec != b.record->timestamp.tv_sec) {
+                return a.record->timestamp.tv_sec < b.record->timestamp.tv_sec;
+            }
+            return a.record->timestamp.tv_nsec < b.record->timestamp.tv_nsec;
+        });
+
+        for (Pending const& entry : pending) {
+            Format(entry.ring->thread_number, *entry.record, &output);
+        }
+
+        // Release the slots only once the records have been formatted.
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            snapshot[i]->head.store(observed_tails[i], memory_order_release);
+        }
+
+        if (!output.empty()) {
+            WriteAll(output);
+        }
+
+        ReapAbandonedRings();
+        return !output.empty();
+    }
+
+    void WriteFatal(uint64_t thread_number, char const* data, size_t length) noexcept {
+        DrainAll();
+
+        struct LogRecord record;
+        clock_gettime(CLOCK_REALTIME, &record.timestamp);
+        record.level = KIWI_LOG_LEVEL_FATAL;
+        record.length = length;
+        memcpy(record.text, data, length);
+
+        string output;
+        Format(thread_number, record, &output);
+        WriteAll(output);
+    }
+
+private:
+    mutex registry_mutex;
+    mutex drain_mutex;
+    vector<LogRing*> rings;
+    uint64_t next_thread_number;
+    pthread_t thread;
+    bool thread_started;
+    std::atomic<bool> stopping;
+
+    LogDrainer(void) :
+            next_thread_number(1),
+            thread_started(false),
+            stopping(false) {}
+
+    ~LogDrainer(void) {
+        stopping.store(true);
+        if (thread_started) {
+            pthread_join(thread, nullptr);
+        }
+        DrainAll();
+    }
+
+    static void* ThreadWrapper(void* ptr) {
+        LogDrainer* drainer = static_cast<LogDrainer*>(ptr);
+        while (!drainer->stopping.load()) {
+            if (!drainer->DrainAll()) {
+                struct timespec idle = {0, kIdleSleepNanos};
+                nanosleep(&idle, nullptr);
+            }
+        }
+        return nullptr;
+    }
+
+    void ReapAbandonedRings(void) noexcept {
+        lock_guard<mutex> guard(registry_mutex);
+        auto it = rings.begin();
+        while (it != rings.end()) {
+            LogRing* ring = *it;
+            if (ring->abandoned.load(memory_order_acquire) &&
+                    ring->head.load(memory_order_relaxed) == ring->tail.load(memory_order_acquire)) {
+                delete ring;
+                it = rings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    static void Format(uint64_t thread_number, LogRecord const& record, string* output) {
+        struct tm tm;
+        gmtime_r(&record.timestamp.tv_sec, &tm);
+
+        char prefix[64];
+        int prefix_length = snprintf(prefix, sizeof(prefix), "%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ %-5s [t%llu] ",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            record.timestamp.tv_nsec / 1000, kLevelNames[record.level],
+            static_cast<unsigned long long>(thread_number));
+        output->append(prefix, prefix_length);
+        output->append(record.text, record.length);
+        output->push_back('\n');
+    }
+
+    static void WriteAll(string const& output) noexcept {
+        size_t written = 0;
+        while (written < output.length()) {
+            ssize_t result = write(STDERR_FILENO, output.data() + written, output.length() - written);
+            if (result == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            written += result;
+        }
+    }
+};
+
+
+struct ThreadState {
+    FixedStreamBuf buffer;
+    std::ostream stream;
+    LogRing* ring;
+
+    ThreadState(void) :
+            buffer(),
+            stream(&buffer),
+            ring(nullptr) {}
+
+    ~ThreadState(void) {
+        // The drainer frees the ring once it has written out what's left.
+        if (ring != nullptr) {
+            ring->abandoned.store(true, memory_order_release);
+        }
+    }
+};
+
+thread_local ThreadState thread_state;
+
+}  // namespace
+
+
+std::ostream& Logger::Begin(void) noexcept {
+    thread_state.buffer.Reset();
+    thread_state.stream.clear();
+    return thread_state.stream;
+}
+
+
+void Logger::Commit(int level) noexcept {
+    char const* text = thread_state.buffer.Data();
+    size_t length = thread_state.buffer.Length();
+
+    if (level >= KIWI_LOG_LEVEL_FATAL) {
+        uint64_t thread_number = (thread_state.ring != nullptr) ? (thread_state.ring->thread_number) : (0);
+        LogDrainer::Instance().WriteFatal(thread_number, text, length);
+        return;
+    }
+
+    LogRing* ring = thread_state.ring;
+    if (ring == nullptr) {
+        try {
+            ring = thread_state.ring = LogDrainer::Instance().Register();
+        } catch (...) {
+            return;
+        }
+    }
+
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    uint64_t head = ring->head.load(memory_order_acquire);
+    if (tail - head >= kRingCapacity) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord* record = &ring->records[tail % kRingCapacity];
+    clock_gettime(CLOCK_REALTIME, &record->timestamp);
+    record->level = level;
+    record->length = length;
+    memcpy(record->text, text, length);
+    ring->tail.store(tail + 1, memory_order_release);
+}
+
+
+void Logger::Flush(void) noexcept {
+    LogDrainer::Instance().DrainAll();
+}
@@ -0,0 +1,58 @@
+#ifndef KIWI_LOGGER_H_
+#define KIWI_LOGGER_H_
+
+#include <ostream>
+
+
+#define KIWI_LOG_LEVEL_DEBUG 0
+#define KIWI_LOG_LEVEL_INFO  1
+#define KIWI_LOG_LEVEL_WARN  2
+#define KIWI_LOG_LEVEL_ERROR 3
+#define KIWI_LOG_LEVEL_FATAL 4
+
+// Compile-time threshold: statements below it are eliminated entirely.
+#ifndef KIWI_LOG_LEVEL
+    #define KIWI_LOG_LEVEL KIWI_LOG_LEVEL_INFO
+#endif
+
+/*
+ * Usage: KIWI_LOG_INFO("Accepted " << num_connections << " connections");
+ *
+ * The message is formatted on the calling thread into a fixed-size,
+ * thread-local scratch buffer (no allocation; overly long messages are
+ * truncated) and pushed onto that thread's lock-free ring, from which a
+ * background thread writes it out. The calling thread never blocks and never
+ * issues a syscall; if its ring is full the record is dropped and counted.
+ *
+ * FATAL is the exception: it first drains every ring and then writes the
+ * message synchronously, so that it is guaranteed to be visible before the
+ * caller abort()s.
+ */
+#define KIWI_LOG(level, message) \
+    do { \
+        if ((level) >= KIWI_LOG_LEVEL) { \
+            std::ostream& kiwi_log_stream_ = Logger::Begin(); \
+            kiwi_log_stream_ << message; \
+            Logger::Commit(level); \
+        } \
+    } while (0)
+
+#define KIWI_LOG_DEBUG(message) KIWI_LOG(KIWI_LOG_LEVEL_DEBUG, message)
+#define KIWI_LOG_INFO(message)  KIWI_LOG(KIWI_LOG_LEVEL_INFO, message)
+#define KIWI_LOG_WARN(message)  KIWI_LOG(KIWI_LOG_LEVEL_WARN, message)
+#define KIWI_LOG_ERROR(message) KIWI_LOG(KIWI_LOG_LEVEL_ERROR, message)
+#define KIWI_LOG_FATAL(message) KIWI_LOG(KIWI_LOG_LEVEL_FATAL, message)
+
+
+namespace Logger {
+    std::ostream& Begin(void) noexcept;
+    void Commit(int level) noexcept;
+
+    /*
+     * Blocks until every record logged so far (by any thread) has been
+     * written out.
+     */
+    void Flush(void) noexcept;
+}
+
+#endif  // KIWI_LOGGER_H_
@@ -0,0 +1,298 @@
+#include "config.h"
+#if defined(HAVE_EPOLL)
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+#elif defined(HAVE_KQUEUE)
+    #include <sys/event.h>
+    #include <sys/time.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+#include "io_utils.h"
+#include "logger.h"
+#include "poller.h"
+
+
+using namespace std;
+
+int Poller::GetFD(void) noexcept {
+    return fd;
+}
+
+
+#if defined(HAVE_EPOLL)
+
+static uint32_t ToEpollEvents(uint32_t interest) {
+    uint32_t events = 0;
+    if (interest & Poller::Interest::READ) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (interest & Poller::Interest::WRITE) {
+        events |= EPOLLOUT;
+    }
+    if (interest & Poller::Interest::EDGE_TRIGGERED) {
+        events |= EPOLLET;
+    }
+    return events;
+}
+
+
+Poller::Poller(void) :
+        pending_user_events(0) {
+
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) {
+        throw IOException("Error creating epoll fd: " + string(strerror(errno)));
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        IOUtils::Close(fd);
+        throw IOException("Error creating eventfd: " + string(strerror(errno)));
+    }
+
+    try {
+        // The wakeup fd is the only fd registered with our own address as the
+        // user data, which is how Wait() tells it apart from everything else.
+        Add(wakeup_fd, Interest::READ, &wakeup_fd);
+    } catch (...) {
+        IOUtils::Close(wakeup_fd);
+        IOUtils::Close(fd);
+        throw;
+    }
+}
+
+
+Poller::~Poller(void) noexcept {
+    IOUtils::Close(wakeup_fd);
+    IOUtils::Close(fd);
+}
+
+
+void Poller::Add(int target_fd, uint32_t interest, void* data) {
+    struct epoll_event event;
+    event.events = ToEpollEvents(interest);
+    event.data.ptr = data;
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, target_fd, &event) == -1) {
+        throw IOException("Error adding fd to epoll: " + string(strerror(errno)));
+    }
+}
+
+
+void Poller::Modify(int target_fd, uint32_t interest, void* data) {
+    struct epoll_event event;
+    event.events = ToEpollEvents(interest);
+    event.data.ptr = data;
+    if (epoll_ctl(fd, EPOLL_CTL_MOD, target_fd, &event) == -1) {
+        throw IOException("Error modifying fd in epoll: " + string(strerror(errno)));
+    }
+}
+
+
+void Poller::Remove(int target_fd) {
+    if (epoll_ctl(fd, EPOLL_CTL_DEL, target_fd, nullptr) == -1) {
+        throw IOException("Error removing fd from epoll: " + string(strerror(errno)));
+    }
+}
+
+
+int Poller::Wait(Event* events, int max_events, int timeout_ms) {
+    struct epoll_event epoll_events[64];
+    if (max_events > static_cast<int>(sizeof(epoll_events) / sizeof(epoll_events[0]))) {
+        max_events = sizeof(epoll_events) / sizeof(epoll_events[0]);
+    }
+
+    int num_ready = epoll_wait(fd, epoll_events, max_events, timeout_ms);
+    if (num_ready == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        throw IOException("Problem querying ready events from epoll: " + string(strerror(errno)));
+    }
+
+    int num_events = 0;
+    bool woken_up = false;
+    for (int i = 0; i < num_ready; i++) {
+        struct epoll_event* epoll_event = &epoll_events[i];
+        if (epoll_event->data.ptr == &wakeup_fd) {
+            woken_up = true;
+            continue;
+        }
+
+        Event* event = &events[num_events++];
+        event->data = epoll_event->data.ptr;
+        event->readable = (epoll_event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+        event->writable = (epoll_event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+        event->user = false;
+        event->user_event = 0;
+    }
+
+    if (woken_up) {
+        uint64_t counter;
+        while (read(wakeup_fd, &counter, sizeof(counter)) == -1 && errno == EINTR) {
+        }
+
+        uint32_t pending = pending_user_events.exchange(0);
+        while (pending != 0 && num_events < max_events) {
+            uint32_t user_event = __builtin_ctz(pending);
+            pending &= pending - 1;
+
+            Event* event = &events[num_events++];
+            event->data = nullptr;
+            event->readable = false;
+            event->writable = false;
+            event->user = true;
+            event->user_event = user_event;
+        }
+
+        // Out of room in the caller's array; re-arm whatever we couldn't report.
+        if (pending != 0) {
+            pending_user_events.fetch_or(pending);
+            uint64_t one = 1;
+            while (write(wakeup_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+            }
+        }
+    }
+
+    return num_events;
+}
+
+
+void Poller::Trigger(uint32_t user_event) noexcept {
+    uint32_t bit = 1u << user_event;
+    uint32_t previous = pending_user_events.fetch_or(bit);
+    if (previous & bit) {
+        // Someone else already rang the bell for this event.
+        return;
+    }
+
+    uint64_t one = 1;
+    for (;;) {
+        if (write(wakeup_fd, &one, sizeof(one)) == sizeof(one)) {
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        // EAGAIN means the counter is saturated, i.e. a wakeup is already pending.
+        if (errno == EAGAIN) {
+            return;
+        }
+        KIWI_LOG_FATAL("Problem waking up event loop: " << strerror(errno));
+        abort();
+    }
+}
+
+#elif defined(HAVE_KQUEUE)
+
+Poller::Poller(void) {
+    fd = kqueue();
+    if (fd == -1) {
+        throw IOException("Error creating kqueue: " + string(strerror(errno)));
+    }
+}
+
+
+Poller::~Poller(void) noexcept {
+    IOUtils::Close(fd);
+}
+
+
+static void ApplyChanges(int kq, struct kevent* changes, int num_changes, string const& description) {
+    int err = kevent(kq, changes, num_changes, nullptr, 0, nullptr);
+    if (err == -1) {
+        throw IOException("Error " + description + ": " + string(strerror(errno)));
+    }
+
+    for (int i = 0; i < num_changes; i++) {
+        if (changes[i].flags & EV_ERROR) {
+            throw IOException("Error " + description + ": " + string(strerror(changes[i].data)));
+        }
+    }
+}
+
+
+void Poller::Add(int target_fd, uint32_t interest, void* data) {
+    Modify(target_fd, interest, data);
+}
+
+
+void Poller::Modify(int target_fd, uint32_t interest, void* data) {
+    // Both filters are always registered (possibly disabled) so that a single
+    // kevent() call can flip either of them without an add/delete round trip.
+    u_short clear = (interest & Interest::EDGE_TRIGGERED) ? (EV_CLEAR) : (0);
+    u_short read_flags = EV_ADD | clear | ((interest & Interest::READ) ? (EV_ENABLE) : (EV_DISABLE));
+    u_short write_flags = EV_ADD | clear | ((interest & Interest::WRITE) ? (EV_ENABLE) : (EV_DISABLE));
+
+    struct kevent changes[2];
+    EV_SET(&changes[0], target_fd, EVFILT_READ, read_flags, 0, 0, data);
+    EV_SET(&changes[1], target_fd, EVFILT_WRITE, write_flags, 0, 0, data);
+    ApplyChanges(fd, changes, 2, "updating fd in kqueue");
+}
+
+
+void Poller::Remove(int target_fd) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], target_fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&changes[1], target_fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    ApplyChanges(fd, changes, 2, "removing fd from kqueue");
+}
+
+
+int Poller::Wait(Event* events, int max_events, int timeout_ms) {
+    struct kevent kevents[64];
+    if (max_events > static_cast<int>(sizeof(kevents) / sizeof(kevents[0]))) {
+        max_events = sizeof(kevents) / sizeof(kevents[0]);
+    }
+
+    struct timespec timeout;
+    struct timespec* timeout_ptr = nullptr;
+    if (timeout_ms >= 0) {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout_ptr = &timeout;
+    }
+
+    int num_ready = kevent(fd, nullptr, 0, kevents, max_events, timeout_ptr);
+    if (num_ready == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        throw IOException("Problem querying ready events from kqueue: " + string(strerror(errno)));
+    }
+
+    for (int i = 0; i < num_ready; i++) {
+        struct kevent* kevent = &kevents[i];
+        Event* event = &events[i];
+        event->data = kevent->udata;
+        event->readable = (kevent->filter == EVFILT_READ);
+        event->writable = (kevent->filter == EVFILT_WRITE);
+        event->user = (kevent->filter == EVFILT_USER);
+        event->user_event = (event->user) ? (kevent->ident) : (0);
+    }
+
+    return num_ready;
+}
+
+
+void Poller::Trigger(uint32_t user_event) noexcept {
+    struct kevent event;
+    EV_SET(&event, user_event/*ident*/, EVFILT_USER/*filter*/, EV_ADD | EV_CLEAR/*flags*/, NOTE_TRIGGER/*fflags*/, 0/*data*/, nullptr/*user data*/);
+
+    int err = kevent(fd, &event, 1, nullptr, 0, nullptr);
+    if (err == -1) {
+        KIWI_LOG_FATAL("Problem waking up event loop: " << strerror(errno));
+        abort();
+    }
+
+    if (event.flags & EV_ERROR) {
+        KIWI_LOG_FATAL("Problem waking up event loop: " << strerror(event.data));
+        abort();
+    }
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef KIWI_POLLER_H_
+#define KIWI_POLLER_H_
+
+#include <atomic>
+#include <stdint.h>
+#include "config.h"
+
+
+/*
+ * Small readiness-notification abstraction over epoll (Linux) and kqueue
+ * (BSD/macOS). The backend is chosen at build time via config.h.
+ *
+ * Besides file descriptor readiness, the poller also delivers "user events":
+ * small integer ids (0-31) that any thread may Trigger() in order to wake up
+ * the thread blocked in Wait(). kqueue implements these natively through
+ * EVFILT_USER; epoll emulates them with a single eventfd plus a pending bitmask.
+ */
+class Poller {
+public:
+    enum Interest : uint32_t {
+        NONE =           0,
+        READ =           1 << 0,
+        WRITE =          1 << 1,
+        EDGE_TRIGGERED = 1 << 2,
+    };
+
+    struct Event {
+        void* data;
+        bool readable;
+        bool writable;
+        bool user;
+        uint32_t user_event;
+    };
+
+    Poller(void);
+    ~Poller(void) noexcept;
+
+    /*
+     * Register the fd with the given interest set. `data` is handed back
+     * verbatim in every Event reported for this fd.
+     */
+    void Add(int fd, uint32_t interest, void* data);
+
+    /*
+     * Replace the interest set of an already registered fd. This is a single
+     * syscall on both backends (EPOLL_CTL_MOD, or one kevent() call carrying
+     * both the read and write filter changes).
+     */
+    void Modify(int fd, uint32_t interest, void* data);
+    void Remove(int fd);
+
+    /*
+     * Block until at least one event is ready or until `timeout_ms` elapses
+     * (-1 waits indefinitely). Returns the number of events written to
+     * `events`, which may be 0 on timeout or signal interruption.
+     */
+    int Wait(Event* events, int max_events, int timeout_ms);
+
+    /*
+     * Thread-safe. Wakes up the poller and makes it report `user_event` from
+     * Wait(). Repeated triggers of the same id before the poller wakes up are
+     * coalesced into a single event.
+     */
+    void Trigger(uint32_t user_event) noexcept;
+
+    /*
+     * The epoll/kqueue fd itself. It polls readable whenever Wait() would
+     * return at least one event, which lets another event source (e.g. an
+     * io_uring loop) wait on this poller without blocking in Wait().
+     */
+    int GetFD(void) noexcept;
+
+    // Delete copy constructor and copy assignment operator
+    Poller(Poller const& other) = delete;
+    Poller& operator=(Poller const& other) = delete;
+
+private:
+    int fd;
+#if defined(HAVE_EPOLL)
+    int wakeup_fd;
+    std::atomic<uint32_t> pending_user_events;
+#endif
+};
+
+#endif  // KIWI_POLLER_H_
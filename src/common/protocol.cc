@@ -25,3 +25,11 @@ string Protocol::ClusterNameMismatchErrorMessage(void) {
     ss << "Cluster name mismatch.";
     return ss.str();
 }
+
+
+string Protocol::UnexpectedServerIdErrorMessage(uint32_t server_id) {
+    stringstream ss;
+    ss << "Server " << server_id << " may not connect to this server; ";
+    ss << "servers only accept connections from lower-numbered hosts in the cluster.";
+    return ss.str();
+}
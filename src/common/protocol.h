@@ -19,8 +19,38 @@ namespace Protocol {
         CLIENT_TEST =            0x40000002,
         CLIENT_TEST_REPLY =      0x40000003,
 
+        CLIENT_GET =                   0x40000004,
+        CLIENT_GET_REPLY =             0x40000005,
+        CLIENT_PUT =                   0x40000006,
+        CLIENT_PUT_REPLY =             0x40000007,
+        CLIENT_DELETE =                0x40000008,
+        CLIENT_DELETE_REPLY =          0x40000009,
+        CLIENT_MULTI_GET =             0x4000000A,
+        CLIENT_MULTI_GET_REPLY =       0x4000000B,
+        CLIENT_MULTI_PUT =             0x4000000C,
+        CLIENT_MULTI_PUT_REPLY =       0x4000000D,
+        CLIENT_SCAN =                  0x4000000E,
+        CLIENT_SCAN_CHUNK =            0x4000000F,
+        CLIENT_SUBSCRIBE =             0x40000010,
+        CLIENT_SUBSCRIBE_BATCH =       0x40000011,
+        CLIENT_SUBSCRIBE_CREDIT =      0x40000012,
+        CLIENT_UNSUBSCRIBE =           0x40000013,
+        CLIENT_COMPARE_AND_SET =       0x40000014,
+        CLIENT_COMPARE_AND_SET_REPLY = 0x40000015,
+        CLIENT_INCREMENT =             0x40000016,
+        CLIENT_INCREMENT_REPLY =       0x40000017,
+        CLIENT_STATUS =                0x40000018,
+        CLIENT_STATUS_REPLY =          0x40000019,
+
         SERVER_HELLO =           0x80000000,
         SERVER_HELLO_REPLY =     0x80000001,
+
+        RAFT_APPEND_ENTRIES =         0x80000002,
+        RAFT_APPEND_ENTRIES_REPLY =   0x80000003,
+        RAFT_REQUEST_VOTE =           0x80000004,
+        RAFT_REQUEST_VOTE_REPLY =     0x80000005,
+        RAFT_INSTALL_SNAPSHOT =       0x80000006,
+        RAFT_INSTALL_SNAPSHOT_REPLY = 0x80000007,
     };
 
     enum ErrorCode {
@@ -28,11 +58,18 @@ namespace Protocol {
         INVALID_MAGIC_NUMBER = 1,
         UNSUPPORTED_PROTOCOL_VERSION = 2,
         CLUSTER_NAME_MISMATCH = 3,
+        UNEXPECTED_SERVER_ID = 4,
+        NOT_LEADER = 5,
+        LOG_PURGED = 6,
+        INVALID_CREDITS = 7,
+        OUTCOME_UNKNOWN = 8,
+        TRX_ID_AHEAD = 9,
     };
 
     std::string InvalidMagicNumberErrorMessage(uint32_t invalid_magic_number);
     std::string UnsupportedProtocolVersionErrorMessage(uint32_t invalid_protocol_version);
     std::string ClusterNameMismatchErrorMessage(void);
+    std::string UnexpectedServerIdErrorMessage(uint32_t server_id);
 }
 
 #endif  // KIWI_PROTOCOL_H_
@@ -1,8 +1,221 @@
 #ifndef KIWI_UNBOUNDED_BLOCKING_QUEUE_H_
 #define KIWI_UNBOUNDED_BLOCKING_QUEUE_H_
 
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "poller.h"
 
+
+/*
+ * Lock-free multi-producer / single-consumer queue whose consumer sleeps in
+ * a Poller rather than on the queue itself.
+ *
+ * Elements live in fixed-size segments, so a malloc is only needed once per
+ * SEGMENT_CAPACITY elements; the consumer hands its most recently emptied
+ * segment back for reuse, so in the steady state there is none at all.
+ * Producers claim a slot by advancing the tail index with a CAS and then
+ * fill it in; the consumer reads slots in order, waiting on each one's
+ * `written` flag. Segments are chained by the producer that claims the last
+ * slot of the previous one, and freed by the consumer once it has read
+ * every slot in them, at which point no producer can still be touching it.
+ *
+ * Blocking: a failed TryDequeue() arms the queue, and the first Enqueue()
+ * after that triggers `user_event` on the consumer's poller, exactly once,
+ * no matter how many producers race. While the consumer is busy draining
+ * (the queue is not armed) enqueuing costs no syscall at all. The consumer
+ * therefore drains until TryDequeue() fails each time it sees the event.
+ */
+template <typename T>
 class UnboundedBlockingQueue {
+public:
+    static const size_t SEGMENT_CAPACITY = 63;
+
+    UnboundedBlockingQueue(Poller& poller, uint32_t user_event);
+    ~UnboundedBlockingQueue(void);
+
+    // Thread-safe.
+    void Enqueue(T value);
+
+    // Consumer thread only. Returns false (and arms the queue) if the queue is empty.
+    bool TryDequeue(T* value);
+
+    // Delete copy constructor and copy assignment operator
+    UnboundedBlockingQueue(UnboundedBlockingQueue const& other) = delete;
+    UnboundedBlockingQueue& operator=(UnboundedBlockingQueue const& other) = delete;
+
+private:
+    // Index positions per segment: one per slot plus a sentinel, which
+    // tells producers that the next segment is being installed.
+    static const size_t LAP = SEGMENT_CAPACITY + 1;
+
+    struct Slot {
+        std::atomic<bool> written;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Segment {
+        std::atomic<Segment*> next;
+        Slot slots[SEGMENT_CAPACITY];
+
+        Segment(void) : next(nullptr) {
+            for (Slot& slot : slots) {
+                slot.written.store(false, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    Poller& poller;
+    uint32_t user_event;
+    std::atomic<Segment*> spare_segment;
+
+    // Producer side
+    alignas(64) std::atomic<size_t> tail_index;
+    std::atomic<Segment*> tail_segment;
+
+    // Shared
+    alignas(64) std::atomic<bool> armed;
+
+    // Consumer side
+    alignas(64) size_t head_index;
+    Segment* head_segment;
+
+    Segment* NewSegment(void);
+    void RecycleSegment(Segment* segment) noexcept;
+    bool HeadWritten(void) noexcept;
 };
 
+
+template <typename T>
+UnboundedBlockingQueue<T>::UnboundedBlockingQueue(Poller& poller, uint32_t user_event) :
+        poller(poller),
+        user_event(user_event),
+        spare_segment(nullptr),
+        tail_index(0),
+        tail_segment(nullptr),
+        armed(true),
+        head_index(0),
+        head_segment(nullptr) {
+
+    head_segment = new Segment();
+    tail_segment.store(head_segment);
+}
+
+
+template <typename T>
+UnboundedBlockingQueue<T>::~UnboundedBlockingQueue(void) {
+    while (HeadWritten()) {
+        reinterpret_cast<T*>(head_segment->slots[head_index].storage)->~T();
+        head_index++;
+        if (head_index == SEGMENT_CAPACITY) {
+            Segment* next = head_segment->next.load(std::memory_order_acquire);
+            delete head_segment;
+            head_segment = next;
+            head_index = 0;
+        }
+    }
+    delete head_segment;
+    delete spare_segment.load();
+}
+
+
+template <typename T>
+void UnboundedBlockingQueue<T>::Enqueue(T value) {
+    Segment* next_segment = nullptr;
+    for (;;) {
+        size_t tail = tail_index.load(std::memory_order_acquire);
+        size_t offset = tail % LAP;
+
+        // Another producer is installing the next segment.
+        if (offset == SEGMENT_CAPACITY) {
+            continue;
+        }
+
+        // Allocate ahead of the CAS so the window above stays short.
+        if (offset + 1 == SEGMENT_CAPACITY && next_segment == nullptr) {
+            next_segment = NewSegment();
+        }
+
+        // Only dereferenced once the CAS proves it's still the tail segment.
+        Segment* segment = tail_segment.load(std::memory_order_acquire);
+        if (!tail_index.compare_exchange_weak(tail, tail + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            continue;
+        }
+
+        if (offset + 1 == SEGMENT_CAPACITY) {
+            tail_segment.store(next_segment, std::memory_order_release);
+            tail_index.fetch_add(1, std::memory_order_release);
+            segment->next.store(next_segment, std::memory_order_release);
+        } else if (next_segment != nullptr) {
+            RecycleSegment(next_segment);
+        }
+
+        Slot& slot = segment->slots[offset];
+        new (slot.storage) T(std::move(value));
+        slot.written.store(true, std::memory_order_seq_cst);
+
+        // Pairs with the re-check in TryDequeue(): either it sees our slot or we see it armed.
+        if (armed.load(std::memory_order_seq_cst) && armed.exchange(false)) {
+            poller.Trigger(user_event);
+        }
+        return;
+    }
+}
+
+
+template <typename T>
+bool UnboundedBlockingQueue<T>::TryDequeue(T* value) {
+    if (!HeadWritten()) {
+        armed.store(true, std::memory_order_seq_cst);
+        if (!HeadWritten()) {
+            return false;
+        }
+        // Lost the race to a producer; a spurious wakeup may follow.
+        armed.store(false, std::memory_order_relaxed);
+    }
+
+    Slot& slot = head_segment->slots[head_index];
+    T* stored = reinterpret_cast<T*>(slot.storage);
+    *value = std::move(*stored);
+    stored->~T();
+    head_index++;
+
+    if (head_index == SEGMENT_CAPACITY) {
+        // The producer that claimed the last slot linked the next segment first.
+        Segment* next = head_segment->next.load(std::memory_order_acquire);
+        RecycleSegment(head_segment);
+        head_segment = next;
+        head_index = 0;
+    }
+    return true;
+}
+
+
+template <typename T>
+bool UnboundedBlockingQueue<T>::HeadWritten(void) noexcept {
+    return head_segment->slots[head_index].written.load(std::memory_order_seq_cst);
+}
+
+
+template <typename T>
+typename UnboundedBlockingQueue<T>::Segment* UnboundedBlockingQueue<T>::NewSegment(void) {
+    Segment* segment = spare_segment.exchange(nullptr, std::memory_order_acquire);
+    if (segment != nullptr) {
+        return segment;
+    }
+    return new Segment();
+}
+
+
+template <typename T>
+void UnboundedBlockingQueue<T>::RecycleSegment(Segment* segment) noexcept {
+    segment->next.store(nullptr, std::memory_order_relaxed);
+    for (Slot& slot : segment->slots) {
+        slot.written.store(false, std::memory_order_relaxed);
+    }
+    delete spare_segment.exchange(segment, std::memory_order_acq_rel);
+}
+
 #endif  // KIWI_UNBOUNDED_BLOCKING_QUEUE_H_
@@ -0,0 +1,147 @@
+#include "common/config.h"
+#if defined(HAVE_LIBURING)
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include "common/exceptions.h"
+#include "io_uring_engine.h"
+
+
+using namespace std;
+
+static const uint64_t kOpMask = 0x7;
+static const int kBufferGroupID = 0;
+
+static uint64_t Pack(void* data, IOUringEngine::Op op) {
+    return reinterpret_cast<uintptr_t>(data) | op;
+}
+
+
+IOUringEngine::IOUringEngine(unsigned entries, unsigned num_buffers, unsigned buffer_size) :
+        buffer_ring(nullptr),
+        buffers(new char[static_cast<size_t>(num_buffers) * buffer_size]),
+        num_buffers(num_buffers),
+        buffer_size(buffer_size) {
+
+    int err = io_uring_queue_init(entries, &ring, 0);
+    if (err < 0) {
+        delete[] buffers;
+        throw IOException("Error initializing io_uring: " + string(strerror(-err)));
+    }
+
+    buffer_ring = io_uring_setup_buf_ring(&ring, num_buffers, kBufferGroupID, 0, &err);
+    if (buffer_ring == nullptr) {
+        io_uring_queue_exit(&ring);
+        delete[] buffers;
+        throw IOException("Error registering io_uring provided buffer ring: " + string(strerror(-err)));
+    }
+
+    for (unsigned i = 0; i < num_buffers; i++) {
+        io_uring_buf_ring_add(buffer_ring, buffers + static_cast<size_t>(i) * buffer_size, buffer_size, i, io_uring_buf_ring_mask(num_buffers), i);
+    }
+    io_uring_buf_ring_advance(buffer_ring, num_buffers);
+}
+
+
+IOUringEngine::~IOUringEngine(void) noexcept {
+    io_uring_free_buf_ring(&ring, buffer_ring, num_buffers, kBufferGroupID);
+    io_uring_queue_exit(&ring);
+    delete[] buffers;
+}
+
+
+struct io_uring_sqe* IOUringEngine::NextSQE(void) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    while (sqe == nullptr) {
+        // Submission queue is full; push what we have to the kernel without
+        // waiting and try again.
+        int err = io_uring_submit(&ring);
+        if (err < 0 && err != -EINTR && err != -EAGAIN && err != -EBUSY) {
+            throw IOException("Error submitting to io_uring: " + string(strerror(-err)));
+        }
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+
+void IOUringEngine::MultishotAccept(int listen_fd, void* data) {
+    struct io_uring_sqe* sqe = NextSQE();
+    io_uring_prep_multishot_accept(sqe, listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, Pack(data, ACCEPT));
+}
+
+
+void IOUringEngine::MultishotRecv(int fd, void* data) {
+    struct io_uring_sqe* sqe = NextSQE();
+    io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroupID;
+    io_uring_sqe_set_data64(sqe, Pack(data, RECV));
+}
+
+
+void IOUringEngine::SendMessage(int fd, struct msghdr const* message, void* data) {
+    struct io_uring_sqe* sqe = NextSQE();
+    io_uring_prep_sendmsg(sqe, fd, message, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, Pack(data, SEND));
+}
+
+
+void IOUringEngine::MultishotPoll(int fd, void* data) {
+    struct io_uring_sqe* sqe = NextSQE();
+    io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, Pack(data, POLL));
+}
+
+
+void IOUringEngine::CancelAll(int fd) {
+    struct io_uring_sqe* sqe = NextSQE();
+    io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+    io_uring_sqe_set_data64(sqe, Pack(nullptr, CANCEL));
+}
+
+
+int IOUringEngine::SubmitAndWait(Completion* completions, int max_completions) {
+    int err = io_uring_submit_and_wait(&ring, 1);
+    if (err < 0 && err != -EINTR && err != -ETIME) {
+        throw IOException("Error waiting for io_uring completions: " + string(strerror(-err)));
+    }
+
+    struct io_uring_cqe* cqes[256];
+    if (max_completions > static_cast<int>(sizeof(cqes) / sizeof(cqes[0]))) {
+        max_completions = sizeof(cqes) / sizeof(cqes[0]);
+    }
+
+    unsigned num_cqes = io_uring_peek_batch_cqe(&ring, cqes, max_completions);
+    for (unsigned i = 0; i < num_cqes; i++) {
+        struct io_uring_cqe* cqe = cqes[i];
+        uint64_t user_data = io_uring_cqe_get_data64(cqe);
+
+        Completion* completion = &completions[i];
+        completion->op = static_cast<Op>(user_data & kOpMask);
+        completion->data = reinterpret_cast<void*>(user_data & ~kOpMask);
+        completion->result = cqe->res;
+        completion->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            completion->buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            completion->buffer = buffers + static_cast<size_t>(completion->buffer_id) * buffer_size;
+        } else {
+            completion->buffer_id = 0;
+            completion->buffer = nullptr;
+        }
+    }
+    io_uring_cq_advance(&ring, num_cqes);
+
+    return num_cqes;
+}
+
+
+void IOUringEngine::ReturnBuffer(uint16_t buffer_id) {
+    io_uring_buf_ring_add(buffer_ring, buffers + static_cast<size_t>(buffer_id) * buffer_size, buffer_size, buffer_id, io_uring_buf_ring_mask(num_buffers), 0);
+    io_uring_buf_ring_advance(buffer_ring, 1);
+}
+
+#endif  // HAVE_LIBURING
@@ -0,0 +1,84 @@
+#ifndef KIWI_IO_URING_ENGINE_H_
+#define KIWI_IO_URING_ENGINE_H_
+
+#include "common/config.h"
+#if defined(HAVE_LIBURING)
+
+#include <liburing.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+
+/*
+ * Completion-based network I/O on top of io_uring.
+ *
+ * An IOThread prepares any number of operations during one loop iteration and
+ * then calls SubmitAndWait(), which hands all of them to the kernel and reaps
+ * whatever has completed in a single io_uring_enter(2):
+ *
+ *   - accepts are multishot: one submission yields a completion per client.
+ *   - receives are multishot and use a provided buffer ring, so the kernel
+ *     picks a free buffer for each completion; the caller copies the bytes out
+ *     and hands the buffer straight back with ReturnBuffer().
+ *   - sends are one-shot sendmsg operations (so a connection's whole output
+ *     backlog goes out as one gather), batched per loop iteration. The
+ *     message must stay valid until the send completes.
+ *
+ * Every operation carries an 8-byte-aligned pointer supplied by the caller;
+ * the low bits are used to tag the operation type.
+ */
+class IOUringEngine {
+public:
+    enum Op : uint64_t {
+        RECV =   0,
+        SEND =   1,
+        ACCEPT = 2,
+        POLL =   3,
+        CANCEL = 4,
+    };
+
+    struct Completion {
+        Op op;
+        void* data;
+        int result;
+        bool more;       // the (multishot) operation remains armed
+        char* buffer;    // RECV only: provided buffer holding `result` bytes
+        uint16_t buffer_id;
+    };
+
+    /*
+     * Throws IOException if the kernel lacks io_uring or provided buffer ring
+     * support, in which case callers should fall back to the Poller.
+     */
+    IOUringEngine(unsigned entries, unsigned num_buffers, unsigned buffer_size);
+    ~IOUringEngine(void) noexcept;
+
+    void MultishotAccept(int listen_fd, void* data);
+    void MultishotRecv(int fd, void* data);
+    void SendMessage(int fd, struct msghdr const* message, void* data);
+    void MultishotPoll(int fd, void* data);
+    void CancelAll(int fd);
+
+    /*
+     * Submit everything prepared since the last call, wait for at least one
+     * completion and copy up to `max_completions` of them into `completions`.
+     */
+    int SubmitAndWait(Completion* completions, int max_completions);
+    void ReturnBuffer(uint16_t buffer_id);
+
+    // Delete copy constructor and copy assignment operator
+    IOUringEngine(IOUringEngine const& other) = delete;
+    IOUringEngine& operator=(IOUringEngine const& other) = delete;
+
+private:
+    struct io_uring ring;
+    struct io_uring_buf_ring* buffer_ring;
+    char* buffers;
+    unsigned num_buffers;
+    unsigned buffer_size;
+
+    struct io_uring_sqe* NextSQE(void);
+};
+
+#endif  // HAVE_LIBURING
+#endif  // KIWI_IO_URING_ENGINE_H_
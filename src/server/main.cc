@@ -1,6 +1,7 @@
 #include <iostream>
 #include <pthread.h>
 #include <signal.h>
+#include <string.h>
 #include "server.h"
 
 
@@ -16,7 +17,7 @@ static int Run(const char * config_file_path, const sigset_t termination_signals
     // Read the configuration file
     ServerConfig config = ServerConfig::ParseFromFile(config_file_path);
 
-    // Initialize the storage
+    // Initialize the storage, rolling committed transactions forward before anyone can connect
     Storage storage(config);
 
     // Start the server
@@ -0,0 +1,1767 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "common/constants.h"
+#include "common/exceptions.h"
+#include "common/file_utils.h"
+#include "common/frame_writer.h"
+#include "common/io_utils.h"
+#include "common/logger.h"
+#include "common/protocol.h"
+#include "common/timing_utils.h"
+#include "raft.h"
+#include "transaction.h"
+
+
+using namespace std;
+
+enum RaftEventID {
+    kSHUTDOWN = 1,
+    kMESSAGE = 2,
+};
+
+static const uint64_t kElectionTimeoutMinMillis = 500;
+static const uint64_t kElectionTimeoutMaxMillis = 1000;
+static const uint64_t kHeartbeatIntervalMillis = 50;
+static const uint64_t kRedialDelayMillis = 100;
+static const uint64_t kDialTimeoutMillis = 1000;
+
+// The lease runs for the election timeout less this, to allow for the
+// servers' clocks running at slightly different rates.
+static const uint64_t kLeaseMarginMillis = 100;
+static const uint64_t kLeaseNanos = (kElectionTimeoutMinMillis - kLeaseMarginMillis) * 1000000;
+
+// Events handled per loop iteration, so that a flood of proposals can't hold
+// up heartbeats; whatever is left over is picked up on the next iteration.
+static const size_t kMaxEventsPerIteration = 4096;
+
+// Limits on what the leader sends to a single follower.
+static const size_t kMaxEntriesPerMessage = 4096;
+static const size_t kMaxBytesPerMessage = 1024 * 1024;
+static const uint64_t kMaxInflightEntries = 16384;
+
+// Upper bound on the recent-entry cache; older entries are read back from raft_log.
+static const size_t kMaxCacheBytes = 64 * 1024 * 1024;
+
+// [8 term][8 prev index][8 prev term][8 leader commit][8 sent at][4 number of entries]
+static const size_t kAppendEntriesHeaderSize = 8 + 8 + 8 + 8 + 8 + 4;
+
+// A follower this far behind the commit index gets a snapshot even if
+// raft_log still has everything it's missing.
+static const uint64_t kSnapshotCatchUpEntries = 100000;
+
+// Limits on snapshot transfers: chunk size, unacknowledged bytes per
+// follower, and how long to wait before building again after a failure.
+static const size_t kSnapshotChunkBytes = 1024 * 1024;
+static const uint64_t kMaxSnapshotInflightBytes = 8 * 1024 * 1024;
+static const uint64_t kSnapshotRetryMillis = 1000;
+
+// [8 term][8 sent at][8 snapshot index][8 snapshot term][4 number of files][4 file number][2 name length]
+// followed by the name and [8 offset][1 last chunk of the file][4 length][data]
+static const size_t kInstallSnapshotHeaderSize = 8 + 8 + 8 + 8 + 4 + 4 + 2 + 8 + 1 + 4;
+
+static const string kSnapshotFileSuffix = ".sst";
+
+static uint64_t NowMillis(void) {
+    struct timespec now;
+    TimingUtils::Nanotime(&now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static uint64_t NowNanos(void) {
+    struct timespec now;
+    TimingUtils::Nanotime(&now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+Raft::Raft(ServerConfig const& config, Storage& storage, RaftTransport& transport) :
+        config(config),
+        storage(storage),
+        transport(transport),
+        id(config.ServerId()),
+        quorum(config.Hosts().size() / 2 + 1),
+        peers(),
+        poller(),
+        events(poller, kMESSAGE),
+        started(false),
+        is_leader(false),
+        random(static_cast<uint64_t>(NowMillis()) * 31 + config.ServerId()),
+        current_term(0),
+        voted_for(0),
+        role(Role::FOLLOWER),
+        leader_id(0),
+        last_log_index(0),
+        last_log_term(0),
+        commit_index(0),
+        election_deadline(0),
+        last_leader_contact(0),
+        votes(0),
+        cache(),
+        cache_first_index(0),
+        cache_bytes(0),
+        durable_index(0),
+        known_commit_index(0),
+        batch_window(config.RaftLogBatchWindowMs()),
+        batch_max_size(config.RaftLogBatchMaxSize()),
+        batch_deadline(0),
+        replicate_pending(false),
+        deferred_replies(),
+        pending_proposals(),
+        lease_expires_at(0),
+        lease_read_index(0),
+        quorum_acked_at(0),
+        snapshot_dir(config.DataDir() + "/snapshots"),
+        snapshot_rate(config.RaftSnapshotMaxBytesPerSecond()),
+        snapshot_next_send_at(0),
+        snapshot_build_after(0),
+        snapshot_building(false),
+        snapshot_thread(),
+        built_snapshot(),
+        built_snapshot_ok(false),
+        next_snapshot_id(0),
+        outgoing(),
+        incoming(),
+        log_base_index(0),
+        log_base_term(0),
+        leader_contact_at(0),
+        leader_contact_commit_index(0),
+        heartbeat_pending(false),
+        pending_reads() {
+
+    for (auto const& host : config.Hosts()) {
+        if (host.first == id) {
+            continue;
+        }
+
+        Peer& peer = peers[host.first];
+        peer.id = host.first;
+        peer.connected = false;
+        peer.route = PeerRoute{0, 0};
+        peer.dial_state = DialState::IDLE;
+        peer.dial_fd = -1;
+        peer.redial_at = 0;
+        peer.next_index = 1;
+        peer.match_index = 0;
+        peer.probing = true;
+        peer.probe_outstanding = false;
+        peer.last_sent_at = 0;
+        peer.acked_sent_at = 0;
+        peer.snapshot_state = SnapshotState::NONE;
+        peer.snapshot_probing = false;
+        peer.snapshot_sent = 0;
+        peer.snapshot_acked = 0;
+        peer.snapshot_last_sent_at = 0;
+        peer.vote_granted = false;
+    }
+    outgoing.ready = false;
+    incoming.fd = -1;
+    incoming.installing = false;
+
+    // Whatever an earlier run left half sent or half received is of no use
+    // now; an install that had already started was finished by storage.
+    FileUtils::RemoveDirectory(snapshot_dir);
+    FileUtils::MakeDirectory(snapshot_dir);
+
+    storage.LoadHardState(&current_term, &voted_for);
+    storage.ReadLogBase(&log_base_index, &log_base_term);
+    storage.ReadLastLogEntry(&last_log_index, &last_log_term);
+    commit_index = storage.AppliedRaftTrxId();
+    known_commit_index = commit_index;
+    durable_index = last_log_index;
+    cache_first_index = last_log_index + 1;
+
+    KIWI_LOG_INFO("Raft server " << id << " starting at term " << current_term
+        << " with log up to " << last_log_index << " (term " << last_log_term << "), "
+        << commit_index << " applied, quorum of " << quorum);
+}
+
+
+Raft::~Raft(void) {
+    if (started) {
+        Shutdown();
+    }
+
+    for (auto& entry : peers) {
+        if (entry.second.dial_fd != -1) {
+            IOUtils::Close(entry.second.dial_fd);
+        }
+    }
+    for (int fd : outgoing.fds) {
+        IOUtils::Close(fd);
+    }
+    if (incoming.fd != -1) {
+        IOUtils::Close(incoming.fd);
+    }
+}
+
+
+void Raft::Start(void) {
+    int err = pthread_create(&thread, nullptr, ThreadWrapper, this);
+    if (err != 0) {
+        throw ServerException("Error creating raft thread: " + string(strerror(err)));
+    }
+    started = true;
+}
+
+
+/*
+ * Unlike the io threads, this also waits for the raft thread to exit, so
+ * that the transport is no longer used once it returns.
+ */
+void Raft::Shutdown(void) {
+    if (!started) {
+        return;
+    }
+
+    poller.Trigger(kSHUTDOWN);
+    int err = pthread_join(thread, nullptr);
+    if (err != 0) {
+        KIWI_LOG_FATAL("Problem joining raft thread: " << strerror(err));
+        abort();
+    }
+    started = false;
+}
+
+
+void Raft::PeerConnected(uint32_t peer_id, PeerRoute const& route) {
+    Event event{};
+    event.type = Event::CONNECTED;
+    event.peer_id = peer_id;
+    event.route = route;
+    events.Enqueue(move(event));
+}
+
+
+void Raft::PeerDisconnected(uint32_t peer_id, PeerRoute const& route) {
+    Event event{};
+    event.type = Event::DISCONNECTED;
+    event.peer_id = peer_id;
+    event.route = route;
+    events.Enqueue(move(event));
+}
+
+
+void Raft::Receive(uint32_t peer_id, uint32_t message_type, string body) {
+    Event event{};
+    event.type = Event::MESSAGE;
+    event.peer_id = peer_id;
+    event.message_type = message_type;
+    event.data = move(body);
+    events.Enqueue(move(event));
+}
+
+
+void Raft::Propose(string transaction, function<void(ProposeResult)> done) {
+    Event event{};
+    event.type = Event::PROPOSAL;
+    event.data = move(transaction);
+    event.proposed = move(done);
+    events.Enqueue(move(event));
+}
+
+
+void Raft::Read(function<void(bool)> done) {
+    uint64_t lease = lease_expires_at.load(memory_order_acquire);
+    uint64_t read_index = lease_read_index.load(memory_order_acquire);
+    if (read_index != 0 && NowNanos() < lease) {
+        storage.WhenApplied(read_index, [done]() { done(true); });
+        return;
+    }
+
+    Event event{};
+    event.type = Event::READ;
+    event.done = move(done);
+    events.Enqueue(move(event));
+}
+
+
+void Raft::StaleRead(uint64_t max_staleness_ms, function<void(bool)> done) {
+    if (is_leader.load(memory_order_relaxed)) {
+        Read(move(done));
+        return;
+    }
+
+    uint64_t contact_at = leader_contact_at.load(memory_order_acquire);
+    uint64_t read_index = leader_contact_commit_index.load(memory_order_acquire);
+    if (contact_at == 0 || NowNanos() > contact_at + max_staleness_ms * 1000000) {
+        done(false);
+        return;
+    }
+    storage.WhenApplied(read_index, [done]() { done(true); });
+}
+
+
+bool Raft::IsLeader(void) const noexcept {
+    return is_leader.load(memory_order_relaxed);
+}
+
+
+void* Raft::ThreadWrapper(void* ptr) {
+    Raft* raft = static_cast<Raft*>(ptr);
+    try {
+        raft->ThreadMain();
+    } catch (exception const& e) {
+        KIWI_LOG_FATAL("Raft thread crashed: " << e.what());
+        abort();
+    } catch (...) {
+        KIWI_LOG_FATAL("Raft thread crashed");
+        abort();
+    }
+    return nullptr;
+}
+
+
+void Raft::ThreadMain(void) {
+    uint64_t now = NowMillis();
+    ResetElectionDeadline(now);
+
+    // We may have acknowledged a leader's lease just before a restart, so
+    // hold off voting as if we'd heard from it just now.
+    last_leader_contact = now;
+
+    bool shutdown = false;
+    while (!shutdown) {
+        Poller::Event poller_events[64];
+        int num_events = poller.Wait(poller_events, sizeof(poller_events) / sizeof(poller_events[0]), NextTimeout(NowMillis()));
+
+        now = NowMillis();
+        for (int i = 0; i < num_events; i++) {
+            Poller::Event* event = &poller_events[i];
+            if (!event->user) {
+                FinishDial(*static_cast<Peer*>(event->data), now);
+                continue;
+            }
+
+            RaftEventID event_id = static_cast<RaftEventID>(event->user_event);
+            switch (event_id) {
+                case kSHUTDOWN:
+                    shutdown = true;
+                    break;
+
+                case kMESSAGE:
+                    DrainEvents(now);
+                    break;
+
+                default:
+                    KIWI_LOG_FATAL("Unknown event id: " << event_id);
+                    abort();
+            }
+        }
+
+        Tick(now);
+
+        // Followers get new entries while our own sync is still in progress.
+        if (replicate_pending || heartbeat_pending) {
+            for (auto& entry : peers) {
+                Replicate(entry.second, now, heartbeat_pending);
+            }
+            replicate_pending = false;
+            heartbeat_pending = false;
+        }
+        FlushOutboxes();
+
+        if (storage.StagedLogBytes() > 0 && now >= batch_deadline) {
+            SyncLog();
+            FlushOutboxes();
+        }
+    }
+
+    FailPendingProposals();
+    is_leader.store(false, memory_order_relaxed);
+
+    if (snapshot_building) {
+        pthread_join(snapshot_thread, nullptr);
+        snapshot_building = false;
+    }
+}
+
+
+int Raft::NextTimeout(uint64_t now) {
+    uint64_t due = UINT64_MAX;
+    if (role == Role::LEADER) {
+        for (auto const& entry : peers) {
+            if (entry.second.connected) {
+                due = min(due, entry.second.last_sent_at + kHeartbeatIntervalMillis);
+            }
+
+            Peer const& peer = entry.second;
+            if (peer.connected && peer.snapshot_state == SnapshotState::SENDING && !peer.snapshot_probing &&
+                    peer.snapshot_sent < outgoing.offsets.back() &&
+                    peer.snapshot_sent - peer.snapshot_acked < kMaxSnapshotInflightBytes) {
+                due = min(due, snapshot_next_send_at);
+            }
+        }
+    } else if (!incoming.installing) {
+        due = election_deadline;
+    }
+
+    for (auto const& entry : peers) {
+        if (entry.second.dial_state != DialState::CONNECTED && entry.first > id) {
+            due = min(due, entry.second.redial_at);
+        }
+    }
+
+    if (storage.StagedLogBytes() > 0) {
+        due = min(due, batch_deadline);
+    }
+
+    if (due <= now) {
+        return 0;
+    }
+    return static_cast<int>(min<uint64_t>(due - now, kElectionTimeoutMaxMillis));
+}
+
+
+void Raft::DrainEvents(uint64_t now) {
+    // The queue only rings again once we've seen it empty, so if we stop
+    // early we have to ring it ourselves.
+    Event event;
+    for (size_t num_events = 0; ; num_events++) {
+        if (num_events == kMaxEventsPerIteration) {
+            poller.Trigger(kMESSAGE);
+            return;
+        }
+        if (!events.TryDequeue(&event)) {
+            return;
+        }
+
+        // A full batch is synced right away, window or not.
+        if (storage.StagedLogBytes() >= batch_max_size) {
+            SyncLog();
+        }
+
+        if (event.type == Event::PROPOSAL) {
+            HandlePropose(event.data, event.proposed, now);
+            continue;
+        }
+        if (event.type == Event::READ) {
+            HandleRead(event.done);
+            continue;
+        }
+        if (event.type == Event::SNAPSHOT_BUILT) {
+            HandleSnapshotBuilt(now);
+            continue;
+        }
+        if (event.type == Event::SNAPSHOT_INSTALLED) {
+            HandleSnapshotInstalled();
+            continue;
+        }
+
+        auto it = peers.find(event.peer_id);
+        if (it == peers.end()) {
+            KIWI_LOG_WARN("Ignoring raft event for unknown server " << event.peer_id);
+            continue;
+        }
+        Peer& peer = it->second;
+
+        switch (event.type) {
+            case Event::CONNECTED:
+                KIWI_LOG_INFO("Connected to server " << peer.id);
+                peer.connected = true;
+                peer.route = event.route;
+                peer.outbox.clear();
+                if (role == Role::LEADER) {
+                    // Whatever was in flight on the old connection is gone.
+                    peer.next_index = last_log_index + 1;
+                    peer.probing = true;
+                    peer.probe_outstanding = false;
+                    peer.snapshot_probing = true;
+                    Replicate(peer, now, true);
+                } else if (role == Role::CANDIDATE && !peer.vote_granted) {
+                    SendRequestVote(peer);
+                }
+                break;
+
+            case Event::DISCONNECTED:
+                if (!peer.connected || !(peer.route == event.route)) {
+                    break;
+                }
+                KIWI_LOG_INFO("Disconnected from server " << peer.id);
+                peer.connected = false;
+                peer.outbox.clear();
+                if (peer.dial_state == DialState::CONNECTED) {
+                    peer.dial_state = DialState::IDLE;
+                    peer.redial_at = now + kRedialDelayMillis;
+                }
+                break;
+
+            case Event::MESSAGE:
+                HandleMessage(peer.id, event.message_type, event.data, now);
+                break;
+
+            case Event::PROPOSAL:
+            case Event::READ:
+            case Event::SNAPSHOT_BUILT:
+            case Event::SNAPSHOT_INSTALLED:
+                break;
+        }
+    }
+}
+
+
+void Raft::HandleMessage(uint32_t peer_id, uint32_t message_type, string const& body, uint64_t now) {
+    Peer& peer = peers[peer_id];
+    FrameReader reader(body.data(), body.length());
+    switch (message_type) {
+        case Protocol::MessageType::RAFT_APPEND_ENTRIES:
+            HandleAppendEntries(peer, reader, now);
+            break;
+
+        case Protocol::MessageType::RAFT_APPEND_ENTRIES_REPLY:
+            HandleAppendEntriesReply(peer, reader, now);
+            break;
+
+        case Protocol::MessageType::RAFT_REQUEST_VOTE:
+            HandleRequestVote(peer, reader, now);
+            break;
+
+        case Protocol::MessageType::RAFT_REQUEST_VOTE_REPLY:
+            HandleRequestVoteReply(peer, reader, now);
+            break;
+
+        case Protocol::MessageType::RAFT_INSTALL_SNAPSHOT:
+            HandleInstallSnapshot(peer, reader);
+            break;
+
+        case Protocol::MessageType::RAFT_INSTALL_SNAPSHOT_REPLY:
+            HandleInstallSnapshotReply(peer, reader, now);
+            break;
+
+        default:
+            KIWI_LOG_WARN("Ignoring unknown raft message type " << message_type << " from server " << peer_id);
+            break;
+    }
+}
+
+
+void Raft::HandlePropose(string& transaction, function<void(ProposeResult)>& done, uint64_t now) {
+    if (role != Role::LEADER || transaction.length() > Constants::MAX_MESSAGE_SIZE - 4 - 4 - kAppendEntriesHeaderSize - 8 - 4) {
+        done(ProposeResult::NOT_APPENDED);
+        return;
+    }
+
+    LogEntry entry;
+    entry.index = last_log_index + 1;
+    entry.term = current_term;
+    entry.transaction = move(transaction);
+    pending_proposals.push_back(Proposal{entry.index, move(done)});
+    AppendEntry(entry, now);
+    replicate_pending = true;
+}
+
+
+void Raft::HandleRead(function<void(bool)>& done) {
+    if (role != Role::LEADER) {
+        done(false);
+        return;
+    }
+
+    pending_reads.push_back(PendingRead{NowNanos(), move(done)});
+    heartbeat_pending = true;
+    ReleaseReads();
+}
+
+
+void Raft::Tick(uint64_t now) {
+    for (auto& entry : peers) {
+        Peer& peer = entry.second;
+        if (peer.id < id || now < peer.redial_at) {
+            continue;
+        }
+        if (peer.dial_state == DialState::IDLE) {
+            Dial(peer, now);
+        } else if (peer.dial_state == DialState::CONNECTING) {
+            KIWI_LOG_DEBUG("Timed out connecting to server " << peer.id);
+            AbandonDial(peer, now);
+        }
+    }
+
+    if (role == Role::LEADER) {
+        for (auto& entry : peers) {
+            Peer& peer = entry.second;
+            if (!peer.connected) {
+                continue;
+            }
+            if (now >= peer.last_sent_at + kHeartbeatIntervalMillis) {
+                Replicate(peer, now, true);
+            } else if (peer.snapshot_state == SnapshotState::SENDING) {
+                SendSnapshot(peer, now, false);
+            }
+        }
+        MaybeBuildSnapshot(now);
+    } else if (now >= election_deadline && !incoming.installing) {
+        // An install resets the log under us, so it has to finish first.
+        StartElection(now);
+    }
+}
+
+
+void Raft::ResetElectionDeadline(uint64_t now) {
+    uniform_int_distribution<uint64_t> timeout(kElectionTimeoutMinMillis, kElectionTimeoutMaxMillis);
+    election_deadline = now + timeout(random);
+}
+
+
+void Raft::StartElection(uint64_t now) {
+    // A leader replicates from raft_log, so its own log must be on disk first.
+    SyncLog();
+
+    current_term++;
+    voted_for = id;
+    storage.SaveHardState(current_term, voted_for);
+
+    role = Role::CANDIDATE;
+    leader_id = 0;
+    votes = 1;
+    ResetElectionDeadline(now);
+    KIWI_LOG_INFO("Starting election for term " << current_term);
+
+    if (votes >= quorum) {
+        BecomeLeader(now);
+        return;
+    }
+
+    for (auto& entry : peers) {
+        entry.second.vote_granted = false;
+        if (entry.second.connected) {
+            SendRequestVote(entry.second);
+        }
+    }
+}
+
+
+void Raft::BecomeFollower(uint64_t term, uint32_t leader) {
+    if (term > current_term) {
+        current_term = term;
+        voted_for = 0;
+        storage.SaveHardState(current_term, voted_for);
+    }
+
+    if (role == Role::LEADER) {
+        KIWI_LOG_INFO("Stepping down as leader at term " << current_term);
+        is_leader.store(false, memory_order_relaxed);
+        lease_read_index.store(0, memory_order_release);
+        lease_expires_at.store(0, memory_order_release);
+        replicate_pending = false;
+        heartbeat_pending = false;
+        FailPendingProposals();
+        FailPendingReads();
+    }
+    role = Role::FOLLOWER;
+    leader_id = leader;
+}
+
+
+void Raft::BecomeLeader(uint64_t now) {
+    KIWI_LOG_INFO("Elected leader for term " << current_term);
+    role = Role::LEADER;
+    leader_id = id;
+    is_leader.store(true, memory_order_relaxed);
+
+    for (auto& entry : peers) {
+        Peer& peer = entry.second;
+        peer.next_index = last_log_index + 1;
+        peer.match_index = 0;
+        peer.probing = true;
+        peer.probe_outstanding = false;
+        peer.last_sent_at = 0;
+        peer.acked_sent_at = 0;
+        peer.snapshot_state = SnapshotState::NONE;
+    }
+    UpdateLease();
+
+    // Entries from earlier terms only commit along with one from ours, so
+    // start the term with an empty transaction rather than wait for a client.
+    LogEntry entry;
+    entry.index = last_log_index + 1;
+    entry.term = current_term;
+    TransactionCodec::Encode(Transaction(), &entry.transaction);
+    AppendEntry(entry, now);
+    replicate_pending = true;
+}
+
+
+void Raft::HandleRequestVote(Peer& peer, FrameReader& reader, uint64_t now) {
+    uint64_t term;
+    uint64_t candidate_last_index;
+    uint64_t candidate_last_term;
+    if (!reader.GetLong(&term) || !reader.GetLong(&candidate_last_index) || !reader.GetLong(&candidate_last_term)) {
+        KIWI_LOG_WARN("Malformed RequestVote from server " << peer.id);
+        return;
+    }
+
+    // A follower that still hears from its leader ignores candidates, so a
+    // server that was merely partitioned away can't depose a healthy leader.
+    // This is also what the leader's lease relies on, and a leader holding
+    // one doesn't step down for a candidate either.
+    bool leader_alive = (role == Role::FOLLOWER && now < last_leader_contact + kElectionTimeoutMinMillis) ||
+        (role == Role::LEADER && NowNanos() < lease_expires_at.load(memory_order_relaxed));
+    bool granted = false;
+    if (term > current_term && !leader_alive) {
+        BecomeFollower(term, 0);
+    }
+
+    if (term == current_term && (voted_for == 0 || voted_for == peer.id)) {
+        bool up_to_date = candidate_last_term > last_log_term ||
+            (candidate_last_term == last_log_term && candidate_last_index >= last_log_index);
+        if (up_to_date) {
+            granted = true;
+            if (voted_for != peer.id) {
+                voted_for = peer.id;
+                storage.SaveHardState(current_term, voted_for);
+            }
+            ResetElectionDeadline(now);
+        }
+    }
+
+    FrameWriter writer(ReserveFrame(peer, Protocol::MessageType::RAFT_REQUEST_VOTE_REPLY, 8 + 1));
+    writer.PutLong(current_term);
+    writer.PutByte(granted ? 1 : 0);
+}
+
+
+void Raft::HandleRequestVoteReply(Peer& peer, FrameReader& reader, uint64_t now) {
+    uint64_t term;
+    uint8_t granted;
+    if (!reader.GetLong(&term) || !reader.GetByte(&granted)) {
+        KIWI_LOG_WARN("Malformed RequestVoteReply from server " << peer.id);
+        return;
+    }
+
+    if (term > current_term) {
+        BecomeFollower(term, 0);
+        return;
+    }
+    if (role != Role::CANDIDATE || term != current_term || granted == 0 || peer.vote_granted) {
+        return;
+    }
+
+    peer.vote_granted = true;
+    votes++;
+    if (votes >= quorum) {
+        BecomeLeader(now);
+    }
+}
+
+
+void Raft::HandleAppendEntries(Peer& peer, FrameReader& reader, uint64_t now) {
+    uint64_t term;
+    uint64_t prev_index;
+    uint64_t prev_term;
+    uint64_t leader_commit;
+    uint64_t sent_at;
+    uint32_t num_entries;
+    if (!reader.GetLong(&term) ||
+            !reader.GetLong(&prev_index) ||
+            !reader.GetLong(&prev_term) ||
+            !reader.GetLong(&leader_commit) ||
+            !reader.GetLong(&sent_at) ||
+            !reader.GetInt(&num_entries)) {
+        KIWI_LOG_WARN("Malformed AppendEntries from server " << peer.id);
+        return;
+    }
+
+    vector<LogEntry> entries;
+    entries.reserve(num_entries);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        LogEntry entry;
+        uint32_t length;
+        char const* transaction;
+        if (!reader.GetLong(&entry.term) || !reader.GetInt(&length) || !reader.GetBytes(length, &transaction)) {
+            KIWI_LOG_WARN("Malformed AppendEntries from server " << peer.id);
+            return;
+        }
+        entry.index = prev_index + 1 + i;
+        entry.transaction.assign(transaction, length);
+        entries.push_back(move(entry));
+    }
+
+    if (term < current_term) {
+        SendAppendEntriesReply(peer, false, prev_index, last_log_index, sent_at);
+        return;
+    }
+    if (term > current_term || role != Role::FOLLOWER) {
+        BecomeFollower(term, peer.id);
+    }
+
+    // `now` dates from before the queue was drained, possibly before the
+    // leader sent this; the leader's lease must not outlast our contact time.
+    leader_id = peer.id;
+    last_leader_contact = NowMillis();
+    ResetElectionDeadline(last_leader_contact);
+    leader_contact_commit_index.store(max(leader_commit, commit_index), memory_order_release);
+    leader_contact_at.store(NowNanos(), memory_order_release);
+
+    // The log is about to be replaced by a snapshot's.
+    if (incoming.installing) {
+        SendAppendEntriesReply(peer, false, prev_index, commit_index, sent_at);
+        return;
+    }
+
+    if (prev_index > last_log_index) {
+        SendAppendEntriesReply(peer, false, prev_index, last_log_index, sent_at);
+        return;
+    }
+
+    // Our committed prefix is known to match the leader's; past it, the
+    // leader resumes from there rather than backing off one entry at a time.
+    if (prev_index > commit_index && TermAt(prev_index) != prev_term) {
+        SendAppendEntriesReply(peer, false, prev_index, commit_index, sent_at);
+        return;
+    }
+
+    // Skip whatever we already have, truncate at the first conflict.
+    for (LogEntry& entry : entries) {
+        if (entry.index <= last_log_index) {
+            if (entry.index <= commit_index || TermAt(entry.index) == entry.term) {
+                continue;
+            }
+            TruncateSuffix(entry.index);
+        }
+        AppendEntry(entry, now);
+    }
+
+    // Everything up to match_index is on the leader's log, so whatever the
+    // leader says is committed in that range is ours to apply once synced.
+    uint64_t match_index = prev_index + num_entries;
+    known_commit_index = max(known_commit_index, min(leader_commit, match_index));
+    if (min(known_commit_index, durable_index) > commit_index) {
+        Commit(min(known_commit_index, durable_index));
+    }
+
+    // The leader counts our reply towards its quorum, so it waits for the sync.
+    if (match_index > durable_index) {
+        deferred_replies.push_back(DeferredReply{peer.id, prev_index, match_index, sent_at});
+    } else {
+        SendAppendEntriesReply(peer, true, prev_index, match_index, sent_at);
+    }
+}
+
+
+void Raft::HandleAppendEntriesReply(Peer& peer, FrameReader& reader, uint64_t now) {
+    uint64_t term;
+    uint8_t success;
+    uint64_t prev_index;
+    uint64_t last_index;
+    uint64_t sent_at;
+    if (!reader.GetLong(&term) ||
+            !reader.GetByte(&success) ||
+            !reader.GetLong(&prev_index) ||
+            !reader.GetLong(&last_index) ||
+            !reader.GetLong(&sent_at)) {
+        KIWI_LOG_WARN("Malformed AppendEntriesReply from server " << peer.id);
+        return;
+    }
+
+    if (term > current_term) {
+        BecomeFollower(term, 0);
+        return;
+    }
+    if (role != Role::LEADER || term != current_term) {
+        return;
+    }
+
+    // Even a rejection acknowledges us as leader for the term.
+    if (sent_at > peer.acked_sent_at) {
+        peer.acked_sent_at = sent_at;
+        UpdateLease();
+    }
+
+    // Whatever was in flight before the snapshot no longer matters.
+    if (peer.snapshot_state != SnapshotState::NONE) {
+        return;
+    }
+
+    if (success != 0) {
+        peer.match_index = max(peer.match_index, last_index);
+        peer.next_index = max(peer.next_index, peer.match_index + 1);
+        peer.probing = false;
+        peer.probe_outstanding = false;
+        AdvanceCommitIndex();
+        Replicate(peer, now, false);
+        return;
+    }
+
+    // With several messages in flight, only the first rejection means anything.
+    if (peer.probing ? (prev_index != peer.next_index - 1) : (prev_index <= peer.match_index)) {
+        return;
+    }
+    peer.next_index = max(peer.match_index + 1, min(prev_index, last_index + 1));
+    peer.probing = true;
+    peer.probe_outstanding = false;
+    Replicate(peer, now, false);
+}
+
+
+/*
+ * Writes every append and truncation staged since the last sync with one
+ * WAL sync, then releases what was waiting on it: follower replies, the
+ * leader's own vote towards a quorum and commits of newly durable entries.
+ */
+void Raft::SyncLog(void) {
+    storage.SyncLog();
+    durable_index = last_log_index;
+
+    for (DeferredReply const& reply : deferred_replies) {
+        SendAppendEntriesReply(peers[reply.peer_id], true, reply.prev_index, reply.match_index, reply.sent_at);
+    }
+    deferred_replies.clear();
+
+    if (role == Role::LEADER) {
+        AdvanceCommitIndex();
+    } else if (min(known_commit_index, durable_index) > commit_index) {
+        Commit(min(known_commit_index, durable_index));
+    }
+}
+
+
+/*
+ * Sends the follower everything it doesn't have yet, up to the in-flight
+ * limit. A follower being probed gets a single message until it replies.
+ * With `heartbeat` set, an (empty) message is sent regardless. A follower
+ * that needs a snapshot gets that instead, once there's one to send.
+ */
+void Raft::Replicate(Peer& peer, uint64_t now, bool heartbeat) {
+    if (!peer.connected || role != Role::LEADER) {
+        return;
+    }
+
+    if (peer.snapshot_state == SnapshotState::NONE && NeedsSnapshot(peer)) {
+        KIWI_LOG_INFO("Server " << peer.id << " needs a snapshot (next index " << peer.next_index
+            << ", log base " << log_base_index << ", commit index " << commit_index << ")");
+        peer.snapshot_state = SnapshotState::WAITING;
+    }
+    if (peer.snapshot_state == SnapshotState::WAITING) {
+        if (!NeedsSnapshot(peer)) {
+            peer.snapshot_state = SnapshotState::NONE;
+        } else if (SnapshotUsable(peer)) {
+            KIWI_LOG_INFO("Sending snapshot at " << outgoing.info.index << " to server " << peer.id);
+            peer.snapshot_state = SnapshotState::SENDING;
+            peer.snapshot_probing = true;
+            peer.snapshot_sent = 0;
+            peer.snapshot_acked = 0;
+            heartbeat = true;
+        } else {
+            if (heartbeat) {
+                SendHeartbeat(peer, now);
+            }
+            return;
+        }
+    }
+    if (peer.snapshot_state == SnapshotState::SENDING) {
+        SendSnapshot(peer, now, heartbeat);
+        return;
+    }
+
+    if (peer.probing) {
+        if (!peer.probe_outstanding || heartbeat) {
+            SendAppendEntries(peer, now);
+            peer.probe_outstanding = true;
+        }
+        return;
+    }
+
+    bool sent = false;
+    while (peer.next_index <= last_log_index && peer.next_index - peer.match_index - 1 < kMaxInflightEntries) {
+        size_t num_entries = SendAppendEntries(peer, now);
+        if (num_entries == 0) {
+            throw StorageException("raft_log has no entry at index " + to_string(peer.next_index));
+        }
+        peer.next_index += num_entries;
+        sent = true;
+    }
+    if (!sent && heartbeat) {
+        SendAppendEntries(peer, now);
+    }
+}
+
+
+/*
+ * Encodes an AppendEntries starting at peer.next_index straight into the
+ * peer's outbox and returns the number of entries in it.
+ */
+size_t Raft::SendAppendEntries(Peer& peer, uint64_t now) {
+    uint64_t prev_index = peer.next_index - 1;
+    uint64_t prev_term = TermAt(prev_index);
+
+    vector<LogEntry> scratch;
+    vector<LogEntry const*> entries;
+    size_t num_bytes = 0;
+    if (peer.next_index >= cache_first_index) {
+        for (size_t i = peer.next_index - cache_first_index; i < cache.size() && entries.size() < kMaxEntriesPerMessage && num_bytes < kMaxBytesPerMessage; i++) {
+            entries.push_back(&cache[i]);
+            num_bytes += cache[i].transaction.length();
+        }
+    } else {
+        storage.ReadLog(peer.next_index, kMaxEntriesPerMessage, kMaxBytesPerMessage, &scratch);
+        for (LogEntry const& entry : scratch) {
+            entries.push_back(&entry);
+            num_bytes += entry.transaction.length();
+        }
+    }
+
+    size_t body_length = kAppendEntriesHeaderSize + entries.size() * (8 + 4) + num_bytes;
+    FrameWriter writer(ReserveFrame(peer, Protocol::MessageType::RAFT_APPEND_ENTRIES, body_length));
+    writer.PutLong(current_term);
+    writer.PutLong(prev_index);
+    writer.PutLong(prev_term);
+    writer.PutLong(commit_index);
+    writer.PutLong(NowNanos());
+    writer.PutInt(entries.size());
+    for (LogEntry const* entry : entries) {
+        writer.PutLong(entry->term);
+        writer.PutInt(entry->transaction.length());
+        writer.PutBytes(entry->transaction.data(), entry->transaction.length());
+    }
+
+    peer.last_sent_at = now;
+    return entries.size();
+}
+
+
+// An AppendEntries that asserts leadership and nothing else.
+void Raft::SendHeartbeat(Peer& peer, uint64_t now) {
+    FrameWriter writer(ReserveFrame(peer, Protocol::MessageType::RAFT_APPEND_ENTRIES, kAppendEntriesHeaderSize));
+    writer.PutLong(current_term);
+    writer.PutLong(last_log_index);
+    writer.PutLong(last_log_term);
+    writer.PutLong(commit_index);
+    writer.PutLong(NowNanos());
+    writer.PutInt(0);
+    peer.last_sent_at = now;
+}
+
+
+void Raft::SendAppendEntriesReply(Peer& peer, bool success, uint64_t prev_index, uint64_t last_index, uint64_t sent_at) {
+    FrameWriter writer(ReserveFrame(peer, Protocol::MessageType::RAFT_APPEND_ENTRIES_REPLY, 8 + 1 + 8 + 8 + 8));
+    writer.PutLong(current_term);
+    writer.PutByte(success ? 1 : 0);
+    writer.PutLong(prev_index);
+    writer.PutLong(last_index);
+    writer.PutLong(sent_at);
+}
+
+
+void Raft::SendRequestVote(Peer& peer) {
+    FrameWriter writer(ReserveFrame(peer, Protocol::MessageType::RAFT_REQUEST_VOTE, 8 + 8 + 8));
+    writer.PutLong(current_term);
+    writer.PutLong(last_log_index);
+    writer.PutLong(last_log_term);
+}
+
+
+void Raft::AdvanceCommitIndex(void) {
+    // The leader's own log counts too, but only as far as it's synced.
+    vector<uint64_t> match_indexes;
+    match_indexes.push_back(durable_index);
+    for (auto const& entry : peers) {
+        match_indexes.push_back(entry.second.match_index);
+    }
+
+    // The quorum-th highest match index is on a quorum of logs.
+    nth_element(match_indexes.begin(), match_indexes.begin() + (quorum - 1), match_indexes.end(), greater<uint64_t>());
+    uint64_t quorum_index = match_indexes[quorum - 1];
+    if (quorum_index > commit_index && TermAt(quorum_index) == current_term) {
+        Commit(quorum_index);
+    }
+}
+
+
+void Raft::Commit(uint64_t index) {
+    commit_index = index;
+    storage.Deliver(commit_index);
+
+    // Published before any proposal completes, so a read that starts after
+    // a write returns can't be handed an older index. A leader only ever
+    // commits entries from its own term, so the index is current.
+    if (role == Role::LEADER) {
+        lease_read_index.store(commit_index, memory_order_release);
+        ReleaseReads();
+    }
+
+    while (!pending_proposals.empty() && pending_proposals.front().index <= commit_index) {
+        pending_proposals.front().done(ProposeResult::COMMITTED);
+        pending_proposals.pop_front();
+    }
+}
+
+
+// They're in the log already, so whoever leads next may still commit them.
+void Raft::FailPendingProposals(void) {
+    for (Proposal& proposal : pending_proposals) {
+        proposal.done(ProposeResult::OUTCOME_UNKNOWN);
+    }
+    pending_proposals.clear();
+}
+
+
+bool Raft::NeedsSnapshot(Peer const& peer) const {
+    return peer.next_index <= log_base_index || peer.next_index + kSnapshotCatchUpEntries <= commit_index;
+}
+
+
+// Whether the snapshot we have would bring the follower forward, with the log picking up right after it.
+bool Raft::SnapshotUsable(Peer const& peer) const {
+    return outgoing.ready && outgoing.info.index >= log_base_index && outgoing.info.index >= peer.next_index;
+}
+
+
+/*
+ * Starts building a snapshot on a helper thread if a follower is waiting
+ * for one. The current one's files stay in place while anyone is still
+ * being sent them.
+ */
+void Raft::MaybeBuildSnapshot(uint64_t now) {
+    if (snapshot_building || now < snapshot_build_after) {
+        return;
+    }
+
+    bool wanted = false;
+    for (auto const& entry : peers) {
+        Peer const& peer = entry.second;
+        if (peer.snapshot_state == SnapshotState::SENDING) {
+            return;
+        }
+        if (peer.snapshot_state == SnapshotState::WAITING && peer.connected && !SnapshotUsable(peer)) {
+            wanted = true;
+        }
+    }
+    if (!wanted) {
+        return;
+    }
+
+    DiscardOutgoingSnapshot();
+    outgoing.dir = snapshot_dir + "/outgoing-" + to_string(next_snapshot_id++);
+    built_snapshot = SnapshotInfo{};
+    built_snapshot_ok = false;
+    KIWI_LOG_INFO("Building snapshot in " << outgoing.dir);
+
+    int err = pthread_create(&snapshot_thread, nullptr, SnapshotThreadWrapper, this);
+    if (err != 0) {
+        KIWI_LOG_ERROR("Error creating snapshot thread: " << strerror(err));
+        snapshot_build_after = now + kSnapshotRetryMillis;
+        return;
+    }
+    snapshot_building = true;
+}
+
+
+void* Raft::SnapshotThreadWrapper(void* ptr) {
+    Raft* raft = static_cast<Raft*>(ptr);
+    try {
+        raft->storage.CreateSnapshot(raft->outgoing.dir, &raft->built_snapshot);
+        raft->built_snapshot_ok = true;
+    } catch (exception const& e) {
+        KIWI_LOG_ERROR("Problem creating snapshot: " << e.what());
+    }
+
+    Event event{};
+    event.type = Event::SNAPSHOT_BUILT;
+    raft->events.Enqueue(move(event));
+    return nullptr;
+}
+
+
+void Raft::HandleSnapshotBuilt(uint64_t now) {
+    int err = pthread_join(snapshot_thread, nullptr);
+    if (err != 0) {
+        KIWI_LOG_FATAL("Problem joining snapshot thread: " << strerror(err));
+        abort();
+    }
+    snapshot_building = false;
+
+    try {
+        if (!built_snapshot_ok) {
+            throw IOException("snapshot was not created");
+        }
+
+        outgoing.info = move(built_snapshot);
+        outgoing.offsets.assign(1, 0);
+        for (string const& file : outgoing.info.files) {
+            string path = outgoing.dir + "/" + file;
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                throw IOException("Error opening " + path + ": " + string(strerror(errno)));
+            }
+            outgoing.fds.push_back(fd);
+
+            // Followers know a file is complete from its last chunk, so there must be one.
+            struct stat file_stat;
+            if (fstat(fd, &file_stat) == -1) {
+                throw IOException("Error reading " + path + ": " + string(strerror(errno)));
+            }
+            if (file_stat.st_size == 0) {
+                throw IOException("Snapshot file " + path + " is empty");
+            }
+            outgoing.offsets.push_back(outgoing.offsets.back() + file_stat.st_size);
+        }
+    } catch (exception const& e) {
+        KIWI_LOG_ERROR("Problem preparing snapshot: " << e.what());
+        DiscardOutgoingSnapshot();
+        snapshot_build_after = now + kSnapshotRetryMillis;
+        return;
+    }
+
+    outgoing.ready = true;
+    KIWI_LOG_INFO("Built snapshot at " << outgoing.info.index << ": " << outgoing.info.files.size()
+        << " files, " << outgoing.offsets.back() << " bytes");
+
+    for (auto& entry : peers) {
+        if (entry.second.snapshot_state == SnapshotState::WAITING) {
+            Replicate(entry.second, now, true);
+        }
+    }
+}
+
+
+void Raft::DiscardOutgoingSnapshot(void) {
+    for (int fd : outgoing.fds) {
+        IOUtils::Close(fd);
+    }
+    outgoing.fds.clear();
+    outgoing.offsets.clear();
+    outgoing.info = SnapshotInfo{};
+    outgoing.ready = false;
+
+    if (!outgoing.dir.empty()) {
+        try {
+            FileUtils::RemoveDirectory(outgoing.dir);
+        } catch (exception const& e) {
+            KIWI_LOG_WARN("Problem removing snapshot: " << e.what());
+        }
+        outgoing.dir.clear();
+    }
+}
+
+
+/*
+ * Sends the follower as many chunks as the in-flight limit and the rate
+ * limit (shared by every follower) allow. Until it has told us where it
+ * is, and with `keepalive` set when nothing else goes out, it gets an empty
+ * message that it answers with its position.
+ */
+void Raft::SendSnapshot(Peer& peer, uint64_t now, bool keepalive) {
+    bool sent = false;
+    while (!peer.snapshot_probing &&
+            peer.snapshot_sent < outgoing.offsets.back() &&
+            peer.snapshot_sent - peer.snapshot_acked < kMaxSnapshotInflightBytes &&
+            now >= snapshot_next_send_at) {
+        size_t length = SendSnapshotChunk(peer, kSnapshotChunkBytes, now);
+        snapshot_next_send_at = max(snapshot_next_send_at, now) + length * 1000 / snapshot_rate;
+        sent = true;
+    }
+    if (!sent && keepalive) {
+        SendSnapshotChunk(peer, 0, now);
+    }
+}
+
+
+/*
+ * Reads the chunk at peer.snapshot_sent straight into the peer's outbox and
+ * returns its length; chunks never span files.
+ */
+size_t Raft::SendSnapshotChunk(Peer& peer, size_t max_bytes, uint64_t now) {
+    vector<uint64_t> const& offsets = outgoing.offsets;
+    uint64_t position = peer.snapshot_sent;
+    uint32_t file_count = outgoing.info.files.size();
+    uint32_t file = (upper_bound(offsets.begin(), offsets.end(), position) - offsets.begin()) - 1;
+    uint64_t offset = position - offsets[file];
+
+    static const string kNoFile;
+    string const& name = (file < file_count) ? outgoing.info.files[file] : kNoFile;
+    size_t length = 0;
+    bool last = false;
+    if (file < file_count) {
+        length = min<uint64_t>(max_bytes, offsets[file + 1] - position);
+        last = length > 0 && position + length == offsets[file + 1];
+    }
+
+    uint64_t sent_at = NowNanos();
+    char* body = ReserveFrame(peer, Protocol::MessageType::RAFT_INSTALL_SNAPSHOT, kInstallSnapshotHeaderSize + name.length() + length);
+    FrameWriter writer(body);
+    writer.PutLong(current_term);
+    writer.PutLong(sent_at);
+    writer.PutLong(outgoing.info.index);
+    writer.PutLong(outgoing.info.term);
+    writer.PutInt(file_count);
+    writer.PutInt(file);
+    writer.PutShort(name.length());
+    writer.PutBytes(name.data(), name.length());
+    writer.PutLong(offset);
+    writer.PutByte(last ? 1 : 0);
+    writer.PutInt(length);
+    if (length > 0) {
+        FileUtils::ReadAt(outgoing.fds[file], body + writer.Position(), length, offset);
+    }
+
+    peer.snapshot_sent += length;
+    peer.snapshot_last_sent_at = sent_at;
+    peer.last_sent_at = now;
+    return length;
+}
+
+
+/*
+ * Follower side of a snapshot transfer. Chunks are written out in order,
+ * anything else is dropped; every message is answered with how far we've
+ * got, except that the last chunk is answered once the install is done.
+ */
+void Raft::HandleInstallSnapshot(Peer& peer, FrameReader& reader) {
+    uint64_t term;
+    uint64_t sent_at;
+    uint64_t index;
+    uint64_t snapshot_term;
+    uint32_t file_count;
+    uint32_t file;
+    uint16_t name_length;
+    char const* name;
+    uint64_t offset;
+    uint8_t last;
+    uint32_t length;
+    char const* data;
+    if (!reader.GetLong(&term) ||
+            !reader.GetLong(&sent_at) ||
+            !reader.GetLong(&index) ||
+            !reader.GetLong(&snapshot_term) ||
+            !reader.GetInt(&file_count) ||
+            !reader.GetInt(&file) ||
+            !reader.GetShort(&name_length) ||
+            !reader.GetBytes(name_length, &name) ||
+            !reader.GetLong(&offset) ||
+            !reader.GetByte(&last) ||
+            !reader.GetInt(&length) ||
+            !reader.GetBytes(length, &data)) {
+        KIWI_LOG_WARN("Malformed InstallSnapshot from server " << peer.id);
+        return;
+    }
+
+    if (term < current_term) {
+        SendInstallSnapshotReply(peer, sent_at, index, false);
+        return;
+    }
+    if (term > current_term || role != Role::FOLLOWER) {
+        BecomeFollower(term, peer.id);
+    }
+
+    // This counts as hearing from the leader, lease included, but says
+    // nothing about its commit index, so follower reads are left alone.
+    leader_id = peer.id;
+    last_leader_contact = NowMillis();
+    ResetElectionDeadline(last_leader_contact);
+
+    if (incoming.installing) {
+        SendInstallSnapshotReply(peer, sent_at, index, false);
+        return;
+    }
+    if (index <= commit_index) {
+        SendInstallSnapshotReply(peer, sent_at, index, true);
+        return;
+    }
+
+    // A disk error loses what we had so far; the leader starts over once it
+    // sees we're back at the beginning.
+    try {
+        if (incoming.info.index != index) {
+            DiscardIncomingSnapshot();
+            incoming.dir = snapshot_dir + "/incoming-" + to_string(index);
+            FileUtils::MakeDirectory(incoming.dir);
+            incoming.info.index = index;
+            incoming.info.term = snapshot_term;
+            incoming.file_count = file_count;
+            incoming.file = 0;
+            incoming.offset = 0;
+        }
+        incoming.leader_id = peer.id;
+
+        if (length > 0 && file == incoming.file && offset == incoming.offset && file < incoming.file_count) {
+            // Storage takes the column family from the name, and it mustn't lead out of the directory.
+            string file_name(name, name_length);
+            if (file_name.length() <= kSnapshotFileSuffix.length() ||
+                    file_name.compare(file_name.length() - kSnapshotFileSuffix.length(), string::npos, kSnapshotFileSuffix) != 0 ||
+                    file_name.find('/') != string::npos ||
+                    file_name[0] == '.') {
+                KIWI_LOG_WARN("Ignoring snapshot file with bad name from server " << peer.id);
+                return;
+            }
+
+            if (incoming.fd == -1) {
+                string path = incoming.dir + "/" + file_name;
+                incoming.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (incoming.fd == -1) {
+                    throw IOException("Error creating " + path + ": " + string(strerror(errno)));
+                }
+                incoming.info.files.push_back(file_name);
+            }
+            FileUtils::WriteAll(incoming.fd, data, length);
+            incoming.offset += length;
+
+            if (last != 0) {
+                IOUtils::Close(incoming.fd);
+                incoming.fd = -1;
+                incoming.file++;
+                incoming.offset = 0;
+            }
+        }
+    } catch (exception const& e) {
+        KIWI_LOG_ERROR("Problem receiving snapshot from server " << peer.id << ": " << e.what());
+        DiscardIncomingSnapshot();
+        SendInstallSnapshotReply(peer, sent_at, index, false);
+        return;
+    }
+
+    if (incoming.file == incoming.file_count) {
+        KIWI_LOG_INFO("Installing snapshot at " << index << " from server " << peer.id);
+        incoming.installing = true;
+
+        // Nothing may still be staged for the raft_log the install resets.
+        SyncLog();
+        storage.InstallSnapshot(incoming.dir, incoming.info, [this]() {
+            Event event{};
+            event.type = Event::SNAPSHOT_INSTALLED;
+            events.Enqueue(move(event));
+        });
+        return;
+    }
+    SendInstallSnapshotReply(peer, sent_at, index, false);
+}
+
+
+void Raft::HandleInstallSnapshotReply(Peer& peer, FrameReader& reader, uint64_t now) {
+    uint64_t term;
+    uint64_t sent_at;
+    uint64_t index;
+    uint32_t file;
+    uint64_t offset;
+    uint8_t installed;
+    if (!reader.GetLong(&term) ||
+            !reader.GetLong(&sent_at) ||
+            !reader.GetLong(&index) ||
+            !reader.GetInt(&file) ||
+            !reader.GetLong(&offset) ||
+            !reader.GetByte(&installed)) {
+        KIWI_LOG_WARN("Malformed InstallSnapshotReply from server " << peer.id);
+        return;
+    }
+
+    if (term > current_term) {
+        BecomeFollower(term, 0);
+        return;
+    }
+    if (role != Role::LEADER || term != current_term) {
+        return;
+    }
+
+    if (sent_at > peer.acked_sent_at) {
+        peer.acked_sent_at = sent_at;
+        UpdateLease();
+    }
+
+    if (peer.snapshot_state != SnapshotState::SENDING || index != outgoing.info.index) {
+        return;
+    }
+
+    if (installed != 0) {
+        KIWI_LOG_INFO("Server " << peer.id << " installed snapshot at " << index);
+        peer.snapshot_state = SnapshotState::NONE;
+        peer.match_index = max(peer.match_index, index);
+        peer.next_index = peer.match_index + 1;
+        peer.probing = false;
+        peer.probe_outstanding = false;
+        AdvanceCommitIndex();
+        Replicate(peer, now, false);
+        return;
+    }
+
+    vector<uint64_t> const& offsets = outgoing.offsets;
+    if (file >= offsets.size() || offset > (file + 1 < offsets.size() ? offsets[file + 1] - offsets[file] : 0)) {
+        KIWI_LOG_WARN("Ignoring InstallSnapshotReply with bad position from server " << peer.id);
+        return;
+    }
+
+    // In-order delivery means acknowledgements only move forward, except
+    // for the first one after (re)connecting, which is where we resume. We
+    // also resume from a follower that has seen our latest chunk but isn't
+    // there: it threw away what it had, and dropped everything since.
+    uint64_t position = offsets[file] + offset;
+    if (peer.snapshot_probing) {
+        peer.snapshot_sent = position;
+        peer.snapshot_acked = position;
+        peer.snapshot_probing = false;
+    } else if (sent_at == peer.snapshot_last_sent_at && position < peer.snapshot_sent) {
+        KIWI_LOG_WARN("Server " << peer.id << " lost its copy of the snapshot; resending from " << position);
+        peer.snapshot_sent = position;
+        peer.snapshot_acked = position;
+    } else {
+        peer.snapshot_acked = min(peer.snapshot_sent, max(peer.snapshot_acked, position));
+    }
+    SendSnapshot(peer, now, false);
+}
+
+
+/*
+ * Storage has replaced the tables and reset raft_log, so our log now
+ * consists of the snapshot alone, all of it committed.
+ */
+void Raft::HandleSnapshotInstalled(void) {
+    uint64_t index = incoming.info.index;
+    KIWI_LOG_INFO("Installed snapshot at " << index << " (term " << incoming.info.term << ")");
+
+    log_base_index = index;
+    log_base_term = incoming.info.term;
+    last_log_index = index;
+    last_log_term = incoming.info.term;
+    commit_index = index;
+    known_commit_index = index;
+    durable_index = index;
+    cache.clear();
+    cache_bytes = 0;
+    cache_first_index = index + 1;
+    deferred_replies.clear();
+
+    // Storage has removed the directory.
+    uint32_t leader = incoming.leader_id;
+    incoming.dir.clear();
+    incoming.info = SnapshotInfo{};
+    incoming.installing = false;
+    ResetElectionDeadline(NowMillis());
+
+    auto it = peers.find(leader);
+    if (role == Role::FOLLOWER && it != peers.end()) {
+        SendInstallSnapshotReply(it->second, 0, index, true);
+    }
+}
+
+
+void Raft::DiscardIncomingSnapshot(void) {
+    if (incoming.fd != -1) {
+        IOUtils::Close(incoming.fd);
+        incoming.fd = -1;
+    }
+    if (!incoming.dir.empty()) {
+        try {
+            FileUtils::RemoveDirectory(incoming.dir);
+        } catch (exception const& e) {
+            KIWI_LOG_WARN("Problem removing snapshot: " << e.what());
+        }
+        incoming.dir.clear();
+    }
+    incoming.info = SnapshotInfo{};
+    incoming.file_count = 0;
+    incoming.file = 0;
+    incoming.offset = 0;
+}
+
+
+void Raft::SendInstallSnapshotReply(Peer& peer, uint64_t sent_at, uint64_t index, bool installed) {
+    FrameWriter writer(ReserveFrame(peer, Protocol::MessageType::RAFT_INSTALL_SNAPSHOT_REPLY, 8 + 8 + 8 + 4 + 8 + 1));
+    writer.PutLong(current_term);
+    writer.PutLong(sent_at);
+    writer.PutLong(index);
+    writer.PutInt(incoming.file);
+    writer.PutLong(incoming.offset);
+    writer.PutByte(installed ? 1 : 0);
+}
+
+
+/*
+ * The quorum-th latest acknowledged send time, counting ourselves as always
+ * up to date, is when a quorum last confirmed our leadership.
+ */
+void Raft::UpdateLease(void) {
+    vector<uint64_t> acked_at;
+    acked_at.push_back(UINT64_MAX);
+    for (auto const& entry : peers) {
+        acked_at.push_back(entry.second.acked_sent_at);
+    }
+    nth_element(acked_at.begin(), acked_at.begin() + (quorum - 1), acked_at.end(), greater<uint64_t>());
+    quorum_acked_at = acked_at[quorum - 1];
+
+    if (quorum_acked_at == UINT64_MAX) {
+        lease_expires_at.store(UINT64_MAX, memory_order_release);
+    } else if (quorum_acked_at != 0) {
+        lease_expires_at.store(quorum_acked_at + kLeaseNanos, memory_order_release);
+    }
+    ReleaseReads();
+}
+
+
+/*
+ * ReadIndex: a read is safe once a quorum has acknowledged a message sent
+ * after it arrived and an entry from our term has committed. It then only
+ * has to wait for the apply thread to catch up with the commit index.
+ */
+void Raft::ReleaseReads(void) {
+    uint64_t read_index = lease_read_index.load(memory_order_relaxed);
+    if (read_index == 0) {
+        return;
+    }
+
+    while (!pending_reads.empty() && pending_reads.front().arrived_at < quorum_acked_at) {
+        function<void(bool)> done = move(pending_reads.front().done);
+        pending_reads.pop_front();
+        storage.WhenApplied(read_index, [done]() { done(true); });
+    }
+}
+
+
+void Raft::FailPendingReads(void) {
+    for (PendingRead& read : pending_reads) {
+        read.done(false);
+    }
+    pending_reads.clear();
+}
+
+
+void Raft::AppendEntry(LogEntry& entry, uint64_t now) {
+    if (storage.StagedLogBytes() == 0) {
+        batch_deadline = now + batch_window;
+    }
+    storage.StageLogEntry(entry);
+    last_log_index = entry.index;
+    last_log_term = entry.term;
+
+    // Staged entries can only be read back from here until they're synced.
+    cache_bytes += entry.transaction.length();
+    cache.push_back(move(entry));
+    while (cache_bytes > kMaxCacheBytes && cache.front().index <= durable_index) {
+        cache_bytes -= cache.front().transaction.length();
+        cache.pop_front();
+        cache_first_index++;
+    }
+}
+
+
+void Raft::TruncateSuffix(uint64_t index) {
+    if (index <= commit_index) {
+        KIWI_LOG_FATAL("Asked to truncate committed raft_log entry " << index << " (commit index " << commit_index << ")");
+        abort();
+    }
+    KIWI_LOG_INFO("Truncating raft_log from " << index << " to " << last_log_index);
+
+    // Rare enough that it isn't worth holding back; the batch goes out next iteration.
+    batch_deadline = 0;
+    storage.StageLogTruncation(index);
+    durable_index = min(durable_index, index - 1);
+    while (!cache.empty() && cache.back().index >= index) {
+        cache_bytes -= cache.back().transaction.length();
+        cache.pop_back();
+    }
+    cache_first_index = min(cache_first_index, index);
+
+    last_log_index = index - 1;
+    last_log_term = TermAt(last_log_index);
+}
+
+
+uint64_t Raft::TermAt(uint64_t index) {
+    if (index == log_base_index) {
+        return log_base_term;
+    }
+    if (index >= cache_first_index && index <= last_log_index) {
+        return cache[index - cache_first_index].term;
+    }
+
+    uint64_t term;
+    if (!storage.ReadLogTerm(index, &term)) {
+        throw StorageException("raft_log has no entry at index " + to_string(index));
+    }
+    return term;
+}
+
+
+void Raft::Dial(Peer& peer, uint64_t now) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    peer.redial_at = now + kRedialDelayMillis;
+    try {
+        IOUtils::AutoCloseableAddrInfo addrs(config.Hosts().at(peer.id), hints);
+        while (addrs.HasNext()) {
+            struct addrinfo* addr = addrs.Next();
+            int fd = IOUtils::OpenSocketFD(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            int flags = fcntl(fd, F_GETFL, 0);
+            if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+                int err = errno;
+                IOUtils::Close(fd);
+                throw IOException("Problem making socket non-blocking: " + string(strerror(err)));
+            }
+
+            if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0 || errno == EINPROGRESS) {
+                peer.dial_state = DialState::CONNECTING;
+                peer.dial_fd = fd;
+                peer.redial_at = now + kDialTimeoutMillis;
+                poller.Add(fd, Poller::Interest::WRITE, &peer);
+                return;
+            }
+            IOUtils::Close(fd);
+        }
+    } catch (exception const& e) {
+        KIWI_LOG_WARN("Problem connecting to server " << peer.id << ": " << e.what());
+    }
+}
+
+
+void Raft::FinishDial(Peer& peer, uint64_t now) {
+    if (peer.dial_state != DialState::CONNECTING) {
+        return;
+    }
+
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (getsockopt(peer.dial_fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1) {
+        error = errno;
+    }
+    if (error != 0) {
+        KIWI_LOG_DEBUG("Problem connecting to server " << peer.id << ": " << strerror(error));
+        AbandonDial(peer, now);
+        return;
+    }
+
+    poller.Remove(peer.dial_fd);
+    int fd = peer.dial_fd;
+    peer.dial_fd = -1;
+    peer.dial_state = DialState::CONNECTED;
+    transport.AdoptPeerConnection(peer.id, fd);
+}
+
+
+void Raft::AbandonDial(Peer& peer, uint64_t now) {
+    // Closing the fd also drops its poller registration.
+    IOUtils::Close(peer.dial_fd);
+    peer.dial_fd = -1;
+    peer.dial_state = DialState::IDLE;
+    peer.redial_at = now + kRedialDelayMillis;
+}
+
+
+char* Raft::ReserveFrame(Peer& peer, uint32_t message_type, size_t body_length) {
+    size_t offset = peer.outbox.length();
+    peer.outbox.resize(offset + 4 + 4 + body_length);
+    FrameWriter writer(&peer.outbox[offset]);
+    writer.PutInt(message_type);
+    writer.PutInt(body_length);
+    return &peer.outbox[offset + 4 + 4];
+}
+
+
+void Raft::FlushOutboxes(void) {
+    for (auto& entry : peers) {
+        Peer& peer = entry.second;
+        if (peer.outbox.empty()) {
+            continue;
+        }
+        if (peer.connected) {
+            transport.SendToPeer(peer.id, peer.route, move(peer.outbox));
+        }
+        peer.outbox.clear();
+    }
+}
@@ -0,0 +1,396 @@
+#ifndef KIWI_RAFT_H_
+#define KIWI_RAFT_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <pthread.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "common/frame_reader.h"
+#include "common/poller.h"
+#include "common/unbounded_blocking_queue.h"
+#include "server_config.h"
+#include "storage.h"
+
+
+/*
+ * Identifies one connection to a peer: the io thread that owns it plus a
+ * per-thread generation, so that messages meant for a connection that has
+ * since been replaced are dropped rather than sent down the new one.
+ */
+struct PeerRoute {
+    size_t io_thread;
+    uint64_t generation;
+
+    bool operator==(PeerRoute const& other) const noexcept {
+        return io_thread == other.io_thread && generation == other.generation;
+    }
+};
+
+
+/*
+ * How raft reaches the peer mesh. Peer connections live on the server's io
+ * threads; raft only ever hands them whole frames. Every method is called
+ * from the raft thread and must not block.
+ */
+class RaftTransport {
+public:
+    virtual ~RaftTransport(void) {}
+
+    // Takes ownership of a connected, non-blocking socket to `peer_id`.
+    virtual void AdoptPeerConnection(uint32_t peer_id, int fd) = 0;
+
+    // Queues `frames` (one or more complete messages) on the peer's connection.
+    virtual void SendToPeer(uint32_t peer_id, PeerRoute const& route, std::string frames) = 0;
+};
+
+
+/*
+ * Raft log replication over the ServerHello peer mesh.
+ *
+ * Everything runs on one dedicated thread, which is also the only thread
+ * that writes to raft_log. Proposals and peer messages are queued to it;
+ * appends are group committed, so every entry that arrives within the
+ * configured batch window goes to raft_log in a single synced WriteBatch.
+ *
+ * The leader pipelines AppendEntries: it keeps sending entries past each
+ * follower's last acknowledged index, up to an in-flight limit, instead of
+ * waiting for every reply. A follower that rejects an AppendEntries is put
+ * back into probing, where one message is outstanding at a time until the
+ * leader has found where their logs agree. Once an entry from the current
+ * term is on a quorum of logs it is committed and handed to
+ * Storage::Deliver().
+ *
+ * Reads don't go through the log. Every AppendEntries carries the leader's
+ * monotonic send time and every reply echoes it, so the leader knows when a
+ * quorum last acknowledged it. Followers refuse to vote for anyone else for
+ * an election timeout after hearing from their leader, so until then minus
+ * a margin for clock drift (the lease) no other leader can exist, and reads
+ * are served from local storage once it has applied the commit index. With
+ * the lease expired a read is a ReadIndex instead: it waits for a quorum to
+ * acknowledge a heartbeat sent after the read arrived.
+ *
+ * A follower whose next entry is no longer in raft_log, or that is too far
+ * behind for replaying the log to make sense, is sent a snapshot of the
+ * tables instead. The leader builds it on a helper thread and streams its
+ * files in chunks, paced to a configured rate and with a bounded number of
+ * bytes in flight, so AppendEntries to the other followers keep flowing.
+ * The follower writes the chunks out and hands the finished snapshot to
+ * Storage::InstallSnapshot(); its log then starts right after it.
+ *
+ * Outbound connections: lower-numbered servers dial higher-numbered ones.
+ * The dial happens on the raft thread; once connected the socket is handed
+ * to the transport, which says hello and reports back via PeerConnected().
+ */
+class Raft {
+public:
+    Raft(ServerConfig const& config, Storage& storage, RaftTransport& transport);
+    ~Raft(void);
+
+    void Start(void);
+    void Shutdown(void);
+
+    // Thread-safe. The peer's connection (re)appeared or went away.
+    void PeerConnected(uint32_t peer_id, PeerRoute const& route);
+    void PeerDisconnected(uint32_t peer_id, PeerRoute const& route);
+
+    // Thread-safe. `body` is a RAFT_* message, without its type and length.
+    void Receive(uint32_t peer_id, uint32_t message_type, std::string body);
+
+    enum class ProposeResult {
+        COMMITTED,
+        NOT_APPENDED,     // never made it into the log, so it will never commit
+        OUTCOME_UNKNOWN,  // leadership was lost first; a later leader may still commit it
+    };
+
+    /*
+     * Thread-safe. Appends an encoded transaction to the log if this server
+     * is the leader. `done` runs on the raft thread once the entry's fate is
+     * settled, or as far as this server can tell.
+     */
+    void Propose(std::string transaction, std::function<void(ProposeResult)> done);
+
+    /*
+     * Thread-safe. Linearizable read barrier: `done(true)` runs once local
+     * storage reflects every write committed before the call, false if this
+     * server isn't the leader or stops being it first. Under a valid lease
+     * this costs no more than waiting for the apply thread (if anything);
+     * `done` runs on the calling thread, the raft thread or the apply thread.
+     */
+    void Read(std::function<void(bool)> done);
+
+    /*
+     * Thread-safe. Bounded-staleness read barrier that followers serve too:
+     * `done(true)` runs once local storage reflects everything the leader
+     * had committed when we last heard from it, provided that was at most
+     * `max_staleness_ms` ago by our clock; otherwise done(false) right away.
+     * On the leader this is just a Read(). Reads that instead need a given
+     * table transaction go straight to Storage::WhenTableApplied().
+     */
+    void StaleRead(uint64_t max_staleness_ms, std::function<void(bool)> done);
+
+    // Thread-safe. A hint; leadership may already have moved on.
+    bool IsLeader(void) const noexcept;
+
+    // Delete copy constructor and copy assignment operator
+    Raft(Raft const&) = delete;
+    Raft& operator=(Raft const&) = delete;
+
+private:
+    enum class Role {
+        FOLLOWER,
+        CANDIDATE,
+        LEADER,
+    };
+
+    enum class DialState {
+        IDLE,
+        CONNECTING,
+        CONNECTED,
+    };
+
+    enum class SnapshotState {
+        NONE,
+        WAITING,  // for a usable snapshot to be built
+        SENDING,
+    };
+
+    struct Event {
+        enum Type {
+            CONNECTED,
+            DISCONNECTED,
+            MESSAGE,
+            PROPOSAL,
+            READ,
+            SNAPSHOT_BUILT,
+            SNAPSHOT_INSTALLED,
+        };
+
+        Type type;
+        uint32_t peer_id;
+        PeerRoute route;
+        uint32_t message_type;
+        std::string data;
+        std::function<void(bool)> done;
+        std::function<void(ProposeResult)> proposed;
+    };
+
+    struct Peer {
+        uint32_t id;
+        bool connected;
+        PeerRoute route;
+        std::string outbox;  // frames to hand to the transport at the end of this iteration
+
+        // Outbound connection (only for peers with a higher id)
+        DialState dial_state;
+        int dial_fd;
+        uint64_t redial_at;
+
+        // Leader state
+        uint64_t next_index;
+        uint64_t match_index;
+        bool probing;
+        bool probe_outstanding;
+        uint64_t last_sent_at;
+        uint64_t acked_sent_at;  // nanoseconds: send time of the latest message answered this term
+
+        // Leader state while catching up with a snapshot; positions are byte
+        // offsets into the snapshot's files laid end to end.
+        SnapshotState snapshot_state;
+        bool snapshot_probing;  // waiting to hear where the follower is before sending data
+        uint64_t snapshot_sent;
+        uint64_t snapshot_acked;
+        uint64_t snapshot_last_sent_at;  // nanoseconds: send time of the latest chunk
+
+        // Candidate state
+        bool vote_granted;
+    };
+
+    struct Proposal {
+        uint64_t index;
+        std::function<void(ProposeResult)> done;
+    };
+
+    struct DeferredReply {
+        uint32_t peer_id;
+        uint64_t prev_index;
+        uint64_t match_index;
+        uint64_t sent_at;
+    };
+
+    struct PendingRead {
+        uint64_t arrived_at;  // nanoseconds
+        std::function<void(bool)> done;
+    };
+
+    struct OutgoingSnapshot {
+        bool ready;
+        std::string dir;
+        SnapshotInfo info;
+        std::vector<int> fds;
+        std::vector<uint64_t> offsets;  // where each file starts; the last one is the total size
+    };
+
+    struct IncomingSnapshot {
+        std::string dir;
+        SnapshotInfo info;  // index 0 when there's none
+        uint32_t file_count;
+        uint32_t file;      // position of the next byte expected
+        uint64_t offset;
+        int fd;
+        bool installing;
+        uint32_t leader_id;
+    };
+
+    ServerConfig const& config;
+    Storage& storage;
+    RaftTransport& transport;
+    uint32_t id;
+    size_t quorum;
+    std::map<uint32_t, Peer> peers;
+
+    Poller poller;
+    UnboundedBlockingQueue<Event> events;
+    pthread_t thread;
+    bool started;
+    std::atomic<bool> is_leader;
+    std::mt19937_64 random;
+
+    // Persistent state (mirrored in kiwi_db_metadata)
+    uint64_t current_term;
+    uint32_t voted_for;  // 0 for nobody; the config rejects 0 as a server id
+
+    // Volatile state
+    Role role;
+    uint32_t leader_id;
+    uint64_t last_log_index;
+    uint64_t last_log_term;
+    uint64_t commit_index;
+    uint64_t election_deadline;
+    uint64_t last_leader_contact;
+    size_t votes;
+
+    /*
+     * Recently appended entries, kept so that replicating them to followers
+     * doesn't have to read them back from raft_log. Covers
+     * [cache_first_index, last_log_index] and is trimmed from the front.
+     */
+    std::deque<LogEntry> cache;
+    uint64_t cache_first_index;
+    size_t cache_bytes;
+
+    /*
+     * Group commit: appends are staged in storage as they arrive, from
+     * proposals and AppendEntries alike, and synced together once the batch
+     * window has passed or the batch is full. Entries past durable_index
+     * don't count towards anything until then.
+     */
+    uint64_t durable_index;
+    uint64_t known_commit_index;  // follower: committed according to the leader, maybe not yet durable here
+    uint64_t batch_window;
+    size_t batch_max_size;
+    uint64_t batch_deadline;
+    bool replicate_pending;                    // leader: staged entries not yet offered to followers
+    std::vector<DeferredReply> deferred_replies;
+    std::deque<Proposal> pending_proposals;   // leader: waiting to commit, in index order
+
+    /*
+     * Leader reads. lease_read_index is the commit index, published once an
+     * entry from the current term has committed (0 until then, and whenever
+     * we aren't leader); lease_expires_at is in nanoseconds. Stepping down
+     * clears the index before the lease, and Read() loads them the other
+     * way around, so it never pairs a fresh lease with a stale index.
+     */
+    std::atomic<uint64_t> lease_expires_at;
+    std::atomic<uint64_t> lease_read_index;
+    uint64_t quorum_acked_at;                 // leader: quorum-th latest acked_sent_at, counting ourselves
+
+    // Snapshots
+    std::string snapshot_dir;
+    uint64_t snapshot_rate;            // bytes per second, across all followers
+    uint64_t snapshot_next_send_at;    // leader: pacing for the next chunk
+    uint64_t snapshot_build_after;     // leader: retry delay after a failed build
+    bool snapshot_building;
+    pthread_t snapshot_thread;
+    SnapshotInfo built_snapshot;       // filled in by the helper thread
+    bool built_snapshot_ok;
+    uint64_t next_snapshot_id;
+    OutgoingSnapshot outgoing;
+    IncomingSnapshot incoming;
+    uint64_t log_base_index;           // the entry just before raft_log's first one
+    uint64_t log_base_term;
+
+    // Follower reads: the leader's commit index as of our last contact with it
+    // (nanoseconds), published in that order and loaded the other way around.
+    std::atomic<uint64_t> leader_contact_at;
+    std::atomic<uint64_t> leader_contact_commit_index;
+    bool heartbeat_pending;                   // leader: a read is waiting for a heartbeat round
+    std::deque<PendingRead> pending_reads;    // leader: waiting for quorum_acked_at to pass arrived_at
+
+    static void* ThreadWrapper(void* ptr);
+    void ThreadMain(void);
+    int NextTimeout(uint64_t now);
+    void DrainEvents(uint64_t now);
+    void HandleMessage(uint32_t peer_id, uint32_t message_type, std::string const& body, uint64_t now);
+    void HandlePropose(std::string& transaction, std::function<void(ProposeResult)>& done, uint64_t now);
+    void HandleRead(std::function<void(bool)>& done);
+    void Tick(uint64_t now);
+
+    // Elections
+    void ResetElectionDeadline(uint64_t now);
+    void StartElection(uint64_t now);
+    void BecomeFollower(uint64_t term, uint32_t leader);
+    void BecomeLeader(uint64_t now);
+    void HandleRequestVote(Peer& peer, FrameReader& reader, uint64_t now);
+    void HandleRequestVoteReply(Peer& peer, FrameReader& reader, uint64_t now);
+
+    // Replication
+    void HandleAppendEntries(Peer& peer, FrameReader& reader, uint64_t now);
+    void HandleAppendEntriesReply(Peer& peer, FrameReader& reader, uint64_t now);
+    void SyncLog(void);
+    void Replicate(Peer& peer, uint64_t now, bool heartbeat);
+    size_t SendAppendEntries(Peer& peer, uint64_t now);
+    void AdvanceCommitIndex(void);
+    void Commit(uint64_t index);
+    void FailPendingProposals(void);
+
+    // Snapshots
+    bool NeedsSnapshot(Peer const& peer) const;
+    bool SnapshotUsable(Peer const& peer) const;
+    void MaybeBuildSnapshot(uint64_t now);
+    static void* SnapshotThreadWrapper(void* ptr);
+    void HandleSnapshotBuilt(uint64_t now);
+    void DiscardOutgoingSnapshot(void);
+    void SendSnapshot(Peer& peer, uint64_t now, bool keepalive);
+    size_t SendSnapshotChunk(Peer& peer, size_t max_bytes, uint64_t now);
+    void HandleInstallSnapshot(Peer& peer, FrameReader& reader);
+    void HandleInstallSnapshotReply(Peer& peer, FrameReader& reader, uint64_t now);
+    void HandleSnapshotInstalled(void);
+    void DiscardIncomingSnapshot(void);
+    void SendInstallSnapshotReply(Peer& peer, uint64_t sent_at, uint64_t index, bool installed);
+
+    // Reads
+    void UpdateLease(void);
+    void ReleaseReads(void);
+    void FailPendingReads(void);
+
+    // Log access
+    void AppendEntry(LogEntry& entry, uint64_t now);
+    void TruncateSuffix(uint64_t index);
+    uint64_t TermAt(uint64_t index);
+
+    // Peer connections
+    void Dial(Peer& peer, uint64_t now);
+    void FinishDial(Peer& peer, uint64_t now);
+    void AbandonDial(Peer& peer, uint64_t now);
+    char* ReserveFrame(Peer& peer, uint32_t message_type, size_t body_length);
+    void SendHeartbeat(Peer& peer, uint64_t now);
+    void SendAppendEntriesReply(Peer& peer, bool success, uint64_t prev_index, uint64_t last_index, uint64_t sent_at);
+    void SendRequestVote(Peer& peer);
+    void FlushOutboxes(void);
+};
+
+#endif  // KIWI_RAFT_H_
@@ -1,91 +1,139 @@
-#include "common/config.h"
-#if defined(HAVE_EPOLL)
-    #include <sys/epoll.h>
-#elif defined(HAVE_KQUEUE)
-    #include <sys/event.h>
-#endif
-
+#include <algorithm>
 #include <errno.h>
-#include <iostream>
+#include <string.h>
 #include <unistd.h>
 
+#include "common/buffer_pool.h"
+#include "common/constants.h"
 #include "common/exceptions.h"
-#include "common/socket.h"
+#include "common/logger.h"
 #include "server.h"
 
 
 using namespace std;
 
-enum KqueueUserEventID {
+enum UserEventID {
     kSHUTDOWN = 1,
     kMESSAGE = 2,
 };
 
+// Scan chunks are cut once they hold this much, and a connection's scans
+// get this many chunks per turn before other connections are served.
+static const size_t kScanChunkBytes = 64 * 1024;
+static const size_t kScanChunksPerTurn = 16;
+
+// Subscription batches are cut at whichever of these comes first. A
+// subscription may hold at most kMaxSubscribeCredits unused credits (asking
+// for more ends it), and is sent this many batches per turn before other
+// connections are served.
+static const size_t kSubscribeBatchBytes = 64 * 1024;
+static const size_t kSubscribeBatchEntries = 1024;
+static const uint32_t kMaxSubscribeCredits = 256;
+static const size_t kSubscribeBatchesPerTurn = 16;
+
+// A read waiting for its Min Table Trx ID to be applied gives up after this
+// long and answers Not Leader.
+static const uint32_t kReadWaitMillis = 5000;
+
+// The io thread running on this thread, if any.
+static thread_local void const* current_io_thread = nullptr;
+
+#if defined(HAVE_LIBURING)
+static const unsigned kIOUringEntries = 4096;
+static const unsigned kIOUringBuffers = 1024;
+static const unsigned kIOUringBufferSize = 16 * 1024;
+#endif
+
 Server::Server(ServerConfig const& config, Storage& storage) :
         config(config),
         storage(storage),
-        connections() {
-
-    kq = kqueue();
-    if (kq == -1) {
-        throw ServerException("Error creating kqueue: " + string(strerror(errno)));
-    }
+        raft(nullptr),
+        io_threads() {
 
+    raft = new Raft(config, storage, *this);
     try {
-        int err = pthread_create(&thread, nullptr, ThreadWrapper, this);
-        if (err != 0) {
-            throw ServerException("Error creating server thread: " + string(strerror(err)));
+        // Bind every listen socket before starting any thread so that a bad
+        // bind address is reported to the caller rather than crashing a thread.
+        for (size_t i = 0; i < config.IOThreads(); i++) {
+            io_threads.push_back(nullptr);
+            io_threads.back() = new IOThread(config, storage, *raft, i);
+        }
+
+        for (IOThread* io_thread : io_threads) {
+            io_thread->Start();
         }
 
+        // Raft hands peer connections to the io threads, so it goes last.
+        raft->Start();
+
     } catch (...) {
-        IOUtils::Close(kq);
+        raft->Shutdown();
+        for (IOThread* io_thread : io_threads) {
+            if (io_thread != nullptr) {
+                io_thread->Shutdown();
+            }
+        }
+        for (IOThread* io_thread : io_threads) {
+            delete io_thread;
+        }
+        delete raft;
         throw;
     }
 }
 
 
-void* Server::ThreadWrapper(void* ptr) {
-    Server* server = static_cast<Server*>(ptr);
-    try {
-        server->ThreadMain();
-    } catch (exception const& e) {
-        cerr << "Server thread crashed: " << e.what() << endl;
-        abort();
-    } catch (...) {
-        cerr << "Server thread crashed" << endl;
-        abort();
+Server::~Server(void) {
+    // Raft goes first so that it no longer sends through the io threads; the
+    // io threads may still report to it until they're gone, which is harmless.
+    raft->Shutdown();
+
+    // Signal every thread first so that they wind down in parallel.
+    for (IOThread* io_thread : io_threads) {
+        io_thread->Shutdown();
     }
-    return nullptr;
+    for (IOThread* io_thread : io_threads) {
+        io_thread->Join();
+    }
+
+    // Storage outlives us and may keep applying; nothing it still has
+    // waiting (reads, subscriptions) may call back into a deleted io thread.
+    storage.DropWaiters();
+    for (IOThread* io_thread : io_threads) {
+        delete io_thread;
+    }
+    delete raft;
 }
 
 
-void Server::AddEventInterest(int ident, short filter, void* data) {
-    struct kevent event;
-    EV_SET(&event, ident, filter, EV_ADD, 0, 0, data);
+void Server::AdoptPeerConnection(uint32_t peer_id, int fd) {
+    io_threads[peer_id % io_threads.size()]->AdoptPeerConnection(peer_id, fd);
+}
 
-    int err = kevent(kq, &event, 1, nullptr, 0, nullptr);
-    if (err == -1) {
-        throw IOException("Error adding (ident,filter) pair to kqueue: " + string(strerror(errno)));
-    }
 
-    if (event.flags & EV_ERROR) {
-        throw IOException("Error adding (ident,filter) pair to kqueue: " + string(strerror(event.data)));
-    }
+void Server::SendToPeer(uint32_t peer_id, PeerRoute const& route, string frames) {
+    io_threads[route.io_thread]->SendToPeer(peer_id, route.generation, move(frames));
 }
 
 
-void Server::RemoveEventInterest(int ident, short filter) {
-    struct kevent event;
-    EV_SET(&event, ident, filter, EV_DELETE, 0, 0, nullptr);
+static Transaction SingleActionTransaction(uint64_t database_id, Action action) {
+    Transaction transaction;
+    transaction.batches.emplace_back();
+    transaction.batches.back().databases.push_back(DatabaseActions{database_id, {move(action)}});
+    return transaction;
+}
 
-    int err = kevent(kq, &event, 1, nullptr, 0, nullptr);
-    if (err == -1) {
-        throw IOException("Error removing (ident,filter) pair from kqueue: " + string(strerror(errno)));
-    }
 
-    if (event.flags & EV_ERROR) {
-        throw IOException("Error removing (ident,filter) pair from kqueue: " + string(strerror(event.data)));
+// Not Leader only when the write is certain never to be applied.
+static Protocol::ErrorCode ProposeErrorCode(Raft::ProposeResult result) {
+    switch (result) {
+        case Raft::ProposeResult::COMMITTED:
+            return Protocol::ErrorCode::OK;
+        case Raft::ProposeResult::NOT_APPENDED:
+            return Protocol::ErrorCode::NOT_LEADER;
+        case Raft::ProposeResult::OUTCOME_UNKNOWN:
+            return Protocol::ErrorCode::OUTCOME_UNKNOWN;
     }
+    return Protocol::ErrorCode::OUTCOME_UNKNOWN;
 }
 
 
@@ -95,6 +143,7 @@ static Socket CreateListenSocket(IOUtils::AutoCloseableAddrInfo& addrs) {
 
         Socket socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
         socket.SetReuseAddr(true);
+        socket.SetReusePort(true);
         if (socket.Bind(addr->ai_addr, addr->ai_addrlen) == -1) {
             throw IOException("Problem calling bind(2): " + string(strerror(errno)));
         }
@@ -108,9 +157,7 @@ static Socket CreateListenSocket(IOUtils::AutoCloseableAddrInfo& addrs) {
 }
 
 
-void Server::ThreadMain(void) {
-
-    auto hosts = config.Hosts();
+static Socket CreateListenSocket(ServerConfig const& config) {
     auto bind_address = config.BindAddress();
     auto use_ipv4 = config.UseIPV4();
     auto use_ipv6 = config.UseIPV6();
@@ -133,495 +180,1782 @@ void Server::ThreadMain(void) {
 
     IOUtils::AutoCloseableAddrInfo addrs(bind_address, hints);
     Socket listen_socket = CreateListenSocket(addrs);
-
     listen_socket.SetNonBlocking(true);
-    AddEventInterest(listen_socket.GetFD(), EVFILT_READ, nullptr);
-
-    // Start connection attempts for all higher-numbered peers
+    return listen_socket;
+}
 
-    bool shutdown = false;
-    while (!shutdown) { // We may want to relax this a bit and allow more graceful termination rather than immediately breaking from the loop.
-        struct kevent events[64];
-        int num_events = kevent(kq, nullptr, 0, events, sizeof(events) / sizeof(events[0]), nullptr);
-        if (num_events == -1) {
-            cerr << "Problem querying ready events from kqueue: " << strerror(errno) << endl;
-            abort();
-        }
 
-        for (int i = 0; i < num_events; i++) {
-            struct kevent* event = &events[i];
-            if (event->filter == EVFILT_USER) {
-                KqueueUserEventID event_id = static_cast<KqueueUserEventID>(event->ident);
-                switch (event_id) {
-                    case kSHUTDOWN:
-                        shutdown = true;
-                        break;
-
-                    case kMESSAGE:
-                        break;
-
-                    default:
-                        cerr << "Unknown event id: " << event_id << endl;
-                        abort();
-                }
-            } else {
-                int ready_fd = event->ident;
-                if (ready_fd == listen_socket.GetFD()) {
-                    /*
-                     * Accept up to 64 connections before looping again. This ensures that we don't live-lock
-                     * during shutdown.
-                     */
-                    for (int i = 0; i < 64; i++) {
-                        struct sockaddr_storage sockaddr;
-                        socklen_t address_len = sizeof(sockaddr);
-                        int fd = accept(listen_socket.GetFD(), (struct sockaddr *)&sockaddr, &address_len);
-                        if (fd == -1) {
-                            if (errno == EINTR) {
-                                continue;
-                            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                                /* try poll()ing again */
-                                break;
-                            } else {
-                                cerr << "Problem accepting connection: " << strerror(errno) << endl;
-                                break;
-                            }
-                        } else {
-                            try {
-                                Connection* connection = new Connection(fd);
-                                try {
-                                    connections.insert(connection);
-                                } catch (...) {
-                                    delete connection;
-                                }
-
-                                try {
-                                    SetReadInterest(connection, true);
-                                } catch (...) {
-                                    connections.erase(connection);
-                                    delete connection;
-                                }
-
-                            } catch (...) {
-                                IOUtils::Close(fd);
-                                throw;
-                            }
-                        }
-                    }
-                } else {
-                    Connection* connection = static_cast<Connection*>(event->udata);
-                    switch (event->filter) {
-                        case EVFILT_READ:
-                            RecvData(connection);
-                            break;
-                        
-                        case EVFILT_WRITE:
-                            SendData(connection);
-                            break;
-
-                        default:
-                            cerr << "Unexpected event filter: " << event->filter << endl;
-                            abort();
-                    }
-                }
-            }
-        }
+Server::IOThread::IOThread(ServerConfig const& config, Storage& storage, Raft& raft, size_t id) :
+        config(config),
+        storage(storage),
+        raft(raft),
+        id(id),
+        listen_socket(CreateListenSocket(config)),
+        poller(),
+        tasks(poller, kMESSAGE),
+        started(false),
+        connections(),
+        closed_connections(),
+        peer_connections(),
+        next_peer_generation(0),
+        client_connections(),
+        next_client_generation(0),
+        scan_chunk(),
+        next_subscription_serial(0) {
+
+#if defined(HAVE_LIBURING)
+    uring = nullptr;
+    try {
+        uring = new IOUringEngine(kIOUringEntries, kIOUringBuffers, kIOUringBufferSize);
+        return;
+    } catch (IOException const& e) {
+        KIWI_LOG_WARN("io_uring unavailable, falling back to the poller: " << e.what());
     }
+#endif
 
-    for (Connection* connection : connections) {
-        // Deleting the BufferedNetworkStream will close the underlying fd, which internally will
-        // also remove it from the kqueue (whereas with epoll, closing the underlying fd leaves the fd
-        // still a member of any epoll fds to which it was added).
-        delete connection;
+    poller.Add(listen_socket.GetFD(), Poller::Interest::READ, nullptr);
+}
+
+
+void Server::IOThread::Start(void) {
+    int err = pthread_create(&thread, nullptr, ThreadWrapper, this);
+    if (err != 0) {
+        throw ServerException("Error creating server thread: " + string(strerror(err)));
     }
+    started = true;
 }
 
 
-void Server::RecvData(Connection* connection) {
-    for (;;) {
-        uint32_t incoming_message_type_int;
-        uint32_t incoming_magic_number;
-        uint32_t incoming_protocol_version;
-        uint32_t incoming_cluster_name_length;
-        string incoming_cluster_name;
-        switch (connection->read_state) {
-            case Connection::ReadState::READING_MESSAGE_TYPE:
-                cout << "READING_MESSAGE_TYPE" << endl;
-                switch (connection->socket.Fill(connection->incoming_message_type_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_message_type_buffer.Flip();
-                        incoming_message_type_int = connection->incoming_message_type_buffer.UnsafeGetInt();
-                        connection->incoming_message_type_buffer.Clear();
-                        switch (incoming_message_type_int) {
-                            case Protocol::MessageType::CLIENT_HELLO:
-                                connection->read_state = Connection::ReadState::READING_CLIENT_HELLO_MAGIC_NUMBER;
-                                break;
-
-                            case Protocol::MessageType::CLIENT_TEST:
-                                connection->read_state = Connection::ReadState::READING_MESSAGE_TYPE;
-                                break;
-
-                            case Protocol::MessageType::SERVER_HELLO:
-                                connection->read_state = Connection::ReadState::READING_SERVER_HELLO_MAGIC_NUMBER;
-                                break;
-
-                            default:
-                                CloseAndDestroy(connection);
-                                return;
-                        }
-                        break;
+void Server::IOThread::Shutdown(void) {
+    poller.Trigger(kSHUTDOWN);
+}
 
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
 
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
+void Server::IOThread::Post(function<void(void)> task) {
+    tasks.Enqueue(move(task));
+}
 
-            case Connection::ReadState::READING_CLIENT_HELLO_MAGIC_NUMBER:
-                cout << "READING_CLIENT_HELLO_MAGIC_NUMBER" << endl;
-                switch (connection->socket.Fill(connection->incoming_magic_number_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_magic_number_buffer.Flip();
-                        incoming_magic_number = connection->incoming_magic_number_buffer.UnsafeGetInt();
-                        connection->incoming_magic_number_buffer.Clear();
-                        if (incoming_magic_number == Protocol::MAGIC_NUMBER) {
-                            connection->read_state = Connection::ReadState::READING_CLIENT_HELLO_PROTOCOL_VERSION;
-                        } else {
-                            StopReadingAndSendErrorReplyAndClose(
-                                connection,
-                                Protocol::ErrorCode::INVALID_MAGIC_NUMBER,
-                                Protocol::InvalidMagicNumberErrorMessage(incoming_magic_number));
-                        }
-                        break;
 
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
+void Server::IOThread::AdoptPeerConnection(uint32_t peer_id, int fd) {
+    Post([this, peer_id, fd](void) {
+        Connection* connection = AddConnection(fd);
+        RegisterPeer(connection, peer_id);
 
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
+        // Raft messages may be pipelined right behind the hello.
+        SendServerHello(connection);
+        SendData(connection);
+    });
+}
 
-            case Connection::ReadState::READING_CLIENT_HELLO_PROTOCOL_VERSION:
-                cout << "READING_CLIENT_HELLO_PROTOCOL_VERSION" << endl;
-                switch (connection->socket.Fill(connection->incoming_protocol_version_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_protocol_version_buffer.Flip();
-                        incoming_protocol_version = connection->incoming_protocol_version_buffer.UnsafeGetInt();
-                        connection->incoming_protocol_version_buffer.Clear();
-                        if (incoming_protocol_version == Protocol::PROTOCOL_VERSION) {
-                            connection->read_state = Connection::ReadState::READING_MESSAGE_TYPE;
-                            SendClientHelloReply(connection);
-                        } else {
-                            StopReadingAndSendErrorReplyAndClose(
-                                connection,
-                                Protocol::ErrorCode::UNSUPPORTED_PROTOCOL_VERSION,
-                                Protocol::UnsupportedProtocolVersionErrorMessage(incoming_protocol_version));
-                        }
-                        break;
 
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
+void Server::IOThread::SendToPeer(uint32_t peer_id, uint64_t generation, string frames) {
+    Post([this, peer_id, generation, frames = move(frames)](void) {
+        auto it = peer_connections.find(peer_id);
+        if (it == peer_connections.end() || it->second->peer_generation != generation) {
+            return;
+        }
 
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
+        Connection* connection = it->second;
+        memcpy(connection->socket.ReserveWrite(frames.length()), frames.data(), frames.length());
+        if (!connection->interested_in_writes) {
+            SendData(connection);
+        }
+    });
+}
 
-            case Connection::ReadState::READING_SERVER_HELLO_MAGIC_NUMBER:
-                cout << "READING_SERVER_HELLO_MAGIC_NUMBER" << endl;
-                switch (connection->socket.Fill(connection->incoming_magic_number_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_magic_number_buffer.Flip();
-                        incoming_magic_number = connection->incoming_magic_number_buffer.UnsafeGetInt();
-                        connection->incoming_magic_number_buffer.Clear();
-                        if (incoming_magic_number == Protocol::MAGIC_NUMBER) {
-                            connection->read_state = Connection::ReadState::READING_SERVER_HELLO_PROTOCOL_VERSION;
-                        } else {
-                            StopReadingAndSendErrorReplyAndClose(
-                                connection,
-                                Protocol::ErrorCode::INVALID_MAGIC_NUMBER,
-                                Protocol::InvalidMagicNumberErrorMessage(incoming_magic_number));
-                        }
-                        break;
 
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
+void Server::IOThread::Join(void) {
+    if (started) {
+        int err = pthread_join(thread, nullptr);
+        if (err != 0) {
+            KIWI_LOG_FATAL("Problem joining server thread: " << strerror(err));
+            abort();
+        }
+        started = false;
+    }
+}
 
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
 
-            case Connection::ReadState::READING_SERVER_HELLO_PROTOCOL_VERSION:
-                cout << "READING_SERVER_HELLO_PROTOCOL_VERSION" << endl;
-                switch (connection->socket.Fill(connection->incoming_protocol_version_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_protocol_version_buffer.Flip();
-                        incoming_protocol_version = connection->incoming_protocol_version_buffer.UnsafeGetInt();
-                        connection->incoming_protocol_version_buffer.Clear();
-                        if (incoming_protocol_version == Protocol::PROTOCOL_VERSION) {
-                            connection->read_state = Connection::ReadState::READING_SERVER_HELLO_SERVER_ID;
-                        } else {
-                            StopReadingAndSendErrorReplyAndClose(
-                                connection,
-                                Protocol::ErrorCode::UNSUPPORTED_PROTOCOL_VERSION,
-                                Protocol::UnsupportedProtocolVersionErrorMessage(incoming_protocol_version));
-                        }
-                        break;
+Server::IOThread::~IOThread(void) {
+    Join();
 
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
+#if defined(HAVE_LIBURING)
+    // Tear down the ring first: it cancels every in-flight operation, some of
+    // which may still reference connection buffers.
+    delete uring;
+#endif
 
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
+    for (Connection* connection : connections) {
+        // Deleting the Connection closes the underlying fd, which also removes it from the
+        // poller (both epoll and kqueue drop registrations once the last reference to the
+        // file description goes away; we never dup() these fds).
+        delete connection;
+    }
+}
 
-            case Connection::ReadState::READING_SERVER_HELLO_SERVER_ID:
-                cout << "READING_SERVER_HELLO_SERVER_ID" << endl;
-                switch (connection->socket.Fill(connection->incoming_server_id_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_server_id_buffer.Flip();
-                        connection->server_id = connection->incoming_server_id_buffer.UnsafeGetInt();
-                        connection->incoming_server_id_buffer.Clear();
-                        connection->read_state = Connection::ReadState::READING_SERVER_HELLO_CLUSTER_NAME_LENGTH;
-                        break;
-
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
-
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
 
-            case Connection::ReadState::READING_SERVER_HELLO_CLUSTER_NAME_LENGTH:
-                cout << "READING_SERVER_HELLO_CLUSTER_NAME_LENGTH" << endl;
-                switch (connection->socket.Fill(connection->incoming_cluster_name_length_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_cluster_name_length_buffer.Flip();
-                        incoming_cluster_name_length = connection->incoming_cluster_name_length_buffer.UnsafeGetShort();
-                        connection->incoming_cluster_name_buffer.ResetAndGrow(incoming_cluster_name_length);
-                        connection->read_state = Connection::ReadState::READING_SERVER_HELLO_CLUSTER_NAME;
-                        break;
-
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
-
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
+void* Server::IOThread::ThreadWrapper(void* ptr) {
+    IOThread* io_thread = static_cast<IOThread*>(ptr);
+    try {
+        io_thread->ThreadMain();
+
+        BufferPool::Statistics statistics = BufferPool::GetStatistics();
+        KIWI_LOG_DEBUG("io thread " << io_thread->id << " buffer pool: "
+            << statistics.allocations << " allocations, "
+            << statistics.hits << " hits, "
+            << statistics.misses << " misses, "
+            << statistics.oversized << " oversized, "
+            << statistics.trims << " trims, "
+            << statistics.peak_cached_bytes << " peak cached bytes");
+    } catch (exception const& e) {
+        KIWI_LOG_FATAL("Server thread crashed: " << e.what());
+        abort();
+    } catch (...) {
+        KIWI_LOG_FATAL("Server thread crashed");
+        abort();
+    }
+    return nullptr;
+}
 
-            case Connection::ReadState::READING_SERVER_HELLO_CLUSTER_NAME:
-                cout << "READING_SERVER_HELLO_CLUSTER_NAME" << endl;
-                switch (connection->socket.Fill(connection->incoming_cluster_name_buffer)) {
-                    case BufferedSocket::RecvStatus::complete:
-                        connection->incoming_cluster_name_buffer.Flip();
-                        incoming_cluster_name = connection->incoming_cluster_name_buffer.UnsafeGetString(connection->incoming_cluster_name_buffer.Limit());
-                        connection->incoming_cluster_name_buffer.Clear();
-                        if (incoming_cluster_name.compare(config.ClusterName()) == 0) {
-                            connection->read_state = Connection::ReadState::READING_MESSAGE_TYPE;
-                        } else {
-                            StopReadingAndSendErrorReplyAndClose(
-                                connection,
-                                Protocol::ErrorCode::CLUSTER_NAME_MISMATCH,
-                                Protocol::ClusterNameMismatchErrorMessage());
-                        }
-                        break;
 
-                    case BufferedSocket::RecvStatus::incomplete:
-                        return;
+void Server::IOThread::PinToCPU(void) {
+#if defined(__linux__)
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus <= 0) {
+        return;
+    }
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(id % num_cpus, &cpu_set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (err != 0) {
+        KIWI_LOG_WARN("Problem pinning io thread " << id << " to cpu " << (id % num_cpus) << ": " << strerror(err));
+    }
+#else
+    KIWI_LOG_WARN("Pinning io threads to cpus is not supported on this platform");
+#endif
+}
 
-                    case BufferedSocket::RecvStatus::closed:
-                        CloseAndDestroy(connection);
-                        return;
-                }
-                break;
 
-            case Connection::ReadState::TERMINAL:
-                cout << "TERMINAL" << endl;
-                return;
+void Server::IOThread::ThreadMain(void) {
+    current_io_thread = this;
+    if (config.PinIOThreads()) {
+        PinToCPU();
+    }
+
+#if defined(HAVE_LIBURING)
+    if (uring != nullptr) {
+        RunCompletionLoop();
+        return;
+    }
+#endif
+    RunReadinessLoop();
+}
+
+
+void Server::IOThread::RunReadinessLoop(void) {
+    bool shutdown = false;
+    while (!shutdown) { // We may want to relax this a bit and allow more graceful termination rather than immediately breaking from the loop.
+        Poller::Event events[64];
+        int num_events = poller.Wait(events, sizeof(events) / sizeof(events[0]), -1);
 
-            default:
-                cerr << "Unknown read state: " << static_cast<int>(connection->read_state) << endl;
-                abort();
+        for (int i = 0; i < num_events; i++) {
+            Poller::Event* event = &events[i];
+            if (event->user) {
+                HandleUserEvent(event->user_event, &shutdown);
+            } else if (event->data == nullptr) {
+                AcceptConnections();
+            } else {
+                /*
+                 * Connections are registered edge-triggered, so a single event may report both
+                 * readability and writability. Either handler may close the connection; closed
+                 * connections are only destroyed once the whole batch has been processed so that
+                 * later events in this batch never observe a dangling pointer.
+                 */
+                Connection* connection = static_cast<Connection*>(event->data);
+                if (event->readable && !connection->closed) {
+                    RecvData(connection);
+                }
+                if (event->writable && !connection->closed && connection->interested_in_writes) {
+                    SendData(connection);
+                }
+            }
         }
+
+        DestroyClosedConnections();
     }
 }
 
 
-void Server::SendClientHelloReply(Connection* connection) {
-    Buffer& client_hello_reply_buffer = connection->outgoing_buffers.emplace_back(4);
-    client_hello_reply_buffer.UnsafePutInt(Protocol::MessageType::CLIENT_HELLO_REPLY);
-    client_hello_reply_buffer.Flip();
-    SetWriteInterest(connection, true);
+void Server::IOThread::HandleUserEvent(uint32_t user_event, bool* shutdown) {
+    UserEventID event_id = static_cast<UserEventID>(user_event);
+    switch (event_id) {
+        case kSHUTDOWN:
+            *shutdown = true;
+            break;
+
+        case kMESSAGE:
+            RunPostedTasks();
+            break;
+
+        default:
+            KIWI_LOG_FATAL("Unknown event id: " << event_id);
+            abort();
+    }
 }
 
 
-void Server::SendClientTestReply(Connection* connection) {
-    Buffer& client_test_reply_buffer = connection->outgoing_buffers.emplace_back(4);
-    client_test_reply_buffer.UnsafePutInt(Protocol::MessageType::CLIENT_TEST_REPLY);
-    client_test_reply_buffer.Flip();
-    SetWriteInterest(connection, true);
+void Server::IOThread::RunPostedTasks(void) {
+    // The queue only rings again once we've seen it empty.
+    function<void(void)> task;
+    while (tasks.TryDequeue(&task)) {
+        task();
+    }
 }
 
 
-void Server::SendServerHelloReply(Connection* connection) {
-    Buffer& server_hello_reply_buffer = connection->outgoing_buffers.emplace_back(4);
-    server_hello_reply_buffer.UnsafePutInt(Protocol::MessageType::SERVER_HELLO_REPLY);
-    server_hello_reply_buffer.Flip();
-    SetWriteInterest(connection, true);
+void Server::IOThread::AcceptConnections(void) {
+    /*
+     * Accept up to 64 connections before looping again. This ensures that we don't live-lock
+     * during shutdown. The listen socket is level-triggered, so anything left in the backlog
+     * is reported again on the next iteration.
+     */
+    for (int i = 0; i < 64; i++) {
+        struct sockaddr_storage sockaddr;
+        socklen_t address_len = sizeof(sockaddr);
+        int fd = accept(listen_socket.GetFD(), (struct sockaddr *)&sockaddr, &address_len);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* try poll()ing again */
+                break;
+            } else {
+                KIWI_LOG_ERROR("Problem accepting connection: " << strerror(errno));
+                break;
+            }
+        }
+
+        AddConnection(fd);
+    }
 }
 
 
-void Server::StopReadingAndSendErrorReplyAndClose(
-        Connection* connection,
-        Protocol::ErrorCode error_code,
-        std::string error_message) {
+Server::Connection* Server::IOThread::AddConnection(int fd) {
+    Connection* connection;
+    try {
+        connection = new Connection(fd);
+    } catch (...) {
+        IOUtils::Close(fd);
+        throw;
+    }
+    connection->socket.SetMaxBufferSize(config.SocketBufferMaxSize());
 
-    // We want to explicitly stop watching the fd for readability so that the
-    // event loop will not keep returning us the fd if there happens to be
-    // unread data in the network buffers that we have no intention of ever
-    // reading. This is important so that we avoid live-lock, which could
-    // happen if there are sufficiently many connections which have reached
-    // the terminal read state but still have ready file descriptors such that
-    // the event loop ONLY returns events for readability and NEVER returns
-    // events for writability (which is what we need in order to progress to
-    // actually send()ing the error reply). 
-    connection->read_state = Connection::ReadState::TERMINAL;
-    SetReadInterest(connection, false);
+    try {
+        connections.insert(connection);
+        SetReadInterest(connection, true);
+    } catch (...) {
+        connections.erase(connection);
+        delete connection;
+        throw;
+    }
 
-    Buffer& error_reply_buffer = connection->outgoing_buffers.emplace_back(4 + 4 + 2 + error_message.length());
-    error_reply_buffer.UnsafePutInt(Protocol::MessageType::ERROR_REPLY);
-    error_reply_buffer.UnsafePutInt(error_code);
-    error_reply_buffer.UnsafePutShort(error_message.length());
-    error_reply_buffer.UnsafePutString(error_message);
-    error_reply_buffer.Flip();
+#if defined(HAVE_LIBURING)
+    if (uring != nullptr) {
+        connection->socket.SetCompletionBased(true);
+        uring->MultishotRecv(fd, connection);
+        connection->inflight_operations++;
+    }
+#endif
 
-    connection->close_connection_after_all_buffers_have_been_flushed = true;
-    SetWriteInterest(connection, true);
+    return connection;
 }
 
 
-void Server::SendData(Connection* connection) {
-    auto it = connection->outgoing_buffers.begin();
-    while (it != connection->outgoing_buffers.end()) {
-        Buffer& buffer = *it;
-        switch (connection->socket.Write(buffer)) {
-            case BufferedSocket::SendStatus::complete:
-                it = connection->outgoing_buffers.erase(it);
+void Server::IOThread::RecvData(Connection* connection) {
+    for (;;) {
+        BufferedSocket::RecvStatus status = connection->socket.Recv();
+
+        // Dispatch every complete message we have, decoding in place.
+        size_t needed;
+        size_t consumed = ProcessMessages(connection, connection->socket.ReadData(), connection->socket.ReadableBytes(), &needed);
+        connection->socket.Consume(consumed);
+        if (connection->closed) {
+            return;
+        }
+
+        // Replies to everything in this batch were encoded into the output
+        // arena as we went; push them all out together.
+        if (connection->socket.HasPendingWrites() && !connection->interested_in_writes) {
+            SendData(connection);
+            if (connection->closed) {
+                return;
+            }
+        }
+        if (connection->read_state == Connection::ReadState::TERMINAL) {
+            return;
+        }
+
+        switch (status) {
+            case BufferedSocket::RecvStatus::complete:
+                // The read buffer filled up. If the partial frame at its head
+                // can't fit even once compacted, grow the buffer to fit it.
+                if (needed > Constants::MAX_MESSAGE_SIZE) {
+                    KIWI_LOG_WARN("Message of " << needed << " bytes exceeds the maximum message size");
+                    CloseAndDestroy(connection);
+                    return;
+                }
+                connection->socket.ReserveRead(needed);
                 break;
 
-            case BufferedSocket::SendStatus::incomplete:
+            case BufferedSocket::RecvStatus::incomplete:
+                // Drained the socket; don't hold on to buffers while we wait.
+                connection->socket.ReleaseIdleBuffers();
                 return;
 
-            case BufferedSocket::SendStatus::closed:
+            case BufferedSocket::RecvStatus::closed:
                 CloseAndDestroy(connection);
                 return;
         }
     }
+}
 
-    switch (connection->socket.Flush()) {
-        case BufferedSocket::SendStatus::complete:
-            if (connection->close_connection_after_all_buffers_have_been_flushed) {
-                CloseAndDestroy(connection);
-            } else {
-                SetWriteInterest(connection, false);
-            }
-            return;
-
-        case BufferedSocket::SendStatus::incomplete:
-            return;
 
-        case BufferedSocket::SendStatus::closed:
-            CloseAndDestroy(connection);
-            return;
+size_t Server::IOThread::ProcessMessages(Connection* connection, char const* data, size_t length, size_t* needed) {
+    size_t consumed = 0;
+    *needed = 0;
+    while (connection->read_state == Connection::ReadState::READING_MESSAGES && !connection->closed) {
+        FrameReader reader(data + consumed, length - consumed);
+        if (!ProcessMessage(connection, reader)) {
+            *needed = reader.Needed();
+            break;
+        }
+        consumed += reader.Position();
     }
+    return consumed;
 }
 
 
-void Server::SetReadInterest(Connection* connection, bool interested_in_reads) {
-    if (connection->interested_in_reads != interested_in_reads) {
-        if (interested_in_reads) {
-            AddEventInterest(connection->socket.GetFD(), EVFILT_READ, connection);
-        } else {
-            RemoveEventInterest(connection->socket.GetFD(), EVFILT_READ);
-        }
-        connection->interested_in_reads = interested_in_reads;
+bool Server::IOThread::ProcessMessage(Connection* connection, FrameReader& reader) {
+    uint32_t message_type;
+    if (!reader.GetInt(&message_type)) {
+        return false;
     }
-}
 
+    switch (message_type) {
+        case Protocol::MessageType::CLIENT_HELLO: {
+            uint32_t magic_number;
+            uint32_t protocol_version;
+            if (!reader.GetInt(&magic_number) || !reader.GetInt(&protocol_version)) {
+                return false;
+            }
 
-void Server::SetWriteInterest(Connection* connection, bool interested_in_writes) {
-    if (connection->interested_in_writes != interested_in_writes) {
-        if (interested_in_writes) {
-            AddEventInterest(connection->socket.GetFD(), EVFILT_WRITE, connection);
-        } else {
-            RemoveEventInterest(connection->socket.GetFD(), EVFILT_WRITE);
+            if (magic_number != Protocol::MAGIC_NUMBER) {
+                StopReadingAndSendErrorReplyAndClose(
+                    connection,
+                    Protocol::ErrorCode::INVALID_MAGIC_NUMBER,
+                    Protocol::InvalidMagicNumberErrorMessage(magic_number));
+            } else if (protocol_version != Protocol::PROTOCOL_VERSION) {
+                StopReadingAndSendErrorReplyAndClose(
+                    connection,
+                    Protocol::ErrorCode::UNSUPPORTED_PROTOCOL_VERSION,
+                    Protocol::UnsupportedProtocolVersionErrorMessage(protocol_version));
+            } else {
+                RegisterClient(connection);
+                SendClientHelloReply(connection);
+            }
+            return true;
         }
-        connection->interested_in_writes = interested_in_writes;
-    }
-}
 
+        case Protocol::MessageType::CLIENT_TEST: {
+            uint32_t payload_length;
+            char const* payload;
+            if (!reader.GetInt(&payload_length) || !reader.GetBytes(payload_length, &payload)) {
+                return false;
+            }
 
-void Server::CloseAndDestroy(Connection* connection) {
-    cout << "Closing connection" << endl;
-    connections.erase(connection);
-    delete connection;
-}
+            SendClientTestReply(connection, payload, payload_length);
+            return true;
+        }
 
+        case Protocol::MessageType::CLIENT_GET: {
+            uint32_t request_id;
+            uint64_t database_id;
+            uint64_t table_id;
+            ReadBound bound;
+            uint32_t key_length;
+            char const* key;
+            if (!reader.GetInt(&request_id) ||
+                    !reader.GetLong(&database_id) ||
+                    !reader.GetLong(&table_id) ||
+                    !reader.GetLong(&bound.min_table_trx_id) ||
+                    !reader.GetInt(&bound.max_staleness_ms) ||
+                    !reader.GetInt(&key_length) ||
+                    !reader.GetBytes(key_length, &key)) {
+                return false;
+            }
 
-Server::Connection::Connection(int fd) :
-        socket(fd),
-        interested_in_reads(false),
-        interested_in_writes(false),
-        read_state(ReadState::READING_MESSAGE_TYPE),
-        close_connection_after_all_buffers_have_been_flushed(false),
-        incoming_message_type_buffer(4),
-        incoming_magic_number_buffer(4),
-        incoming_protocol_version_buffer(4),
-        incoming_server_id_buffer(4),
-        incoming_cluster_name_length_buffer(2),
-        incoming_cluster_name_buffer(0),
-        outgoing_buffers() {
-    socket.SetNonBlocking(true);
-}
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                HandleGet(connection, request_id, database_id, table_id, bound, string(key, key_length));
+            }
+            return true;
+        }
 
+        case Protocol::MessageType::CLIENT_PUT: {
+            uint32_t request_id;
+            uint64_t database_id;
+            uint64_t table_id;
+            uint32_t key_length;
+            char const* key;
+            uint32_t value_length;
+            char const* value;
+            if (!reader.GetInt(&request_id) ||
+                    !reader.GetLong(&database_id) ||
+                    !reader.GetLong(&table_id) ||
+                    !reader.GetInt(&key_length) ||
+                    !reader.GetBytes(key_length, &key) ||
+                    !reader.GetInt(&value_length) ||
+                    !reader.GetBytes(value_length, &value)) {
+                return false;
+            }
 
-Server::Connection::~Connection(void) {
-}
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                Action action{Action::Type::PUT, table_id, string(key, key_length), string(value, value_length)};
+                HandleWrite(connection, Protocol::MessageType::CLIENT_PUT_REPLY, request_id, SingleActionTransaction(database_id, move(action)));
+            }
+            return true;
+        }
 
+        case Protocol::MessageType::CLIENT_DELETE: {
+            uint32_t request_id;
+            uint64_t database_id;
+            uint64_t table_id;
+            uint32_t key_length;
+            char const* key;
+            if (!reader.GetInt(&request_id) ||
+                    !reader.GetLong(&database_id) ||
+                    !reader.GetLong(&table_id) ||
+                    !reader.GetInt(&key_length) ||
+                    !reader.GetBytes(key_length, &key)) {
+                return false;
+            }
 
-Server::~Server(void) {
-    struct kevent event;
-    EV_SET(&event, kSHUTDOWN/*ident*/, EVFILT_USER/*filter*/, EV_ADD | EV_CLEAR/*flags*/, NOTE_TRIGGER/*fflags*/, 0/*data*/, nullptr/*user data*/);
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                Action action{Action::Type::DELETE, table_id, string(key, key_length), string()};
+                HandleWrite(connection, Protocol::MessageType::CLIENT_DELETE_REPLY, request_id, SingleActionTransaction(database_id, move(action)));
+            }
+            return true;
+        }
 
-    int err = kevent(kq, &event, 1, nullptr, 0, nullptr);
-    if (err == -1) {
-        cerr << "Fatal: problem notifying event loop about shutdown: " << strerror(err) << endl;
-        abort();
-    }
+        case Protocol::MessageType::CLIENT_COMPARE_AND_SET: {
+            uint32_t request_id;
+            uint64_t database_id;
+            uint64_t table_id;
+            uint32_t key_length;
+            char const* key;
+            char const* expected_found;
+            uint32_t expected_value_length;
+            char const* expected_value;
+            uint32_t value_length;
+            char const* value;
+            if (!reader.GetInt(&request_id) ||
+                    !reader.GetLong(&database_id) ||
+                    !reader.GetLong(&table_id) ||
+                    !reader.GetInt(&key_length) ||
+                    !reader.GetBytes(key_length, &key) ||
+                    !reader.GetBytes(1, &expected_found) ||
+                    !reader.GetInt(&expected_value_length) ||
+                    !reader.GetBytes(expected_value_length, &expected_value) ||
+                    !reader.GetInt(&value_length) ||
+                    !reader.GetBytes(value_length, &value)) {
+                return false;
+            }
 
-    if (event.flags & EV_ERROR) {
-        cerr << "Fatal: problem notifying event loop about shutdown: " << strerror(event.data) << endl;
-        abort();
-    }
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                Action action{Action::Type::COMPARE_AND_SET, table_id, string(key, key_length), string(value, value_length)};
+                action.expected_exists = (*expected_found != 0);
+                action.expected_value.assign(expected_value, expected_value_length);
+                HandleWriteWithOutcome(connection, request_id, database_id, move(action));
+            }
+            return true;
+        }
 
-    err = pthread_join(thread, nullptr);
-    if (err != 0) {
-        cerr << "Fatal: problem joining server thread: " << strerror(err) << endl;
-        abort();
-    }
+        case Protocol::MessageType::CLIENT_INCREMENT: {
+            uint32_t request_id;
+            uint64_t database_id;
+            uint64_t table_id;
+            uint32_t key_length;
+            char const* key;
+            uint64_t delta;
+            char const* return_value;
+            if (!reader.GetInt(&request_id) ||
+                    !reader.GetLong(&database_id) ||
+                    !reader.GetLong(&table_id) ||
+                    !reader.GetInt(&key_length) ||
+                    !reader.GetBytes(key_length, &key) ||
+                    !reader.GetLong(&delta) ||
+                    !reader.GetBytes(1, &return_value)) {
+                return false;
+            }
+
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                Action action{Action::Type::INCREMENT, table_id, string(key, key_length), string()};
+                action.delta = static_cast<int64_t>(delta);
+                HandleIncrement(connection, request_id, database_id, move(action), *return_value != 0);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::CLIENT_STATUS: {
+            uint32_t request_id;
+            if (!reader.GetInt(&request_id)) {
+                return false;
+            }
+
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                SendStatusReply(connection, request_id);
+            }
+            return true;
+        }
 
-    IOUtils::Close(kq);
+        case Protocol::MessageType::CLIENT_MULTI_GET:
+        case Protocol::MessageType::CLIENT_MULTI_PUT:
+        case Protocol::MessageType::CLIENT_SCAN: {
+            uint32_t body_length;
+            char const* body;
+            if (!reader.GetInt(&body_length) || !reader.GetBytes(body_length, &body)) {
+                return false;
+            }
+
+            bool accepted;
+            if (connection->client_generation == 0) {
+                accepted = false;
+            } else if (message_type == Protocol::MessageType::CLIENT_MULTI_GET) {
+                accepted = HandleMultiGet(connection, body, body_length);
+            } else if (message_type == Protocol::MessageType::CLIENT_MULTI_PUT) {
+                accepted = HandleMultiPut(connection, body, body_length);
+            } else {
+                accepted = HandleScan(connection, body, body_length);
+            }
+            if (!accepted) {
+                CloseAndDestroy(connection);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::CLIENT_SUBSCRIBE: {
+            uint32_t request_id;
+            uint64_t database_id;
+            uint64_t table_id;
+            uint64_t from_trx_id;
+            uint32_t credits;
+            if (!reader.GetInt(&request_id) ||
+                    !reader.GetLong(&database_id) ||
+                    !reader.GetLong(&table_id) ||
+                    !reader.GetLong(&from_trx_id) ||
+                    !reader.GetInt(&credits)) {
+                return false;
+            }
+
+            if (connection->client_generation == 0 || !HandleSubscribe(connection, request_id, database_id, table_id, from_trx_id, credits)) {
+                CloseAndDestroy(connection);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::CLIENT_SUBSCRIBE_CREDIT: {
+            uint32_t request_id;
+            uint32_t credits;
+            if (!reader.GetInt(&request_id) || !reader.GetInt(&credits)) {
+                return false;
+            }
+
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                HandleSubscribeCredit(connection, request_id, credits);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::CLIENT_UNSUBSCRIBE: {
+            uint32_t request_id;
+            if (!reader.GetInt(&request_id)) {
+                return false;
+            }
+
+            if (connection->client_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                HandleUnsubscribe(connection, request_id);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::SERVER_HELLO: {
+            uint32_t magic_number;
+            uint32_t protocol_version;
+            uint32_t server_id;
+            uint16_t cluster_name_length;
+            char const* cluster_name;
+            if (!reader.GetInt(&magic_number) ||
+                    !reader.GetInt(&protocol_version) ||
+                    !reader.GetInt(&server_id) ||
+                    !reader.GetShort(&cluster_name_length) ||
+                    !reader.GetBytes(cluster_name_length, &cluster_name)) {
+                return false;
+            }
+
+            if (magic_number != Protocol::MAGIC_NUMBER) {
+                StopReadingAndSendErrorReplyAndClose(
+                    connection,
+                    Protocol::ErrorCode::INVALID_MAGIC_NUMBER,
+                    Protocol::InvalidMagicNumberErrorMessage(magic_number));
+            } else if (protocol_version != Protocol::PROTOCOL_VERSION) {
+                StopReadingAndSendErrorReplyAndClose(
+                    connection,
+                    Protocol::ErrorCode::UNSUPPORTED_PROTOCOL_VERSION,
+                    Protocol::UnsupportedProtocolVersionErrorMessage(protocol_version));
+            } else if (config.ClusterName().compare(0, string::npos, cluster_name, cluster_name_length) != 0) {
+                StopReadingAndSendErrorReplyAndClose(
+                    connection,
+                    Protocol::ErrorCode::CLUSTER_NAME_MISMATCH,
+                    Protocol::ClusterNameMismatchErrorMessage());
+            } else if (server_id >= config.ServerId() || config.Hosts().count(server_id) == 0 || connection->server_id != 0) {
+                // Lower-numbered servers dial higher-numbered ones, never the other way around.
+                StopReadingAndSendErrorReplyAndClose(
+                    connection,
+                    Protocol::ErrorCode::UNEXPECTED_SERVER_ID,
+                    Protocol::UnexpectedServerIdErrorMessage(server_id));
+            } else {
+                RegisterPeer(connection, server_id);
+                SendServerHelloReply(connection);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::SERVER_HELLO_REPLY: {
+            uint32_t error_code;
+            uint16_t error_message_length;
+            char const* error_message;
+            if (!reader.GetInt(&error_code) ||
+                    !reader.GetShort(&error_message_length) ||
+                    !reader.GetBytes(error_message_length, &error_message)) {
+                return false;
+            }
+
+            if (error_code != Protocol::ErrorCode::OK) {
+                KIWI_LOG_WARN("Server " << connection->server_id << " refused our hello: " << string(error_message, error_message_length));
+                CloseAndDestroy(connection);
+            }
+            return true;
+        }
+
+        case Protocol::MessageType::ERROR_REPLY: {
+            uint32_t error_code;
+            uint16_t error_message_length;
+            char const* error_message;
+            if (!reader.GetInt(&error_code) ||
+                    !reader.GetShort(&error_message_length) ||
+                    !reader.GetBytes(error_message_length, &error_message)) {
+                return false;
+            }
+
+            KIWI_LOG_WARN("Received error " << error_code << " from server " << connection->server_id << ": " << string(error_message, error_message_length));
+            CloseAndDestroy(connection);
+            return true;
+        }
+
+        case Protocol::MessageType::RAFT_APPEND_ENTRIES:
+        case Protocol::MessageType::RAFT_APPEND_ENTRIES_REPLY:
+        case Protocol::MessageType::RAFT_REQUEST_VOTE:
+        case Protocol::MessageType::RAFT_REQUEST_VOTE_REPLY:
+        case Protocol::MessageType::RAFT_INSTALL_SNAPSHOT:
+        case Protocol::MessageType::RAFT_INSTALL_SNAPSHOT_REPLY: {
+            uint32_t body_length;
+            char const* body;
+            if (!reader.GetInt(&body_length) || !reader.GetBytes(body_length, &body)) {
+                return false;
+            }
+
+            if (connection->peer_generation == 0) {
+                CloseAndDestroy(connection);
+            } else {
+                raft.Receive(connection->server_id, message_type, string(body, body_length));
+            }
+            return true;
+        }
+
+        default:
+            CloseAndDestroy(connection);
+            return true;
+    }
+}
+
+
+void Server::IOThread::SendClientHelloReply(Connection* connection) {
+    FrameWriter writer(connection->socket.ReserveWrite(4));
+    writer.PutInt(Protocol::MessageType::CLIENT_HELLO_REPLY);
+}
+
+
+void Server::IOThread::SendClientTestReply(Connection* connection, char const* payload, uint32_t payload_length) {
+    // `payload` points into the read buffer, so it must be copied out before
+    // the next receive; encoding it into the output arena does exactly that.
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + payload_length));
+    writer.PutInt(Protocol::MessageType::CLIENT_TEST_REPLY);
+    writer.PutInt(payload_length);
+    writer.PutBytes(payload, payload_length);
+}
+
+
+void Server::IOThread::SendGetReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, string const* value) {
+    uint32_t value_length = (value != nullptr) ? (value->length()) : (0);
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 4 + 1 + 4 + value_length));
+    writer.PutInt(Protocol::MessageType::CLIENT_GET_REPLY);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+    writer.PutByte(value != nullptr);
+    writer.PutInt(value_length);
+    if (value != nullptr) {
+        writer.PutBytes(value->data(), value_length);
+    }
+}
+
+
+void Server::IOThread::SendMultiGetReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, vector<rocksdb::PinnableSlice> const* values, vector<bool> const* found) {
+    size_t num_values = (values != nullptr) ? (values->size()) : (0);
+    size_t body_length = 4 + 4 + 4;
+    for (size_t i = 0; i < num_values; i++) {
+        body_length += 1 + 4 + (*values)[i].size();
+    }
+
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + body_length));
+    writer.PutInt(Protocol::MessageType::CLIENT_MULTI_GET_REPLY);
+    writer.PutInt(body_length);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+    writer.PutInt(num_values);
+    for (size_t i = 0; i < num_values; i++) {
+        rocksdb::PinnableSlice const& value = (*values)[i];
+        writer.PutByte((*found)[i]);
+        writer.PutInt(value.size());
+        writer.PutBytes(value.data(), value.size());
+    }
+}
+
+
+void Server::IOThread::SendWriteReply(Connection* connection, uint32_t reply_type, uint32_t request_id, Protocol::ErrorCode error_code) {
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 4));
+    writer.PutInt(reply_type);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+}
+
+
+// Any server answers, from what it knows locally; nothing waits on raft or storage.
+void Server::IOThread::SendStatusReply(Connection* connection, uint32_t request_id) {
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 4 + 1 + 8 + 8));
+    writer.PutInt(Protocol::MessageType::CLIENT_STATUS_REPLY);
+    writer.PutInt(request_id);
+    writer.PutInt(Protocol::ErrorCode::OK);
+    writer.PutByte(raft.IsLeader());
+    writer.PutLong(storage.AppliedRaftTrxId());
+    writer.PutLong(storage.ApplyLag());
+}
+
+
+void Server::IOThread::SendCompareAndSetReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, bool swapped, string const* value) {
+    uint32_t value_length = (value != nullptr) ? (value->length()) : (0);
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 4 + 1 + 1 + 4 + value_length));
+    writer.PutInt(Protocol::MessageType::CLIENT_COMPARE_AND_SET_REPLY);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+    writer.PutByte(swapped);
+    writer.PutByte(value != nullptr);
+    writer.PutInt(value_length);
+    if (value != nullptr) {
+        writer.PutBytes(value->data(), value_length);
+    }
+}
+
+
+void Server::IOThread::SendIncrementReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, uint64_t counter) {
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 4 + 8));
+    writer.PutInt(Protocol::MessageType::CLIENT_INCREMENT_REPLY);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+    writer.PutLong(counter);
+}
+
+
+void Server::IOThread::SendSubscribeBatch(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, bool last, vector<TableLogEntry> const& entries) {
+    size_t body_length = 4 + 4 + 1 + 4;
+    for (TableLogEntry const& entry : entries) {
+        body_length += 8 + 4 + entry.row_events.length();
+    }
+
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + body_length));
+    writer.PutInt(Protocol::MessageType::CLIENT_SUBSCRIBE_BATCH);
+    writer.PutInt(body_length);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+    writer.PutByte(last);
+    writer.PutInt(entries.size());
+    for (TableLogEntry const& entry : entries) {
+        writer.PutLong(entry.table_trx_id);
+        writer.PutInt(entry.row_events.length());
+        writer.PutBytes(entry.row_events.data(), entry.row_events.length());
+    }
+}
+
+
+void Server::IOThread::SendScanChunk(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, bool last, uint32_t num_pairs, string const& pairs) {
+    size_t body_length = 4 + 4 + 1 + 4 + pairs.length();
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + body_length));
+    writer.PutInt(Protocol::MessageType::CLIENT_SCAN_CHUNK);
+    writer.PutInt(body_length);
+    writer.PutInt(request_id);
+    writer.PutInt(error_code);
+    writer.PutByte(last);
+    writer.PutInt(num_pairs);
+    writer.PutBytes(pairs.data(), pairs.length());
+}
+
+
+void Server::IOThread::SendServerHello(Connection* connection) {
+    std::string const& cluster_name = config.ClusterName();
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 4 + 4 + 2 + cluster_name.length()));
+    writer.PutInt(Protocol::MessageType::SERVER_HELLO);
+    writer.PutInt(Protocol::MAGIC_NUMBER);
+    writer.PutInt(Protocol::PROTOCOL_VERSION);
+    writer.PutInt(config.ServerId());
+    writer.PutShort(cluster_name.length());
+    writer.PutBytes(cluster_name.data(), cluster_name.length());
+}
+
+
+void Server::IOThread::SendServerHelloReply(Connection* connection) {
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 2));
+    writer.PutInt(Protocol::MessageType::SERVER_HELLO_REPLY);
+    writer.PutInt(Protocol::ErrorCode::OK);
+    writer.PutShort(0);
+}
+
+
+/*
+ * Makes `connection` the one raft talks to `peer_id` through. An older
+ * connection to the same peer on this thread is closed; one on another
+ * thread is left for its peer to close and is then ignored by raft.
+ */
+void Server::IOThread::RegisterPeer(Connection* connection, uint32_t peer_id) {
+    auto it = peer_connections.find(peer_id);
+    if (it != peer_connections.end()) {
+        Connection* previous = it->second;
+        peer_connections.erase(it);
+        CloseAndDestroy(previous);
+    }
+
+    connection->server_id = peer_id;
+    connection->peer_generation = ++next_peer_generation;
+    peer_connections[peer_id] = connection;
+    raft.PeerConnected(peer_id, PeerRoute{id, connection->peer_generation});
+}
+
+
+void Server::IOThread::RegisterClient(Connection* connection) {
+    if (connection->client_generation == 0) {
+        connection->client_generation = ++next_client_generation;
+        client_connections[connection->client_generation] = connection;
+    }
+}
+
+
+void Server::IOThread::ReplyToClient(uint64_t client_generation, function<void(Connection*)> reply) {
+    if (current_io_thread == this) {
+        // Called back while processing the request; RecvData() flushes the reply with the rest of the batch.
+        auto it = client_connections.find(client_generation);
+        if (it != client_connections.end()) {
+            reply(it->second);
+        }
+        return;
+    }
+
+    Post([this, client_generation, reply = move(reply)](void) {
+        auto it = client_connections.find(client_generation);
+        if (it == client_connections.end()) {
+            return;
+        }
+
+        Connection* connection = it->second;
+        reply(connection);
+        if (!connection->interested_in_writes) {
+            SendData(connection);
+        }
+    });
+}
+
+
+/*
+ * Picks the cheapest barrier that meets the bound: raft's linearizable Read()
+ * when there's none, otherwise StaleRead() and/or waiting for the table to be
+ * applied far enough, which followers serve too. done(false) means this
+ * server can't serve the read, or not within kReadWaitMillis; like a Not
+ * Leader, the client should try the leader.
+ */
+void Server::IOThread::ReadBarrier(Connection* connection, uint64_t database_id, uint64_t table_id, ReadBound bound, function<void(bool)> done) {
+    uint64_t client_generation = connection->client_generation;
+    if (bound.max_staleness_ms == 0 && bound.min_table_trx_id == 0) {
+        raft.Read(move(done));
+    } else if (bound.min_table_trx_id == 0) {
+        raft.StaleRead(bound.max_staleness_ms, move(done));
+    } else if (bound.max_staleness_ms == 0) {
+        WaitForTable(client_generation, database_id, table_id, bound.min_table_trx_id, move(done));
+    } else {
+        raft.StaleRead(bound.max_staleness_ms, [this, client_generation, database_id, table_id, bound, done](bool ok) {
+            if (!ok) {
+                done(false);
+                return;
+            }
+            WaitForTable(client_generation, database_id, table_id, bound.min_table_trx_id, done);
+        });
+    }
+}
+
+
+/*
+ * The connection keeps the waiter's id while it waits, so closing it drops
+ * the waiter rather than leaving it in storage. The deadline covers whatever
+ * a close misses.
+ */
+void Server::IOThread::WaitForTable(uint64_t client_generation, uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, function<void(bool)> done) {
+    uint64_t waiter_id = storage.NewTableWaiterId();
+    ReplyToClient(client_generation, [waiter_id](Connection* connection) {
+        connection->table_waiters.insert(waiter_id);
+    });
+    storage.WhenTableApplied(database_id, table_id, table_trx_id, kReadWaitMillis, waiter_id, [this, client_generation, waiter_id, done](bool applied) {
+        ReplyToClient(client_generation, [waiter_id](Connection* connection) {
+            connection->table_waiters.erase(waiter_id);
+        });
+        done(applied);
+    });
+}
+
+
+/*
+ * The value is read once the read barrier for the Get's bound clears. For a
+ * linearizable Get under the leader lease that's usually right away, and the
+ * reply goes out with the rest of the batch.
+ */
+void Server::IOThread::HandleGet(Connection* connection, uint32_t request_id, uint64_t database_id, uint64_t table_id, ReadBound bound, string key) {
+    uint64_t client_generation = connection->client_generation;
+    ReadBarrier(connection, database_id, table_id, bound, [this, client_generation, request_id, database_id, table_id, key = move(key)](bool ok) mutable {
+        ReplyToClient(client_generation, [this, ok, request_id, database_id, table_id, key = move(key)](Connection* connection) {
+            if (!ok) {
+                SendGetReply(connection, request_id, Protocol::ErrorCode::NOT_LEADER, nullptr);
+                return;
+            }
+
+            string value;
+            bool found = storage.Get(database_id, table_id, key, &value);
+            SendGetReply(connection, request_id, Protocol::ErrorCode::OK, (found) ? (&value) : (nullptr));
+        });
+    });
+}
+
+
+// Acknowledged once committed; a later Get waits for it to be applied.
+void Server::IOThread::HandleWrite(Connection* connection, uint32_t reply_type, uint32_t request_id, Transaction const& transaction) {
+    string encoded;
+    encoded.reserve(TransactionCodec::EncodedSize(transaction));
+    TransactionCodec::Encode(transaction, &encoded);
+
+    uint64_t client_generation = connection->client_generation;
+    raft.Propose(move(encoded), [this, client_generation, reply_type, request_id](Raft::ProposeResult result) {
+        ReplyToClient(client_generation, [this, result, reply_type, request_id](Connection* connection) {
+            SendWriteReply(connection, reply_type, request_id, ProposeErrorCode(result));
+        });
+    });
+}
+
+
+/*
+ * A CompareAndSet, or an Increment that wants its new counter. Only the
+ * apply thread knows the outcome, so the request takes a ticket from storage
+ * that travels in the raft log entry, and is answered when the entry is
+ * applied here. If it doesn't commit, the ticket is given back, unless the
+ * apply thread got to it first.
+ */
+void Server::IOThread::HandleWriteWithOutcome(Connection* connection, uint32_t request_id, uint64_t database_id, Action action) {
+    uint64_t client_generation = connection->client_generation;
+    bool increment = (action.type == Action::Type::INCREMENT);
+    action.ticket = storage.ExpectOutcome([this, client_generation, request_id, increment](bool swapped, bool found, string const& value) {
+        ReplyToClient(client_generation, [this, request_id, increment, swapped, found, value](Connection* connection) {
+            if (increment) {
+                uint64_t counter = 0;
+                FrameReader(value.data(), value.length()).GetLong(&counter);
+                SendIncrementReply(connection, request_id, Protocol::ErrorCode::OK, counter);
+            } else {
+                SendCompareAndSetReply(connection, request_id, Protocol::ErrorCode::OK, swapped, (found) ? (&value) : (nullptr));
+            }
+        });
+    });
+
+    uint64_t ticket = action.ticket;
+    string encoded;
+    Transaction transaction = SingleActionTransaction(database_id, move(action));
+    encoded.reserve(TransactionCodec::EncodedSize(transaction));
+    TransactionCodec::Encode(transaction, &encoded);
+    raft.Propose(move(encoded), [this, client_generation, request_id, increment, ticket](Raft::ProposeResult result) {
+        if (result != Raft::ProposeResult::COMMITTED && storage.ForgetOutcome(ticket)) {
+            ReplyToClient(client_generation, [this, request_id, increment, result](Connection* connection) {
+                if (increment) {
+                    SendIncrementReply(connection, request_id, ProposeErrorCode(result), 0);
+                } else {
+                    SendCompareAndSetReply(connection, request_id, ProposeErrorCode(result), false, nullptr);
+                }
+            });
+        }
+    });
+}
+
+
+/*
+ * Unless the client asked for the new counter, an Increment is a blind merge,
+ * acknowledged once committed like a Put. Only one that did takes a ticket,
+ * which makes the apply thread read the key.
+ */
+void Server::IOThread::HandleIncrement(Connection* connection, uint32_t request_id, uint64_t database_id, Action action, bool return_value) {
+    if (return_value) {
+        HandleWriteWithOutcome(connection, request_id, database_id, move(action));
+        return;
+    }
+
+    string encoded;
+    Transaction transaction = SingleActionTransaction(database_id, move(action));
+    encoded.reserve(TransactionCodec::EncodedSize(transaction));
+    TransactionCodec::Encode(transaction, &encoded);
+
+    uint64_t client_generation = connection->client_generation;
+    raft.Propose(move(encoded), [this, client_generation, request_id](Raft::ProposeResult result) {
+        ReplyToClient(client_generation, [this, result, request_id](Connection* connection) {
+            SendIncrementReply(connection, request_id, ProposeErrorCode(result), 0);
+        });
+    });
+}
+
+
+/*
+ * One batched lookup for every key, through the same read barrier as a Get,
+ * with the values copied straight from RocksDB's pinned blocks into the
+ * reply.
+ */
+bool Server::IOThread::HandleMultiGet(Connection* connection, char const* body, uint32_t body_length) {
+    FrameReader reader(body, body_length);
+    uint32_t request_id;
+    uint64_t database_id;
+    uint64_t table_id;
+    ReadBound bound;
+    uint32_t num_keys;
+    if (!reader.GetInt(&request_id) ||
+            !reader.GetLong(&database_id) ||
+            !reader.GetLong(&table_id) ||
+            !reader.GetLong(&bound.min_table_trx_id) ||
+            !reader.GetInt(&bound.max_staleness_ms) ||
+            !reader.GetInt(&num_keys)) {
+        return false;
+    }
+
+    vector<string> keys;
+    keys.reserve(min<size_t>(num_keys, body_length / 4));
+    for (uint32_t i = 0; i < num_keys; i++) {
+        uint32_t key_length;
+        char const* key;
+        if (!reader.GetInt(&key_length) || !reader.GetBytes(key_length, &key)) {
+            return false;
+        }
+        keys.emplace_back(key, key_length);
+    }
+    if (reader.Position() != body_length) {
+        return false;
+    }
+
+    uint64_t client_generation = connection->client_generation;
+    ReadBarrier(connection, database_id, table_id, bound, [this, client_generation, request_id, database_id, table_id, keys = move(keys)](bool ok) mutable {
+        ReplyToClient(client_generation, [this, ok, request_id, database_id, table_id, keys = move(keys)](Connection* connection) {
+            if (!ok) {
+                SendMultiGetReply(connection, request_id, Protocol::ErrorCode::NOT_LEADER, nullptr, nullptr);
+                return;
+            }
+
+            vector<rocksdb::Slice> key_slices(keys.begin(), keys.end());
+            vector<rocksdb::PinnableSlice> values;
+            vector<bool> found;
+            storage.MultiGet(database_id, table_id, key_slices, &values, &found);
+            SendMultiGetReply(connection, request_id, Protocol::ErrorCode::OK, &values, &found);
+        });
+    });
+    return true;
+}
+
+
+// Every pair goes into one transaction: one raft log entry, applied in one WriteBatch.
+bool Server::IOThread::HandleMultiPut(Connection* connection, char const* body, uint32_t body_length) {
+    FrameReader reader(body, body_length);
+    uint32_t request_id;
+    uint64_t database_id;
+    uint64_t table_id;
+    uint32_t num_pairs;
+    if (!reader.GetInt(&request_id) ||
+            !reader.GetLong(&database_id) ||
+            !reader.GetLong(&table_id) ||
+            !reader.GetInt(&num_pairs)) {
+        return false;
+    }
+
+    Transaction transaction;
+    transaction.batches.emplace_back();
+    transaction.batches.back().databases.push_back(DatabaseActions{database_id, {}});
+    vector<Action>& actions = transaction.batches.back().databases.back().actions;
+    actions.reserve(min<size_t>(num_pairs, body_length / 8));
+    for (uint32_t i = 0; i < num_pairs; i++) {
+        uint32_t key_length;
+        char const* key;
+        uint32_t value_length;
+        char const* value;
+        if (!reader.GetInt(&key_length) ||
+                !reader.GetBytes(key_length, &key) ||
+                !reader.GetInt(&value_length) ||
+                !reader.GetBytes(value_length, &value)) {
+            return false;
+        }
+        actions.push_back(Action{Action::Type::PUT, table_id, string(key, key_length), string(value, value_length)});
+    }
+    if (reader.Position() != body_length) {
+        return false;
+    }
+
+    HandleWrite(connection, Protocol::MessageType::CLIENT_MULTI_PUT_REPLY, request_id, transaction);
+    return true;
+}
+
+
+/*
+ * Scans start from the same read barrier as a Get, then stream from a
+ * snapshot taken right after it. The first chunk is written straight away;
+ * the rest are pulled by SendData() as the connection drains.
+ */
+bool Server::IOThread::HandleScan(Connection* connection, char const* body, uint32_t body_length) {
+    FrameReader reader(body, body_length);
+    uint32_t request_id;
+    uint64_t database_id;
+    uint64_t table_id;
+    ReadBound bound;
+    uint32_t start_key_length;
+    char const* start_key;
+    uint32_t end_key_length;
+    char const* end_key;
+    uint32_t prefix_length;
+    char const* prefix;
+    uint32_t limit;
+    if (!reader.GetInt(&request_id) ||
+            !reader.GetLong(&database_id) ||
+            !reader.GetLong(&table_id) ||
+            !reader.GetLong(&bound.min_table_trx_id) ||
+            !reader.GetInt(&bound.max_staleness_ms) ||
+            !reader.GetInt(&start_key_length) ||
+            !reader.GetBytes(start_key_length, &start_key) ||
+            !reader.GetInt(&end_key_length) ||
+            !reader.GetBytes(end_key_length, &end_key) ||
+            !reader.GetInt(&prefix_length) ||
+            !reader.GetBytes(prefix_length, &prefix) ||
+            !reader.GetInt(&limit) ||
+            reader.Position() != body_length) {
+        return false;
+    }
+
+    uint64_t client_generation = connection->client_generation;
+    uint64_t remaining = (limit != 0) ? (limit) : (UINT64_MAX);
+    ReadBarrier(connection, database_id, table_id, bound, [this, client_generation, request_id, database_id, table_id, remaining,
+            start_key = string(start_key, start_key_length),
+            end_key = string(end_key, end_key_length),
+            prefix = string(prefix, prefix_length)](bool ok) mutable {
+        ReplyToClient(client_generation, [this, ok, request_id, database_id, table_id, remaining,
+                start_key = move(start_key), end_key = move(end_key), prefix = move(prefix)](Connection* connection) {
+            if (!ok) {
+                SendScanChunk(connection, request_id, Protocol::ErrorCode::NOT_LEADER, true, 0, string());
+                return;
+            }
+
+            unique_ptr<TableScan> scan = storage.OpenScan(database_id, table_id, start_key, end_key, prefix);
+            connection->scans.push_back(ClientScan{request_id, remaining, move(scan)});
+            WriteScanChunk(connection);
+        });
+    });
+    return true;
+}
+
+
+/*
+ * Writes the next chunk of the connection's first scan and moves that scan
+ * to the back, so that concurrent scans on one connection take turns.
+ */
+void Server::IOThread::WriteScanChunk(Connection* connection) {
+    ClientScan& client_scan = connection->scans.front();
+    TableScan& scan = *client_scan.scan;
+
+    scan_chunk.clear();
+    uint32_t num_pairs = 0;
+    while (client_scan.remaining > 0 && scan.Valid() && scan_chunk.length() < kScanChunkBytes) {
+        rocksdb::Slice key = scan.Key();
+        rocksdb::Slice value = scan.Value();
+        size_t position = scan_chunk.length();
+        scan_chunk.resize(position + 4 + key.size() + 4 + value.size());
+        FrameWriter writer(&scan_chunk[position]);
+        writer.PutInt(key.size());
+        writer.PutBytes(key.data(), key.size());
+        writer.PutInt(value.size());
+        writer.PutBytes(value.data(), value.size());
+        num_pairs++;
+        client_scan.remaining--;
+        scan.Next();
+    }
+
+    bool last = client_scan.remaining == 0 || !scan.Valid();
+    SendScanChunk(connection, client_scan.request_id, Protocol::ErrorCode::OK, last, num_pairs, scan_chunk);
+
+    // Don't hold on to the space a single oversized pair needed.
+    if (scan_chunk.capacity() > 4 * kScanChunkBytes) {
+        string().swap(scan_chunk);
+    }
+
+    ClientScan current = move(connection->scans.front());
+    connection->scans.pop_front();
+    if (!last) {
+        connection->scans.push_back(move(current));
+    }
+}
+
+
+// Picks the connection's scans up again on the next loop iteration, once other connections have had a turn.
+void Server::IOThread::ResumeScansLater(Connection* connection) {
+    Post([this, client_generation = connection->client_generation](void) {
+        auto it = client_connections.find(client_generation);
+        if (it != client_connections.end() && !it->second->interested_in_writes) {
+            SendData(it->second);
+        }
+    });
+}
+
+
+// Returns false if the request id is already subscribed.
+bool Server::IOThread::HandleSubscribe(Connection* connection, uint32_t request_id, uint64_t database_id, uint64_t table_id, uint64_t from_trx_id, uint32_t credits) {
+    if (connection->subscriptions.count(request_id) != 0) {
+        return false;
+    }
+    if (credits > kMaxSubscribeCredits) {
+        SendSubscribeBatch(connection, request_id, Protocol::ErrorCode::INVALID_CREDITS, true, vector<TableLogEntry>());
+        return true;
+    }
+    if (from_trx_id > storage.AppliedTableTrxId(database_id, table_id, nullptr) + 1) {
+        SendSubscribeBatch(connection, request_id, Protocol::ErrorCode::TRX_ID_AHEAD, true, vector<TableLogEntry>());
+        return true;
+    }
+
+    ClientSubscription subscription;
+    subscription.serial = ++next_subscription_serial;
+    subscription.database_id = database_id;
+    subscription.table_id = table_id;
+    subscription.next_trx_id = from_trx_id;
+    subscription.credits = credits;
+    subscription.waiter_id = 0;
+    connection->subscriptions[request_id] = subscription;
+
+    storage.WatchTable(database_id, table_id);
+    PumpSubscription(connection, request_id);
+    return true;
+}
+
+
+void Server::IOThread::HandleSubscribeCredit(Connection* connection, uint32_t request_id, uint32_t credits) {
+    auto it = connection->subscriptions.find(request_id);
+    if (it == connection->subscriptions.end()) {
+        return;
+    }
+
+    if (credits > kMaxSubscribeCredits - it->second.credits) {
+        EndSubscription(connection, request_id, Protocol::ErrorCode::INVALID_CREDITS);
+        return;
+    }
+
+    it->second.credits += credits;
+    PumpSubscription(connection, request_id);
+}
+
+
+void Server::IOThread::HandleUnsubscribe(Connection* connection, uint32_t request_id) {
+    auto it = connection->subscriptions.find(request_id);
+    if (it == connection->subscriptions.end()) {
+        return;
+    }
+
+    EndSubscription(connection, request_id, Protocol::ErrorCode::OK);
+}
+
+
+void Server::IOThread::EndSubscription(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code) {
+    ClientSubscription const& subscription = connection->subscriptions.at(request_id);
+    if (subscription.waiter_id != 0) {
+        storage.ForgetTableWaiter(subscription.waiter_id);
+    }
+    storage.UnwatchTable(subscription.database_id, subscription.table_id);
+    connection->subscriptions.erase(request_id);
+    SendSubscribeBatch(connection, request_id, error_code, true, vector<TableLogEntry>());
+}
+
+
+/*
+ * Sends a batch per credit for as long as there's something to send.
+ * Subscribers that have caught up are served from the apply thread's
+ * in-memory tail of the table log; only those further behind read RocksDB.
+ * Once there's nothing left, waits for the table's next transaction. If
+ * log retention purged the next entry before it could be sent, the
+ * subscription ends with Log Purged rather than skipping past the gap.
+ */
+void Server::IOThread::PumpSubscription(Connection* connection, uint32_t request_id) {
+    ClientSubscription& subscription = connection->subscriptions.at(request_id);
+    vector<TableLogEntry> entries;
+    for (size_t batches = 0; subscription.credits > 0; batches++) {
+        if (batches == kSubscribeBatchesPerTurn) {
+            ResumeSubscription(connection->client_generation, request_id, subscription.serial, false);
+            return;
+        }
+
+        entries.clear();
+        if (!storage.ReadTableTail(subscription.database_id, subscription.table_id, subscription.next_trx_id, kSubscribeBatchEntries, kSubscribeBatchBytes, &entries)) {
+            uint64_t oldest_live = storage.ReadTableLog(subscription.database_id, subscription.table_id, subscription.next_trx_id, kSubscribeBatchEntries, kSubscribeBatchBytes, nullptr, &entries);
+            if (subscription.next_trx_id == 0) {
+                subscription.next_trx_id = oldest_live;
+            } else if (oldest_live > subscription.next_trx_id) {
+                EndSubscription(connection, request_id, Protocol::ErrorCode::LOG_PURGED);
+                return;
+            }
+        }
+
+        if (entries.empty()) {
+            if (subscription.waiter_id == 0) {
+                subscription.waiter_id = storage.NewTableWaiterId();
+                uint64_t client_generation = connection->client_generation;
+                uint64_t serial = subscription.serial;
+                storage.WhenTableApplied(subscription.database_id, subscription.table_id, subscription.next_trx_id, 0, subscription.waiter_id, [this, client_generation, request_id, serial](bool) {
+                    ResumeSubscription(client_generation, request_id, serial, true);
+                });
+            }
+            return;
+        }
+
+        SendSubscribeBatch(connection, request_id, Protocol::ErrorCode::OK, false, entries);
+        subscription.next_trx_id = entries.back().table_trx_id + 1;
+        subscription.credits--;
+    }
+}
+
+
+// Always posted, even from this thread, so that pumping never recurses.
+void Server::IOThread::ResumeSubscription(uint64_t client_generation, uint32_t request_id, uint64_t serial, bool woken) {
+    Post([this, client_generation, request_id, serial, woken](void) {
+        auto it = client_connections.find(client_generation);
+        if (it == client_connections.end()) {
+            return;
+        }
+
+        Connection* connection = it->second;
+        auto subscription = connection->subscriptions.find(request_id);
+        if (subscription == connection->subscriptions.end() || subscription->second.serial != serial) {
+            return;
+        }
+        if (woken) {
+            subscription->second.waiter_id = 0;
+        }
+        PumpSubscription(connection, request_id);
+        if (!connection->interested_in_writes) {
+            SendData(connection);
+        }
+    });
+}
+
+
+void Server::IOThread::StopReadingAndSendErrorReplyAndClose(
+        Connection* connection,
+        Protocol::ErrorCode error_code,
+        std::string error_message) {
+
+    // We want to explicitly stop watching the fd for readability so that the
+    // event loop will not keep returning us the fd if there happens to be
+    // unread data in the network buffers that we have no intention of ever
+    // reading. This is important so that we avoid live-lock, which could
+    // happen if there are sufficiently many connections which have reached
+    // the terminal read state but still have ready file descriptors such that
+    // the event loop ONLY returns events for readability and NEVER returns
+    // events for writability (which is what we need in order to progress to
+    // actually send()ing the error reply). 
+    connection->read_state = Connection::ReadState::TERMINAL;
+    SetReadInterest(connection, false);
+
+    FrameWriter writer(connection->socket.ReserveWrite(4 + 4 + 2 + error_message.length()));
+    writer.PutInt(Protocol::MessageType::ERROR_REPLY);
+    writer.PutInt(error_code);
+    writer.PutShort(error_message.length());
+    writer.PutBytes(error_message.data(), error_message.length());
+
+    connection->close_connection_after_all_buffers_have_been_flushed = true;
+}
+
+
+void Server::IOThread::SendData(Connection* connection) {
+#if defined(HAVE_LIBURING)
+    if (uring != nullptr) {
+        // Sent as one sendmsg at the end of this loop iteration.
+        QueueSend(connection);
+        return;
+    }
+#endif
+
+    for (size_t scan_chunks = 0;; scan_chunks++) {
+        switch (connection->socket.Flush()) {
+            case BufferedSocket::SendStatus::complete:
+                // Flow control: a scan's next chunk is only read once everything before it went out.
+                if (!connection->scans.empty() && !connection->close_connection_after_all_buffers_have_been_flushed) {
+                    if (scan_chunks < kScanChunksPerTurn) {
+                        WriteScanChunk(connection);
+                        continue;
+                    }
+                    ResumeScansLater(connection);
+                }
+                if (connection->close_connection_after_all_buffers_have_been_flushed) {
+                    CloseAndDestroy(connection);
+                } else {
+                    SetWriteInterest(connection, false);
+                    connection->socket.ReleaseIdleBuffers();
+                }
+                return;
+
+            case BufferedSocket::SendStatus::incomplete:
+                SetWriteInterest(connection, true);
+                return;
+
+            case BufferedSocket::SendStatus::closed:
+                CloseAndDestroy(connection);
+                return;
+        }
+    }
+}
+
+
+void Server::IOThread::SetReadInterest(Connection* connection, bool interested_in_reads) {
+    if (connection->interested_in_reads != interested_in_reads) {
+        bool registered = connection->interested_in_reads || connection->interested_in_writes;
+        connection->interested_in_reads = interested_in_reads;
+#if defined(HAVE_LIBURING)
+        if (uring != nullptr) {
+            // Reads are driven by the multishot recv armed in AddConnection();
+            // data arriving while we are not interested is simply dropped.
+            return;
+        }
+#endif
+        if (registered) {
+            UpdateEventInterest(connection);
+        } else {
+            poller.Add(connection->socket.GetFD(), Poller::Interest::READ | Poller::Interest::EDGE_TRIGGERED, connection);
+        }
+    }
+}
+
+
+void Server::IOThread::SetWriteInterest(Connection* connection, bool interested_in_writes) {
+    if (connection->interested_in_writes != interested_in_writes) {
+        connection->interested_in_writes = interested_in_writes;
+        UpdateEventInterest(connection);
+    }
+}
+
+
+void Server::IOThread::UpdateEventInterest(Connection* connection) {
+#if defined(HAVE_LIBURING)
+    if (uring != nullptr) {
+        if (connection->interested_in_writes) {
+            QueueSend(connection);
+        }
+        return;
+    }
+#endif
+
+    uint32_t interest = Poller::Interest::EDGE_TRIGGERED;
+    if (connection->interested_in_reads) {
+        interest |= Poller::Interest::READ;
+    }
+    if (connection->interested_in_writes) {
+        interest |= Poller::Interest::WRITE;
+    }
+    poller.Modify(connection->socket.GetFD(), interest, connection);
+}
+
+
+void Server::IOThread::CloseAndDestroy(Connection* connection) {
+    KIWI_LOG_DEBUG("Closing connection");
+    if (!connection->closed) {
+        connection->closed = true;
+        closed_connections.push_back(connection);
+        if (connection->peer_generation != 0) {
+            auto it = peer_connections.find(connection->server_id);
+            if (it != peer_connections.end() && it->second == connection) {
+                peer_connections.erase(it);
+                raft.PeerDisconnected(connection->server_id, PeerRoute{id, connection->peer_generation});
+            }
+        }
+        if (connection->client_generation != 0) {
+            client_connections.erase(connection->client_generation);
+        }
+        for (auto const& entry : connection->subscriptions) {
+            if (entry.second.waiter_id != 0) {
+                storage.ForgetTableWaiter(entry.second.waiter_id);
+            }
+            storage.UnwatchTable(entry.second.database_id, entry.second.table_id);
+        }
+        connection->subscriptions.clear();
+        for (uint64_t waiter_id : connection->table_waiters) {
+            storage.ForgetTableWaiter(waiter_id);
+        }
+        connection->table_waiters.clear();
+#if defined(HAVE_LIBURING)
+        if (uring != nullptr && connection->inflight_operations > 0) {
+            uring->CancelAll(connection->socket.GetFD());
+        }
+#endif
+    }
+}
+
+
+void Server::IOThread::DestroyClosedConnections(void) {
+    size_t num_remaining = 0;
+    for (Connection* connection : closed_connections) {
+        if (connection->inflight_operations > 0) {
+            // The kernel may still touch this connection; wait for its
+            // cancelled operations to complete before freeing it.
+            closed_connections[num_remaining++] = connection;
+            continue;
+        }
+        connections.erase(connection);
+        delete connection;
+    }
+    closed_connections.resize(num_remaining);
+}
+
+
+#if defined(HAVE_LIBURING)
+
+void Server::IOThread::RunCompletionLoop(void) {
+    // The poller only carries user events (shutdown, messages) in this mode;
+    // its fd polls readable whenever one of them is pending.
+    uring->MultishotAccept(listen_socket.GetFD(), nullptr);
+    uring->MultishotPoll(poller.GetFD(), nullptr);
+
+    bool shutdown = false;
+    while (!shutdown) {
+        SubmitPendingSends();
+
+        IOUringEngine::Completion completions[256];
+        int num_completions = uring->SubmitAndWait(completions, sizeof(completions) / sizeof(completions[0]));
+
+        for (int i = 0; i < num_completions; i++) {
+            IOUringEngine::Completion* completion = &completions[i];
+            switch (completion->op) {
+                case IOUringEngine::Op::ACCEPT:
+                    if (completion->result >= 0) {
+                        AddConnection(completion->result);
+                    } else if (completion->result != -EAGAIN && completion->result != -EINTR) {
+                        KIWI_LOG_ERROR("Problem accepting connection: " << strerror(-completion->result));
+                    }
+                    if (!completion->more) {
+                        uring->MultishotAccept(listen_socket.GetFD(), nullptr);
+                    }
+                    break;
+
+                case IOUringEngine::Op::POLL: {
+                    Poller::Event events[64];
+                    int num_events = poller.Wait(events, sizeof(events) / sizeof(events[0]), 0);
+                    for (int j = 0; j < num_events; j++) {
+                        if (events[j].user) {
+                            HandleUserEvent(events[j].user_event, &shutdown);
+                        }
+                    }
+                    if (!completion->more) {
+                        uring->MultishotPoll(poller.GetFD(), nullptr);
+                    }
+                    break;
+                }
+
+                case IOUringEngine::Op::RECV:
+                    HandleRecvCompletion(completion);
+                    break;
+
+                case IOUringEngine::Op::SEND:
+                    HandleSendCompletion(completion);
+                    break;
+
+                case IOUringEngine::Op::CANCEL:
+                    break;
+
+                default:
+                    KIWI_LOG_FATAL("Unexpected io_uring operation: " << completion->op);
+                    abort();
+            }
+        }
+
+        DestroyClosedConnections();
+    }
+}
+
+
+void Server::IOThread::HandleRecvCompletion(IOUringEngine::Completion* completion) {
+    Connection* connection = static_cast<Connection*>(completion->data);
+    if (!completion->more) {
+        connection->inflight_operations--;
+    }
+
+    if (connection->closed) {
+        if (completion->buffer != nullptr) {
+            uring->ReturnBuffer(completion->buffer_id);
+        }
+        return;
+    }
+
+    if (completion->result > 0) {
+        if (connection->interested_in_reads) {
+            connection->socket.Append(completion->buffer, completion->result);
+        }
+        uring->ReturnBuffer(completion->buffer_id);
+        if (connection->interested_in_reads) {
+            RecvData(connection);
+        }
+    } else if (completion->result == -ENOBUFS) {
+        // Provided buffers ran dry; we hand buffers back immediately, so simply re-arm below.
+    } else {
+        // EOF or a socket error. If we're still reading, RecvData() processes
+        // whatever was buffered and then observes the closed stream; otherwise
+        // we're busy flushing a final reply and the write side decides.
+        connection->socket.MarkEndOfStream();
+        if (connection->interested_in_reads) {
+            RecvData(connection);
+        }
+        return;
+    }
+
+    if (!completion->more && !connection->closed) {
+        uring->MultishotRecv(connection->socket.GetFD(), connection);
+        connection->inflight_operations++;
+    }
+}
+
+
+void Server::IOThread::HandleSendCompletion(IOUringEngine::Completion* completion) {
+    Connection* connection = static_cast<Connection*>(completion->data);
+    connection->inflight_operations--;
+    connection->send_in_flight = false;
+
+    if (connection->closed) {
+        return;
+    }
+
+    if (completion->result < 0) {
+        CloseAndDestroy(connection);
+        return;
+    }
+
+    connection->socket.SendCompleted(completion->result);
+    QueueSend(connection);
+}
+
+
+void Server::IOThread::QueueSend(Connection* connection) {
+    if (!connection->send_queued) {
+        connection->send_queued = true;
+        pending_sends.push_back(connection);
+    }
+}
+
+
+void Server::IOThread::SubmitPendingSends(void) {
+    // CloseAndDestroy() may queue further sends, so work on a private copy.
+    std::vector<Connection*> connections_to_send;
+    connections_to_send.swap(pending_sends);
+
+    for (Connection* connection : connections_to_send) {
+        connection->send_queued = false;
+        if (connection->closed || connection->send_in_flight) {
+            continue;
+        }
+
+        struct msghdr const* message;
+        bool pending = connection->socket.PendingSend(&message);
+        if (!pending && !connection->scans.empty() && !connection->close_connection_after_all_buffers_have_been_flushed) {
+            // Flow control: a scan's next chunk is only read once the previous send completed.
+            WriteScanChunk(connection);
+            pending = connection->socket.PendingSend(&message);
+        }
+        if (pending) {
+            uring->SendMessage(connection->socket.GetFD(), message, connection);
+            connection->inflight_operations++;
+            connection->send_in_flight = true;
+        } else if (connection->close_connection_after_all_buffers_have_been_flushed) {
+            CloseAndDestroy(connection);
+        } else {
+            connection->socket.ReleaseIdleBuffers();
+        }
+    }
+
+    // Hand the (now empty) vector's storage back so we don't reallocate every iteration.
+    if (pending_sends.empty()) {
+        connections_to_send.clear();
+        pending_sends.swap(connections_to_send);
+    }
+}
+
+#endif  // HAVE_LIBURING
+
+
+Server::Connection::Connection(int fd) :
+        socket(fd),
+        interested_in_reads(false),
+        interested_in_writes(false),
+        read_state(ReadState::READING_MESSAGES),
+        close_connection_after_all_buffers_have_been_flushed(false),
+        closed(false),
+        inflight_operations(0),
+        send_in_flight(false),
+        send_queued(false),
+        server_id(0),
+        peer_generation(0),
+        client_generation(0),
+        scans(),
+        subscriptions(),
+        table_waiters() {
+    socket.SetNonBlocking(true);
+}
+
+
+Server::Connection::~Connection(void) {
 }
@@ -2,34 +2,85 @@
 #define KIWI_SERVER_H_
 
 #include <deque>
+#include <functional>
+#include <map>
+#include <memory>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common/config.h"
 #include "common/buffered_socket.h"
+#include "common/frame_reader.h"
+#include "common/frame_writer.h"
 #include "common/io_utils.h"
+#include "common/poller.h"
 #include "common/protocol.h"
+#include "common/socket.h"
+#include "common/unbounded_blocking_queue.h"
+#include "io_uring_engine.h"
+#include "raft.h"
 #include "server_config.h"
 #include "storage.h"
+#include "transaction.h"
 
 
-class Server {
+class Server : public RaftTransport {
 public:
     Server(ServerConfig const& config, Storage& storage);
     ~Server(void);
 
+    // RaftTransport
+    void AdoptPeerConnection(uint32_t peer_id, int fd) override;
+    void SendToPeer(uint32_t peer_id, PeerRoute const& route, std::string frames) override;
+
+    // Delete copy constructor and copy assignment operator
+    Server(Server const& other) = delete;
+    Server& operator=(Server const& other) = delete;
+
 private:
+    /*
+     * How fresh a client read has to be. All zeros means linearizable, which
+     * only the leader serves. Otherwise any server may serve it, once it has
+     * heard from the leader within max_staleness_ms (if set) and has applied
+     * the table up to min_table_trx_id (if set).
+     */
+    struct ReadBound {
+        uint64_t min_table_trx_id;
+        uint32_t max_staleness_ms;
+    };
+
+    /*
+     * A client scan being streamed back in chunks. The next chunk is only
+     * read from storage once everything queued before it has been sent.
+     */
+    struct ClientScan {
+        uint32_t request_id;
+        uint64_t remaining;  // pairs left before the limit
+        std::unique_ptr<TableScan> scan;
+    };
+
+    /*
+     * A client's feed of one table's change log. Each credit lets one batch
+     * go out; once caught up, the subscription waits for the table's next
+     * transaction to be applied.
+     */
+    struct ClientSubscription {
+        uint64_t serial;  // tells a resubscription under the same request id apart from its predecessor
+        uint64_t database_id;
+        uint64_t table_id;
+        uint64_t next_trx_id;  // 0 until the oldest entry still kept is found
+        uint32_t credits;
+        uint64_t waiter_id;  // storage waiter id while waiting for the table's next transaction, 0 otherwise
+    };
+
     class Connection {
     public:
         Connection(int fd);
         ~Connection(void);
 
         enum class ReadState {
-            READING_MESSAGE_TYPE,
-            READING_CLIENT_HELLO_MAGIC_NUMBER,
-            READING_CLIENT_HELLO_PROTOCOL_VERSION,
-            READING_SERVER_HELLO_MAGIC_NUMBER,
-            READING_SERVER_HELLO_PROTOCOL_VERSION,
-            READING_SERVER_HELLO_SERVER_ID,
-            READING_SERVER_HELLO_CLUSTER_NAME_LENGTH,
-            READING_SERVER_HELLO_CLUSTER_NAME,
+            READING_MESSAGES,
             TERMINAL,
         };
 
@@ -39,43 +90,147 @@ private:
         bool interested_in_writes;
         ReadState read_state;
         bool close_connection_after_all_buffers_have_been_flushed;
+        bool closed;
+
+        // Completion-based (io_uring) bookkeeping; unused with the Poller
+        uint32_t inflight_operations;
+        bool send_in_flight;
+        bool send_queued;
 
         // Server Connection Data
         uint32_t server_id;
+        uint64_t peer_generation;  // non-zero once registered as the connection to server_id
+
+        // Client Connection Data
+        uint64_t client_generation;  // non-zero once the client's hello has been accepted
+        std::deque<ClientScan> scans;  // streamed round-robin, a chunk at a time
+        std::map<uint32_t, ClientSubscription> subscriptions;  // by request id
+        std::set<uint64_t> table_waiters;  // storage waiter ids of reads waiting for a table trx id
+    };
+
+    /*
+     * One event loop. Every IOThread owns its own poller, its own SO_REUSEPORT
+     * listen socket and its own set of connections, so the kernel spreads
+     * incoming connections across threads and nothing on the hot path is
+     * shared between them.
+     */
+    class IOThread {
+    public:
+        IOThread(ServerConfig const& config, Storage& storage, Raft& raft, size_t id);
+        ~IOThread(void);
+
+        void Start(void);
+        void Shutdown(void);
+        void Join(void);
+
+        // Thread-safe. Runs the task on this io thread.
+        void Post(std::function<void(void)> task);
+
+        // Thread-safe. Takes over a freshly dialed connection to a peer and says hello.
+        void AdoptPeerConnection(uint32_t peer_id, int fd);
+
+        // Thread-safe. Dropped if the peer's connection is no longer the one identified by `generation`.
+        void SendToPeer(uint32_t peer_id, uint64_t generation, std::string frames);
+
+        // Delete copy constructor and copy assignment operator
+        IOThread(IOThread const& other) = delete;
+        IOThread& operator=(IOThread const& other) = delete;
+
+    private:
+        ServerConfig const& config;
+        Storage& storage;
+        Raft& raft;
+        size_t id;
+        Socket listen_socket;
+        Poller poller;
+        UnboundedBlockingQueue<std::function<void(void)>> tasks;
+        pthread_t thread;
+        bool started;
+        std::set<Connection*> connections;
+        std::vector<Connection*> closed_connections;
+        std::unordered_map<uint32_t, Connection*> peer_connections;
+        uint64_t next_peer_generation;
+        std::unordered_map<uint64_t, Connection*> client_connections;  // by client_generation
+        uint64_t next_client_generation;
+        std::string scan_chunk;  // scratch space for encoding scan chunks
+        uint64_t next_subscription_serial;
+#if defined(HAVE_LIBURING)
+        IOUringEngine* uring;
+        std::vector<Connection*> pending_sends;
+#endif
+
+        static void* ThreadWrapper(void* ptr);
+        void ThreadMain(void);
+        void RunReadinessLoop(void);
+        void HandleUserEvent(uint32_t user_event, bool* shutdown);
+        void RunPostedTasks(void);
+        void PinToCPU(void);
+        void AcceptConnections(void);
+        Connection* AddConnection(int fd);
+        void RecvData(Connection* connection);
+        size_t ProcessMessages(Connection* connection, char const* data, size_t length, size_t* needed);
+        bool ProcessMessage(Connection* connection, FrameReader& reader);
+        void SendData(Connection* connection);
+
+        void SendClientHelloReply(Connection* connection);
+        void SendClientTestReply(Connection* connection, char const* payload, uint32_t payload_length);
+        void SendServerHello(Connection* connection);
+        void SendServerHelloReply(Connection* connection);
+        void RegisterPeer(Connection* connection, uint32_t peer_id);
+        void RegisterClient(Connection* connection);
+
+        /*
+         * Client requests finish on whichever thread raft or storage calls
+         * back on. `reply` is always run on this io thread, and only if the
+         * client is still connected.
+         */
+        void ReplyToClient(uint64_t client_generation, std::function<void(Connection*)> reply);
+        void ReadBarrier(Connection* connection, uint64_t database_id, uint64_t table_id, ReadBound bound, std::function<void(bool)> done);
+        void WaitForTable(uint64_t client_generation, uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, std::function<void(bool)> done);  // thread-safe
+        void HandleGet(Connection* connection, uint32_t request_id, uint64_t database_id, uint64_t table_id, ReadBound bound, std::string key);
+        void HandleWrite(Connection* connection, uint32_t reply_type, uint32_t request_id, Transaction const& transaction);
+        void HandleWriteWithOutcome(Connection* connection, uint32_t request_id, uint64_t database_id, Action action);
+        void HandleIncrement(Connection* connection, uint32_t request_id, uint64_t database_id, Action action, bool return_value);
+        bool HandleMultiGet(Connection* connection, char const* body, uint32_t body_length);  // false if the body is malformed
+        bool HandleMultiPut(Connection* connection, char const* body, uint32_t body_length);  // false if the body is malformed
+        bool HandleScan(Connection* connection, char const* body, uint32_t body_length);  // false if the body is malformed
+        void WriteScanChunk(Connection* connection);
+        void ResumeScansLater(Connection* connection);
+        bool HandleSubscribe(Connection* connection, uint32_t request_id, uint64_t database_id, uint64_t table_id, uint64_t from_trx_id, uint32_t credits);
+        void HandleSubscribeCredit(Connection* connection, uint32_t request_id, uint32_t credits);
+        void HandleUnsubscribe(Connection* connection, uint32_t request_id);
+        void EndSubscription(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code);
+        void PumpSubscription(Connection* connection, uint32_t request_id);
+        void ResumeSubscription(uint64_t client_generation, uint32_t request_id, uint64_t serial, bool woken);  // thread-safe
+        void SendGetReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, std::string const* value);
+        void SendMultiGetReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, std::vector<rocksdb::PinnableSlice> const* values, std::vector<bool> const* found);
+        void SendWriteReply(Connection* connection, uint32_t reply_type, uint32_t request_id, Protocol::ErrorCode error_code);
+        void SendStatusReply(Connection* connection, uint32_t request_id);
+        void SendCompareAndSetReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, bool swapped, std::string const* value);
+        void SendIncrementReply(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, uint64_t counter);
+        void SendSubscribeBatch(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, bool last, std::vector<TableLogEntry> const& entries);
+        void SendScanChunk(Connection* connection, uint32_t request_id, Protocol::ErrorCode error_code, bool last, uint32_t num_pairs, std::string const& pairs);
 
-        // Temporary buffers for incoming data
-        Buffer incoming_message_type_buffer;
-        Buffer incoming_magic_number_buffer;
-        Buffer incoming_protocol_version_buffer;
-        Buffer incoming_server_id_buffer;
-        Buffer incoming_cluster_name_length_buffer;
-        Buffer incoming_cluster_name_buffer;
+        void StopReadingAndSendErrorReplyAndClose(Connection* connection, Protocol::ErrorCode error_code, std::string error_message);
+        void SetReadInterest(Connection* connection, bool interested_in_reads);
+        void SetWriteInterest(Connection* connection, bool interested_in_writes);
+        void UpdateEventInterest(Connection* connection);
+        void CloseAndDestroy(Connection* connection);
+        void DestroyClosedConnections(void);
 
-        // Temporary buffers for outgoing data
-        std::deque<Buffer> outgoing_buffers;
+#if defined(HAVE_LIBURING)
+        void RunCompletionLoop(void);
+        void HandleRecvCompletion(IOUringEngine::Completion* completion);
+        void HandleSendCompletion(IOUringEngine::Completion* completion);
+        void QueueSend(Connection* connection);
+        void SubmitPendingSends(void);
+#endif
     };
 
     ServerConfig const& config;
     Storage& storage;
-    int kq;
-    pthread_t thread;
-    std::set<Connection*> connections;
-
-    static void* ThreadWrapper(void* ptr);
-    void ThreadMain(void);
-    void AddEventInterest(int ident, short filter, void* data);
-    void RemoveEventInterest(int ident, short filter);
-    void RecvData(Connection* connection);
-    void SendData(Connection* connection);
-
-    void SendClientHelloReply(Connection* connection);
-    void SendClientTestReply(Connection* connection);
-    void SendServerHelloReply(Connection* connection);    
-
-    void StopReadingAndSendErrorReplyAndClose(Connection* connection, Protocol::ErrorCode error_code, std::string error_message);
-    void SetReadInterest(Connection* connection, bool interested_in_reads);
-    void SetWriteInterest(Connection* connection, bool interested_in_writes);
-    void CloseAndDestroy(Connection* connection);
+    Raft* raft;
+    std::vector<IOThread*> io_threads;
 };
 
 #endif  // KIWI_SERVER_H_
@@ -1,3 +1,4 @@
+#include "common/buffered_socket.h"
 #include "common/constants.h"
 #include "common/exceptions.h"
 #include "common/file_utils.h"
@@ -65,6 +66,11 @@ static unordered_map<uint32_t, SocketAddress> ParseHostMap(char const* config_pa
         unordered_map<uint32_t, SocketAddress> result;
         for (YAML::const_iterator it = hosts.begin(); it != hosts.end(); ++it) {
             uint32_t key = it->first.as<uint32_t>();
+            if (key == 0) {
+                stringstream ss;
+                ss << "The keys of \"" << name << "\" in \"" << config_path << "\" must be server ids of 1 or more; 0 is reserved.";
+                throw ConfigurationException(ss.str());
+            }
             string value = it->second.as<string>();
             result.insert(make_pair(key, SocketAddress::FromString(value, Constants::DEFAULT_PORT)));
         }
@@ -81,6 +87,51 @@ static unordered_map<uint32_t, SocketAddress> ParseHostMap(char const* config_pa
 }
 
 
+// Keys are "<database id>.<table id>".
+static map<pair<uint64_t, uint64_t>, uint64_t> ParseTableMap(char const* config_path, YAML::Node const& yaml, string const& name) {
+    map<pair<uint64_t, uint64_t>, uint64_t> result;
+    auto tables = yaml[name];
+    if (!tables) {
+        return result;
+    }
+
+    if (!tables.IsMap()) {
+        stringstream ss;
+        ss << "The \"" << name << "\" configuration option in \"" << config_path << "\" must be a map.";
+        throw ConfigurationException(ss.str());
+    }
+
+    try {
+        for (YAML::const_iterator it = tables.begin(); it != tables.end(); ++it) {
+            string key = it->first.as<string>();
+            size_t dot = key.find('.');
+            if (dot == 0 || dot == string::npos || dot + 1 == key.length() ||
+                    key.find('.', dot + 1) != string::npos || key.find_first_not_of("0123456789.") != string::npos) {
+                stringstream ss;
+                ss << "The keys of \"" << name << "\" in \"" << config_path << "\" must look like \"<database id>.<table id>\", not \"" << key << "\".";
+                throw ConfigurationException(ss.str());
+            }
+            uint64_t database_id = stoull(key.substr(0, dot));
+            uint64_t table_id = stoull(key.substr(dot + 1));
+            result[make_pair(database_id, table_id)] = it->second.as<uint64_t>();
+        }
+        return result;
+
+    } catch (YAML::BadConversion& e) {
+        stringstream ss;
+        ss << "Error parsing \"" << name << "\" @ ";
+        ss << "file " << config_path << ", ";
+        ss << "line " << e.mark.line << ", ";
+        ss << "column " << e.mark.column << ".";
+        throw ConfigurationException(ss.str());
+    } catch (out_of_range const&) {
+        stringstream ss;
+        ss << "The keys of \"" << name << "\" in \"" << config_path << "\" must be valid database and table ids.";
+        throw ConfigurationException(ss.str());
+    }
+}
+
+
 ServerConfig ServerConfig::ParseFromFile(char const* config_path) {
     auto contents = FileUtils::ReadFile(config_path);
     auto yaml = YAML::Load(contents);
@@ -93,6 +144,11 @@ ServerConfig ServerConfig::ParseFromFile(char const* config_path) {
     }
 
     auto server_id = ParseRequiredParameter<uint32_t>(config_path, yaml, "server_id");
+    if (server_id == 0) {
+        stringstream ss;
+        ss << "The \"server_id\" configuration parameter must be 1 or more; 0 is reserved.";
+        throw ConfigurationException(ss.str());
+    }
     auto hosts = ParseHostMap(config_path, yaml, "hosts");
     if (hosts.find(server_id) == hosts.end()) {
         stringstream ss;
@@ -106,18 +162,65 @@ ServerConfig ServerConfig::ParseFromFile(char const* config_path) {
     auto bind_address = ParseRequiredParameter<string>(config_path, yaml, "bind_address");
     auto socket_address = SocketAddress::FromString(bind_address, Constants::DEFAULT_PORT);
 
-    return ServerConfig(cluster_name, server_id, socket_address, hosts, data_dir, use_ipv4, use_ipv6);
+    auto io_threads = ParseOptionalParameter<uint32_t>(config_path, yaml, "io_threads", 1);
+    if (io_threads < 1 || io_threads > Constants::MAX_IO_THREADS) {
+        stringstream ss;
+        ss << "The \"io_threads\" configuration parameter must be between 1 and " << Constants::MAX_IO_THREADS << ".";
+        throw ConfigurationException(ss.str());
+    }
+    auto pin_io_threads = ParseOptionalParameter<bool>(config_path, yaml, "pin_io_threads", false);
+
+    auto socket_buffer_max_size = ParseOptionalParameter<uint32_t>(config_path, yaml, "socket_buffer_max_size", BufferedSocket::DEFAULT_MAX_BUFFER_SIZE);
+    if (socket_buffer_max_size < BufferedSocket::MIN_BUFFER_SIZE || socket_buffer_max_size > Constants::MAX_MESSAGE_SIZE) {
+        stringstream ss;
+        ss << "The \"socket_buffer_max_size\" configuration parameter must be between " << BufferedSocket::MIN_BUFFER_SIZE << " and " << Constants::MAX_MESSAGE_SIZE << ".";
+        throw ConfigurationException(ss.str());
+    }
+
+    auto raft_log_batch_window_ms = ParseOptionalParameter<uint32_t>(config_path, yaml, "raft_log_batch_window_ms", 0);
+    if (raft_log_batch_window_ms > Constants::MAX_RAFT_LOG_BATCH_WINDOW_MS) {
+        stringstream ss;
+        ss << "The \"raft_log_batch_window_ms\" configuration parameter must be <= " << Constants::MAX_RAFT_LOG_BATCH_WINDOW_MS << ".";
+        throw ConfigurationException(ss.str());
+    }
+
+    auto raft_log_batch_max_size = ParseOptionalParameter<uint32_t>(config_path, yaml, "raft_log_batch_max_size", Constants::DEFAULT_RAFT_LOG_BATCH_MAX_SIZE);
+    if (raft_log_batch_max_size < 1 || raft_log_batch_max_size > Constants::MAX_MESSAGE_SIZE) {
+        stringstream ss;
+        ss << "The \"raft_log_batch_max_size\" configuration parameter must be between 1 and " << Constants::MAX_MESSAGE_SIZE << ".";
+        throw ConfigurationException(ss.str());
+    }
+
+    auto raft_snapshot_max_bytes_per_second = ParseOptionalParameter<uint64_t>(config_path, yaml, "raft_snapshot_max_bytes_per_second", Constants::DEFAULT_RAFT_SNAPSHOT_MAX_BYTES_PER_SECOND);
+    if (raft_snapshot_max_bytes_per_second < Constants::MIN_RAFT_SNAPSHOT_MAX_BYTES_PER_SECOND) {
+        stringstream ss;
+        ss << "The \"raft_snapshot_max_bytes_per_second\" configuration parameter must be >= " << Constants::MIN_RAFT_SNAPSHOT_MAX_BYTES_PER_SECOND << ".";
+        throw ConfigurationException(ss.str());
+    }
+
+    auto table_log_retention = ParseOptionalParameter<uint64_t>(config_path, yaml, "table_log_retention", Constants::DEFAULT_TABLE_LOG_RETENTION);
+    auto table_log_retention_overrides = ParseTableMap(config_path, yaml, "table_log_retention_overrides");
+
+    return ServerConfig(cluster_name, server_id, socket_address, hosts, data_dir, use_ipv4, use_ipv6, io_threads, pin_io_threads, socket_buffer_max_size, raft_log_batch_window_ms, raft_log_batch_max_size, raft_snapshot_max_bytes_per_second, table_log_retention, table_log_retention_overrides);
 }
 
 
-ServerConfig::ServerConfig(string const& cluster_name, uint32_t server_id, SocketAddress const& bind_address, unordered_map<uint32_t, SocketAddress> const& hosts, string const& data_dir, bool use_ipv4, bool use_ipv6) :
+ServerConfig::ServerConfig(string const& cluster_name, uint32_t server_id, SocketAddress const& bind_address, unordered_map<uint32_t, SocketAddress> const& hosts, string const& data_dir, bool use_ipv4, bool use_ipv6, size_t io_threads, bool pin_io_threads, size_t socket_buffer_max_size, uint32_t raft_log_batch_window_ms, size_t raft_log_batch_max_size, uint64_t raft_snapshot_max_bytes_per_second, uint64_t table_log_retention, map<pair<uint64_t, uint64_t>, uint64_t> const& table_log_retention_overrides) :
         cluster_name(cluster_name),
         server_id(server_id),
         bind_address(bind_address),
         hosts(hosts),
         data_dir(data_dir),
         use_ipv4(use_ipv4),
-        use_ipv6(use_ipv6) {}
+        use_ipv6(use_ipv6),
+        io_threads(io_threads),
+        pin_io_threads(pin_io_threads),
+        socket_buffer_max_size(socket_buffer_max_size),
+        raft_log_batch_window_ms(raft_log_batch_window_ms),
+        raft_log_batch_max_size(raft_log_batch_max_size),
+        raft_snapshot_max_bytes_per_second(raft_snapshot_max_bytes_per_second),
+        table_log_retention(table_log_retention),
+        table_log_retention_overrides(table_log_retention_overrides) {}
 
 
 string const& ServerConfig::ClusterName(void) const {
@@ -152,3 +255,39 @@ bool ServerConfig::UseIPV4(void) const {
 bool ServerConfig::UseIPV6(void) const {
     return use_ipv6;
 }
+
+
+size_t ServerConfig::IOThreads(void) const {
+    return io_threads;
+}
+
+
+bool ServerConfig::PinIOThreads(void) const {
+    return pin_io_threads;
+}
+
+
+size_t ServerConfig::SocketBufferMaxSize(void) const {
+    return socket_buffer_max_size;
+}
+
+
+uint32_t ServerConfig::RaftLogBatchWindowMs(void) const {
+    return raft_log_batch_window_ms;
+}
+
+
+size_t ServerConfig::RaftLogBatchMaxSize(void) const {
+    return raft_log_batch_max_size;
+}
+
+
+uint64_t ServerConfig::RaftSnapshotMaxBytesPerSecond(void) const {
+    return raft_snapshot_max_bytes_per_second;
+}
+
+
+uint64_t ServerConfig::TableLogRetention(uint64_t database_id, uint64_t table_id) const {
+    auto it = table_log_retention_overrides.find(make_pair(database_id, table_id));
+    return (it == table_log_retention_overrides.end()) ? (table_log_retention) : (it->second);
+}
@@ -2,14 +2,16 @@
 #define KIWI_SERVER_CONFIG_H_
 
 #include <cstdint>
+#include <map>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include "common/socket_address.h"
 
 
 class ServerConfig {
 public:
-    ServerConfig(std::string const& cluster_name, uint32_t server_id, SocketAddress const& bind_address, std::unordered_map<uint32_t, SocketAddress> const& hosts, std::string const& data_dir, bool use_ipv4, bool use_ipv6);
+    ServerConfig(std::string const& cluster_name, uint32_t server_id, SocketAddress const& bind_address, std::unordered_map<uint32_t, SocketAddress> const& hosts, std::string const& data_dir, bool use_ipv4, bool use_ipv6, size_t io_threads, bool pin_io_threads, size_t socket_buffer_max_size, uint32_t raft_log_batch_window_ms, size_t raft_log_batch_max_size, uint64_t raft_snapshot_max_bytes_per_second, uint64_t table_log_retention, std::map<std::pair<uint64_t, uint64_t>, uint64_t> const& table_log_retention_overrides);
     static ServerConfig ParseFromFile(char const* config_path);
     std::string const& ClusterName(void) const;
     uint32_t ServerId(void) const;
@@ -18,6 +20,15 @@ public:
     std::string const& DataDir(void) const;
     bool UseIPV4(void) const;
     bool UseIPV6(void) const;
+    size_t IOThreads(void) const;
+    bool PinIOThreads(void) const;
+    size_t SocketBufferMaxSize(void) const;
+    uint32_t RaftLogBatchWindowMs(void) const;
+    size_t RaftLogBatchMaxSize(void) const;
+    uint64_t RaftSnapshotMaxBytesPerSecond(void) const;
+
+    // How many of the table's latest change-log entries to keep; 0 keeps them all.
+    uint64_t TableLogRetention(uint64_t database_id, uint64_t table_id) const;
 
 private:
     std::string cluster_name;
@@ -27,6 +38,14 @@ private:
     std::string data_dir;
     bool use_ipv4;
     bool use_ipv6;
+    size_t io_threads;
+    bool pin_io_threads;
+    size_t socket_buffer_max_size;
+    uint32_t raft_log_batch_window_ms;
+    size_t raft_log_batch_max_size;
+    uint64_t raft_snapshot_max_bytes_per_second;
+    uint64_t table_log_retention;
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> table_log_retention_overrides;  // by (database id, table id)
 };
 
 #endif  // KIWI_SERVER_CONFIG_H_
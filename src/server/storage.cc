@@ -1,13 +1,285 @@
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "common/exceptions.h"
-/*#include "rocksdb/cache.h"
+#include "common/file_utils.h"
+#include "common/frame_reader.h"
+#include "common/frame_writer.h"
+#include "common/logger.h"
+#include "common/timing_utils.h"
+#include "rocksdb/cache.h"
 #include "rocksdb/filter_policy.h"
+#include "rocksdb/iterator.h"
+#include "rocksdb/merge_operator.h"
 #include "rocksdb/slice_transform.h"
-#include "rocksdb/table.h"*/
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/table.h"
+#include "rocksdb/write_batch.h"
 #include "storage.h"
 
 
-Storage::Storage(ServerConfig const& server_config) {
-    /*rocksdb::Options options;
+using namespace std;
+
+enum ApplyEventID {
+    kSHUTDOWN = 1,
+    kDELIVER = 2,
+    kTASK = 3,
+};
+
+// The apply thread cuts a WriteBatch once it holds this much.
+static const size_t kMaxApplyBatchBytes = 4 * 1024 * 1024;
+
+// Startup recovery reads this much of the raft_log tail at a time.
+static const size_t kMaxRecoveryChunkBytes = 64 * 1024 * 1024;
+
+// Each watched table keeps up to this much of its newest table log in memory.
+static const size_t kMaxTableTailBytes = 4 * 1024 * 1024;
+
+// How often the apply thread trims the table logs.
+static const uint64_t kTableLogRetentionIntervalMillis = 10000;
+
+static char const* const kRaftLog = "raft_log";
+static char const* const kMetadata = "kiwi_db_metadata";
+static char const* const kNextTrxIds = "kiwi_db_next_trx_ids";
+static char const* const kOldestLiveTrxIds = "kiwi_db_oldest_live_trx_ids";
+static char const* const kRaftTrxIdKey = "raft_trx_id";
+static char const* const kCurrentTermKey = "current_term";
+static char const* const kVotedForKey = "voted_for";
+static char const* const kRaftLogBaseKey = "raft_log_base";
+static char const* const kSnapshotInstallKey = "snapshot_install";
+static char const* const kRaftCommitIndexKey = "raft_commit_index";
+static char const* const kTableRaftTrxIdPrefix = "table_raft_trx_id";
+static char const* const kSnapshotFileSuffix = ".sst";
+
+// Length of the prefix the _data column families' prefix extractor (and bloom filters) work on.
+static const size_t kDataKeyPrefixLength = 4;
+
+// Table transaction ids start at 1 so that 0 can mean "none".
+static const uint64_t kFirstTableTrxId = 1;
+
+/*
+ * Ids are stored big-endian so that RocksDB's bytewise ordering matches
+ * numeric ordering.
+ */
+static string EncodeLong(uint64_t value) {
+    string encoded(8, '\0');
+    FrameWriter writer(&encoded[0]);
+    writer.PutLong(value);
+    return encoded;
+}
+
+
+static string EncodeTableId(uint64_t database_id, uint64_t table_id) {
+    string encoded(16, '\0');
+    FrameWriter writer(&encoded[0]);
+    writer.PutLong(database_id);
+    writer.PutLong(table_id);
+    return encoded;
+}
+
+
+static bool DecodeLong(rocksdb::Slice const& slice, uint64_t* value) {
+    FrameReader reader(slice.data(), slice.size());
+    return reader.GetLong(value) && reader.Position() == slice.size();
+}
+
+
+static bool DecodeLogValue(rocksdb::Slice const& value, uint64_t* term, rocksdb::Slice* transaction) {
+    FrameReader reader(value.data(), value.size());
+    if (!reader.GetLong(term)) {
+        return false;
+    }
+    *transaction = rocksdb::Slice(value.data() + 8, value.size() - 8);
+    return true;
+}
+
+
+/*
+ * INCREMENT operands and the counters they add up to are 8-byte big-endian
+ * two's complement values. Anything else a key holds counts as 0, so every
+ * replica ends up with the same counter whatever was Put there before.
+ */
+static uint64_t AddToCounter(rocksdb::Slice const* counter, uint64_t delta) {
+    uint64_t value;
+    if (counter == nullptr || !DecodeLong(*counter, &value)) {
+        value = 0;
+    }
+    return value + delta;
+}
+
+
+class CounterMergeOperator : public rocksdb::AssociativeMergeOperator {
+public:
+    char const* Name(void) const override {
+        return "kiwi.CounterMergeOperator";
+    }
+
+    bool Merge(rocksdb::Slice const&, rocksdb::Slice const* existing_value, rocksdb::Slice const& value, string* new_value, rocksdb::Logger*) const override {
+        uint64_t delta;
+        if (!DecodeLong(value, &delta)) {
+            delta = 0;
+        }
+        *new_value = EncodeLong(AddToCounter(existing_value, delta));
+        return true;
+    }
+};
+
+
+static string TableColumnFamilyName(uint64_t database_id, uint64_t table_id, char const* suffix) {
+    return "kiwi_db_" + to_string(database_id) + "_table_" + to_string(table_id) + "_" + suffix;
+}
+
+
+/*
+ * Recognizes kiwi_db_$DB_table_$TABLE_log and kiwi_db_$DB_table_$TABLE_data.
+ */
+static bool ParseTableColumnFamilyName(string const& name, uint64_t* database_id, uint64_t* table_id, bool* is_log) {
+    unsigned long long parsed_database_id;
+    unsigned long long parsed_table_id;
+    int suffix_offset = 0;
+    if (sscanf(name.c_str(), "kiwi_db_%llu_table_%llu_%n", &parsed_database_id, &parsed_table_id, &suffix_offset) != 2 || suffix_offset == 0) {
+        return false;
+    }
+
+    string suffix = name.substr(suffix_offset);
+    if (suffix != "log" && suffix != "data") {
+        return false;
+    }
+    *database_id = parsed_database_id;
+    *table_id = parsed_table_id;
+    *is_log = (suffix == "log");
+    return true;
+}
+
+
+/*
+ * A row event in a table's _log column family:
+ *     [1 byte for action type][4 bytes for key length][key][4 bytes for value length][value]
+ */
+static void AppendRowEvent(Action::Type action_type, string const& key, string const& value, string* events) {
+    size_t offset = events->length();
+    events->resize(offset + 1 + 4 + key.length() + 4 + value.length());
+
+    char type = static_cast<char>(action_type);
+    FrameWriter writer(&(*events)[offset]);
+    writer.PutBytes(&type, 1);
+    writer.PutInt(key.length());
+    writer.PutBytes(key.data(), key.length());
+    writer.PutInt(value.length());
+    writer.PutBytes(value.data(), value.length());
+}
+
+
+/*
+ * Adds a PUT, DELETE or INCREMENT to the batch and its row event to
+ * `events`. A COMPARE_AND_SET only gets here once it has matched, and is
+ * written and logged as the PUT it amounts to.
+ */
+static void ApplyRowAction(Action const& action, rocksdb::ColumnFamilyHandle* data, rocksdb::WriteBatch* batch, string* events) {
+    switch (action.type) {
+        case Action::Type::PUT:
+        case Action::Type::COMPARE_AND_SET:
+            batch->Put(data, action.key, action.value);
+            AppendRowEvent(Action::Type::PUT, action.key, action.value, events);
+            break;
+
+        case Action::Type::DELETE:
+            batch->Delete(data, action.key);
+            AppendRowEvent(action.type, action.key, action.value, events);
+            break;
+
+        case Action::Type::INCREMENT: {
+            string delta = EncodeLong(static_cast<uint64_t>(action.delta));
+            batch->Merge(data, action.key, delta);
+            AppendRowEvent(action.type, action.key, delta, events);
+            break;
+        }
+
+        case Action::Type::CREATE_TABLE:
+            break;
+    }
+}
+
+
+static bool ContainsCompareAndSet(vector<Action> const& actions) {
+    for (Action const& action : actions) {
+        if (action.type == Action::Type::COMPARE_AND_SET) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static uint64_t NowMillis(void) {
+    struct timespec now;
+    TimingUtils::Nanotime(&now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static void CheckStatus(rocksdb::Status const& status) {
+    if (!status.ok()) {
+        throw StorageException(status.ToString());
+    }
+}
+
+
+/*
+ * The smallest key that is greater than every key starting with `prefix`.
+ * Returns false if there's none (the prefix is all 0xff bytes).
+ */
+static bool PrefixSuccessor(string const& prefix, string* successor) {
+    *successor = prefix;
+    while (!successor->empty()) {
+        unsigned char last = static_cast<unsigned char>(successor->back());
+        if (last != 0xff) {
+            successor->back() = static_cast<char>(last + 1);
+            return true;
+        }
+        successor->pop_back();
+    }
+    return false;
+}
+
+
+Storage::Storage(ServerConfig const& server_config) :
+        config(server_config),
+        db(nullptr),
+        raft_log(nullptr),
+        metadata(nullptr),
+        next_trx_ids(nullptr),
+        oldest_live_trx_ids(nullptr),
+        log_batch(),
+        log_batch_bytes(0),
+        durable_commit_index(0),
+        delivered_raft_trx_id(0),
+        applied_raft_trx_id(0),
+        wakeup_pending(false),
+        poller(),
+        apply_tasks(poller, kTASK),
+        waiting(),
+        table_waiting(),
+        table_waiter_ids(),
+        table_waiter_deadlines(),
+        next_table_waiter_id(0),
+        applied_batches(0),
+        applied_transactions(0),
+        next_retention_at(0),
+        tails(),
+        tails_mutex(),
+        num_tails(0),
+        pending_tail_entries(),
+        expected_outcomes(),
+        outcomes_mutex(),
+        outcome_tickets(NowMillis() * 31 + server_config.ServerId()),
+        pending_outcomes() {
+
+    rocksdb::Options options;
     options.IncreaseParallelism();
     options.max_file_opening_threads = -1;
     options.max_background_jobs = 4;
@@ -19,7 +291,6 @@ Storage::Storage(ServerConfig const& server_config) {
     options.target_file_size_base = 256 * 1024 * 1024;
     options.create_if_missing = true;
     options.create_missing_column_families = true;
-    options.prefix_extractor.reset(rocksdb::NewCappedPrefixTransform(4));
 
     rocksdb::BlockBasedTableOptions table_options;
     table_options.block_cache = rocksdb::NewLRUCache(128 * 1024 * 1024);
@@ -32,18 +303,1576 @@ Storage::Storage(ServerConfig const& server_config) {
     table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, true));
     options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
 
+    /*
+     * Log column families are keyed by 8-byte big-endian ids and read with
+     * in-order scans, which a 4-byte prefix extractor would break; only the
+     * user-keyed _data column families get one.
+     */
+    log_options = rocksdb::ColumnFamilyOptions(options);
+    data_options = rocksdb::ColumnFamilyOptions(options);
+    data_options.prefix_extractor.reset(rocksdb::NewCappedPrefixTransform(kDataKeyPrefixLength));
+    data_options.merge_operator = make_shared<CounterMergeOperator>();
+
+    // Every existing column family must be opened, including per-table ones.
     string const& data_dir = server_config.DataDir();
-    rocksdb::Status status = rocksdb::DB::Open(options, data_dir, &db);
+    vector<string> names;
+    rocksdb::Status status = rocksdb::DB::ListColumnFamilies(options, data_dir, &names);
+    if (!status.ok()) {
+        // Brand new database
+        names = {rocksdb::kDefaultColumnFamilyName};
+    }
+    for (char const* name : {kRaftLog, kMetadata, kNextTrxIds, kOldestLiveTrxIds}) {
+        if (find(names.begin(), names.end(), name) == names.end()) {
+            names.push_back(name);
+        }
+    }
+
+    vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+    for (string const& name : names) {
+        uint64_t database_id;
+        uint64_t table_id;
+        bool is_log;
+        bool is_data = ParseTableColumnFamilyName(name, &database_id, &table_id, &is_log) && !is_log;
+        descriptors.emplace_back(name, (is_data) ? (data_options) : (log_options));
+    }
+
+    status = rocksdb::DB::Open(options, data_dir, descriptors, &handles, &db);
     if (!status.ok()) {
         throw StorageException(status.ToString());
-    }*/
-}
+    }
 
+    for (size_t i = 0; i < names.size(); i++) {
+        uint64_t database_id;
+        uint64_t table_id;
+        bool is_log;
+        if (names[i] == kRaftLog) {
+            raft_log = handles[i];
+        } else if (names[i] == kMetadata) {
+            metadata = handles[i];
+        } else if (names[i] == kNextTrxIds) {
+            next_trx_ids = handles[i];
+        } else if (names[i] == kOldestLiveTrxIds) {
+            oldest_live_trx_ids = handles[i];
+        } else if (ParseTableColumnFamilyName(names[i], &database_id, &table_id, &is_log)) {
+            auto result = tables.emplace(TableId(database_id, table_id), Table{nullptr, nullptr, 0});
+            Table& table = result.first->second;
+            ((is_log) ? (table.log) : (table.data)) = handles[i];
+        }
+    }
 
-void Deliver(uint64_t offset) {
+    try {
+        ResumeSnapshotInstall();
+        applied_raft_trx_id = ReadLong(metadata, kRaftTrxIdKey, 0);
+        durable_commit_index = ReadLong(metadata, kRaftCommitIndexKey, 0);
+        RollForward();
+        delivered_raft_trx_id = applied_raft_trx_id.load();
+
+        int err = pthread_create(&apply_thread, nullptr, ApplyThreadWrapper, this);
+        if (err != 0) {
+            throw StorageException("Error creating apply thread: " + string(strerror(err)));
+        }
+    } catch (...) {
+        Close();
+        throw;
+    }
+    KIWI_LOG_INFO("Opened storage at " << data_dir << " with " << tables.size() << " tables, applied raft trx id " << applied_raft_trx_id);
 }
 
 
 Storage::~Storage(void) {
-    /*delete db;*/
+    // The apply thread finishes off everything delivered so far before exiting.
+    poller.Trigger(kSHUTDOWN);
+    int err = pthread_join(apply_thread, nullptr);
+    if (err != 0) {
+        KIWI_LOG_FATAL("Problem joining apply thread: " << strerror(err));
+        abort();
+    }
+    Close();
+}
+
+
+void Storage::Close(void) noexcept {
+    for (rocksdb::ColumnFamilyHandle* handle : handles) {
+        db->DestroyColumnFamilyHandle(handle);
+    }
+    handles.clear();
+    delete db;
+    db = nullptr;
+}
+
+
+void Storage::StageLogEntry(LogEntry const& entry) {
+    string value;
+    value.resize(8);
+    FrameWriter writer(&value[0]);
+    writer.PutLong(entry.term);
+    value.append(entry.transaction);
+    log_batch.Put(raft_log, EncodeLong(entry.index), value);
+    log_batch_bytes += 8 + value.length();
+}
+
+
+void Storage::StageLogTruncation(uint64_t index) {
+    if (index <= applied_raft_trx_id.load(memory_order_acquire)) {
+        throw StorageException("Refusing to truncate applied raft_log entry " + to_string(index));
+    }
+
+    log_batch.DeleteRange(raft_log, EncodeLong(index), EncodeLong(UINT64_MAX));
+    log_batch_bytes += 8 + 8;
+}
+
+
+size_t Storage::StagedLogBytes(void) const noexcept {
+    return log_batch_bytes;
+}
+
+
+void Storage::SyncLog(void) {
+    if (log_batch_bytes == 0) {
+        return;
+    }
+
+    // Rides along for startup recovery; everything delivered is on our log.
+    uint64_t delivered = delivered_raft_trx_id.load(memory_order_relaxed);
+    if (delivered > durable_commit_index) {
+        log_batch.Put(metadata, kRaftCommitIndexKey, EncodeLong(delivered));
+        durable_commit_index = delivered;
+    }
+
+    rocksdb::WriteOptions write_options;
+    write_options.sync = true;
+    CheckStatus(db->Write(write_options, &log_batch));
+    log_batch.Clear();
+    log_batch_bytes = 0;
+}
+
+
+void Storage::ReadLog(uint64_t index, size_t max_entries, size_t max_bytes, vector<LogEntry>* entries) {
+    string lower_bound = EncodeLong(index);
+    unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(rocksdb::ReadOptions(), raft_log));
+
+    size_t num_bytes = 0;
+    uint64_t expected_index = index;
+    for (iterator->Seek(lower_bound); iterator->Valid() && max_entries > 0 && num_bytes < max_bytes; iterator->Next()) {
+        LogEntry entry;
+        rocksdb::Slice transaction;
+        if (!DecodeLong(iterator->key(), &entry.index) || entry.index != expected_index || !DecodeLogValue(iterator->value(), &entry.term, &transaction)) {
+            throw StorageException("Corrupt raft_log entry at index " + to_string(expected_index));
+        }
+        entry.transaction = transaction.ToString();
+        num_bytes += entry.transaction.length();
+        entries->push_back(move(entry));
+        expected_index++;
+        max_entries--;
+    }
+    CheckStatus(iterator->status());
+}
+
+
+bool Storage::ReadLogTerm(uint64_t index, uint64_t* term) {
+    string value;
+    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), raft_log, EncodeLong(index), &value);
+    if (status.IsNotFound()) {
+        return false;
+    }
+    CheckStatus(status);
+
+    rocksdb::Slice transaction;
+    if (!DecodeLogValue(value, term, &transaction)) {
+        throw StorageException("Corrupt raft_log entry at index " + to_string(index));
+    }
+    return true;
+}
+
+
+void Storage::ReadLastLogEntry(uint64_t* index, uint64_t* term) {
+    unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(rocksdb::ReadOptions(), raft_log));
+    iterator->SeekToLast();
+    if (!iterator->Valid()) {
+        CheckStatus(iterator->status());
+        ReadLogBaseAt(nullptr, index, term);
+        return;
+    }
+
+    rocksdb::Slice transaction;
+    if (!DecodeLong(iterator->key(), index) || !DecodeLogValue(iterator->value(), term, &transaction)) {
+        throw StorageException("Corrupt last raft_log entry");
+    }
+}
+
+
+void Storage::ReadLogBase(uint64_t* index, uint64_t* term) {
+    ReadLogBaseAt(nullptr, index, term);
+}
+
+
+void Storage::ReadLogBaseAt(rocksdb::Snapshot const* snapshot, uint64_t* index, uint64_t* term) {
+    string value;
+    rocksdb::ReadOptions read_options;
+    read_options.snapshot = snapshot;
+    rocksdb::Status status = db->Get(read_options, metadata, kRaftLogBaseKey, &value);
+    if (status.IsNotFound()) {
+        *index = 0;
+        *term = 0;
+        return;
+    }
+    CheckStatus(status);
+
+    FrameReader reader(value.data(), value.size());
+    if (!reader.GetLong(index) || !reader.GetLong(term)) {
+        throw StorageException("Corrupt raft_log base");
+    }
+}
+
+
+void Storage::LoadHardState(uint64_t* current_term, uint32_t* voted_for) {
+    *current_term = ReadLong(metadata, kCurrentTermKey, 0);
+    *voted_for = static_cast<uint32_t>(ReadLong(metadata, kVotedForKey, 0));
+}
+
+
+/*
+ * Must be durable before raft acts on it (e.g. replies to a vote request).
+ */
+void Storage::SaveHardState(uint64_t current_term, uint32_t voted_for) {
+    rocksdb::WriteBatch batch;
+    batch.Put(metadata, kCurrentTermKey, EncodeLong(current_term));
+    batch.Put(metadata, kVotedForKey, EncodeLong(voted_for));
+
+    rocksdb::WriteOptions write_options;
+    write_options.sync = true;
+    CheckStatus(db->Write(write_options, &batch));
+}
+
+
+/*
+ * Lock-free and, unless the apply thread has to be woken up, syscall-free.
+ */
+void Storage::Deliver(uint64_t offset) {
+    delivered_raft_trx_id.store(offset);
+    if (!wakeup_pending.load(memory_order_relaxed) && !wakeup_pending.exchange(true)) {
+        poller.Trigger(kDELIVER);
+    }
+}
+
+
+uint64_t Storage::AppliedRaftTrxId(void) const noexcept {
+    return applied_raft_trx_id.load(memory_order_acquire);
+}
+
+
+uint64_t Storage::ApplyLag(void) const noexcept {
+    uint64_t applied = applied_raft_trx_id.load(memory_order_acquire);
+    uint64_t delivered = delivered_raft_trx_id.load(memory_order_acquire);
+    return (delivered > applied) ? (delivered - applied) : (0);
+}
+
+
+void Storage::WhenApplied(uint64_t raft_trx_id, function<void()> callback) {
+    if (applied_raft_trx_id.load(memory_order_acquire) >= raft_trx_id) {
+        callback();
+        return;
+    }
+    apply_tasks.Enqueue([this, raft_trx_id, callback]() {
+        waiting.emplace(raft_trx_id, move(callback));
+    });
+}
+
+
+void Storage::WhenTableApplied(uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, uint32_t timeout_ms, uint64_t waiter_id, function<void(bool)> callback) {
+    if (AppliedTableTrxId(database_id, table_id, nullptr) >= table_trx_id) {
+        callback(true);
+        return;
+    }
+    if (waiter_id == 0) {
+        waiter_id = NewTableWaiterId();
+    }
+    uint64_t deadline = (timeout_ms != 0) ? (NowMillis() + timeout_ms) : (0);
+
+    // Tables are only advanced on the apply thread, so checking again there can't miss an update.
+    apply_tasks.Enqueue([this, database_id, table_id, table_trx_id, deadline, waiter_id, callback]() {
+        if (AppliedTableTrxId(database_id, table_id, nullptr) >= table_trx_id) {
+            callback(true);
+            return;
+        }
+        TableId waiting_table(database_id, table_id);
+        table_waiting[waiting_table].emplace(table_trx_id, TableWaiter{waiter_id, move(callback)});
+        table_waiter_ids.emplace(waiter_id, make_pair(waiting_table, table_trx_id));
+        if (deadline != 0) {
+            table_waiter_deadlines.emplace(deadline, waiter_id);
+        }
+    });
+}
+
+
+uint64_t Storage::NewTableWaiterId(void) noexcept {
+    return next_table_waiter_id.fetch_add(1, memory_order_relaxed) + 1;
+}
+
+
+void Storage::ForgetTableWaiter(uint64_t waiter_id) {
+    apply_tasks.Enqueue([this, waiter_id]() {
+        function<void(bool)> callback;
+        TakeTableWaiter(waiter_id, &callback);
+    });
+}
+
+
+uint64_t Storage::ExpectOutcome(OutcomeCallback callback) {
+    lock_guard<mutex> guard(outcomes_mutex);
+    uint64_t ticket;
+    do {
+        ticket = outcome_tickets();
+    } while (ticket == 0 || expected_outcomes.count(ticket) != 0);
+    expected_outcomes.emplace(ticket, move(callback));
+    return ticket;
+}
+
+
+bool Storage::ForgetOutcome(uint64_t ticket) {
+    lock_guard<mutex> guard(outcomes_mutex);
+    return expected_outcomes.erase(ticket) != 0;
+}
+
+
+void Storage::DropWaiters(void) {
+    mutex dropped_mutex;
+    condition_variable dropped_condition;
+    bool dropped = false;
+    apply_tasks.Enqueue([&](void) {
+        waiting.clear();
+        table_waiting.clear();
+        table_waiter_ids.clear();
+        table_waiter_deadlines.clear();
+        lock_guard<mutex> outcomes_guard(outcomes_mutex);
+        expected_outcomes.clear();
+        lock_guard<mutex> guard(dropped_mutex);
+        dropped = true;
+        dropped_condition.notify_one();
+    });
+
+    unique_lock<mutex> lock(dropped_mutex);
+    dropped_condition.wait(lock, [&](void) { return dropped; });
+}
+
+
+bool Storage::Get(uint64_t database_id, uint64_t table_id, string const& key, string* value) {
+    rocksdb::ColumnFamilyHandle* data;
+    {
+        shared_lock<shared_mutex> guard(tables_mutex);
+        auto it = tables.find(TableId(database_id, table_id));
+        if (it == tables.end() || it->second.data == nullptr) {
+            return false;
+        }
+        data = it->second.data;
+    }
+
+    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), data, key, value);
+    if (status.IsNotFound()) {
+        return false;
+    }
+    CheckStatus(status);
+    return true;
+}
+
+
+/*
+ * RocksDB's batched MultiGet sorts the keys once and shares bloom filter
+ * probes and block cache lookups between keys that land in the same blocks.
+ */
+void Storage::MultiGet(uint64_t database_id, uint64_t table_id, vector<rocksdb::Slice> const& keys, vector<rocksdb::PinnableSlice>* values, vector<bool>* found) {
+    values->clear();
+    values->resize(keys.size());
+    found->assign(keys.size(), false);
+
+    rocksdb::ColumnFamilyHandle* data;
+    {
+        shared_lock<shared_mutex> guard(tables_mutex);
+        auto it = tables.find(TableId(database_id, table_id));
+        if (it == tables.end() || it->second.data == nullptr) {
+            return;
+        }
+        data = it->second.data;
+    }
+
+    vector<rocksdb::Status> statuses(keys.size());
+    db->MultiGet(rocksdb::ReadOptions(), data, keys.size(), keys.data(), values->data(), statuses.data());
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (statuses[i].IsNotFound()) {
+            continue;
+        }
+        CheckStatus(statuses[i]);
+        (*found)[i] = true;
+    }
+}
+
+
+/*
+ * The prefix and the key range are both turned into iterator bounds, so the
+ * scan stops at the first key past them rather than at the end of the table.
+ * A prefix at least as long as the prefix extractor's also lets RocksDB skip
+ * every SST file whose bloom filter rules it out; shorter ones (and no
+ * prefix at all) have to be read in total order.
+ */
+unique_ptr<TableScan> Storage::OpenScan(uint64_t database_id, uint64_t table_id, string const& start_key, string const& end_key, string const& prefix) {
+    unique_ptr<TableScan> scan(new TableScan(db));
+
+    rocksdb::ColumnFamilyHandle* data;
+    {
+        shared_lock<shared_mutex> guard(tables_mutex);
+        auto it = tables.find(TableId(database_id, table_id));
+        if (it == tables.end() || it->second.data == nullptr) {
+            return scan;
+        }
+        data = it->second.data;
+    }
+
+    scan->lower_bound = max(start_key, prefix);
+    bool has_upper_bound = !end_key.empty();
+    scan->upper_bound = end_key;
+    string prefix_successor;
+    if (!prefix.empty() && PrefixSuccessor(prefix, &prefix_successor)) {
+        if (!has_upper_bound || prefix_successor < scan->upper_bound) {
+            scan->upper_bound = prefix_successor;
+        }
+        has_upper_bound = true;
+    }
+    scan->lower_bound_slice = rocksdb::Slice(scan->lower_bound);
+    scan->upper_bound_slice = rocksdb::Slice(scan->upper_bound);
+
+    scan->snapshot = db->GetSnapshot();
+    rocksdb::ReadOptions read_options;
+    read_options.snapshot = scan->snapshot;
+    read_options.iterate_lower_bound = &scan->lower_bound_slice;
+    if (has_upper_bound) {
+        read_options.iterate_upper_bound = &scan->upper_bound_slice;
+    }
+    if (prefix.length() >= kDataKeyPrefixLength) {
+        read_options.prefix_same_as_start = true;
+    } else {
+        read_options.total_order_seek = true;
+    }
+    scan->iterator.reset(db->NewIterator(read_options, data));
+    scan->iterator->Seek(scan->lower_bound_slice);
+    CheckStatus(scan->iterator->status());
+    return scan;
+}
+
+
+/*
+ * kiwi_db_next_trx_ids is written in the same batch as the table's rows, so
+ * it's exactly in step with whatever the snapshot sees.
+ */
+uint64_t Storage::AppliedTableTrxId(uint64_t database_id, uint64_t table_id, rocksdb::Snapshot const* snapshot) {
+    string value;
+    rocksdb::ReadOptions read_options;
+    read_options.snapshot = snapshot;
+    rocksdb::Status status = db->Get(read_options, next_trx_ids, EncodeTableId(database_id, table_id), &value);
+    if (status.IsNotFound()) {
+        return 0;
+    }
+    CheckStatus(status);
+
+    uint64_t next_trx_id;
+    if (!DecodeLong(value, &next_trx_id)) {
+        throw StorageException("Corrupt next trx id for database " + to_string(database_id) + " table " + to_string(table_id));
+    }
+    return next_trx_id - kFirstTableTrxId;
+}
+
+
+uint64_t Storage::ReadTableLog(uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, size_t max_entries, size_t max_bytes, rocksdb::Snapshot const* snapshot, vector<TableLogEntry>* entries) {
+    rocksdb::ColumnFamilyHandle* log;
+    {
+        shared_lock<shared_mutex> guard(tables_mutex);
+        auto it = tables.find(TableId(database_id, table_id));
+        if (it == tables.end() || it->second.log == nullptr) {
+            return kFirstTableTrxId;
+        }
+        log = it->second.log;
+    }
+
+    // The first live id and the tombstone below it must come from the same view.
+    rocksdb::Snapshot const* own_snapshot = nullptr;
+    if (snapshot == nullptr) {
+        own_snapshot = db->GetSnapshot();
+        snapshot = own_snapshot;
+    }
+
+    try {
+        uint64_t oldest_live = ReadLong(oldest_live_trx_ids, EncodeTableId(database_id, table_id), kFirstTableTrxId, snapshot);
+        string lower_bound = EncodeLong(max(table_trx_id, oldest_live));
+        rocksdb::Slice lower_bound_slice(lower_bound);
+        rocksdb::ReadOptions read_options;
+        read_options.snapshot = snapshot;
+        read_options.iterate_lower_bound = &lower_bound_slice;
+        unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(read_options, log));
+
+        size_t num_bytes = 0;
+        for (iterator->Seek(lower_bound); iterator->Valid() && max_entries > 0 && num_bytes < max_bytes; iterator->Next()) {
+            TableLogEntry entry;
+            if (!DecodeLong(iterator->key(), &entry.table_trx_id)) {
+                throw StorageException("Corrupt table log key for database " + to_string(database_id) + " table " + to_string(table_id));
+            }
+            entry.row_events = iterator->value().ToString();
+            num_bytes += entry.row_events.length();
+            entries->push_back(move(entry));
+            max_entries--;
+        }
+        CheckStatus(iterator->status());
+
+        if (own_snapshot != nullptr) {
+            db->ReleaseSnapshot(own_snapshot);
+        }
+        return oldest_live;
+    } catch (...) {
+        if (own_snapshot != nullptr) {
+            db->ReleaseSnapshot(own_snapshot);
+        }
+        throw;
+    }
+}
+
+
+void Storage::WatchTable(uint64_t database_id, uint64_t table_id) {
+    lock_guard<mutex> guard(tails_mutex);
+    auto inserted = tails.emplace(TableId(database_id, table_id), TableTail{0, {}, 0});
+    inserted.first->second.watchers++;
+    num_tails.store(tails.size(), memory_order_relaxed);
+}
+
+
+void Storage::UnwatchTable(uint64_t database_id, uint64_t table_id) {
+    lock_guard<mutex> guard(tails_mutex);
+    auto it = tails.find(TableId(database_id, table_id));
+    if (it != tails.end() && --it->second.watchers == 0) {
+        tails.erase(it);
+        num_tails.store(tails.size(), memory_order_relaxed);
+    }
+}
+
+
+/*
+ * A tail starts with whatever entry is applied first after the table is
+ * watched, so it may not reach back to `table_trx_id` yet; past its end is
+ * simply nothing new.
+ */
+bool Storage::ReadTableTail(uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, size_t max_entries, size_t max_bytes, vector<TableLogEntry>* entries) {
+    lock_guard<mutex> guard(tails_mutex);
+    auto it = tails.find(TableId(database_id, table_id));
+    if (it == tails.end() || it->second.entries.empty()) {
+        return false;
+    }
+
+    deque<TableLogEntry> const& tail = it->second.entries;
+    uint64_t first = tail.front().table_trx_id;
+    if (table_trx_id < first || table_trx_id > tail.back().table_trx_id + 1) {
+        return false;
+    }
+
+    size_t bytes = 0;
+    for (size_t i = table_trx_id - first; i < tail.size() && entries->size() < max_entries && bytes < max_bytes; i++) {
+        entries->push_back(tail[i]);
+        bytes += tail[i].row_events.length();
+    }
+    return true;
+}
+
+
+/*
+ * Runs right after the batch is written, so a watcher that is woken up by
+ * WhenTableApplied() finds the new entries here. A tail that would no longer
+ * be consecutive (after a snapshot install) starts over.
+ */
+void Storage::AppendToTails(void) {
+    lock_guard<mutex> guard(tails_mutex);
+    for (auto& pending : pending_tail_entries) {
+        auto it = tails.find(pending.first);
+        if (it == tails.end()) {
+            continue;
+        }
+
+        TableTail& tail = it->second;
+        if (!tail.entries.empty() && tail.entries.back().table_trx_id + 1 != pending.second.table_trx_id) {
+            tail.entries.clear();
+            tail.bytes = 0;
+        }
+        tail.bytes += pending.second.row_events.length();
+        tail.entries.push_back(move(pending.second));
+        while (tail.bytes > kMaxTableTailBytes && tail.entries.size() > 1) {
+            tail.bytes -= tail.entries.front().row_events.length();
+            tail.entries.pop_front();
+        }
+    }
+    pending_tail_entries.clear();
+}
+
+
+/*
+ * Everything is read through one RocksDB snapshot, whose applied raft trx id
+ * the snapshot is then labelled with. Each column family is written out with
+ * SstFileWriter, so the files can go straight into IngestExternalFile() on
+ * the other side.
+ */
+void Storage::CreateSnapshot(string const& dir, SnapshotInfo* info) {
+    FileUtils::MakeDirectory(dir);
+
+    // The tables are listed only once the snapshot is taken. A table is in
+    // `tables` before anything is written to it, so every table the snapshot
+    // has data for is listed; any added since are empty in it and skipped.
+    rocksdb::Snapshot const* snapshot = db->GetSnapshot();
+    try {
+        vector<pair<string, rocksdb::ColumnFamilyHandle*>> column_families;
+        column_families.emplace_back(kNextTrxIds, next_trx_ids);
+        column_families.emplace_back(kOldestLiveTrxIds, oldest_live_trx_ids);
+        {
+            shared_lock<shared_mutex> guard(tables_mutex);
+            for (auto const& entry : tables) {
+                column_families.emplace_back(TableColumnFamilyName(entry.first.first, entry.first.second, "log"), entry.second.log);
+                column_families.emplace_back(TableColumnFamilyName(entry.first.first, entry.first.second, "data"), entry.second.data);
+            }
+        }
+
+        info->index = ReadLong(metadata, kRaftTrxIdKey, 0, snapshot);
+        uint64_t base_index;
+        ReadLogBaseAt(snapshot, &base_index, &info->term);
+        if (info->index != base_index) {
+            string value;
+            rocksdb::ReadOptions read_options;
+            read_options.snapshot = snapshot;
+            CheckStatus(db->Get(read_options, raft_log, EncodeLong(info->index), &value));
+            rocksdb::Slice transaction;
+            if (!DecodeLogValue(value, &info->term, &transaction)) {
+                throw StorageException("Corrupt raft_log entry at index " + to_string(info->index));
+            }
+        }
+
+        info->files.clear();
+        for (auto const& column_family : column_families) {
+            bool is_log;
+            uint64_t database_id;
+            uint64_t table_id;
+            bool is_table = ParseTableColumnFamilyName(column_family.first, &database_id, &table_id, &is_log);
+            bool is_data = is_table && !is_log;
+
+            // Table logs start at their first live entry, past any purged ones.
+            string lower_bound;
+            if (is_table && is_log) {
+                lower_bound = EncodeLong(ReadLong(oldest_live_trx_ids, EncodeTableId(database_id, table_id), kFirstTableTrxId, snapshot));
+            }
+            rocksdb::Slice lower_bound_slice(lower_bound);
+            rocksdb::ReadOptions read_options;
+            read_options.snapshot = snapshot;
+            read_options.fill_cache = false;
+            if (!lower_bound.empty()) {
+                read_options.iterate_lower_bound = &lower_bound_slice;
+            }
+            unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(read_options, column_family.second));
+            iterator->Seek(lower_bound);
+            if (!iterator->Valid()) {
+                CheckStatus(iterator->status());
+                continue;
+            }
+
+            rocksdb::Options options(rocksdb::DBOptions(), (is_data) ? (data_options) : (log_options));
+            rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), options, column_family.second);
+
+            string name = column_family.first + kSnapshotFileSuffix;
+            CheckStatus(writer.Open(dir + "/" + name));
+            for (; iterator->Valid(); iterator->Next()) {
+                CheckStatus(writer.Put(iterator->key(), iterator->value()));
+            }
+            CheckStatus(iterator->status());
+            CheckStatus(writer.Finish());
+            info->files.push_back(name);
+        }
+    } catch (...) {
+        db->ReleaseSnapshot(snapshot);
+        throw;
+    }
+    db->ReleaseSnapshot(snapshot);
+}
+
+
+void Storage::InstallSnapshot(string const& dir, SnapshotInfo const& info, function<void()> done) {
+    apply_tasks.Enqueue([this, dir, info, done]() {
+        KIWI_LOG_INFO("Installing snapshot at raft trx id " << info.index << " (term " << info.term << ") from " << dir);
+        for (string const& file : info.files) {
+            FileUtils::Sync(dir + "/" + file);
+        }
+        FileUtils::Sync(dir);
+
+        // From here on a restart picks up where we left off; see ResumeSnapshotInstall().
+        string marker(8 + 8, '\0');
+        FrameWriter writer(&marker[0]);
+        writer.PutLong(info.index);
+        writer.PutLong(info.term);
+        marker.append(dir);
+
+        rocksdb::WriteOptions write_options;
+        write_options.sync = true;
+        CheckStatus(db->Put(write_options, metadata, kSnapshotInstallKey, marker));
+
+        ReplaceTables(dir, info);
+        done();
+    });
+}
+
+
+/*
+ * Wipes the tables, ingests the snapshot's files and then, in one synced
+ * batch, moves the applied raft trx id and the raft_log base to the snapshot
+ * and clears the install marker. Safe to repeat after a crash at any point.
+ */
+void Storage::ReplaceTables(string const& dir, SnapshotInfo const& info) {
+    // The table logs are about to be replaced wholesale; watchers go back to reading them.
+    {
+        lock_guard<mutex> guard(tails_mutex);
+        for (auto& entry : tails) {
+            entry.second.entries.clear();
+            entry.second.bytes = 0;
+        }
+    }
+
+    rocksdb::WriteBatch batch;
+    ClearColumnFamily(next_trx_ids, &batch);
+    ClearColumnFamily(oldest_live_trx_ids, &batch);
+    for (auto& entry : tables) {
+        ClearColumnFamily(entry.second.log, &batch);
+        ClearColumnFamily(entry.second.data, &batch);
+        entry.second.next_trx_id = 0;
+    }
+    CheckStatus(db->Write(rocksdb::WriteOptions(), &batch));
+    batch.Clear();
+
+    for (string const& file : info.files) {
+        string name = file.substr(0, file.length() - strlen(kSnapshotFileSuffix));
+        rocksdb::ColumnFamilyHandle* column_family;
+        uint64_t database_id;
+        uint64_t table_id;
+        bool is_log;
+        if (name == kNextTrxIds) {
+            column_family = next_trx_ids;
+        } else if (name == kOldestLiveTrxIds) {
+            column_family = oldest_live_trx_ids;
+        } else if (ParseTableColumnFamilyName(name, &database_id, &table_id, &is_log)) {
+            Table& table = OpenTable(TableId(database_id, table_id));
+            column_family = (is_log) ? (table.log) : (table.data);
+        } else {
+            throw StorageException("Unexpected snapshot file " + file);
+        }
+
+        // Copied rather than moved, so that the files are still there if we have to start over.
+        rocksdb::IngestExternalFileOptions ingest_options;
+        ingest_options.move_files = false;
+        CheckStatus(db->IngestExternalFile(column_family, {dir + "/" + file}, ingest_options));
+    }
+
+    string base(8 + 8, '\0');
+    FrameWriter writer(&base[0]);
+    writer.PutLong(info.index);
+    writer.PutLong(info.term);
+    batch.DeleteRange(raft_log, EncodeLong(0), EncodeLong(UINT64_MAX));
+    batch.Put(metadata, kRaftLogBaseKey, base);
+    batch.Put(metadata, kRaftTrxIdKey, EncodeLong(info.index));
+    batch.Put(metadata, kRaftCommitIndexKey, EncodeLong(info.index));
+    batch.Delete(metadata, kSnapshotInstallKey);
+
+    rocksdb::WriteOptions write_options;
+    write_options.sync = true;
+    CheckStatus(db->Write(write_options, &batch));
+    FileUtils::RemoveDirectory(dir);
+
+    applied_raft_trx_id.store(info.index, memory_order_release);
+    if (delivered_raft_trx_id.load() < info.index) {
+        delivered_raft_trx_id.store(info.index);
+    }
+    KIWI_LOG_INFO("Installed snapshot at raft trx id " << info.index);
+
+    ReleaseWaiters();
+    for (auto it = table_waiting.begin(); it != table_waiting.end(); ) {
+        TableId table_id = (it++)->first;
+        ReleaseTableWaiters(table_id, AppliedTableTrxId(table_id.first, table_id.second, nullptr));
+    }
+}
+
+
+void Storage::ClearColumnFamily(rocksdb::ColumnFamilyHandle* column_family, rocksdb::WriteBatch* batch) {
+    unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(rocksdb::ReadOptions(), column_family));
+    iterator->SeekToFirst();
+    if (!iterator->Valid()) {
+        CheckStatus(iterator->status());
+        return;
+    }
+    string first_key = iterator->key().ToString();
+    iterator->SeekToLast();
+    CheckStatus(iterator->status());
+
+    // DeleteRange's end is exclusive.
+    batch->DeleteRange(column_family, first_key, iterator->key());
+    batch->Delete(column_family, iterator->key());
+}
+
+
+void Storage::ResumeSnapshotInstall(void) {
+    string marker;
+    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), metadata, kSnapshotInstallKey, &marker);
+    if (status.IsNotFound()) {
+        return;
+    }
+    CheckStatus(status);
+
+    SnapshotInfo info;
+    FrameReader reader(marker.data(), marker.size());
+    if (!reader.GetLong(&info.index) || !reader.GetLong(&info.term)) {
+        throw StorageException("Corrupt snapshot install marker");
+    }
+    string dir = marker.substr(8 + 8);
+    for (string const& name : FileUtils::ListDirectory(dir)) {
+        size_t suffix_length = strlen(kSnapshotFileSuffix);
+        if (name.length() > suffix_length && name.compare(name.length() - suffix_length, suffix_length, kSnapshotFileSuffix) == 0) {
+            info.files.push_back(name);
+        }
+    }
+
+    KIWI_LOG_INFO("Resuming install of snapshot at raft trx id " << info.index << " from " << dir);
+    ReplaceTables(dir, info);
+}
+
+
+/*
+ * Startup roll-forward of raft_log entries that were committed, as of the
+ * last log sync, but not yet applied. The tail is read once, a chunk at a
+ * time; each chunk's transactions are split up by table, and the tables are
+ * dealt out to up to one worker thread per core, so they're replayed in
+ * parallel while each keeps its own order. Every batch a worker writes
+ * records how far its tables have got, so if recovery is itself cut short,
+ * the next attempt skips what's already there instead of applying it twice.
+ */
+void Storage::RollForward(void) {
+    uint64_t applied = applied_raft_trx_id.load();
+    uint64_t last_index;
+    uint64_t last_term;
+    ReadLastLogEntry(&last_index, &last_term);
+    uint64_t target = min(durable_commit_index, last_index);
+    if (target <= applied) {
+        return;
+    }
+
+    KIWI_LOG_INFO("Rolling forward from raft trx id " << applied << " to " << target);
+    uint64_t started_at = NowMillis();
+
+    map<TableId, uint64_t> recovered;
+    string prefix(kTableRaftTrxIdPrefix);
+    unique_ptr<rocksdb::Iterator> marker_iterator(db->NewIterator(rocksdb::ReadOptions(), metadata));
+    for (marker_iterator->Seek(prefix); marker_iterator->Valid() && marker_iterator->key().starts_with(prefix); marker_iterator->Next()) {
+        FrameReader reader(marker_iterator->key().data() + prefix.length(), marker_iterator->key().size() - prefix.length());
+        uint64_t database_id;
+        uint64_t table_id;
+        uint64_t raft_trx_id;
+        if (!reader.GetLong(&database_id) || !reader.GetLong(&table_id) || !DecodeLong(marker_iterator->value(), &raft_trx_id)) {
+            throw StorageException("Corrupt table recovery marker");
+        }
+        recovered[TableId(database_id, table_id)] = raft_trx_id;
+    }
+    CheckStatus(marker_iterator->status());
+    marker_iterator.reset();
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_workers = (num_cpus > 0) ? (num_cpus) : (1);
+    size_t max_workers_used = 0;
+
+    string upper_bound = EncodeLong(target + 1);
+    rocksdb::Slice upper_bound_slice(upper_bound);
+    rocksdb::ReadOptions read_options;
+    read_options.iterate_upper_bound = &upper_bound_slice;
+    read_options.fill_cache = false;
+    unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(read_options, raft_log));
+    iterator->Seek(EncodeLong(applied + 1));
+
+    uint64_t expected_raft_trx_id = applied + 1;
+    Transaction transaction;
+    while (expected_raft_trx_id <= target) {
+        vector<RecoveryWorker> workers;
+        map<TableId, size_t> assignments;
+        rocksdb::WriteBatch new_tables;
+        size_t chunk_bytes = 0;
+        for (; iterator->Valid() && chunk_bytes < kMaxRecoveryChunkBytes; iterator->Next()) {
+            uint64_t raft_trx_id;
+            uint64_t term;
+            rocksdb::Slice value;
+            if (!DecodeLong(iterator->key(), &raft_trx_id) ||
+                    raft_trx_id != expected_raft_trx_id ||
+                    !DecodeLogValue(iterator->value(), &term, &value) ||
+                    !TransactionCodec::Decode(value.data(), value.size(), &transaction)) {
+                throw StorageException("Corrupt raft_log entry at index " + to_string(expected_raft_trx_id));
+            }
+            chunk_bytes += value.size();
+            expected_raft_trx_id++;
+
+            // Tables are all opened here: the workers mustn't change `tables`.
+            map<TableId, vector<Action>> table_actions;
+            for (TransactionBatch& transaction_batch : transaction.batches) {
+                for (DatabaseActions& database : transaction_batch.databases) {
+                    for (Action& action : database.actions) {
+                        TableId table_id(database.database_id, action.table_id);
+                        GetTable(table_id, &new_tables);
+                        if (action.type != Action::Type::CREATE_TABLE) {
+                            table_actions[table_id].push_back(move(action));
+                        }
+                    }
+                }
+            }
+
+            for (auto& entry : table_actions) {
+                auto marker = recovered.find(entry.first);
+                if (marker != recovered.end() && raft_trx_id <= marker->second) {
+                    continue;
+                }
+
+                auto assignment = assignments.find(entry.first);
+                if (assignment == assignments.end()) {
+                    size_t worker = assignments.size() % max_workers;
+                    if (worker == workers.size()) {
+                        workers.push_back(RecoveryWorker{this, vector<RecoveryItem>(), pthread_t(), string()});
+                    }
+                    assignment = assignments.emplace(entry.first, worker).first;
+                }
+                workers[assignment->second].items.push_back(RecoveryItem{raft_trx_id, entry.first, &tables[entry.first], move(entry.second)});
+            }
+        }
+        CheckStatus(iterator->status());
+        if (!iterator->Valid() && expected_raft_trx_id <= target) {
+            throw StorageException("raft_log is missing entries " + to_string(expected_raft_trx_id) + " through " + to_string(target));
+        }
+
+        if (new_tables.Count() > 0) {
+            CheckStatus(db->Write(rocksdb::WriteOptions(), &new_tables));
+        }
+        for (auto const& entry : assignments) {
+            recovered.emplace(entry.first, 0);
+        }
+        max_workers_used = max(max_workers_used, workers.size());
+        RunRecoveryWorkers(workers);
+    }
+
+    rocksdb::WriteBatch batch;
+    batch.Put(metadata, kRaftTrxIdKey, EncodeLong(target));
+    for (auto const& entry : recovered) {
+        batch.Delete(metadata, prefix + EncodeTableId(entry.first.first, entry.first.second));
+    }
+    CheckStatus(db->Write(rocksdb::WriteOptions(), &batch));
+    applied_raft_trx_id = target;
+
+    KIWI_LOG_INFO("Rolled forward " << (target - applied) << " transactions in " << (NowMillis() - started_at)
+        << " ms with up to " << max_workers_used << " threads");
+}
+
+
+void Storage::RunRecoveryWorkers(vector<RecoveryWorker>& workers) {
+    // A single share isn't worth a thread.
+    if (workers.size() == 1) {
+        ReplayTableItems(workers[0].items);
+        return;
+    }
+
+    string error;
+    size_t num_started = 0;
+    for (; num_started < workers.size(); num_started++) {
+        int err = pthread_create(&workers[num_started].thread, nullptr, RecoveryThreadWrapper, &workers[num_started]);
+        if (err != 0) {
+            error = "Error creating recovery thread: " + string(strerror(err));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < num_started; i++) {
+        int err = pthread_join(workers[i].thread, nullptr);
+        if (err != 0) {
+            KIWI_LOG_FATAL("Problem joining recovery thread: " << strerror(err));
+            abort();
+        }
+        if (error.empty()) {
+            error = workers[i].error;
+        }
+    }
+    if (!error.empty()) {
+        throw StorageException(error);
+    }
+}
+
+
+void* Storage::RecoveryThreadWrapper(void* ptr) {
+    RecoveryWorker* worker = static_cast<RecoveryWorker*>(ptr);
+    try {
+        worker->storage->ReplayTableItems(worker->items);
+    } catch (exception const& e) {
+        worker->error = e.what();
+    } catch (...) {
+        worker->error = "Recovery thread crashed";
+    }
+    return nullptr;
+}
+
+
+/*
+ * Applies a worker's share of a chunk. Only this worker touches these
+ * tables, and each batch covers whole transactions of them, along with
+ * their kiwi_db_next_trx_ids and recovery markers. As on the apply thread,
+ * a compare-and-set sees its table as of just before its transaction, and
+ * one that didn't match leaves no log entry behind.
+ */
+void Storage::ReplayTableItems(vector<RecoveryItem>& items) {
+    rocksdb::WriteBatch batch;
+    map<TableId, pair<Table*, uint64_t>> dirty_tables;
+    for (RecoveryItem const& item : items) {
+        if (ContainsCompareAndSet(item.actions)) {
+            FlushRecoveryBatch(&batch, &dirty_tables);
+        }
+
+        string row_events;
+        for (Action const& action : item.actions) {
+            bool found;
+            string value;
+            if (action.type != Action::Type::COMPARE_AND_SET || CompareAndSetMatches(action, item.table->data, &found, &value)) {
+                ApplyRowAction(action, item.table->data, &batch, &row_events);
+            }
+        }
+        if (!row_events.empty()) {
+            batch.Put(item.table->log, EncodeLong(item.table->next_trx_id), row_events);
+            item.table->next_trx_id++;
+        }
+        dirty_tables[item.table_id] = make_pair(item.table, item.raft_trx_id);
+
+        if (batch.GetDataSize() >= kMaxApplyBatchBytes) {
+            FlushRecoveryBatch(&batch, &dirty_tables);
+        }
+    }
+    FlushRecoveryBatch(&batch, &dirty_tables);
+}
+
+
+void Storage::FlushRecoveryBatch(rocksdb::WriteBatch* batch, map<TableId, pair<Table*, uint64_t>>* dirty_tables) {
+    if (dirty_tables->empty()) {
+        return;
+    }
+
+    string prefix(kTableRaftTrxIdPrefix);
+    for (auto const& entry : *dirty_tables) {
+        string table_key = EncodeTableId(entry.first.first, entry.first.second);
+        batch->Put(next_trx_ids, table_key, EncodeLong(entry.second.first->next_trx_id));
+        batch->Put(metadata, prefix + table_key, EncodeLong(entry.second.second));
+    }
+    CheckStatus(db->Write(rocksdb::WriteOptions(), batch));
+    batch->Clear();
+    dirty_tables->clear();
+}
+
+
+void* Storage::ApplyThreadWrapper(void* ptr) {
+    Storage* storage = static_cast<Storage*>(ptr);
+    try {
+        storage->ApplyThreadMain();
+        KIWI_LOG_DEBUG("apply thread: " << storage->applied_transactions << " transactions in " << storage->applied_batches << " batches");
+    } catch (exception const& e) {
+        KIWI_LOG_FATAL("Apply thread crashed: " << e.what());
+        abort();
+    } catch (...) {
+        KIWI_LOG_FATAL("Apply thread crashed");
+        abort();
+    }
+    return nullptr;
+}
+
+
+void Storage::ApplyThreadMain(void) {
+    next_retention_at = NowMillis() + kTableLogRetentionIntervalMillis;
+    bool shutdown = false;
+    while (!shutdown) {
+        Poller::Event events[4];
+        uint64_t now = NowMillis();
+        uint64_t wake_at = next_retention_at;
+        if (!table_waiter_deadlines.empty()) {
+            wake_at = min(wake_at, table_waiter_deadlines.begin()->first);
+        }
+        int timeout = (now >= wake_at) ? (0) : (static_cast<int>(wake_at - now));
+        int num_events = poller.Wait(events, sizeof(events) / sizeof(events[0]), timeout);
+        for (int i = 0; i < num_events; i++) {
+            ApplyEventID event_id = static_cast<ApplyEventID>(events[i].user_event);
+            switch (event_id) {
+                case kSHUTDOWN:
+                    shutdown = true;
+                    break;
+
+                case kDELIVER:
+                    break;
+
+                case kTASK: {
+                    function<void()> task;
+                    while (apply_tasks.TryDequeue(&task)) {
+                        task();
+                    }
+                    break;
+                }
+
+                default:
+                    KIWI_LOG_FATAL("Unknown event id: " << event_id);
+                    abort();
+            }
+        }
+
+        // Re-arm before looking at the offset: a Deliver() that lands after
+        // this point either is seen below or rings the poller again.
+        wakeup_pending.store(false);
+        ApplyDelivered();
+        ReleaseWaiters();
+        ExpireTableWaiters(NowMillis());
+
+        if (NowMillis() >= next_retention_at) {
+            TrimTableLogs();
+            next_retention_at = NowMillis() + kTableLogRetentionIntervalMillis;
+        }
+    }
+}
+
+
+/*
+ * Applies everything up to the latest delivered offset, packing as many
+ * transactions as fit into each WriteBatch.
+ */
+void Storage::ApplyDelivered(void) {
+    for (;;) {
+        uint64_t applied = applied_raft_trx_id.load(memory_order_relaxed);
+        uint64_t offset = delivered_raft_trx_id.load();
+        if (offset <= applied) {
+            return;
+        }
+
+        string lower_bound = EncodeLong(applied + 1);
+        string upper_bound = EncodeLong(offset + 1);
+        rocksdb::Slice upper_bound_slice(upper_bound);
+        rocksdb::ReadOptions read_options;
+        read_options.iterate_upper_bound = &upper_bound_slice;
+
+        unique_ptr<rocksdb::Iterator> iterator(db->NewIterator(read_options, raft_log));
+        rocksdb::WriteBatch batch;
+        map<TableId, Table*> dirty_tables;
+        uint64_t last_raft_trx_id = applied;
+        Transaction transaction;
+        for (iterator->Seek(lower_bound); iterator->Valid(); iterator->Next()) {
+            uint64_t raft_trx_id;
+            uint64_t term;
+            rocksdb::Slice value;
+            if (!DecodeLong(iterator->key(), &raft_trx_id) ||
+                    !DecodeLogValue(iterator->value(), &term, &value) ||
+                    !TransactionCodec::Decode(value.data(), value.size(), &transaction)) {
+                throw StorageException("Corrupt raft_log entry after raft trx id " + to_string(applied_raft_trx_id.load()));
+            }
+
+            // A transaction that reads what's been applied before it needs that written first.
+            if (last_raft_trx_id != applied_raft_trx_id.load(memory_order_relaxed) && ReadsTables(transaction)) {
+                Commit(last_raft_trx_id, &batch, &dirty_tables);
+            }
+            Apply(transaction, &batch, &dirty_tables);
+            last_raft_trx_id = raft_trx_id;
+
+            if (batch.GetDataSize() >= kMaxApplyBatchBytes) {
+                Commit(last_raft_trx_id, &batch, &dirty_tables);
+            }
+        }
+        CheckStatus(iterator->status());
+
+        if (last_raft_trx_id != applied_raft_trx_id.load(memory_order_relaxed)) {
+            Commit(last_raft_trx_id, &batch, &dirty_tables);
+        }
+        if (last_raft_trx_id < offset) {
+            throw StorageException("raft_log is missing entries " + to_string(last_raft_trx_id + 1) + " through " + to_string(offset));
+        }
+    }
+}
+
+
+rocksdb::ColumnFamilyHandle* Storage::CreateColumnFamily(string const& name, rocksdb::ColumnFamilyOptions const& options) {
+    rocksdb::ColumnFamilyHandle* handle;
+    CheckStatus(db->CreateColumnFamily(options, name, &handle));
+    handles.push_back(handle);
+    return handle;
+}
+
+
+/*
+ * Column families are not covered by WriteBatch atomicity, so they're created
+ * eagerly here, before the batch that first uses them is written; an empty
+ * table left behind by a crash is indistinguishable from a new one.
+ */
+Storage::Table& Storage::OpenTable(TableId const& table_id) {
+    auto it = tables.find(table_id);
+    if (it == tables.end() || it->second.log == nullptr || it->second.data == nullptr) {
+        rocksdb::ColumnFamilyHandle* log = (it == tables.end()) ? (nullptr) : (it->second.log);
+        rocksdb::ColumnFamilyHandle* data = (it == tables.end()) ? (nullptr) : (it->second.data);
+        if (log == nullptr) {
+            log = CreateColumnFamily(TableColumnFamilyName(table_id.first, table_id.second, "log"), log_options);
+        }
+        if (data == nullptr) {
+            data = CreateColumnFamily(TableColumnFamilyName(table_id.first, table_id.second, "data"), data_options);
+        }
+
+        unique_lock<shared_mutex> guard(tables_mutex);
+        it = tables.emplace(table_id, Table{nullptr, nullptr, 0}).first;
+        it->second.log = log;
+        it->second.data = data;
+    }
+    return it->second;
+}
+
+
+Storage::Table& Storage::GetTable(TableId const& table_id, rocksdb::WriteBatch* batch) {
+    Table& table = OpenTable(table_id);
+
+    if (table.next_trx_id == 0) {
+        string key = EncodeTableId(table_id.first, table_id.second);
+        table.next_trx_id = ReadLong(next_trx_ids, key, 0);
+        if (table.next_trx_id == 0) {
+            table.next_trx_id = kFirstTableTrxId;
+            batch->Put(oldest_live_trx_ids, key, EncodeLong(kFirstTableTrxId));
+            batch->Put(next_trx_ids, key, EncodeLong(kFirstTableTrxId));
+        }
+    }
+    return table;
+}
+
+
+/*
+ * Adds one transaction to the batch. Every table the transaction touches gets
+ * one _log entry holding its row events, under the table's next transaction
+ * id.
+ */
+void Storage::Apply(Transaction const& transaction, rocksdb::WriteBatch* batch, map<TableId, Table*>* dirty_tables) {
+    map<TableId, string> row_events;
+
+    for (TransactionBatch const& transaction_batch : transaction.batches) {
+        for (DatabaseActions const& database : transaction_batch.databases) {
+            for (Action const& action : database.actions) {
+                TableId table_id(database.database_id, action.table_id);
+                Table& table = GetTable(table_id, batch);
+                switch (action.type) {
+                    case Action::Type::CREATE_TABLE:
+                        break;
+
+                    case Action::Type::PUT:
+                    case Action::Type::DELETE:
+                        ApplyRowAction(action, table.data, batch, &row_events[table_id]);
+                        break;
+
+                    case Action::Type::INCREMENT:
+                        if (action.ticket != 0 && OutcomeExpected(action.ticket)) {
+                            ClaimOutcome(action, true, true, EncodeLong(IncrementedCounter(action, table.data)));
+                        }
+                        ApplyRowAction(action, table.data, batch, &row_events[table_id]);
+                        break;
+
+                    case Action::Type::COMPARE_AND_SET: {
+                        bool found;
+                        string value;
+                        bool swapped = CompareAndSetMatches(action, table.data, &found, &value);
+                        if (swapped) {
+                            ApplyRowAction(action, table.data, batch, &row_events[table_id]);
+                        }
+                        if (action.ticket != 0) {
+                            ClaimOutcome(action, swapped, found, value);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    bool watched = num_tails.load(memory_order_relaxed) > 0;
+    for (auto const& entry : row_events) {
+        Table& table = tables[entry.first];
+        batch->Put(table.log, EncodeLong(table.next_trx_id), entry.second);
+        if (watched) {
+            pending_tail_entries.emplace_back(entry.first, TableLogEntry{table.next_trx_id, entry.second});
+        }
+        table.next_trx_id++;
+        (*dirty_tables)[entry.first] = &table;
+    }
+    applied_transactions++;
+}
+
+
+/*
+ * Reads the key a COMPARE_AND_SET is conditioned on, as of the last batch
+ * written, and returns whether it matches. Afterwards the key is found with
+ * `value`: the new one if it matched, otherwise the one that's there.
+ */
+bool Storage::CompareAndSetMatches(Action const& action, rocksdb::ColumnFamilyHandle* data, bool* found, string* value) {
+    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), data, action.key, value);
+    if (!status.IsNotFound()) {
+        CheckStatus(status);
+    }
+    *found = status.ok();
+
+    bool matches = (*found == action.expected_exists) && (!*found || *value == action.expected_value);
+    if (matches) {
+        *found = true;
+        *value = action.value;
+    }
+    return matches;
+}
+
+
+/*
+ * The counter an INCREMENT leaves behind, reading the key as of the last
+ * batch written, like CompareAndSetMatches().
+ */
+uint64_t Storage::IncrementedCounter(Action const& action, rocksdb::ColumnFamilyHandle* data) {
+    string value;
+    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), data, action.key, &value);
+    if (status.IsNotFound()) {
+        return AddToCounter(nullptr, static_cast<uint64_t>(action.delta));
+    }
+    CheckStatus(status);
+    rocksdb::Slice counter(value);
+    return AddToCounter(&counter, static_cast<uint64_t>(action.delta));
+}
+
+
+/*
+ * Whether applying the transaction reads its tables. A compare-and-set
+ * always does; an increment only when this server is waiting on its new
+ * value, so that counters only cost the leader that was asked for one.
+ */
+bool Storage::ReadsTables(Transaction const& transaction) {
+    for (TransactionBatch const& transaction_batch : transaction.batches) {
+        for (DatabaseActions const& database : transaction_batch.databases) {
+            if (ContainsCompareAndSet(database.actions)) {
+                return true;
+            }
+            for (Action const& action : database.actions) {
+                if (action.type == Action::Type::INCREMENT && action.ticket != 0 && OutcomeExpected(action.ticket)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+
+bool Storage::OutcomeExpected(uint64_t ticket) {
+    lock_guard<mutex> guard(outcomes_mutex);
+    return expected_outcomes.count(ticket) != 0;
+}
+
+
+// Takes the callback waiting on the outcome, if any, to run once the batch is written.
+void Storage::ClaimOutcome(Action const& action, bool swapped, bool found, string const& value) {
+    lock_guard<mutex> guard(outcomes_mutex);
+    auto it = expected_outcomes.find(action.ticket);
+    if (it == expected_outcomes.end()) {
+        return;
+    }
+    pending_outcomes.push_back(Outcome{move(it->second), swapped, found, value});
+    expected_outcomes.erase(it);
+}
+
+
+/*
+ * Writes the batch along with the bookkeeping for everything in it: one
+ * kiwi_db_next_trx_ids update per table and the last applied raft trx id.
+ */
+void Storage::Commit(uint64_t raft_trx_id, rocksdb::WriteBatch* batch, map<TableId, Table*>* dirty_tables) {
+    for (auto const& entry : *dirty_tables) {
+        batch->Put(next_trx_ids, EncodeTableId(entry.first.first, entry.first.second), EncodeLong(entry.second->next_trx_id));
+    }
+    batch->Put(metadata, kRaftTrxIdKey, EncodeLong(raft_trx_id));
+
+    // No sync: raft_log is the durable record, and anything lost here is
+    // re-applied from it.
+    CheckStatus(db->Write(rocksdb::WriteOptions(), batch));
+    batch->Clear();
+    if (!pending_tail_entries.empty()) {
+        AppendToTails();
+    }
+
+    applied_batches++;
+    applied_raft_trx_id.store(raft_trx_id, memory_order_release);
+    ReleaseWaiters();
+    if (!table_waiting.empty()) {
+        for (auto const& entry : *dirty_tables) {
+            ReleaseTableWaiters(entry.first, entry.second->next_trx_id - kFirstTableTrxId);
+        }
+    }
+    dirty_tables->clear();
+
+    for (Outcome const& outcome : pending_outcomes) {
+        outcome.callback(outcome.swapped, outcome.found, outcome.value);
+    }
+    pending_outcomes.clear();
+}
+
+
+/*
+ * The log retention job. Entry ids are dense, so the first one to keep
+ * follows from the table's next trx id and no scan is needed: one range
+ * deletion and one kiwi_db_oldest_live_trx_ids update per table, all in a
+ * single batch. RocksDB reclaims the space as it compacts.
+ */
+void Storage::TrimTableLogs(void) {
+    rocksdb::WriteBatch batch;
+    size_t num_tables = 0;
+    uint64_t num_entries = 0;
+    for (auto& entry : tables) {
+        TableId const& table_id = entry.first;
+        Table& table = entry.second;
+        uint64_t retention = config.TableLogRetention(table_id.first, table_id.second);
+        if (retention == 0 || table.log == nullptr) {
+            continue;
+        }
+
+        string key = EncodeTableId(table_id.first, table_id.second);
+        uint64_t next_trx_id = (table.next_trx_id != 0) ? (table.next_trx_id) : (ReadLong(next_trx_ids, key, 0));
+        if (next_trx_id < kFirstTableTrxId + retention) {
+            continue;
+        }
+        uint64_t first_live = next_trx_id - retention;
+        uint64_t oldest_live = ReadLong(oldest_live_trx_ids, key, kFirstTableTrxId);
+        if (first_live <= oldest_live) {
+            continue;
+        }
+
+        batch.DeleteRange(table.log, EncodeLong(oldest_live), EncodeLong(first_live));
+        batch.Put(oldest_live_trx_ids, key, EncodeLong(first_live));
+        num_tables++;
+        num_entries += first_live - oldest_live;
+    }
+
+    if (num_tables > 0) {
+        CheckStatus(db->Write(rocksdb::WriteOptions(), &batch));
+        KIWI_LOG_DEBUG("Purged " << num_entries << " table log entries from " << num_tables << " tables");
+    }
+}
+
+
+void Storage::ReleaseWaiters(void) {
+    uint64_t applied = applied_raft_trx_id.load(memory_order_relaxed);
+    while (!waiting.empty() && waiting.begin()->first <= applied) {
+        waiting.begin()->second();
+        waiting.erase(waiting.begin());
+    }
+}
+
+
+void Storage::ReleaseTableWaiters(TableId const& table_id, uint64_t table_trx_id) {
+    auto it = table_waiting.find(table_id);
+    if (it == table_waiting.end()) {
+        return;
+    }
+
+    multimap<uint64_t, TableWaiter>& table_waiters = it->second;
+    while (!table_waiters.empty() && table_waiters.begin()->first <= table_trx_id) {
+        table_waiter_ids.erase(table_waiters.begin()->second.id);
+        table_waiters.begin()->second.callback(true);
+        table_waiters.erase(table_waiters.begin());
+    }
+    if (table_waiters.empty()) {
+        table_waiting.erase(it);
+    }
+}
+
+
+// Removes the waiter from table_waiting, if it's still there, and hands back its callback.
+bool Storage::TakeTableWaiter(uint64_t waiter_id, function<void(bool)>* callback) {
+    auto id = table_waiter_ids.find(waiter_id);
+    if (id == table_waiter_ids.end()) {
+        return false;
+    }
+
+    auto table = table_waiting.find(id->second.first);
+    auto range = table->second.equal_range(id->second.second);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.id == waiter_id) {
+            *callback = move(it->second.callback);
+            table->second.erase(it);
+            break;
+        }
+    }
+    if (table->second.empty()) {
+        table_waiting.erase(table);
+    }
+    table_waiter_ids.erase(id);
+    return true;
+}
+
+
+void Storage::ExpireTableWaiters(uint64_t now) {
+    while (!table_waiter_deadlines.empty() && table_waiter_deadlines.begin()->first <= now) {
+        uint64_t waiter_id = table_waiter_deadlines.begin()->second;
+        table_waiter_deadlines.erase(table_waiter_deadlines.begin());
+        function<void(bool)> callback;
+        if (TakeTableWaiter(waiter_id, &callback)) {
+            callback(false);
+        }
+    }
+}
+
+
+uint64_t Storage::ReadLong(rocksdb::ColumnFamilyHandle* column_family, rocksdb::Slice const& key, uint64_t default_value, rocksdb::Snapshot const* snapshot) {
+    string value;
+    rocksdb::ReadOptions read_options;
+    read_options.snapshot = snapshot;
+    rocksdb::Status status = db->Get(read_options, column_family, key, &value);
+    if (status.IsNotFound()) {
+        return default_value;
+    }
+    CheckStatus(status);
+
+    uint64_t result;
+    if (!DecodeLong(value, &result)) {
+        throw StorageException("Corrupt value for key " + key.ToString(true) + " in " + column_family->GetName());
+    }
+    return result;
+}
+
+
+TableScan::TableScan(rocksdb::DB* db) :
+        db(db),
+        snapshot(nullptr),
+        lower_bound(),
+        upper_bound(),
+        lower_bound_slice(),
+        upper_bound_slice(),
+        iterator() {
+}
+
+
+TableScan::~TableScan(void) {
+    // The iterator reads through the snapshot, so it goes first.
+    iterator.reset();
+    if (snapshot != nullptr) {
+        db->ReleaseSnapshot(snapshot);
+    }
+}
+
+
+bool TableScan::Valid(void) const {
+    return iterator != nullptr && iterator->Valid();
+}
+
+
+rocksdb::Slice TableScan::Key(void) const {
+    return iterator->key();
+}
+
+
+rocksdb::Slice TableScan::Value(void) const {
+    return iterator->value();
+}
+
+
+void TableScan::Next(void) {
+    iterator->Next();
+    CheckStatus(iterator->status());
 }
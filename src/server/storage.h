@@ -1,18 +1,388 @@
 #ifndef KIWI_STORAGE_H_
 #define KIWI_STORAGE_H_
 
-/*#include "rocksdb/db.h"*/
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "common/poller.h"
+#include "common/unbounded_blocking_queue.h"
+#include "rocksdb/db.h"
 #include "server_config.h"
+#include "transaction.h"
 
 
+/*
+ * One raft_log entry. The stored value is [8 bytes for term][transaction].
+ */
+struct LogEntry {
+    uint64_t index;
+    uint64_t term;
+    std::string transaction;
+};
+
+
+/*
+ * One kiwi_db_$DB_table_$TABLE_log entry: the row events of one transaction,
+ * as described in COLUMNFAMILIES.
+ */
+struct TableLogEntry {
+    uint64_t table_trx_id;
+    std::string row_events;
+};
+
+
+/*
+ * A forward scan over a key range of one table's data, opened by
+ * Storage::OpenScan(). It reads through a snapshot of its own, taken when it
+ * was opened, so it may be advanced at any pace and from any one thread at a
+ * time; Key() and Value() are valid until the next Next().
+ */
+class TableScan {
+public:
+    ~TableScan(void);
+
+    bool Valid(void) const;
+    rocksdb::Slice Key(void) const;
+    rocksdb::Slice Value(void) const;
+    void Next(void);
+
+    // Delete copy constructor and copy assignment operator
+    TableScan(TableScan const&) = delete;
+    TableScan& operator=(TableScan const&) = delete;
+
+private:
+    friend class Storage;
+
+    TableScan(rocksdb::DB* db);
+
+    rocksdb::DB* db;
+    rocksdb::Snapshot const* snapshot;
+    std::string lower_bound;
+    std::string upper_bound;
+    rocksdb::Slice lower_bound_slice;
+    rocksdb::Slice upper_bound_slice;
+    std::unique_ptr<rocksdb::Iterator> iterator;  // null for a table that doesn't exist
+};
+
+
+/*
+ * A snapshot of the tables as of a raft trx id: one SST file per non-empty
+ * column family, named after it ("<column family>.sst"), in a directory of
+ * its own.
+ */
+struct SnapshotInfo {
+    uint64_t index;  // raft trx id
+    uint64_t term;
+    std::vector<std::string> files;
+};
+
+
+/*
+ * RocksDB-backed storage using the column family layout described in
+ * COLUMNFAMILIES.
+ *
+ * Transactions are first appended to raft_log under their raft transaction
+ * id, and every log sync also records the latest committed offset. On
+ * startup, committed entries that hadn't been applied yet are rolled forward
+ * before anything else can see the tables, by a pool of threads that each
+ * take a share of the tables. Delivering a committed offset hands it to a
+ * dedicated apply thread, which reads every logged transaction up to it back
+ * from raft_log and writes them to the table column families. Each
+ * WriteBatch spans kiwi_db_metadata, kiwi_db_next_trx_ids and the affected
+ * tables' _log/_data column families and covers whole transactions only, so
+ * a crash can never leave them out of step with one another.
+ *
+ * Table logs are trimmed in the background according to each table's
+ * retention policy: everything below the new first live trx id goes in one
+ * range deletion, written in the same batch as kiwi_db_oldest_live_trx_ids.
+ * Readers look that up under the same snapshot and seek straight past the
+ * tombstone, so a scan costs the same however much history was purged.
+ *
+ * For tables that are being watched, the apply thread also keeps the most
+ * recent table log entries in memory once they're written, so that
+ * subscribers that have caught up are fed without reading RocksDB.
+ *
+ * Increments are written as merge operands. Only the server that proposed
+ * one reads its key, when applying it, and only if the client asked for the
+ * new counter. A compare-and-set always has to read its key. Either way, the
+ * batch so far is written out before a transaction that reads: what it sees
+ * never depends on where a replica happened to cut its batches.
+ *
+ * The raft_log and hard state methods and Deliver() must be called from a
+ * single thread (raft's).
+ */
 class Storage {
 public:
     Storage(ServerConfig const& server_config);
-    void Deliver(uint64_t offset); // Raft will call Storage.Deliver() once a quorum have written the values to their log. This is intended to be a very fast call with all the work being done by some internal storage class thread.
     ~Storage(void);
 
+    // Delete copy constructor and copy assignment operator
+    Storage(Storage const&) = delete;
+    Storage& operator=(Storage const&) = delete;
+
+    /*
+     * Group commit for raft_log. Appends and truncations are staged into one
+     * WriteBatch, in order, and SyncLog() writes it with a single WAL sync.
+     * Staged changes are invisible to the other raft_log methods (and to the
+     * apply thread) until then.
+     */
+    void StageLogEntry(LogEntry const& entry);
+    void StageLogTruncation(uint64_t index);  // removes every entry from `index` onward
+    size_t StagedLogBytes(void) const noexcept;
+    void SyncLog(void);
+
+    // Reads entries starting at `index`, stopping after max_entries or once max_bytes is reached.
+    void ReadLog(uint64_t index, size_t max_entries, size_t max_bytes, std::vector<LogEntry>* entries);
+
+    // Returns false if there's no entry at `index`.
+    bool ReadLogTerm(uint64_t index, uint64_t* term);
+
+    // Index and term of the last raft_log entry; the log base if the log is empty.
+    void ReadLastLogEntry(uint64_t* index, uint64_t* term);
+
+    // Index and term of the entry just before the first one in raft_log; both 0 until a snapshot is installed.
+    void ReadLogBase(uint64_t* index, uint64_t* term);
+
+    // Raft's persistent state, kept in kiwi_db_metadata. voted_for is 0 for "nobody".
+    void LoadHardState(uint64_t* current_term, uint32_t* voted_for);
+    void SaveHardState(uint64_t current_term, uint32_t voted_for);
+
+    void Deliver(uint64_t offset); // Raft will call Storage.Deliver() once a quorum have written the values to their log. This is intended to be a very fast call with all the work being done by some internal storage class thread.
+
+    // Thread-safe. The raft transaction id of the last transaction applied to the tables.
+    uint64_t AppliedRaftTrxId(void) const noexcept;
+
+    // Thread-safe. How many delivered transactions have yet to be applied; reported by ClientStatus.
+    uint64_t ApplyLag(void) const noexcept;
+
+    /*
+     * Thread-safe. Runs `callback` once everything up to `raft_trx_id` has
+     * been applied to the tables: right away on the calling thread if it
+     * already has, otherwise on the apply thread.
+     */
+    void WhenApplied(uint64_t raft_trx_id, std::function<void()> callback);
+
+    /*
+     * Thread-safe. The same, for the transaction with the given table-local
+     * trx id, except that the callback learns whether it was applied: once
+     * `timeout_ms` has passed (0 waits for good), it runs with false instead.
+     * A waiter_id from NewTableWaiterId() lets ForgetTableWaiter() drop the
+     * callback; 0 if the caller never will.
+     */
+    void WhenTableApplied(uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, uint32_t timeout_ms, uint64_t waiter_id, std::function<void(bool)> callback);
+    uint64_t NewTableWaiterId(void) noexcept;
+
+    // Thread-safe. Discards the callback without running it, unless it has run already.
+    void ForgetTableWaiter(uint64_t waiter_id);
+
+    // Whether a COMPARE_AND_SET swapped, and the key's value afterwards. An
+    // INCREMENT always counts as swapped, and its value is the new counter.
+    typedef std::function<void(bool swapped, bool found, std::string const& value)> OutcomeCallback;
+
+    /*
+     * Thread-safe. Returns a ticket for a COMPARE_AND_SET or INCREMENT about
+     * to be proposed. Once it's applied, the callback runs on the apply thread.
+     */
+    uint64_t ExpectOutcome(OutcomeCallback callback);
+
+    // Thread-safe. Returns false if it's too late: the callback is going to run.
+    bool ForgetOutcome(uint64_t ticket);
+
+    /*
+     * Thread-safe. Discards every callback still waiting in WhenApplied(),
+     * WhenTableApplied() or ExpectOutcome(), without running it, and returns
+     * once that's done. For shutdown, once whatever the callbacks refer to is
+     * about to go away.
+     */
+    void DropWaiters(void);
+
+    /*
+     * Table reads, from any thread, of the latest applied state. The apply
+     * thread writes whole transactions per WriteBatch, so every read sees a
+     * transaction boundary. Returns false if the key (or the whole table)
+     * doesn't exist.
+     */
+    bool Get(uint64_t database_id, uint64_t table_id, std::string const& key, std::string* value);
+
+    /*
+     * Looks every key up in one batched read, as of a single point. values
+     * and found are resized to match keys; a missing key (or table) leaves
+     * its value empty and found false.
+     */
+    void MultiGet(uint64_t database_id, uint64_t table_id, std::vector<rocksdb::Slice> const& keys, std::vector<rocksdb::PinnableSlice>* values, std::vector<bool>* found);
+
+    /*
+     * Opens a scan of the keys in [start_key, end_key) that begin with
+     * `prefix`; an empty end_key means no upper end and an empty prefix
+     * matches every key.
+     */
+    std::unique_ptr<TableScan> OpenScan(uint64_t database_id, uint64_t table_id, std::string const& start_key, std::string const& end_key, std::string const& prefix);
+
+    // The table-local trx id of the last transaction applied to the table, 0 if there's none.
+    uint64_t AppliedTableTrxId(uint64_t database_id, uint64_t table_id, rocksdb::Snapshot const* snapshot);
+
+    /*
+     * Reads the table's change log from `table_trx_id` on, stopping after
+     * max_entries or once max_bytes is reached. Returns the oldest table trx
+     * id still kept; if that's past `table_trx_id`, what came before it has
+     * been purged and the entries start there instead.
+     */
+    uint64_t ReadTableLog(uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, size_t max_entries, size_t max_bytes, rocksdb::Snapshot const* snapshot, std::vector<TableLogEntry>* entries);
+
+    /*
+     * Thread-safe. While a table is watched (each WatchTable() is undone by
+     * one UnwatchTable()), its newest table log entries are kept in memory.
+     * ReadTableTail() reads from `table_trx_id` on out of them, like
+     * ReadTableLog(), and returns false if they don't reach back that far,
+     * in which case the caller should ReadTableLog() instead. Reaching the
+     * end of the table log returns true with no entries.
+     */
+    void WatchTable(uint64_t database_id, uint64_t table_id);
+    void UnwatchTable(uint64_t database_id, uint64_t table_id);
+    bool ReadTableTail(uint64_t database_id, uint64_t table_id, uint64_t table_trx_id, size_t max_entries, size_t max_bytes, std::vector<TableLogEntry>* entries);
+
+    /*
+     * Thread-safe and slow: writes a snapshot of everything applied so far
+     * into `dir`, which is created. Call it off the raft thread.
+     */
+    void CreateSnapshot(std::string const& dir, SnapshotInfo* info);
+
+    /*
+     * Thread-safe. Replaces the tables with a snapshot received into `dir`
+     * and resets raft_log to start right after it, on the apply thread;
+     * `done` runs there once it's durable, after which `dir` is gone. Once
+     * started, an install that's cut short by a crash is finished on the
+     * next startup. Nothing else may be delivered or logged meanwhile.
+     */
+    void InstallSnapshot(std::string const& dir, SnapshotInfo const& info, std::function<void()> done);
+
 private:
-    /*rocksdb::DB* db;*/
+    struct Table {
+        rocksdb::ColumnFamilyHandle* log;
+        rocksdb::ColumnFamilyHandle* data;
+        uint64_t next_trx_id;  // 0 until loaded from kiwi_db_next_trx_ids
+    };
+
+    typedef std::pair<uint64_t, uint64_t> TableId;  // (database id, table id)
+
+    // The newest log entries of a watched table, consecutive and oldest first.
+    struct TableTail {
+        uint64_t watchers;
+        std::deque<TableLogEntry> entries;
+        size_t bytes;
+    };
+
+    struct TableWaiter {
+        uint64_t id;
+        std::function<void(bool)> callback;
+    };
+
+    struct Outcome {
+        OutcomeCallback callback;
+        bool swapped;
+        bool found;
+        std::string value;
+    };
+
+    // Startup recovery: one transaction's actions on one table, and a share of the tables.
+    struct RecoveryItem {
+        uint64_t raft_trx_id;
+        TableId table_id;
+        Table* table;
+        std::vector<Action> actions;
+    };
+
+    struct RecoveryWorker {
+        Storage* storage;
+        std::vector<RecoveryItem> items;
+        pthread_t thread;
+        std::string error;
+    };
+
+
+    ServerConfig const& config;
+    rocksdb::DB* db;
+    rocksdb::ColumnFamilyOptions log_options;
+    rocksdb::ColumnFamilyOptions data_options;
+    std::vector<rocksdb::ColumnFamilyHandle*> handles;
+    rocksdb::ColumnFamilyHandle* raft_log;
+    rocksdb::ColumnFamilyHandle* metadata;
+    rocksdb::ColumnFamilyHandle* next_trx_ids;
+    rocksdb::ColumnFamilyHandle* oldest_live_trx_ids;
+    std::map<TableId, Table> tables;  // apply thread, except that readers look up data handles
+    std::shared_mutex tables_mutex;   // held by readers, and by the apply thread to add tables
+    rocksdb::WriteBatch log_batch;    // raft thread only
+    size_t log_batch_bytes;
+    uint64_t durable_commit_index;    // raft thread only: as of the last log sync
+
+    /*
+     * Deliver() publishes the committed offset here; offsets only move
+     * forward, so the apply thread just needs the latest one. The poller is
+     * only rung when the apply thread may be asleep (wakeup_pending unset).
+     */
+    std::atomic<uint64_t> delivered_raft_trx_id;
+    std::atomic<uint64_t> applied_raft_trx_id;
+    std::atomic<bool> wakeup_pending;
+    Poller poller;
+    UnboundedBlockingQueue<std::function<void()>> apply_tasks;  // run on the apply thread
+    std::multimap<uint64_t, std::function<void()>> waiting;  // apply thread only, by raft trx id
+    std::map<TableId, std::multimap<uint64_t, TableWaiter>> table_waiting;  // apply thread only, by table trx id
+    std::unordered_map<uint64_t, std::pair<TableId, uint64_t>> table_waiter_ids;  // apply thread only: where each waiter is in table_waiting
+    std::multimap<uint64_t, uint64_t> table_waiter_deadlines;  // apply thread only: waiter ids by deadline, in milliseconds; may outlive the waiter
+    std::atomic<uint64_t> next_table_waiter_id;
+    pthread_t apply_thread;
+    uint64_t applied_batches;
+    uint64_t applied_transactions;
+    uint64_t next_retention_at;  // apply thread only, in milliseconds
+    std::map<TableId, TableTail> tails;
+    std::mutex tails_mutex;
+    std::atomic<size_t> num_tails;  // read by the apply thread to skip collecting entries nobody watches
+    std::vector<std::pair<TableId, TableLogEntry>> pending_tail_entries;  // apply thread only: in the batch being built
+    std::unordered_map<uint64_t, OutcomeCallback> expected_outcomes;  // by ticket
+    std::mutex outcomes_mutex;  // guards expected_outcomes and outcome_tickets
+    std::mt19937_64 outcome_tickets;
+    std::vector<Outcome> pending_outcomes;  // apply thread only: in the batch being built
+
+    void Close(void) noexcept;
+    static void* ApplyThreadWrapper(void* ptr);
+    void ApplyThreadMain(void);
+    void ApplyDelivered(void);
+    void ReleaseWaiters(void);
+    void ReleaseTableWaiters(TableId const& table_id, uint64_t table_trx_id);
+    bool TakeTableWaiter(uint64_t waiter_id, std::function<void(bool)>* callback);
+    void ExpireTableWaiters(uint64_t now);
+    void AppendToTails(void);
+    bool OutcomeExpected(uint64_t ticket);
+    void ClaimOutcome(Action const& action, bool swapped, bool found, std::string const& value);
+    bool ReadsTables(Transaction const& transaction);
+    void TrimTableLogs(void);
+    rocksdb::ColumnFamilyHandle* CreateColumnFamily(std::string const& name, rocksdb::ColumnFamilyOptions const& options);
+    Table& OpenTable(TableId const& table_id);
+    Table& GetTable(TableId const& table_id, rocksdb::WriteBatch* batch);
+    bool CompareAndSetMatches(Action const& action, rocksdb::ColumnFamilyHandle* data, bool* found, std::string* value);
+    uint64_t IncrementedCounter(Action const& action, rocksdb::ColumnFamilyHandle* data);
+    void Apply(Transaction const& transaction, rocksdb::WriteBatch* batch, std::map<TableId, Table*>* dirty_tables);
+    void Commit(uint64_t raft_trx_id, rocksdb::WriteBatch* batch, std::map<TableId, Table*>* dirty_tables);
+    uint64_t ReadLong(rocksdb::ColumnFamilyHandle* column_family, rocksdb::Slice const& key, uint64_t default_value, rocksdb::Snapshot const* snapshot = nullptr);
+    void ReadLogBaseAt(rocksdb::Snapshot const* snapshot, uint64_t* index, uint64_t* term);
+    void ClearColumnFamily(rocksdb::ColumnFamilyHandle* column_family, rocksdb::WriteBatch* batch);
+    void ReplaceTables(std::string const& dir, SnapshotInfo const& info);
+    void ResumeSnapshotInstall(void);
+    void RollForward(void);
+    void RunRecoveryWorkers(std::vector<RecoveryWorker>& workers);
+    static void* RecoveryThreadWrapper(void* ptr);
+    void ReplayTableItems(std::vector<RecoveryItem>& items);
+    void FlushRecoveryBatch(rocksdb::WriteBatch* batch, std::map<TableId, std::pair<Table*, uint64_t>>* dirty_tables);
 };
 
 #endif  // KIWI_STORAGE_H_
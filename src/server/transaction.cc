@@ -0,0 +1,181 @@
+#include "common/frame_reader.h"
+#include "common/frame_writer.h"
+#include "transaction.h"
+
+
+using namespace std;
+
+static size_t ActionSize(Action const& action) {
+    switch (action.type) {
+        case Action::Type::CREATE_TABLE:
+            return 1 + 8;
+
+        case Action::Type::PUT:
+            return 1 + 8 + 4 + action.key.length() + 4 + action.value.length();
+
+        case Action::Type::DELETE:
+            return 1 + 8 + 4 + action.key.length();
+
+        case Action::Type::INCREMENT:
+            return 1 + 8 + 4 + action.key.length() + 8 + 8;
+
+        case Action::Type::COMPARE_AND_SET:
+            return 1 + 8 + 4 + action.key.length() + 1 + 4 + action.expected_value.length() + 4 + action.value.length() + 8;
+    }
+    return 0;
+}
+
+
+static bool DecodeAction(FrameReader& reader, Action* action) {
+    char const* type;
+    char const* bytes;
+    uint32_t length;
+    if (!reader.GetBytes(1, &type) || !reader.GetLong(&action->table_id)) {
+        return false;
+    }
+
+    action->type = static_cast<Action::Type>(static_cast<uint8_t>(*type));
+    switch (action->type) {
+        case Action::Type::CREATE_TABLE:
+            return true;
+
+        case Action::Type::PUT:
+            if (!reader.GetInt(&length) || !reader.GetBytes(length, &bytes)) {
+                return false;
+            }
+            action->key.assign(bytes, length);
+            if (!reader.GetInt(&length) || !reader.GetBytes(length, &bytes)) {
+                return false;
+            }
+            action->value.assign(bytes, length);
+            return true;
+
+        case Action::Type::DELETE:
+            if (!reader.GetInt(&length) || !reader.GetBytes(length, &bytes)) {
+                return false;
+            }
+            action->key.assign(bytes, length);
+            return true;
+
+        case Action::Type::INCREMENT: {
+            uint64_t delta;
+            if (!reader.GetInt(&length) || !reader.GetBytes(length, &bytes) || !reader.GetLong(&delta) || !reader.GetLong(&action->ticket)) {
+                return false;
+            }
+            action->key.assign(bytes, length);
+            action->delta = static_cast<int64_t>(delta);
+            return true;
+        }
+
+        case Action::Type::COMPARE_AND_SET: {
+            char const* expected_exists;
+            if (!reader.GetInt(&length) || !reader.GetBytes(length, &bytes)) {
+                return false;
+            }
+            action->key.assign(bytes, length);
+            if (!reader.GetBytes(1, &expected_exists) || !reader.GetInt(&length) || !reader.GetBytes(length, &bytes)) {
+                return false;
+            }
+            action->expected_exists = (*expected_exists != 0);
+            action->expected_value.assign(bytes, length);
+            if (!reader.GetInt(&length) || !reader.GetBytes(length, &bytes) || !reader.GetLong(&action->ticket)) {
+                return false;
+            }
+            action->value.assign(bytes, length);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+size_t TransactionCodec::EncodedSize(Transaction const& transaction) {
+    size_t size = 4;
+    for (TransactionBatch const& batch : transaction.batches) {
+        size += 4;
+        for (DatabaseActions const& database : batch.databases) {
+            size += 8 + 4;
+            for (Action const& action : database.actions) {
+                size += ActionSize(action);
+            }
+        }
+    }
+    return size;
+}
+
+
+void TransactionCodec::Encode(Transaction const& transaction, string* output) {
+    size_t offset = output->length();
+    output->resize(offset + EncodedSize(transaction));
+
+    FrameWriter writer(&(*output)[offset]);
+    writer.PutInt(transaction.batches.size());
+    for (TransactionBatch const& batch : transaction.batches) {
+        writer.PutInt(batch.databases.size());
+        for (DatabaseActions const& database : batch.databases) {
+            writer.PutLong(database.database_id);
+            writer.PutInt(database.actions.size());
+            for (Action const& action : database.actions) {
+                char type = static_cast<char>(action.type);
+                writer.PutBytes(&type, 1);
+                writer.PutLong(action.table_id);
+                if (action.type != Action::Type::CREATE_TABLE) {
+                    writer.PutInt(action.key.length());
+                    writer.PutBytes(action.key.data(), action.key.length());
+                }
+                if (action.type == Action::Type::INCREMENT) {
+                    writer.PutLong(static_cast<uint64_t>(action.delta));
+                }
+                if (action.type == Action::Type::COMPARE_AND_SET) {
+                    writer.PutByte(action.expected_exists);
+                    writer.PutInt(action.expected_value.length());
+                    writer.PutBytes(action.expected_value.data(), action.expected_value.length());
+                }
+                if (action.type == Action::Type::PUT || action.type == Action::Type::COMPARE_AND_SET) {
+                    writer.PutInt(action.value.length());
+                    writer.PutBytes(action.value.data(), action.value.length());
+                }
+                if (action.type == Action::Type::INCREMENT || action.type == Action::Type::COMPARE_AND_SET) {
+                    writer.PutLong(action.ticket);
+                }
+            }
+        }
+    }
+}
+
+
+bool TransactionCodec::Decode(char const* data, size_t length, Transaction* transaction) {
+    FrameReader reader(data, length);
+    uint32_t num_batches;
+    if (!reader.GetInt(&num_batches)) {
+        return false;
+    }
+
+    // Counts are bounded by what's left so a corrupt count can't make us
+    // reserve gigabytes.
+    transaction->batches.clear();
+    for (uint32_t i = 0; i < num_batches; i++) {
+        uint32_t num_databases;
+        if (!reader.GetInt(&num_databases) || num_databases > length) {
+            return false;
+        }
+
+        transaction->batches.emplace_back();
+        TransactionBatch& batch = transaction->batches.back();
+        batch.databases.resize(num_databases);
+        for (DatabaseActions& database : batch.databases) {
+            uint32_t num_actions;
+            if (!reader.GetLong(&database.database_id) || !reader.GetInt(&num_actions) || num_actions > length) {
+                return false;
+            }
+
+            database.actions.resize(num_actions);
+            for (Action& action : database.actions) {
+                if (!DecodeAction(reader, &action)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return reader.Position() == length;
+}
@@ -0,0 +1,79 @@
+#ifndef KIWI_TRANSACTION_H_
+#define KIWI_TRANSACTION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*
+ * In-memory form of a raft_log value. The encoding follows COLUMNFAMILIES:
+ *
+ *     transaction: [4 bytes for number of batches][batch]*
+ *     batch:       [4 bytes for number of databases][database]*
+ *     database:    [8 bytes for database id][4 bytes for number of actions][action]*
+ *     action:      [1 byte for action type][8 bytes for table id][payload]
+ *
+ * Action payloads:
+ *     CREATE_TABLE: (none)
+ *     PUT:          [4 bytes for key length][key][4 bytes for value length][value]
+ *     DELETE:       [4 bytes for key length][key]
+ *     INCREMENT:    [4 bytes for key length][key][8 bytes for delta][8 bytes for outcome ticket]
+ *     COMPARE_AND_SET:
+ *                   [4 bytes for key length][key][1 byte for whether the key is expected to exist]
+ *                   [4 bytes for expected value length][expected value][4 bytes for value length][value]
+ *                   [8 bytes for outcome ticket]
+ */
+struct Action {
+    enum Type {
+        CREATE_TABLE = 1,
+        PUT = 2,
+        DELETE = 3,
+        INCREMENT = 4,
+        COMPARE_AND_SET = 5,
+    };
+
+    Type type;
+    uint64_t table_id;
+    std::string key;
+    std::string value;
+
+    // INCREMENT only. Added to the key's 8-byte counter, wrapping around.
+    int64_t delta = 0;
+
+    // COMPARE_AND_SET only. `value` is written if the key currently has
+    // expected_value, or is missing and expected_exists is false.
+    bool expected_exists = false;
+    std::string expected_value = "";
+
+    // INCREMENT and COMPARE_AND_SET. How the proposing server learns the
+    // outcome: the new counter, or whether it swapped (0 if nobody's waiting).
+    uint64_t ticket = 0;
+};
+
+struct DatabaseActions {
+    uint64_t database_id;
+    std::vector<Action> actions;
+};
+
+struct TransactionBatch {
+    std::vector<DatabaseActions> databases;
+};
+
+struct Transaction {
+    std::vector<TransactionBatch> batches;
+};
+
+
+namespace TransactionCodec {
+    size_t EncodedSize(Transaction const& transaction);
+
+    // Appends the encoded transaction to output.
+    void Encode(Transaction const& transaction, std::string* output);
+
+    // Returns false if the data is truncated or otherwise malformed.
+    bool Decode(char const* data, size_t length, Transaction* transaction);
+}
+
+#endif  // KIWI_TRANSACTION_H_